@@ -18,7 +18,16 @@
 #include "../src/packetcomms/PacketDemuxer.h"
 #include "../src/packetcomms/PacketMuxer.h"
 #include "../src/packetcomms/SimpleQueue.h"
+#include "../src/packetcomms/LockFreeQueue.h"
+#include "../src/packetcomms/PacketConnection.h"
+#include "../src/packetcomms/UdpTransport.h"
+#include "../src/packetcomms/SharedMemoryTransport.h"
+#include "../src/packetcomms/SessionTransport.h"
+#include "../src/packetcomms/PacketRecorder.h"
+#include "../src/packetcomms/PacketReplayer.h"
+#include "../src/packetcomms/PacketRelay.h"
 #include "../src/packetcomms/PacketSerialisation.h"
+#include "../src/packetcomms/Channel.h"
 
 #include "../src/robotcomms/VideoClient.h"
 
@@ -5,6 +5,7 @@
 #define __ROBO_NETWORK_H__
 
 #include "../src/network/TcpSocket.h"
+#include "../src/network/EventLoop.h"
 
 #endif /* __ROBO_NETWORK_H__ */
 
@@ -0,0 +1,394 @@
+#include "../packetcomms/PacketComms.h"
+#include "../network/TcpSocket.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+
+/**
+    Benchmark suite for the muxer and demuxer: runs a muxer and demuxer
+    back-to-back over each transport and sweeps the payload size, number
+    of packet types, number of producer threads and number of subscribers
+    per type. Each run reports packets/sec, MiB/sec, the latency from
+    posting to callback (under saturation, so mostly queueing) and the
+    heap allocations made per packet.
+
+    Results are written as JSON so runs can be compared between releases.
+
+    Usage: packetcomms-benchmark [options]
+        --transports=socketpair,tcp,memory
+        --payloads=16,256,4096,65536
+        --types=1,4
+        --producers=1,4
+        --subscribers=1,4
+        --packets=N        Packets per run (default scales with the payload size).
+        --port=N           TCP loopback port (default 4567).
+        --output=FILE      Write the JSON here instead of stdout.
+        --quick            Smallest useful sweep (e.g. for a smoke test).
+*/
+
+namespace
+{
+
+std::atomic<std::uint64_t> g_allocations( 0 );
+
+struct Config
+{
+    std::string transport;
+    std::size_t payloadBytes;
+    int numTypes;
+    int numProducers;
+    int numSubscribers;
+    int numPackets;
+};
+
+struct Result
+{
+    bool ok = false;
+    int received = 0;
+    double seconds = 0.0;
+    std::uint64_t allocations = 0;
+    LatencySummary latency;
+};
+
+/// Socket for one end of a socketpair():
+class SocketPairEnd : public Socket
+{
+public:
+    explicit SocketPairEnd( int fd ) { m_socket = fd; }
+};
+
+/**
+    A connected writer/reader pair over one of the transports under test.
+*/
+struct Link
+{
+    std::unique_ptr<Socket> writeSocket;
+    std::unique_ptr<Socket> readSocket;
+    std::unique_ptr<TcpSocket> listener;
+    std::unique_ptr<SharedMemoryTransport> writeMemory;
+    std::unique_ptr<SharedMemoryTransport> readMemory;
+
+    AbstractWriter* writer = nullptr;
+    AbstractReader* reader = nullptr;
+
+    /// Wake a demuxer waiting on the reader so it exits promptly:
+    void Shutdown()
+    {
+        if ( readSocket ) { readSocket->Shutdown(); }
+        writeMemory.reset();
+    }
+};
+
+bool Connect( const std::string& transport, int port, Link& link )
+{
+    if ( transport == "socketpair" )
+    {
+        int fds[2];
+        if ( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) != 0 )
+        {
+            return false;
+        }
+        link.writeSocket.reset( new SocketPairEnd( fds[0] ) );
+        link.readSocket.reset( new SocketPairEnd( fds[1] ) );
+    }
+    else if ( transport == "tcp" )
+    {
+        link.listener.reset( new TcpSocket() );
+        if ( link.listener->Bind( port ) == false || link.listener->Listen( 1 ) == false )
+        {
+            std::cerr << "Could not listen on port " << port << std::endl;
+            return false;
+        }
+
+        std::unique_ptr<TcpSocket> client( new TcpSocket() );
+        std::thread connector( [&]() { client->Connect( "127.0.0.1", port ); } );
+        link.readSocket.reset( link.listener->Accept() );
+        connector.join();
+        client->SetNagleBufferingOff();
+        link.writeSocket = std::move( client );
+    }
+    else if ( transport == "memory" )
+    {
+        link.writeMemory = SharedMemoryTransport::Create();
+        if ( link.writeMemory == nullptr )
+        {
+            return false;
+        }
+        link.readMemory = link.writeMemory->MakePeer();
+        link.writer = link.writeMemory.get();
+        link.reader = link.readMemory.get();
+        return link.readMemory != nullptr;
+    }
+    else
+    {
+        std::cerr << "Unknown transport '" << transport << "'" << std::endl;
+        return false;
+    }
+
+    link.writer = link.writeSocket.get();
+    link.reader = link.readSocket.get();
+    return link.readSocket != nullptr && link.writeSocket->IsValid();
+}
+
+Result Run( const Config& config, int port )
+{
+    Result result;
+    Link link;
+    if ( Connect( config.transport, port, link ) == false )
+    {
+        return result;
+    }
+
+    std::vector<std::string> packetIds;
+    for ( int t = 0; t < config.numTypes; ++t )
+    {
+        packetIds.push_back( "Type" + std::to_string( t ) );
+    }
+
+    const std::uint64_t expectedCallbacks = std::uint64_t( config.numPackets ) * config.numSubscribers;
+    std::atomic<std::uint64_t> callbacks( 0 );
+    std::atomic<int> received( 0 );
+    LatencyHistogram latency;
+    std::chrono::steady_clock::time_point start, end;
+    std::uint64_t allocationsAtStart = 0;
+
+    {
+        PacketDemuxer demuxer( *link.reader, packetIds );
+        std::vector<PacketSubscription> subscriptions;
+        for ( const std::string& type : packetIds )
+        {
+            // The first subscriber of each type measures latency and counts packets, the rest just count callbacks:
+            subscriptions.push_back( demuxer.Subscribe( type, [&]( const ComPacket::ConstSharedPacket& packet ) {
+                std::uint64_t posted = 0;
+                std::memcpy( &posted, packet->GetDataPtr(), sizeof(posted) );
+                latency.Record( LatencyHistogram::Now() - posted );
+                received += 1;
+                callbacks += 1;
+            }));
+
+            for ( int s = 1; s < config.numSubscribers; ++s )
+            {
+                subscriptions.push_back( demuxer.Subscribe( type, [&]( const ComPacket::ConstSharedPacket& ) { callbacks += 1; } ) );
+            }
+        }
+
+        std::unique_ptr<PacketMuxer> muxer( new PacketMuxer( *link.writer, packetIds ) );
+
+        auto produce = [&]( int producer ) {
+            std::vector<VectorStream::CharType> payload( config.payloadBytes, 'x' );
+            for ( int i = producer; i < config.numPackets; i += config.numProducers )
+            {
+                const std::uint64_t now = LatencyHistogram::Now();
+                std::memcpy( payload.data(), &now, sizeof(now) );
+                muxer->EmplacePacket( packetIds[ i % config.numTypes ], payload.data(), payload.size() );
+            }
+        };
+
+        allocationsAtStart = g_allocations;
+        start = std::chrono::steady_clock::now();
+
+        std::vector<std::thread> producers;
+        for ( int p = 0; p < config.numProducers; ++p )
+        {
+            producers.emplace_back( produce, p );
+        }
+        for ( std::thread& producer : producers )
+        {
+            producer.join();
+        }
+
+        const auto timeout = start + std::chrono::seconds( 60 );
+        while ( callbacks < expectedCallbacks && demuxer.Ok() && std::chrono::steady_clock::now() < timeout )
+        {
+            std::this_thread::sleep_for( std::chrono::microseconds( 100 ) );
+        }
+        end = std::chrono::steady_clock::now();
+        result.allocations = g_allocations - allocationsAtStart;
+
+        muxer.reset();
+        link.Shutdown();
+    }
+
+    result.received = received;
+    result.ok = callbacks == expectedCallbacks;
+    result.seconds = std::chrono::duration<double>( end - start ).count();
+    result.latency = latency.Summarise();
+    return result;
+}
+
+std::vector<std::string> Split( const std::string& list )
+{
+    std::vector<std::string> items;
+    std::stringstream stream( list );
+    std::string item;
+    while ( std::getline( stream, item, ',' ) )
+    {
+        items.push_back( item );
+    }
+    return items;
+}
+
+std::vector<int> SplitNumbers( const std::string& list )
+{
+    std::vector<int> numbers;
+    for ( const std::string& item : Split( list ) )
+    {
+        numbers.push_back( std::atoi( item.c_str() ) );
+    }
+    return numbers;
+}
+
+/// Enough packets for a stable measurement without the large payload runs taking too long:
+int DefaultPacketCount( std::size_t payloadBytes )
+{
+    constexpr std::size_t bytesPerRun = 256*1024*1024;
+    return std::max<std::size_t>( 5000, std::min<std::size_t>( 200000, bytesPerRun / ( payloadBytes + 8 ) ) );
+}
+
+void WriteJson( std::ostream& out, const std::vector< std::pair<Config, Result> >& results )
+{
+    out << "{\n  \"benchmark\": \"packetcomms\",\n  \"results\": [\n";
+    for ( std::size_t r = 0; r < results.size(); ++r )
+    {
+        const Config& c = results[r].first;
+        const Result& m = results[r].second;
+        const double packetsPerSecond = m.seconds > 0.0 ? m.received / m.seconds : 0.0;
+        const double mibPerSecond = packetsPerSecond * ( c.payloadBytes + 8 ) / ( 1024.0 * 1024.0 );
+        const double allocationsPerPacket = m.received > 0 ? double( m.allocations ) / m.received : 0.0;
+
+        out << "    {"
+            << " \"transport\": \"" << c.transport << "\","
+            << " \"payload_bytes\": " << c.payloadBytes << ","
+            << " \"types\": " << c.numTypes << ","
+            << " \"producers\": " << c.numProducers << ","
+            << " \"subscribers\": " << c.numSubscribers << ","
+            << " \"packets\": " << c.numPackets << ","
+            << " \"ok\": " << ( m.ok ? "true" : "false" ) << ","
+            << " \"seconds\": " << m.seconds << ","
+            << " \"packets_per_sec\": " << packetsPerSecond << ","
+            << " \"mib_per_sec\": " << mibPerSecond << ","
+            << " \"latency_us\": { \"p50\": " << m.latency.p50 * 1e-3
+            << ", \"p99\": " << m.latency.p99 * 1e-3
+            << ", \"max\": " << m.latency.max * 1e-3 << " },"
+            << " \"allocations_per_packet\": " << allocationsPerPacket
+            << " }" << ( r + 1 < results.size() ? "," : "" ) << "\n";
+    }
+    out << "  ]\n}" << std::endl;
+}
+
+} // end anonymous namespace
+
+// Count heap allocations so the runs can report allocations per packet:
+void* operator new( std::size_t size )
+{
+    g_allocations.fetch_add( 1, std::memory_order_relaxed );
+    void* p = std::malloc( size > 0 ? size : 1 );
+    if ( p == nullptr )
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete( void* p ) noexcept
+{
+    std::free( p );
+}
+
+void operator delete( void* p, std::size_t ) noexcept
+{
+    std::free( p );
+}
+
+int main( int argc, char** argv )
+{
+    std::vector<std::string> transports = { "socketpair", "tcp", "memory" };
+    std::vector<int> payloads = { 16, 256, 4096, 65536 };
+    std::vector<int> types = { 1, 4 };
+    std::vector<int> producers = { 1, 4 };
+    std::vector<int> subscribers = { 1, 4 };
+    int numPackets = 0;
+    int port = 4567;
+    std::string outputFile;
+
+    for ( int a = 1; a < argc; ++a )
+    {
+        const std::string arg = argv[a];
+        const std::size_t equals = arg.find( '=' );
+        const std::string name = arg.substr( 0, equals );
+        const std::string value = equals == std::string::npos ? "" : arg.substr( equals + 1 );
+
+        if ( name == "--transports" ) { transports = Split( value ); }
+        else if ( name == "--payloads" ) { payloads = SplitNumbers( value ); }
+        else if ( name == "--types" ) { types = SplitNumbers( value ); }
+        else if ( name == "--producers" ) { producers = SplitNumbers( value ); }
+        else if ( name == "--subscribers" ) { subscribers = SplitNumbers( value ); }
+        else if ( name == "--packets" ) { numPackets = std::atoi( value.c_str() ); }
+        else if ( name == "--port" ) { port = std::atoi( value.c_str() ); }
+        else if ( name == "--output" ) { outputFile = value; }
+        else if ( name == "--quick" )
+        {
+            payloads = { 16, 4096 };
+            types = { 1 };
+            producers = { 1 };
+            subscribers = { 1 };
+            numPackets = 20000;
+        }
+        else
+        {
+            std::cerr << "Unknown option '" << arg << "' (see the comment at the top of packetcomms_benchmark.cpp)" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    // The payload carries the time it was posted:
+    for ( int& payload : payloads )
+    {
+        payload = std::max<int>( payload, sizeof(std::uint64_t) );
+    }
+
+    // Each TCP run uses its own port so that TIME_WAIT sockets from earlier runs do not get in the way:
+    int nextPort = port;
+    bool allOk = true;
+    std::vector< std::pair<Config, Result> > results;
+    for ( const std::string& transport : transports )
+    for ( int payload : payloads )
+    for ( int t : types )
+    for ( int p : producers )
+    for ( int s : subscribers )
+    {
+        const Config config = { transport, std::size_t( payload ), t, p, s, numPackets > 0 ? numPackets : DefaultPacketCount( payload ) };
+        const Result result = Run( config, transport == "tcp" ? nextPort++ : port );
+        allOk &= result.ok;
+        results.emplace_back( config, result );
+
+        std::clog << transport << " payload=" << payload << " types=" << t << " producers=" << p << " subscribers=" << s
+                  << ": " << ( result.seconds > 0.0 ? result.received / result.seconds : 0.0 ) << " packets/sec"
+                  << ( result.ok ? "" : " (FAILED)" ) << std::endl;
+    }
+
+    if ( outputFile.empty() )
+    {
+        WriteJson( std::cout, results );
+    }
+    else
+    {
+        std::ofstream out( outputFile );
+        WriteJson( out, results );
+    }
+
+    return allOk ? EXIT_SUCCESS : EXIT_FAILURE;
+}
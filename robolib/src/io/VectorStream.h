@@ -1,6 +1,7 @@
 #ifndef VECTORSTREAM_H
 #define VECTORSTREAM_H
 
+#include <cstddef>
 #include <streambuf>
 #include <vector>
 
@@ -51,8 +52,8 @@ private:
 
     std::streamsize xsputn( const std::streambuf::char_type* s, std::streamsize n )
     {
-        // Make sure vector has enough capacity then insert all the bytes:
-        m_v.reserve(m_v.size()+n);
+        // Insert all the bytes at once (reserving exactly size+n here would
+        // defeat the vector's geometric growth and reallocate on every call):
         m_v.insert(m_v.end(),s,s+n);
         return n;
     }
@@ -73,11 +74,21 @@ public:
         be modified for the lifetime of the VectorInputStream object.
     */
     explicit VectorInputStream( const VectorStream::Buffer& v )
+    :
+        VectorInputStream( v.data(), v.size() )
     {
-        const std::streambuf::char_type* begin = v.data();
-        setg( const_cast<char_type*>(begin),
-              const_cast<char_type*>(begin),
-              const_cast<char_type*>(begin + v.size()) );
+    }
+
+    /**
+        @param data Memory to input from - it must not be modified
+        or freed for the lifetime of the VectorInputStream object.
+        @param size Number of bytes of data.
+    */
+    VectorInputStream( const VectorStream::CharType* data, std::size_t size )
+    {
+        setg( const_cast<char_type*>(data),
+              const_cast<char_type*>(data),
+              const_cast<char_type*>(data + size) );
     }
 
 private:
@@ -46,12 +46,13 @@ void TeleJoystick::Run()
     int16_t jy = 0;
     int16_t jmax = 1;
 
-    // Setup subscription callback to enqueue joystick packets:
-    SimpleQueue joyPackets;
+    // Setup subscription callback to keep the latest joystick packet (only the
+    // latest command matters, so a newer one replaces any not yet acted on):
+    LatestPacketSlot joyPacket;
     PacketSubscription joystickSubscription = m_demuxer.Subscribe( "Joystick", [&]( const ComPacket::ConstSharedPacket& packet )
     {
         assert( packet->GetType() == m_demuxer.GetIdManager().ToId("Joystick") );
-        joyPackets.Emplace( packet );
+        joyPacket.Put( packet );
     });
 
     constexpr std::chrono::milliseconds wait(200);
@@ -60,19 +61,13 @@ void TeleJoystick::Run()
         timeSinceLastCommand_secs = timer.GetSeconds();
         {
             // Sleep with timeout until a packet is received:
-            joyPackets.Lock().WaitNotEmpty( wait );
+            joyPacket.WaitNotEmpty( wait );
 
-            if ( joyPackets.Empty() == false )
+            const ComPacket::ConstSharedPacket packet = joyPacket.Take();
+            if ( packet != nullptr )
             {
                 timer.Reset();
-
-                // Only interested in latest packet if there are multiple (more control responsiveness):
-                while ( joyPackets.Size() > 1 )
-                {
-                    joyPackets.Pop();
-                }
-
-                ProcessPacket( joyPackets, jx, jy, jmax );
+                ProcessPacket( packet, jx, jy, jmax );
             }
             else if ( timeSinceLastCommand_secs > motionTimeout_secs )
             {
@@ -116,11 +111,9 @@ void TeleJoystick::Run()
     @param jy y-axis reading from the packet
     @param jmax The max value an axis reading can take.
 */
-void TeleJoystick::ProcessPacket(SimpleQueue& joyPackets, int16_t& jx, int16_t& jy, int16_t& jmax )
+void TeleJoystick::ProcessPacket( const ComPacket::ConstSharedPacket& packet, int16_t& jx, int16_t& jy, int16_t& jmax )
 {
-    const ComPacket::ConstSharedPacket packet = joyPackets.Front();
     Deserialise( packet, jx, jy, jmax );
-    joyPackets.Pop();
 }
 
 bool TeleJoystick::IsRunning() const
@@ -5,7 +5,7 @@
 #include <thread>
 
 #include "../packetcomms/ComPacket.h"
-#include "../packetcomms/SimpleQueue.h"
+#include "../packetcomms/LockFreeQueue.h"
 
 class PacketMuxer;
 class PacketDemuxer;
@@ -37,7 +37,7 @@ public:
     virtual ~TeleJoystick();
 
     virtual void Run();
-    void ProcessPacket( SimpleQueue & joyPackets, int16_t& jx, int16_t& jy, int16_t& jmax );
+    void ProcessPacket( const ComPacket::ConstSharedPacket& packet, int16_t& jx, int16_t& jy, int16_t& jmax );
     void Go();
     bool IsRunning() const;
 
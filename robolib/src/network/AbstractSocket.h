@@ -2,6 +2,9 @@
 #define ABSTRACTSOCKET_H
 
 #include <cstddef>
+#include <cstdint>
+
+#include <sys/uio.h>
 
 class AbstractWriter
 {
@@ -10,6 +13,52 @@ public:
     virtual ~AbstractWriter() {}
     virtual void SetBlocking( bool )                       = 0;
     virtual int  Write( const char*, std::size_t )         = 0;
+
+    /**
+        Gathering write of count buffers. The default implementation
+        simply calls Write() for each buffer in turn so it costs one
+        call per buffer - sockets override this with a single syscall.
+
+        @return Number of bytes written (which can be less than the total
+        if the write would block) or -1 if nothing could be written due to an error.
+    */
+    virtual int WriteVector( const struct iovec* iov, int count )
+    {
+        int total = 0;
+        for ( int i = 0; i < count; ++i )
+        {
+            const int n = Write( static_cast<const char*>( iov[i].iov_base ), iov[i].iov_len );
+            if ( n < 0 )
+            {
+                return total > 0 ? total : -1;
+            }
+
+            total += n;
+            if ( static_cast<std::size_t>(n) < iov[i].iov_len )
+            {
+                break;
+            }
+        }
+        return total;
+    }
+
+    /// Sleep until a write would not block. Default assumes writes never block.
+    virtual bool ReadyForWriting( int milliseconds ) const { return true; }
+
+    /**
+        Zero-copy writes are optional: writers that can not support
+        them return false from EnableZeroCopy() and the remaining
+        zero-copy functions are never called.
+
+        ZeroCopyIssued() counts the zero-copy writes made so far and
+        ReapZeroCopyCompletions() returns how many of those the transport
+        has finished with: buffers passed to a zero-copy write must not be
+        modified or freed until the completion count has passed it.
+    */
+    virtual bool EnableZeroCopy() { return false; }
+    virtual int  WriteVectorZeroCopy( const struct iovec* iov, int count ) { return WriteVector( iov, count ); }
+    virtual std::uint32_t ZeroCopyIssued() const { return 0; }
+    virtual std::uint32_t ReapZeroCopyCompletions() { return 0; }
 };
 
 class AbstractReader
@@ -20,6 +69,21 @@ public:
     virtual void SetBlocking( bool )                       = 0;
     virtual int  Read( char*, std::size_t )                = 0;
     virtual bool ReadyForReading( int milliseconds ) const = 0;
+
+    /**
+        Kernel receive timestamps are optional: readers that can not
+        support them return false from EnableReceiveTimestamps() and
+        ReadTimestamped() is then the same as Read().
+
+        @param nanoseconds Set to the time (CLOCK_REALTIME) the kernel
+        received the data that was read, or 0 if it is not known.
+    */
+    virtual bool EnableReceiveTimestamps() { return false; }
+    virtual int  ReadTimestamped( char* data, std::size_t maxBytes, std::uint64_t& nanoseconds )
+    {
+        nanoseconds = 0;
+        return Read( data, maxBytes );
+    }
 };
 
 class AbstractSocket
@@ -0,0 +1,309 @@
+#include "EventLoop.h"
+
+#include <future>
+#include <iostream>
+#include <algorithm>
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/**
+    Create the epoll instance and start the loop's thread.
+
+    If epoll is not available the object is invalid (IsValid() returns
+    false) and no thread is started.
+*/
+EventLoop::EventLoop()
+:
+    m_epoll( epoll_create1( EPOLL_CLOEXEC ) ),
+    m_wakeFd( eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC ) ),
+    m_stop( false ),
+    m_nextTimerId( 1 )
+{
+    if ( IsValid() )
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.fd = m_wakeFd;
+        epoll_ctl( m_epoll, EPOLL_CTL_ADD, m_wakeFd, &event );
+        m_thread = std::thread( std::bind( &EventLoop::Run, std::ref(*this) ) );
+    }
+    else
+    {
+        std::clog << "Error: could not create event loop - " << strerror(errno) << std::endl;
+    }
+}
+
+/**
+    Stops the loop and waits for its thread to exit. Tasks that
+    were posted before this are still run.
+*/
+EventLoop::~EventLoop()
+{
+    if ( m_thread.joinable() )
+    {
+        Post( [this]() { m_stop = true; } );
+        m_thread.join();
+    }
+
+    if ( m_wakeFd != -1 ) { close( m_wakeFd ); }
+    if ( m_epoll != -1 ) { close( m_epoll ); }
+}
+
+bool EventLoop::IsValid() const
+{
+    return m_epoll != -1 && m_wakeFd != -1;
+}
+
+/**
+    @return true if called from the loop's thread (e.g. from a handler).
+*/
+bool EventLoop::InLoopThread() const
+{
+    return std::this_thread::get_id() == m_thread.get_id();
+}
+
+/**
+    Call handler from the loop thread whenever any of the epoll events
+    (e.g. EPOLLIN | EPOLLOUT) occur for the file descriptor. Events are
+    level triggered. The file descriptor must stay open until it is removed.
+
+    Must be called from the loop thread.
+
+    @return false if the file descriptor could not be registered.
+*/
+bool EventLoop::Add( int fd, std::uint32_t events, EventHandler handler )
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = fd;
+    if ( epoll_ctl( m_epoll, EPOLL_CTL_ADD, fd, &event ) != 0 )
+    {
+        std::clog << "Error: could not add fd to event loop - " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    m_handlers[fd] = std::make_shared<EventHandler>( std::move(handler) );
+    return true;
+}
+
+/**
+    Change the events a registered file descriptor is waiting for.
+
+    Must be called from the loop thread.
+*/
+bool EventLoop::Modify( int fd, std::uint32_t events )
+{
+    struct epoll_event event;
+    event.events = events;
+    event.data.fd = fd;
+    return epoll_ctl( m_epoll, EPOLL_CTL_MOD, fd, &event ) == 0;
+}
+
+/**
+    Stop watching the file descriptor. Its handler is not called again
+    (even for events already reported in the current iteration) although
+    it may be the handler that is currently running.
+
+    Must be called from the loop thread.
+*/
+void EventLoop::Remove( int fd )
+{
+    epoll_ctl( m_epoll, EPOLL_CTL_DEL, fd, nullptr );
+    m_handlers.erase( fd );
+}
+
+/**
+    Run task on the loop thread every period (the first time being
+    one period from now).
+
+    Must be called from the loop thread.
+
+    @return An id that can be passed to RemoveTimer().
+*/
+EventLoop::TimerId EventLoop::AddTimer( std::chrono::milliseconds period, Task task )
+{
+    const TimerId id = m_nextTimerId++;
+    m_timers.push_back( Timer{ id, period, std::chrono::steady_clock::now() + period, std::move(task) } );
+    return id;
+}
+
+/**
+    Must be called from the loop thread.
+*/
+void EventLoop::RemoveTimer( TimerId id )
+{
+    m_timers.erase( std::remove_if( m_timers.begin(), m_timers.end(), [id]( const Timer& t ) { return t.id == id; } ),
+                    m_timers.end() );
+}
+
+/**
+    Queue a task to run on the loop thread. Tasks run in the order they were posted.
+    Can be called from any thread.
+*/
+void EventLoop::Post( Task task )
+{
+    {
+        std::lock_guard<std::mutex> guard( m_taskLock );
+        m_tasks.push_back( std::move(task) );
+    }
+    Wake();
+}
+
+/**
+    Run a task on the loop thread and wait for it to finish. If this is
+    called from the loop thread the task is run immediately.
+
+    Because tasks run in order this also guarantees any task posted
+    earlier (by this thread) has finished.
+*/
+void EventLoop::Invoke( Task task )
+{
+    if ( InLoopThread() || m_thread.joinable() == false )
+    {
+        task();
+        return;
+    }
+
+    std::promise<void> done;
+    Post( [&]() {
+        task();
+        done.set_value();
+    });
+    done.get_future().wait();
+}
+
+void EventLoop::Wake()
+{
+    const uint64_t one = 1;
+    if ( write( m_wakeFd, &one, sizeof(one) ) < 0 && errno != EAGAIN )
+    {
+        std::clog << "Error: could not wake event loop - " << strerror(errno) << std::endl;
+    }
+}
+
+void EventLoop::Run()
+{
+    constexpr int maxEvents = 64;
+    struct epoll_event events[maxEvents];
+
+    while ( m_stop == false )
+    {
+        const int n = epoll_wait( m_epoll, events, maxEvents, MillisecondsToNextTimer() );
+        if ( n < 0 && errno != EINTR )
+        {
+            std::clog << "Error: epoll_wait failed - " << strerror(errno) << std::endl;
+            break;
+        }
+
+        for ( int i = 0; i < n; ++i )
+        {
+            const int fd = events[i].data.fd;
+            if ( fd == m_wakeFd )
+            {
+                uint64_t count;
+                while ( read( m_wakeFd, &count, sizeof(count) ) > 0 ) {}
+                continue;
+            }
+
+            // An earlier handler may have removed this one. The shared pointer keeps the
+            // handler alive if it removes itself while running:
+            auto itr = m_handlers.find( fd );
+            if ( itr != m_handlers.end() )
+            {
+                std::shared_ptr<EventHandler> handler = itr->second;
+                (*handler)( events[i].events );
+            }
+        }
+
+        RunTasks();
+        RunTimers();
+    }
+
+    // Don't leave anyone waiting in Invoke():
+    RunTasks();
+}
+
+void EventLoop::RunTasks()
+{
+    std::vector<Task> tasks;
+    {
+        std::lock_guard<std::mutex> guard( m_taskLock );
+        std::swap( tasks, m_tasks );
+    }
+
+    for ( Task& task : tasks )
+    {
+        task();
+    }
+}
+
+void EventLoop::RunTimers()
+{
+    const auto now = std::chrono::steady_clock::now();
+
+    std::vector<TimerId> due;
+    for ( const Timer& timer : m_timers )
+    {
+        if ( timer.due <= now )
+        {
+            due.push_back( timer.id );
+        }
+    }
+
+    // Timers can be added or removed by the tasks so look each one up again:
+    for ( TimerId id : due )
+    {
+        auto itr = std::find_if( m_timers.begin(), m_timers.end(), [id]( const Timer& t ) { return t.id == id; } );
+        if ( itr != m_timers.end() )
+        {
+            itr->due = std::max( itr->due + itr->period, now );
+            Task task = itr->task;
+            task();
+        }
+    }
+}
+
+/**
+    @return The epoll_wait() timeout: -1 (no timeout) if there are no timers.
+*/
+int EventLoop::MillisecondsToNextTimer() const
+{
+    if ( m_timers.empty() )
+    {
+        return -1;
+    }
+
+    auto next = m_timers.front().due;
+    for ( const Timer& timer : m_timers )
+    {
+        next = std::min( next, timer.due );
+    }
+
+    const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>( next - std::chrono::steady_clock::now() );
+    return std::max<int>( 0, wait.count() + 1 );
+}
+
+EventLoopPool::EventLoopPool( unsigned numThreads )
+:
+    m_next( 0 )
+{
+    for ( unsigned i = 0; i < std::max( numThreads, 1u ); ++i )
+    {
+        m_loops.emplace_back( new EventLoop() );
+    }
+}
+
+/**
+    @return The next loop in turn (round-robin). Can be called from any thread.
+*/
+EventLoop& EventLoopPool::Next()
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    EventLoop& loop = *m_loops[m_next];
+    m_next = ( m_next + 1 ) % m_loops.size();
+    return loop;
+}
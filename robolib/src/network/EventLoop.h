@@ -0,0 +1,95 @@
+#ifndef ROBOLIB_EVENT_LOOP_H
+#define ROBOLIB_EVENT_LOOP_H
+
+#include <cstdint>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/**
+    An epoll based reactor: file descriptors are registered with a
+    handler that is called (on the loop's own thread) whenever any of
+    the requested events occur. This lets one thread service many
+    connections instead of each connection blocking its own threads.
+
+    Registrations and timers may only be changed from the loop's thread
+    (i.e. from within a handler, task or timer). Other threads hand work
+    to the loop with Post() or Invoke(), which are always safe to call.
+*/
+class EventLoop
+{
+public:
+    typedef std::function<void( std::uint32_t events )> EventHandler;
+    typedef std::function<void()> Task;
+    typedef std::uint64_t TimerId;
+
+    EventLoop();
+    virtual ~EventLoop();
+
+    bool IsValid() const;
+    bool InLoopThread() const;
+
+    bool Add( int fd, std::uint32_t events, EventHandler handler );
+    bool Modify( int fd, std::uint32_t events );
+    void Remove( int fd );
+
+    TimerId AddTimer( std::chrono::milliseconds period, Task task );
+    void RemoveTimer( TimerId id );
+
+    void Post( Task task );
+    void Invoke( Task task );
+
+private:
+    struct Timer
+    {
+        TimerId id;
+        std::chrono::milliseconds period;
+        std::chrono::steady_clock::time_point due;
+        Task task;
+    };
+
+    void Run();
+    void Wake();
+    void RunTasks();
+    void RunTimers();
+    int  MillisecondsToNextTimer() const;
+
+    int m_epoll;
+    int m_wakeFd;
+    bool m_stop;
+
+    std::mutex m_taskLock;
+    std::vector<Task> m_tasks;
+
+    // Only used on the loop's thread:
+    std::unordered_map<int, std::shared_ptr<EventHandler>> m_handlers;
+    std::vector<Timer> m_timers;
+    TimerId m_nextTimerId;
+
+    // Must be initialised last so that everything is set up before the loop runs:
+    std::thread m_thread;
+};
+
+/**
+    A fixed set of event loops (one thread each) that connections
+    are shared out between in turn.
+*/
+class EventLoopPool
+{
+public:
+    explicit EventLoopPool( unsigned numThreads );
+
+    EventLoop& Next();
+    std::size_t Size() const { return m_loops.size(); }
+
+private:
+    std::vector< std::unique_ptr<EventLoop> > m_loops;
+    std::size_t m_next;
+    std::mutex m_lock;
+};
+
+#endif // ROBOLIB_EVENT_LOOP_H
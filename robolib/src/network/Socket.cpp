@@ -10,6 +10,9 @@
 #include <fcntl.h>
 #include <poll.h>
 
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
 #include "Ipv4Address.h"
 
 #include <iostream>
@@ -19,7 +22,11 @@
 **/
 Socket::Socket()
 :
-    m_socket (-1)
+    m_socket            (-1),
+    m_zeroCopy          (false),
+    m_zeroCopyIssued    (0),
+    m_zeroCopyCompleted (0),
+    m_rxTimestamps      (false)
 {
 }
 
@@ -39,6 +46,15 @@ bool Socket::IsValid() const
     return m_socket >= 0;
 }
 
+/**
+    @return The underlying file descriptor (e.g. for registering with an EventLoop).
+    The descriptor still belongs to this object.
+*/
+int Socket::GetFileDescriptor() const
+{
+    return m_socket;
+}
+
 /**
     Bind this socket to the specified port-number on any INET address.
 **/
@@ -105,6 +121,54 @@ bool Socket::Connect( const Ipv4Address& addr )
     return err != -1;
 }
 
+/**
+    Connect without waiting longer than the timeout (a blocking connect to
+    a host that has gone away can take minutes to fail). The socket's
+    blocking mode is left as it was.
+
+    @param [in] hostname name of host to connect to. Can be numeric IP or host name.
+    @param [in] portNumber integer port number to connect to.
+    @param [in] timeoutInMilliseconds Maximum time to wait for the connection.
+    @return True if the connection was successful.
+**/
+bool Socket::Connect( const char* hostname, int portNumber, int timeoutInMilliseconds )
+{
+    return Connect( Ipv4Address( hostname, portNumber ), timeoutInMilliseconds );
+}
+
+bool Socket::Connect( const Ipv4Address& addr, int timeoutInMilliseconds )
+{
+    if ( addr.IsValid() == false )
+    {
+        return false;
+    }
+
+    const int flags = fcntl( m_socket, F_GETFL );
+    fcntl( m_socket, F_SETFL, flags | O_NONBLOCK );
+
+    int err = connect( m_socket, (struct sockaddr*)addr.Get_sockaddr_in_Ptr(), sizeof(struct sockaddr_in) );
+    if ( err == -1 && errno == EINPROGRESS )
+    {
+        // The result is reported through SO_ERROR once the socket is writable:
+        int result = ETIMEDOUT;
+        if ( ReadyForWriting( timeoutInMilliseconds ) )
+        {
+            socklen_t length = sizeof(result);
+            getsockopt( m_socket, SOL_SOCKET, SO_ERROR, &result, &length );
+        }
+        err = result == 0 ? 0 : -1;
+        errno = result;
+    }
+
+    if ( err == -1 )
+    {
+        std::clog <<  __FILE__ << ": Error " << strerror(errno) << std::endl;
+    }
+
+    fcntl( m_socket, F_SETFL, flags );
+    return err != -1;
+}
+
 /**
     Blocking read from this socket.
     
@@ -131,6 +195,75 @@ int Socket::Read( char* message, size_t maxBytes )
     return n;
 }
 
+/**
+    Ask the kernel to timestamp received data in software as it arrives
+    (SO_TIMESTAMPING) so that ReadTimestamped() can report it.
+
+    @return true if receive timestamps are supported by this socket.
+**/
+bool Socket::EnableReceiveTimestamps()
+{
+#ifdef SO_TIMESTAMPING
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    m_rxTimestamps = setsockopt( m_socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags) ) == 0;
+    if ( m_rxTimestamps == false )
+    {
+        std::clog << __FILE__ << ": Receive timestamps not available - " << strerror(errno) << std::endl;
+    }
+#endif
+    return m_rxTimestamps;
+}
+
+/**
+    As Read() but also returns the time the kernel received the data (for
+    a stream socket this is the timestamp of the last segment read).
+
+    @param nanoseconds Set to the receive time (CLOCK_REALTIME) or 0 if
+    the kernel did not supply one (e.g. receive timestamps are not enabled).
+**/
+int Socket::ReadTimestamped( char* message, size_t maxBytes, uint64_t& nanoseconds )
+{
+    nanoseconds = 0;
+#ifdef SCM_TIMESTAMPING
+    if ( m_rxTimestamps == false )
+    {
+        return Read( message, maxBytes );
+    }
+
+    struct iovec iov;
+    iov.iov_base = message;
+    iov.iov_len = maxBytes;
+
+    char control[256];
+    struct msghdr msg;
+    memset( &msg, 0, sizeof(msg) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int n = recvmsg( m_socket, &msg, MSG_NOSIGNAL );
+    if ( n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+    {
+        return 0;
+    }
+
+    for ( struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); n > 0 && cm != nullptr; cm = CMSG_NXTHDR(&msg, cm) )
+    {
+        if ( cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING )
+        {
+            // The software timestamp is the first of the three:
+            const struct scm_timestamping* ts = reinterpret_cast<const struct scm_timestamping*>( CMSG_DATA(cm) );
+            nanoseconds = ts->ts[0].tv_sec * 1000000000ull + ts->ts[0].tv_nsec;
+        }
+    }
+
+    return n;
+#else
+    return Read( message, maxBytes );
+#endif
+}
+
 /**
     In the case of non-blocking IO Write returns 0 if the write would have
     caused the process to block.
@@ -157,6 +290,144 @@ int Socket::Write( const char* message, size_t size )
     return n;
 }
 
+/**
+    Gathering write: sends all the buffers with a single syscall.
+
+    Same return semantics as Write(): in the case of non-blocking IO
+    0 is returned if the write would have blocked.
+
+    @return Number of bytes written (possibly fewer than the total size
+    of all the buffers) or -1 if there was an error.
+**/
+int Socket::WriteVector( const struct iovec* iov, int count )
+{
+    return SendMessage( iov, count, MSG_NOSIGNAL );
+}
+
+/**
+    Request that the kernel avoids copying data for subsequent calls
+    to WriteVectorZeroCopy(). Only worthwhile for large writes because
+    the completion notifications have to be reaped from the socket's
+    error queue (see ReapZeroCopyCompletions()).
+
+    @return true if zero-copy sends are supported by this socket.
+**/
+bool Socket::EnableZeroCopy()
+{
+#ifdef SO_ZEROCOPY
+    int one = 1;
+    m_zeroCopy = setsockopt( m_socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one) ) == 0;
+    if ( m_zeroCopy == false )
+    {
+        std::clog << __FILE__ << ": Zero-copy not available - " << strerror(errno) << std::endl;
+    }
+#endif
+    return m_zeroCopy;
+}
+
+/**
+    As WriteVector() but the payload pages are handed to the kernel by
+    reference. The buffers must stay unmodified until ReapZeroCopyCompletions()
+    shows this write has completed.
+
+    If the kernel can not allocate a notification for the send then
+    this falls back to a normal (copying) send.
+**/
+int Socket::WriteVectorZeroCopy( const struct iovec* iov, int count )
+{
+#ifdef MSG_ZEROCOPY
+    if ( m_zeroCopy )
+    {
+        int n = SendMessage( iov, count, MSG_NOSIGNAL | MSG_ZEROCOPY );
+        if ( n > 0 )
+        {
+            // Each successful zero-copy send is identified by a sequence number:
+            m_zeroCopyIssued += 1;
+            return n;
+        }
+
+        if ( n == 0 || errno != ENOBUFS )
+        {
+            return n;
+        }
+    }
+#endif
+    return WriteVector( iov, count );
+}
+
+/**
+    @return The number of zero-copy sends that have been issued on this socket.
+**/
+uint32_t Socket::ZeroCopyIssued() const
+{
+    return m_zeroCopyIssued;
+}
+
+/**
+    Drain the zero-copy completion notifications from the socket's
+    error queue. Never blocks.
+
+    @return The number of zero-copy sends for which the kernel has
+    released the user's buffers (compare with ZeroCopyIssued()).
+**/
+uint32_t Socket::ReapZeroCopyCompletions()
+{
+#ifdef SO_EE_ORIGIN_ZEROCOPY
+    if ( m_zeroCopy == false )
+    {
+        return m_zeroCopyCompleted;
+    }
+
+    char control[128];
+    while ( true )
+    {
+        struct msghdr msg;
+        memset( &msg, 0, sizeof(msg) );
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if ( recvmsg( m_socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT ) == -1 )
+        {
+            break; // EAGAIN (nothing left to reap) or a real error.
+        }
+
+        for ( struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm) )
+        {
+            const struct sock_extended_err* err = reinterpret_cast<const struct sock_extended_err*>( CMSG_DATA(cm) );
+            if ( err->ee_errno == 0 && err->ee_origin == SO_EE_ORIGIN_ZEROCOPY )
+            {
+                // Notification covers the range of sends [ee_info, ee_data]:
+                const uint32_t completed = err->ee_data + 1;
+                if ( static_cast<int32_t>( completed - m_zeroCopyCompleted ) > 0 )
+                {
+                    m_zeroCopyCompleted = completed;
+                }
+            }
+        }
+    }
+#endif
+    return m_zeroCopyCompleted;
+}
+
+/**
+    Common implementation for the gathering writes.
+**/
+int Socket::SendMessage( const struct iovec* iov, int count, int flags )
+{
+    struct msghdr msg;
+    memset( &msg, 0, sizeof(msg) );
+    msg.msg_iov = const_cast<struct iovec*>( iov );
+    msg.msg_iovlen = count;
+
+    int n = sendmsg( m_socket, &msg, flags );
+    if ( n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) )
+    {
+        n = 0;
+    }
+
+    return n;
+}
+
 /**
     @param block True set socket to blocking mode, false sets socket to non-blocking.
 **/
@@ -240,7 +511,8 @@ bool Socket::WaitForSingleEvent( const short pollEvent, int timeoutInMillisecond
         std::clog << __FILE__ << ": Error from poll() - " << strerror(errno) << std::endl;
     }
 
-    if( (pfds.revents & POLLERR) )
+    // Zero-copy completions are delivered via the error queue so POLLERR is expected in that case:
+    if( (pfds.revents & POLLERR) && m_zeroCopy == false )
     {
         std::clog << __FILE__ << ": POLLERR!\n";
     }
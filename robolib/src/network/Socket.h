@@ -5,6 +5,7 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #endif
 
@@ -26,14 +27,25 @@ public:
     virtual ~Socket();
 
     bool IsValid() const;
+    int GetFileDescriptor() const;
 
     bool Bind( int );
     void Shutdown();
     bool Connect( const char*, int );
     bool Connect( const Ipv4Address& address );
+    bool Connect( const char*, int, int timeoutInMilliseconds );
+    bool Connect( const Ipv4Address& address, int timeoutInMilliseconds );
 
     int Read( char* message, size_t maxBytes );
+    bool EnableReceiveTimestamps();
+    int ReadTimestamped( char* message, size_t maxBytes, uint64_t& nanoseconds );
     int Write( const char* message, size_t size );
+    int WriteVector( const struct iovec* iov, int count );
+
+    bool EnableZeroCopy();
+    int WriteVectorZeroCopy( const struct iovec* iov, int count );
+    uint32_t ZeroCopyIssued() const;
+    uint32_t ReapZeroCopyCompletions();
 
     void SetBlocking( bool );
 
@@ -44,7 +56,12 @@ public:
 
 protected:
     int m_socket;
+    bool m_zeroCopy;
+    uint32_t m_zeroCopyIssued;
+    uint32_t m_zeroCopyCompleted;
+    bool m_rxTimestamps;
 
+    int SendMessage( const struct iovec* iov, int count, int flags );
     bool WaitForSingleEvent( const short pollEvent, int timeoutInMilliseconds ) const;
 
 private:
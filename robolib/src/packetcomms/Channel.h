@@ -0,0 +1,130 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <cstddef>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "IdManager.h"
+#include "PacketMuxer.h"
+#include "PacketDemuxer.h"
+#include "PacketArchive.h"
+
+/**
+    A typed handle to one packet type: it caches the type's id and
+    knows the types its payload is serialised from, so publishing and
+    subscribing are direct (indexed) operations without the name lookup
+    done by PacketMuxer::EmplacePacket(name, ...), and callbacks receive
+    deserialised values rather than raw packets.
+
+    Get a channel once (from the muxer's or demuxer's ids, which must be
+    the same list on both ends) and keep it:
+
+        const Channel<DiffDrive::MotorData> odometry( muxer.GetIdManager(), "Odometry" );
+        odometry.Publish( muxer, data );
+        ...
+        auto subscription = odometry.Subscribe( demuxer, []( const DiffDrive::MotorData& data ) { ... } );
+
+    A payload can be several values (as with Serialise()), e.g.
+    Channel<timespec, int>. The values are serialised with Cereal (see
+    PacketArchive.h) so the packets are compatible with Serialise() and
+    Deserialise().
+
+    For a packet set fixed at compile time the ids can be found at
+    compile time too (see StaticPacketId()).
+*/
+template <typename... Ts>
+class Channel
+{
+public:
+    typedef std::function<void( const Ts&... )> CallBack;
+
+    /// @throw std::out_of_range if the packet ids do not include the name.
+    Channel( const IdManager& packetIds, const std::string& name ) : m_type( packetIds.ToId(name) ) {}
+    explicit constexpr Channel( IdManager::PacketType type ) : m_type( type ) {}
+
+    constexpr IdManager::PacketType GetType() const { return m_type; }
+
+    void Publish( PacketMuxer& muxer, const Ts&... values ) const
+    {
+        PacketOutputArchive archive;
+        archive( values... );
+        muxer.EmplacePacket( m_type, archive.GetBuffer(), archive.GetHeaderSize(), archive.GetDataSize() );
+    }
+
+    PacketSubscription Subscribe( PacketDemuxer& demuxer, CallBack callback, const SubscriptionOptions& options = SubscriptionOptions() ) const
+    {
+        return demuxer.Subscribe( m_type, [callback]( const ComPacket::ConstSharedPacket& packet ) {
+            std::tuple<Ts...> values;
+            PacketInputArchive archive( packet->GetDataPtr(), packet->GetDataSize() );
+            Load( archive, values, std::index_sequence_for<Ts...>() );
+            Call( callback, values, std::index_sequence_for<Ts...>() );
+        }, options );
+    }
+
+private:
+    template <std::size_t... I>
+    static void Load( PacketInputArchive& archive, std::tuple<Ts...>& values, std::index_sequence<I...> )
+    {
+        archive( std::get<I>( values )... );
+    }
+
+    template <std::size_t... I>
+    static void Call( const CallBack& callback, const std::tuple<Ts...>& values, std::index_sequence<I...> )
+    {
+        callback( std::get<I>( values )... );
+    }
+
+    IdManager::PacketType m_type;
+};
+
+namespace PacketSetDetail
+{
+constexpr bool Equal( const char* a, const char* b )
+{
+    while ( *a != '\0' && *a == *b )
+    {
+        ++a;
+        ++b;
+    }
+    return *a == *b;
+}
+}
+
+/**
+    The id a packet type gets from an IdManager constructed from a fixed
+    list of names, found at compile time:
+
+        constexpr const char* PuppyPackets[] = { "AvInfo", "AvData", "Odometry", "Joystick" };
+        constexpr Channel<timespec, int> AvInfo( StaticPacketId( PuppyPackets, "AvInfo" ) );
+        PacketMuxer muxer( socket, PacketIdList( PuppyPackets ) );
+
+    A name that is not in the list is a compile error when evaluated at
+    compile time (and throws std::out_of_range, like IdManager::ToId(),
+    otherwise).
+*/
+template <std::size_t N>
+constexpr IdManager::PacketType StaticPacketId( const char* const (&names)[N], const char* name )
+{
+    for ( std::size_t i = 0; i < N; ++i )
+    {
+        if ( PacketSetDetail::Equal( names[i], name ) )
+        {
+            return IdManager::ControlPacket + 1 + i;
+        }
+    }
+    throw std::out_of_range( "Packet type is not in the packet set" );
+}
+
+/// The packet id list to construct a muxer or demuxer for a fixed packet set (see StaticPacketId()).
+template <std::size_t N>
+std::vector<std::string> PacketIdList( const char* const (&names)[N] )
+{
+    return std::vector<std::string>( names, names + N );
+}
+
+#endif // CHANNEL_H
@@ -9,8 +9,10 @@
 #include <type_traits>
 #include <memory>
 #include <queue>
+#include <algorithm>
 
 #include "IdManager.h"
+#include "PacketBuffer.h"
 #include "../io/VectorStream.h"
 
 class ComPacket
@@ -24,45 +26,86 @@ public:
     ComPacket& operator=( const ComPacket& ) = delete;
 
     /// Default constructed invalid packet:
-    ComPacket() : m_type( IdManager::InvalidPacket ) {}
+    ComPacket() : m_type( IdManager::InvalidPacket ), m_data( nullptr ), m_size( 0 ), m_timestamp( 0 ) {}
 
     /// Construct a com packet from raw buffer of stream data:
-    ComPacket( IdManager::PacketType type, const VectorStream::CharType* buffer, int size ) : m_type(type), m_data( buffer, buffer+size ) {}
-
-    ComPacket( IdManager::PacketType type, VectorStream::Buffer&& buffer ) : m_type(type)
+    ComPacket( IdManager::PacketType type, const VectorStream::CharType* buffer, std::size_t size ) : ComPacket( type, size )
     {
-        std::swap(m_data,buffer);
+        std::copy( buffer, buffer + size, m_data );
     }
 
-    /// Construct ComPacket with preallocated data size (but no valid data).
-    ComPacket( IdManager::PacketType type, int size ) : m_type(type), m_data( size ) {}
+    /// Construct a com packet from serialised data (the data is copied into pooled memory).
+    ComPacket( IdManager::PacketType type, VectorStream::Buffer&& buffer ) : ComPacket( type, buffer.data(), buffer.size() ) {}
+
+    /// Construct ComPacket with preallocated data size (but no valid data). The
+    /// data is allocated from the packet buffer pool and is not initialised.
+    /// Throws std::bad_alloc if the pool can not allocate size bytes.
+    ComPacket( IdManager::PacketType type, std::size_t size )
+    :
+        m_type( type ),
+        m_buffer( size > 0 ? PacketBuffer( size ) : PacketBuffer() ),
+        m_data( m_buffer.Data() ),
+        m_size( size ),
+        m_timestamp( 0 )
+    {}
+
+    /// Construct a ComPacket that shares (a slice of) an existing buffer - no data is copied.
+    ComPacket( IdManager::PacketType type, const PacketBuffer& buffer, std::size_t offset, std::size_t size )
+    :
+        m_type( type ),
+        m_buffer( buffer ),
+        m_data( buffer.Data() + offset ),
+        m_size( size ),
+        m_timestamp( 0 )
+    {}
 
     virtual ~ComPacket() {}
 
-    /// @param p The ComPacket to be moved - it will become of invalid type, with an empty data vector.
-    ComPacket( ComPacket&& p ) : m_type( IdManager::InvalidPacket ) {
-        std::swap( p.m_type, m_type );
-        std::swap( p.m_data, m_data );
-    }; /// @todo use delgating constructor to create  invalid packet when upgraded to gcc-4.7+
+    /// @param p The ComPacket to be moved - it will become of invalid type, with no data.
+    ComPacket( ComPacket&& p ) : ComPacket() {
+        Swap( p );
+    };
 
     ComPacket& operator=( ComPacket&& p ) {
-        std::swap( p.m_type, m_type );
-        std::swap( p.m_data, m_data );
+        Swap( p );
         return *this;
     };
 
+    /// Make a shared packet with both the packet and its control block allocated from the packet buffer pool.
+    template <typename... Args>
+    static SharedPacket MakeShared( Args&&... args )
+    {
+        return std::allocate_shared<ComPacket>( PoolAllocator<ComPacket>(), std::forward<Args>(args)... );
+    }
+
     IdManager::PacketType GetType()   const { return m_type; };
-    const VectorStream::CharType* GetDataPtr() const { return &(m_data[0]); };
-    VectorStream::CharType* GetDataPtr() { return &(m_data[0]); };
-    std::vector<VectorStream::CharType>::size_type GetDataSize() const noexcept { return m_data.size(); };
-    const std::vector<VectorStream::CharType>& GetData() const { return m_data; };
-    std::vector<VectorStream::CharType>& GetData() { return m_data; };
+    const VectorStream::CharType* GetDataPtr() const { return m_data; };
+    VectorStream::CharType* GetDataPtr() { return m_data; };
+    std::size_t GetDataSize() const noexcept { return m_size; };
+
+    /// Time the packet was posted for sending (see LatencyHistogram::Now()), or 0 if it was not recorded:
+    std::uint64_t GetTimestamp() const { return m_timestamp; }
+    void SetTimestamp( std::uint64_t nanoseconds ) { m_timestamp = nanoseconds; }
+
+    /// The underlying buffer may be larger than, and shared with other packets beyond, this packet's data.
+    const PacketBuffer& GetBuffer() const { return m_buffer; }
 
 protected:
 
 private:
     IdManager::PacketType m_type;
-    VectorStream::Buffer m_data;
+    PacketBuffer m_buffer;
+    VectorStream::CharType* m_data;
+    std::size_t m_size;
+    std::uint64_t m_timestamp;
+
+    void Swap( ComPacket& p ) {
+        std::swap( p.m_type, m_type );
+        std::swap( p.m_buffer, m_buffer );
+        std::swap( p.m_data, m_data );
+        std::swap( p.m_size, m_size );
+        std::swap( p.m_timestamp, m_timestamp );
+    }
 };
 
 #endif /* __COM_PACKET_H__ */
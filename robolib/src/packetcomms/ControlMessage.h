@@ -6,8 +6,41 @@
 enum class ControlMessage : std::uint8_t
 {
     HeartBeat = 0,
+    Credit    = 1,   ///< Flow control grant, see CreditMessage.
     Hello     = 254,
     GoodBye   = 255
 };
 
+/**
+    A Hello may carry a second byte of feature flags describing how the
+    muxer will format the packets that follow it. Features are only ever
+    turned on (a Hello without flags leaves them unchanged).
+*/
+enum HelloFeatures : std::uint8_t
+{
+    TimestampedHeaders = 1 ///< Each header is followed by the packet's post and send times (two 64-bit nanosecond counts).
+};
+
+/**
+    Set in the type word of a packet's header when the packet is a fragment
+    of a larger packet and more fragments of it follow (see
+    PacketMuxer::EnableFragmentation()). The last fragment carries the plain
+    type. Fragments of one packet are never interleaved with other packets
+    of the same type, so the receiver appends fragments to the type's packet
+    until it gets one without the flag.
+*/
+constexpr std::uint32_t MoreFragmentsFlag = 0x80000000u;
+
+/**
+    Body of a Credit control message: the receiver of a flow controlled
+    packet type allows the sender to send this many more packets of the
+    type (see TxQueueConfig::flowControl). Both fields are in network
+    byte order and follow the ControlMessage byte.
+*/
+struct CreditMessage
+{
+    std::uint32_t type;
+    std::uint32_t credits;
+};
+
 #endif // MUXERCONTROLMESSAGES_H
@@ -0,0 +1,69 @@
+#include "FlowControl.h"
+#include "PacketMuxer.h"
+
+#include <algorithm>
+
+CreditGranter::CreditGranter( std::size_t numTypes )
+:
+    m_window    ( new std::atomic<std::uint32_t>[numTypes] ),
+    m_returnPath( nullptr ),
+    m_consumed  ( numTypes, 0 )
+{
+    for ( std::size_t type = 0; type < numTypes; ++type )
+    {
+        m_window[type] = 0;
+    }
+}
+
+/**
+    Start flow control of a type by granting the sender a whole window of credit.
+
+    @param returnPath Muxer that sends to the peer whose packets are being received.
+*/
+void CreditGranter::Enable( IdManager::PacketType type, std::uint32_t window, PacketMuxer& returnPath )
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    m_returnPath = &returnPath;
+    m_consumed[type] = 0;
+    m_window[type] = window;
+    returnPath.SendCredits( type, window );
+}
+
+/**
+    @return A packet sharing the received packet's data that grants its
+    credit back once the last reference to it has been released.
+*/
+ComPacket::ConstSharedPacket CreditGranter::Track( const ComPacket::ConstSharedPacket& packet )
+{
+    std::shared_ptr<CreditGranter> self = shared_from_this();
+    ComPacket::ConstSharedPacket original = packet;
+    return ComPacket::ConstSharedPacket( packet.get(), [self, original]( const ComPacket* ) {
+        self->Consumed( original->GetType() );
+    }, PoolAllocator<ComPacket>() );
+}
+
+/**
+    Stop granting credit (packets still held by subscribers are no longer tracked).
+*/
+void CreditGranter::Close()
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    m_returnPath = nullptr;
+}
+
+void CreditGranter::Consumed( IdManager::PacketType type )
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    if ( m_returnPath == nullptr )
+    {
+        return;
+    }
+
+    m_consumed[type] += 1;
+    const std::uint32_t batch = std::max( m_window[type] / 2, 1u );
+    if ( m_consumed[type] >= batch )
+    {
+        m_returnPath->SendCredits( type, m_consumed[type] );
+        m_consumed[type] = 0;
+    }
+}
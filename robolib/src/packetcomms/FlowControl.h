@@ -0,0 +1,57 @@
+#ifndef FLOWCONTROL_H
+#define FLOWCONTROL_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "IdManager.h"
+#include "ComPacket.h"
+
+class PacketMuxer;
+
+/**
+    Receiving half of credit based flow control (see TxQueueConfig::flowControl).
+
+    The sender may only have a window of packets of a flow controlled type
+    outstanding: it starts with the whole window as credit and each packet
+    sent uses one up. A packet's credit is granted back once the consumers
+    have drained it, i.e. once every subscriber has finished with it and
+    released it (which for a subscriber that queues packets, such as a
+    video decoder, is only when it has actually processed the packet).
+    So when the consumers fall behind the sender runs out of credit and
+    packets queue (or are dropped) at the sender rather than piling up in
+    the kernel buffers and the subscribers' queues.
+
+    Credits are returned in batches of half a window to limit the control
+    traffic. They are sent by a muxer to the peer, whose demuxer passes them
+    to its muxer (see PacketDemuxer::SetCreditReceiver()).
+
+    Packets can be released from any thread, and after the demuxer has gone
+    away, so this is shared with the packets being tracked.
+*/
+class CreditGranter : public std::enable_shared_from_this<CreditGranter>
+{
+public:
+    explicit CreditGranter( std::size_t numTypes );
+    CreditGranter( const CreditGranter& ) = delete;
+    virtual ~CreditGranter() {}
+
+    void Enable( IdManager::PacketType type, std::uint32_t window, PacketMuxer& returnPath );
+    bool IsEnabled( IdManager::PacketType type ) const { return m_window[type] != 0; }
+    ComPacket::ConstSharedPacket Track( const ComPacket::ConstSharedPacket& packet );
+    void Close();
+
+private:
+    void Consumed( IdManager::PacketType type );
+
+    std::unique_ptr<std::atomic<std::uint32_t>[]> m_window; // Indexed by packet type (0 if not flow controlled).
+
+    std::mutex m_lock;
+    PacketMuxer* m_returnPath;
+    std::vector<std::uint32_t> m_consumed; // Drained packets whose credit has not been granted yet.
+};
+
+#endif // FLOWCONTROL_H
@@ -38,6 +38,9 @@ public:
     PacketType ToId( const std::string& name ) const { return m_map.at(name); }
     const std::string& ToString( const PacketType id ) const { return m_reverse[id]; }
 
+    /// Ids are allocated densely so this is also one more than the largest valid id:
+    std::size_t Size() const { return m_reverse.size(); }
+
 private:
     std::map<std::string,PacketType> m_map;
     std::vector<std::string> m_reverse;
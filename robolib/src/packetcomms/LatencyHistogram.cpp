@@ -0,0 +1,125 @@
+#include "LatencyHistogram.h"
+
+#include <algorithm>
+
+#include <time.h>
+
+constexpr unsigned LatencyHistogram::SubBucketBits;
+constexpr unsigned LatencyHistogram::MaxShift;
+constexpr std::size_t LatencyHistogram::NumBuckets;
+
+LatencyHistogram::LatencyHistogram()
+:
+    m_count ( 0 ),
+    m_max   ( 0 )
+{
+    for ( std::atomic<std::uint64_t>& bucket : m_buckets )
+    {
+        bucket.store( 0, std::memory_order_relaxed );
+    }
+}
+
+/**
+    Add a latency to the histogram. Negative latencies (which can appear
+    when the clocks of two hosts are not perfectly synchronised) count as zero.
+*/
+void LatencyHistogram::Record( std::int64_t nanoseconds )
+{
+    const std::uint64_t ns = nanoseconds > 0 ? nanoseconds : 0;
+    m_buckets[ BucketIndex( ns ) ].fetch_add( 1, std::memory_order_relaxed );
+
+    std::uint64_t max = m_max.load( std::memory_order_relaxed );
+    while ( ns > max && m_max.compare_exchange_weak( max, ns, std::memory_order_relaxed ) == false ) {}
+
+    m_count.fetch_add( 1, std::memory_order_release );
+}
+
+/**
+    Each percentile is reported as the largest latency its bucket can hold
+    (but never more than the maximum recorded).
+*/
+LatencySummary LatencyHistogram::Summarise() const
+{
+    // Buckets are incremented before the count so every record counted is in a bucket:
+    LatencySummary summary;
+    summary.count = m_count.load( std::memory_order_acquire );
+    summary.max = m_max.load( std::memory_order_relaxed );
+    if ( summary.count == 0 )
+    {
+        return summary;
+    }
+
+    const std::uint64_t p50Rank = ( summary.count + 1 ) / 2;
+    const std::uint64_t p99Rank = std::max<std::uint64_t>( 1, ( summary.count * 99 + 99 ) / 100 );
+
+    std::uint64_t seen = 0;
+    for ( std::size_t b = 0; b < NumBuckets; ++b )
+    {
+        const std::uint64_t n = m_buckets[b].load( std::memory_order_relaxed );
+        if ( n == 0 )
+        {
+            continue;
+        }
+
+        const std::uint64_t limit = std::min( BucketLimit( b ), summary.max );
+        if ( seen < p50Rank && seen + n >= p50Rank )
+        {
+            summary.p50 = limit;
+        }
+
+        seen += n;
+        if ( seen >= p99Rank )
+        {
+            summary.p99 = limit;
+            break;
+        }
+    }
+
+    return summary;
+}
+
+std::uint64_t LatencyHistogram::Now()
+{
+    timespec t;
+    clock_gettime( CLOCK_REALTIME, &t );
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+/**
+    Latencies below 2^SubBucketBits have a bucket each. Above that the
+    bucket is chosen by the position of the highest set bit and the
+    SubBucketBits bits below it.
+*/
+std::size_t LatencyHistogram::BucketIndex( std::uint64_t nanoseconds )
+{
+    constexpr std::uint64_t subBuckets = 1u << SubBucketBits;
+    if ( nanoseconds < subBuckets )
+    {
+        return nanoseconds;
+    }
+
+    const unsigned msb = 63 - __builtin_clzll( nanoseconds );
+    if ( msb >= MaxShift )
+    {
+        return NumBuckets - 1;
+    }
+
+    const unsigned shift = msb - SubBucketBits;
+    return ( ( shift + 1 ) << SubBucketBits ) + ( ( nanoseconds >> shift ) & ( subBuckets - 1 ) );
+}
+
+/**
+    @return The largest latency that goes in the specified bucket.
+*/
+std::uint64_t LatencyHistogram::BucketLimit( std::size_t index )
+{
+    constexpr std::uint64_t subBuckets = 1u << SubBucketBits;
+    if ( index < subBuckets )
+    {
+        return index;
+    }
+
+    const unsigned shift = ( index >> SubBucketBits ) - 1;
+    const std::uint64_t lower = ( subBuckets + ( index & ( subBuckets - 1 ) ) ) << shift;
+    return lower + ( std::uint64_t(1) << shift ) - 1;
+}
@@ -0,0 +1,69 @@
+#ifndef LATENCYHISTOGRAM_H
+#define LATENCYHISTOGRAM_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+    Summary of the latencies recorded in a LatencyHistogram (all in nanoseconds).
+    The percentiles are accurate to within the histogram's bucket resolution.
+*/
+struct LatencySummary
+{
+    std::uint64_t count = 0;
+    std::uint64_t p50 = 0;
+    std::uint64_t p99 = 0;
+    std::uint64_t max = 0;
+};
+
+/**
+    The stages of a packet's journey that the demuxer measures when the
+    muxer sends timestamped headers (see PacketMuxer::EnableLatencyTimestamps()):
+*/
+enum class LatencyStage
+{
+    Queued,  ///< From being posted to the muxer until it was written to the transport (measured by the sender).
+    Network, ///< From being written until the receiving kernel timestamped it (needs synchronised clocks).
+    Receive, ///< From the receiving kernel's timestamp until the callbacks are about to run.
+    Total,   ///< From being posted until the callbacks are about to run (needs synchronised clocks).
+    NumStages
+};
+
+/**
+    Log-linear histogram of latencies (in the style of HdrHistogram): each
+    power of two is split into 16 buckets so the relative error of any
+    percentile is at most about 6%. Latencies above MaxShift bits all go
+    in the last bucket but the maximum is always exact.
+
+    Recording is lock-free and a summary can be taken from any thread
+    while another records.
+*/
+class LatencyHistogram
+{
+public:
+    static constexpr unsigned SubBucketBits = 4;
+    static constexpr unsigned MaxShift = 36; // About 68 seconds.
+    static constexpr std::size_t NumBuckets = ( MaxShift - SubBucketBits + 1 ) << SubBucketBits;
+
+    LatencyHistogram();
+    LatencyHistogram( const LatencyHistogram& ) = delete;
+    LatencyHistogram& operator=( const LatencyHistogram& ) = delete;
+
+    void Record( std::int64_t nanoseconds );
+    LatencySummary Summarise() const;
+
+    /// The clock used for all latency timestamps (CLOCK_REALTIME, as used by the kernel's socket timestamps):
+    static std::uint64_t Now();
+
+protected:
+    static std::size_t BucketIndex( std::uint64_t nanoseconds );
+    static std::uint64_t BucketLimit( std::size_t index );
+
+private:
+    std::atomic<std::uint64_t> m_buckets[NumBuckets];
+    std::atomic<std::uint64_t> m_count;
+    std::atomic<std::uint64_t> m_max;
+};
+
+#endif // LATENCYHISTOGRAM_H
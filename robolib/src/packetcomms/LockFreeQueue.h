@@ -0,0 +1,436 @@
+#ifndef LOCKFREEQUEUE_H
+#define LOCKFREEQUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "ComPacket.h"
+#include "WaitEvent.h"
+
+/**
+    Bounded lock-free queues for passing packets between threads.
+
+    They offer the consumer side of the SimpleQueue interface (Empty(),
+    Size(), Front(), Pop() and WaitNotEmpty()) without the LockedQueue:
+    to migrate replace 'q.Lock().WaitNotEmpty( t )' with 'q.WaitNotEmpty( t )'.
+    Unlike SimpleQueue, Emplace() fails (returning false) when the queue
+    is full, and only the single consumer thread may call the consumer
+    functions.
+
+    Consumers sleep on a WaitEvent (futex) and can optionally spin for a
+    while before they do so. Producers never take a lock or make a
+    syscall unless the consumer is actually asleep.
+
+    The capacity is rounded up to a power of two.
+*/
+namespace LockFreeQueueDetail
+{
+constexpr std::size_t CacheLineBytes = 64;
+
+/// Atomic index padded to fill a cache line so the producer and consumer indices do not falsely share one:
+struct PaddedIndex
+{
+    explicit PaddedIndex( std::size_t v ) : value( v ) {}
+    std::atomic<std::size_t> value;
+    char padding[CacheLineBytes - sizeof(std::atomic<std::size_t>)];
+};
+
+inline std::size_t RoundUpToPowerOfTwo( std::size_t n )
+{
+    std::size_t p = 1;
+    while ( p < n )
+    {
+        p <<= 1;
+    }
+    return p;
+}
+}
+
+/**
+    Single producer, single consumer ring buffer.
+*/
+template <typename T>
+class SpscQueue
+{
+public:
+    /**
+        @param capacity Maximum number of queued items.
+        @param spinCount Number of times a waiting consumer polls the queue before it sleeps.
+    */
+    explicit SpscQueue( std::size_t capacity, unsigned spinCount = 0 )
+    :
+        m_capacity( LockFreeQueueDetail::RoundUpToPowerOfTwo( capacity ) ),
+        m_mask( m_capacity - 1 ),
+        m_items( new T[m_capacity] ),
+        m_spinCount( spinCount ),
+        m_head( 0 ),
+        m_tail( 0 ),
+        m_cachedHead( 0 )
+    {}
+
+    SpscQueue( const SpscQueue& ) = delete;
+    SpscQueue& operator=( const SpscQueue& ) = delete;
+
+    /// Producer only. @return false if the queue is full (the item is not moved from in that case).
+    bool Emplace( const T& item ) { return Push( item ); }
+    bool Emplace( T&& item ) { return Push( std::move(item) ); }
+
+    bool Empty() const { return m_head.value.load( std::memory_order_relaxed ) == m_tail.value.load( std::memory_order_acquire ); }
+    std::size_t Size() const { return m_tail.value.load( std::memory_order_acquire ) - m_head.value.load( std::memory_order_relaxed ); }
+    std::size_t Capacity() const { return m_capacity; }
+
+    /// Consumer only. The queue must not be empty.
+    T& Front() { return m_items[m_head.value.load( std::memory_order_relaxed ) & m_mask]; }
+
+    /// Consumer only. The queue must not be empty.
+    void Pop()
+    {
+        const std::size_t head = m_head.value.load( std::memory_order_relaxed );
+        m_items[head & m_mask] = T();
+        m_head.value.store( head + 1, std::memory_order_release );
+    }
+
+    /// Consumer only. @return false if the queue was empty.
+    bool TryPop( T& item )
+    {
+        if ( Empty() )
+        {
+            return false;
+        }
+        item = std::move( Front() );
+        Pop();
+        return true;
+    }
+
+    /// @return true if the queue is not empty.
+    template< class Rep, class Period >
+    bool WaitNotEmpty( const std::chrono::duration<Rep,Period>& timeout )
+    {
+        return m_notEmpty.WaitFor( [this]() { return !Empty(); }, timeout, m_spinCount );
+    }
+
+    void WaitNotEmpty()
+    {
+        while ( !WaitNotEmpty( std::chrono::hours(1) ) ) {}
+    }
+
+private:
+    const std::size_t m_capacity;
+    const std::size_t m_mask;
+    std::unique_ptr<T[]> m_items;
+    const unsigned m_spinCount;
+    WaitEvent m_notEmpty;
+
+    LockFreeQueueDetail::PaddedIndex m_head;
+    LockFreeQueueDetail::PaddedIndex m_tail;
+    std::size_t m_cachedHead; // Producer's last view of m_head.
+
+    template <typename U>
+    bool Push( U&& item )
+    {
+        const std::size_t tail = m_tail.value.load( std::memory_order_relaxed );
+        if ( tail - m_cachedHead == m_capacity )
+        {
+            m_cachedHead = m_head.value.load( std::memory_order_acquire );
+            if ( tail - m_cachedHead == m_capacity )
+            {
+                return false;
+            }
+        }
+
+        m_items[tail & m_mask] = std::forward<U>( item );
+        m_tail.value.store( tail + 1, std::memory_order_release );
+        m_notEmpty.Notify();
+        return true;
+    }
+};
+
+/**
+    Multiple producer, single consumer bounded queue (the producers claim
+    slots with a compare-and-swap and each slot carries a sequence number
+    that says whether it is free or holds a published item).
+*/
+template <typename T>
+class MpscQueue
+{
+public:
+    /**
+        @param capacity Maximum number of queued items.
+        @param spinCount Number of times a waiting consumer polls the queue before it sleeps.
+    */
+    explicit MpscQueue( std::size_t capacity, unsigned spinCount = 0 )
+    :
+        m_capacity( LockFreeQueueDetail::RoundUpToPowerOfTwo( capacity ) ),
+        m_mask( m_capacity - 1 ),
+        m_cells( new Cell[m_capacity] ),
+        m_spinCount( spinCount ),
+        m_head( 0 ),
+        m_tail( 0 )
+    {
+        for ( std::size_t i = 0; i < m_capacity; ++i )
+        {
+            m_cells[i].sequence.store( i, std::memory_order_relaxed );
+        }
+    }
+
+    MpscQueue( const MpscQueue& ) = delete;
+    MpscQueue& operator=( const MpscQueue& ) = delete;
+
+    /// Any thread. @return false if the queue is full (the item is not moved from in that case).
+    bool Emplace( const T& item ) { return Push( item ); }
+    bool Emplace( T&& item ) { return Push( std::move(item) ); }
+
+    /// Consumer only.
+    bool Empty() const
+    {
+        const std::size_t head = m_head.value.load( std::memory_order_relaxed );
+        return m_cells[head & m_mask].sequence.load( std::memory_order_acquire ) != head + 1;
+    }
+
+    /// Approximate if producers are active.
+    std::size_t Size() const { return m_tail.value.load( std::memory_order_relaxed ) - m_head.value.load( std::memory_order_relaxed ); }
+    std::size_t Capacity() const { return m_capacity; }
+
+    /// Consumer only. The queue must not be empty.
+    T& Front() { return m_cells[m_head.value.load( std::memory_order_relaxed ) & m_mask].item; }
+
+    /// Consumer only. The queue must not be empty.
+    void Pop()
+    {
+        const std::size_t head = m_head.value.load( std::memory_order_relaxed );
+        Cell& cell = m_cells[head & m_mask];
+        cell.item = T();
+        cell.sequence.store( head + m_capacity, std::memory_order_release );
+        m_head.value.store( head + 1, std::memory_order_relaxed );
+    }
+
+    /// Consumer only. @return false if the queue was empty.
+    bool TryPop( T& item )
+    {
+        if ( Empty() )
+        {
+            return false;
+        }
+        item = std::move( Front() );
+        Pop();
+        return true;
+    }
+
+    /// @return true if the queue is not empty.
+    template< class Rep, class Period >
+    bool WaitNotEmpty( const std::chrono::duration<Rep,Period>& timeout )
+    {
+        return m_notEmpty.WaitFor( [this]() { return !Empty(); }, timeout, m_spinCount );
+    }
+
+    void WaitNotEmpty()
+    {
+        while ( !WaitNotEmpty( std::chrono::hours(1) ) ) {}
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<std::size_t> sequence;
+        T item;
+    };
+
+    const std::size_t m_capacity;
+    const std::size_t m_mask;
+    std::unique_ptr<Cell[]> m_cells;
+    const unsigned m_spinCount;
+    WaitEvent m_notEmpty;
+
+    LockFreeQueueDetail::PaddedIndex m_head;
+    LockFreeQueueDetail::PaddedIndex m_tail;
+
+    template <typename U>
+    bool Push( U&& item )
+    {
+        std::size_t tail = m_tail.value.load( std::memory_order_relaxed );
+        Cell* cell = nullptr;
+        while ( true )
+        {
+            cell = &m_cells[tail & m_mask];
+            const std::size_t sequence = cell->sequence.load( std::memory_order_acquire );
+            const std::ptrdiff_t diff = static_cast<std::ptrdiff_t>( sequence - tail );
+            if ( diff == 0 )
+            {
+                if ( m_tail.value.compare_exchange_weak( tail, tail + 1, std::memory_order_relaxed ) )
+                {
+                    break;
+                }
+            }
+            else if ( diff < 0 )
+            {
+                return false;
+            }
+            else
+            {
+                tail = m_tail.value.load( std::memory_order_relaxed );
+            }
+        }
+
+        cell->item = std::forward<U>( item );
+        cell->sequence.store( tail + 1, std::memory_order_release );
+        m_notEmpty.Notify();
+        return true;
+    }
+};
+
+/**
+    Single producer, single consumer queue that never refuses an item, for
+    streams that must not lose anything (e.g. video bitstream chunks).
+
+    Items normally go through an SpscQueue. If the ring is full they are
+    appended to a locked overflow list instead (as is everything after them
+    until the consumer has caught up) so the order is kept: only while the
+    consumer is behind does either side take a lock.
+*/
+template <typename T>
+class SpillingSpscQueue
+{
+public:
+    explicit SpillingSpscQueue( std::size_t capacity, unsigned spinCount = 0 )
+    :
+        m_ring( capacity, spinCount ),
+        m_spilling( false ),
+        m_numSpilled( 0 )
+    {}
+
+    SpillingSpscQueue( const SpillingSpscQueue& ) = delete;
+    SpillingSpscQueue& operator=( const SpillingSpscQueue& ) = delete;
+
+    /// Producer only.
+    void Emplace( T item )
+    {
+        if ( m_spilling.load( std::memory_order_acquire ) == false && m_ring.Emplace( std::move(item) ) )
+        {
+            return;
+        }
+
+        std::lock_guard<std::mutex> guard( m_spillLock );
+        m_spill.push_back( std::move(item) );
+        m_numSpilled += 1;
+        m_spilling.store( true, std::memory_order_release );
+    }
+
+    /// Consumer only.
+    bool Empty() const
+    {
+        return m_overflow.empty() && m_ring.Empty() && m_spilling.load( std::memory_order_acquire ) == false;
+    }
+
+    /// Consumer only.
+    std::size_t Size()
+    {
+        std::lock_guard<std::mutex> guard( m_spillLock );
+        return m_overflow.size() + m_ring.Size() + m_spill.size();
+    }
+
+    /// Consumer only. The queue must not be empty.
+    T& Front()
+    {
+        Refill();
+        return m_overflow.empty() ? m_ring.Front() : m_overflow.front();
+    }
+
+    /// Consumer only. The queue must not be empty.
+    void Pop()
+    {
+        Refill();
+        if ( m_overflow.empty() )
+        {
+            m_ring.Pop();
+        }
+        else
+        {
+            m_overflow.pop_front();
+        }
+    }
+
+    /// @return true if the queue is not empty.
+    template< class Rep, class Period >
+    bool WaitNotEmpty( const std::chrono::duration<Rep,Period>& timeout )
+    {
+        // Items only spill when the ring is full, so waiting on the ring is enough:
+        return Empty() == false || m_ring.WaitNotEmpty( timeout ) || Empty() == false;
+    }
+
+    /// Number of items that had to go to the overflow list (for diagnostics).
+    std::size_t GetNumSpilled()
+    {
+        std::lock_guard<std::mutex> guard( m_spillLock );
+        return m_numSpilled;
+    }
+
+private:
+    /// Once the older items in the ring are used up take the spilled ones.
+    void Refill()
+    {
+        if ( m_overflow.empty() && m_ring.Empty() && m_spilling.load( std::memory_order_acquire ) )
+        {
+            std::lock_guard<std::mutex> guard( m_spillLock );
+            m_overflow.swap( m_spill );
+            m_spilling.store( false, std::memory_order_release );
+        }
+    }
+
+    SpscQueue<T> m_ring;
+    std::deque<T> m_overflow; // Consumer's copy of spilled items (older than anything in the ring).
+
+    std::mutex m_spillLock;
+    std::deque<T> m_spill;
+    std::atomic<bool> m_spilling;
+    std::size_t m_numSpilled;
+};
+
+/**
+    A single slot that only keeps the most recent packet, for command streams
+    where a newer command supersedes any that have not been acted on yet
+    (e.g. joystick commands). Any thread may Put(); one consumer may Take().
+*/
+class LatestPacketSlot
+{
+public:
+    LatestPacketSlot() {}
+    LatestPacketSlot( const LatestPacketSlot& ) = delete;
+    LatestPacketSlot& operator=( const LatestPacketSlot& ) = delete;
+
+    /// Replaces any packet that has not been taken yet.
+    void Put( const ComPacket::ConstSharedPacket& packet )
+    {
+        std::atomic_store_explicit( &m_packet, packet, std::memory_order_release );
+        m_notEmpty.Notify();
+    }
+
+    bool Empty() const { return std::atomic_load_explicit( &m_packet, std::memory_order_acquire ) == nullptr; }
+
+    /// Consumer only. @return the latest packet, or null if there has been none since the last Take().
+    ComPacket::ConstSharedPacket Take()
+    {
+        return std::atomic_exchange_explicit( &m_packet, ComPacket::ConstSharedPacket(), std::memory_order_acq_rel );
+    }
+
+    /// @return true if there is a packet to take.
+    template< class Rep, class Period >
+    bool WaitNotEmpty( const std::chrono::duration<Rep,Period>& timeout )
+    {
+        return m_notEmpty.WaitFor( [this]() { return !Empty(); }, timeout );
+    }
+
+private:
+    ComPacket::ConstSharedPacket m_packet;
+    WaitEvent m_notEmpty;
+};
+
+typedef SpscQueue<ComPacket::ConstSharedPacket> SpscPacketQueue;
+typedef SpillingSpscQueue<ComPacket::ConstSharedPacket> SpillingSpscPacketQueue;
+typedef MpscQueue<ComPacket::ConstSharedPacket> MpscPacketQueue;
+
+#endif // LOCKFREEQUEUE_H
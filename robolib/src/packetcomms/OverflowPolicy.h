@@ -0,0 +1,15 @@
+#ifndef OVERFLOWPOLICY_H
+#define OVERFLOWPOLICY_H
+
+/**
+    What a bounded packet queue does with a new packet when it is full.
+*/
+enum class OverflowPolicy
+{
+    Block,      ///< Wait until there is space (back-pressure onto the producer).
+    DropOldest, ///< Discard queued packets from the front until the new packet fits.
+    DropNewest, ///< Discard the new packet.
+    KeepLatest  ///< Queue only ever holds the most recent packet (limits are ignored).
+};
+
+#endif // OVERFLOWPOLICY_H
@@ -0,0 +1,166 @@
+#ifndef PACKETARCHIVE_H
+#define PACKETARCHIVE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+#include <cereal/cereal.hpp>
+
+#include "PacketBuffer.h"
+
+/**
+    'Cereal' binary archives that serialise straight into pooled packet
+    memory and deserialise straight from a packet's data, without going
+    through std::ostream/std::istream or an intermediate vector.
+
+    The byte format is identical to cereal::BinaryOutputArchive, so data
+    written by either archive can be read by the other.
+
+    The output archive can leave space for a header in front of the data
+    so that a transport can prepend one without copying the payload:
+
+        PacketOutputArchive archive( 256, headerBytes );
+        archive( odometry );
+        muxer.EmplacePacket( "Odometry", archive.GetBuffer(), archive.GetHeaderSize(), archive.GetDataSize() );
+*/
+class PacketOutputArchive : public cereal::OutputArchive<PacketOutputArchive, cereal::AllowEmptyClassElision>
+{
+public:
+    static constexpr std::size_t DefaultCapacity = 256;
+
+    /**
+        @param capacity Initial size of the data (the buffer grows if more is written).
+        @param headerBytes Bytes reserved, uninitialised, in front of the data.
+    */
+    explicit PacketOutputArchive( std::size_t capacity = DefaultCapacity, std::size_t headerBytes = 0 )
+    :
+        cereal::OutputArchive<PacketOutputArchive, cereal::AllowEmptyClassElision>( this ),
+        m_buffer( headerBytes + capacity ),
+        m_headerBytes( headerBytes ),
+        m_size( 0 )
+    {}
+
+    void saveBinary( const void* data, std::size_t size )
+    {
+        const std::size_t end = m_headerBytes + m_size + size;
+        if ( end > m_buffer.Capacity() )
+        {
+            Grow( end );
+        }
+        std::memcpy( m_buffer.Data() + m_headerBytes + m_size, data, size );
+        m_size += size;
+    }
+
+    /// The buffer holds the header space followed by the serialised data:
+    const PacketBuffer& GetBuffer() const { return m_buffer; }
+    char* GetHeaderPtr() { return m_buffer.Data(); }
+    std::size_t GetHeaderSize() const { return m_headerBytes; }
+    const char* GetDataPtr() const { return m_buffer.Data() + m_headerBytes; }
+    std::size_t GetDataSize() const { return m_size; }
+
+private:
+    /// Move to a buffer at least twice as big (nothing else can share the buffer while it is being written).
+    void Grow( std::size_t minCapacity )
+    {
+        PacketBuffer bigger( std::max( minCapacity, 2 * m_buffer.Capacity() ) );
+        std::memcpy( bigger.Data(), m_buffer.Data(), m_headerBytes + m_size );
+        m_buffer = std::move( bigger );
+    }
+
+    PacketBuffer m_buffer;
+    std::size_t m_headerBytes;
+    std::size_t m_size;
+};
+
+/**
+    Reads data written by a PacketOutputArchive (or cereal's
+    BinaryOutputArchive) from memory, e.g. a received packet's data.
+
+    Like cereal's own archives a cereal::Exception is thrown if the
+    data runs out.
+*/
+class PacketInputArchive : public cereal::InputArchive<PacketInputArchive, cereal::AllowEmptyClassElision>
+{
+public:
+    /**
+        @param data Memory to read from - it must not be modified or freed
+        for the lifetime of the archive.
+        @param size Number of bytes of data.
+    */
+    PacketInputArchive( const char* data, std::size_t size )
+    :
+        cereal::InputArchive<PacketInputArchive, cereal::AllowEmptyClassElision>( this ),
+        m_next( data ),
+        m_end( data + size )
+    {}
+
+    void loadBinary( void* data, std::size_t size )
+    {
+        const std::size_t remaining = GetRemaining();
+        if ( size > remaining )
+        {
+            throw cereal::Exception( "Failed to read " + std::to_string( size ) + " bytes from input packet! Only " +
+                                     std::to_string( remaining ) + " remain." );
+        }
+        std::memcpy( data, m_next, size );
+        m_next += size;
+    }
+
+    std::size_t GetRemaining() const { return m_end - m_next; }
+
+private:
+    const char* m_next;
+    const char* m_end;
+};
+
+// Serialisation functions for the basic types (as for cereal's binary archives):
+
+template <typename T>
+typename std::enable_if<std::is_arithmetic<T>::value, void>::type
+save( PacketOutputArchive& archive, const T& t )
+{
+    archive.saveBinary( std::addressof(t), sizeof(t) );
+}
+
+template <typename T>
+typename std::enable_if<std::is_arithmetic<T>::value, void>::type
+load( PacketInputArchive& archive, T& t )
+{
+    archive.loadBinary( std::addressof(t), sizeof(t) );
+}
+
+template <typename Archive, typename T>
+CEREAL_ARCHIVE_RESTRICT(PacketInputArchive, PacketOutputArchive)
+serialize( Archive& archive, cereal::NameValuePair<T>& t )
+{
+    archive( t.value );
+}
+
+template <typename Archive, typename T>
+CEREAL_ARCHIVE_RESTRICT(PacketInputArchive, PacketOutputArchive)
+serialize( Archive& archive, cereal::SizeTag<T>& t )
+{
+    archive( t.size );
+}
+
+template <typename T>
+void save( PacketOutputArchive& archive, const cereal::BinaryData<T>& bd )
+{
+    archive.saveBinary( bd.data, static_cast<std::size_t>( bd.size ) );
+}
+
+template <typename T>
+void load( PacketInputArchive& archive, cereal::BinaryData<T>& bd )
+{
+    archive.loadBinary( bd.data, static_cast<std::size_t>( bd.size ) );
+}
+
+CEREAL_REGISTER_ARCHIVE(PacketOutputArchive)
+CEREAL_REGISTER_ARCHIVE(PacketInputArchive)
+CEREAL_SETUP_ARCHIVE_TRAITS(PacketInputArchive, PacketOutputArchive)
+
+#endif // PACKETARCHIVE_H
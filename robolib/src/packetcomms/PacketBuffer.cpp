@@ -0,0 +1,176 @@
+#include "PacketBuffer.h"
+
+#include <new>
+#include <limits>
+#include <cstdlib>
+
+#include <assert.h>
+
+constexpr std::size_t PacketBufferPool::Alignment;
+constexpr std::size_t PacketBufferPool::SlabBytes;
+
+/**
+    The default pool is intentionally never destroyed: packets can
+    outlive any other static object (e.g. held by a detached thread).
+*/
+PacketBufferPool& PacketBufferPool::Default()
+{
+    static PacketBufferPool* pool = new PacketBufferPool();
+    return *pool;
+}
+
+PacketBufferPool::~PacketBufferPool()
+{
+    // Slabs are chained through the 'next' field of their first block's header
+    // so they can be freed (any blocks still in use become invalid):
+    while ( m_slabs != nullptr )
+    {
+        Block* next = m_slabs->next;
+        free( m_slabs );
+        m_slabs = next;
+    }
+}
+
+/**
+    @return A block with room for at least size bytes and a reference count of one.
+    @throw std::bad_alloc if the memory can not be allocated (including sizes
+    too large to add a block header to).
+*/
+PacketBufferPool::Block* PacketBufferPool::Allocate( std::size_t size )
+{
+    if ( size > std::numeric_limits<std::size_t>::max() - sizeof(Block) )
+    {
+        throw std::bad_alloc();
+    }
+
+    const unsigned sizeClass = SizeClassFor( size );
+    Block* block = nullptr;
+
+    if ( sizeClass == Unpooled )
+    {
+        void* memory = nullptr;
+        if ( posix_memalign( &memory, Alignment, sizeof(Block) + size ) != 0 )
+        {
+            throw std::bad_alloc();
+        }
+        block = new (memory) Block;
+        block->sizeClass = Unpooled;
+        block->capacity = size;
+    }
+    else
+    {
+        SizeClass& sc = m_classes[sizeClass];
+        std::lock_guard<std::mutex> guard( sc.lock );
+        if ( sc.free == nullptr )
+        {
+            sc.free = AllocateSlab( sizeClass );
+        }
+        block = sc.free;
+        sc.free = block->next;
+    }
+
+    block->next = nullptr;
+    block->refCount.store( 1, std::memory_order_relaxed );
+    return block;
+}
+
+/**
+    Return a block to the pool (regardless of its reference count).
+*/
+void PacketBufferPool::Free( Block* block )
+{
+    if ( block->sizeClass == Unpooled )
+    {
+        block->~Block();
+        free( block );
+        return;
+    }
+
+    SizeClass& sc = m_classes[block->sizeClass];
+    std::lock_guard<std::mutex> guard( sc.lock );
+    block->next = sc.free;
+    sc.free = block;
+}
+
+unsigned PacketBufferPool::SizeClassFor( std::size_t size )
+{
+    unsigned shift = MinClassShift;
+    while ( shift <= MaxClassShift && (std::size_t(1) << shift) < size )
+    {
+        shift += 1;
+    }
+    return shift - MinClassShift;
+}
+
+/**
+    Allocate a new slab for a size class and split it into blocks.
+
+    The first block-header sized chunk of each slab is reserved to link
+    the slabs together so they can be released when the pool is destroyed.
+
+    @return The blocks of the new slab linked as a free list.
+*/
+PacketBufferPool::Block* PacketBufferPool::AllocateSlab( unsigned sizeClass )
+{
+    const std::size_t capacity = std::size_t(1) << (sizeClass + MinClassShift);
+    const std::size_t blockBytes = sizeof(Block) + capacity;
+    std::size_t blockCount = SlabBytes / blockBytes;
+    if ( blockCount == 0 )
+    {
+        blockCount = 1;
+    }
+
+    void* memory = nullptr;
+    if ( posix_memalign( &memory, Alignment, sizeof(Block) + blockCount*blockBytes ) != 0 )
+    {
+        throw std::bad_alloc();
+    }
+
+    Block* slab = new (memory) Block;
+    {
+        std::lock_guard<std::mutex> guard( m_slabLock );
+        slab->next = m_slabs;
+        m_slabs = slab;
+    }
+
+    char* base = slab->Data();
+    Block* head = nullptr;
+    for ( std::size_t b = blockCount; b > 0; --b )
+    {
+        Block* block = new (base + (b-1)*blockBytes) Block;
+        block->sizeClass = sizeClass;
+        block->capacity = capacity;
+        block->next = head;
+        head = block;
+    }
+
+    return head;
+}
+
+/**
+    Allocate a new buffer of at least the specified capacity from the
+    default pool. The memory is not initialised.
+*/
+PacketBuffer::PacketBuffer( std::size_t capacity )
+:
+    m_block( PacketBufferPool::Default().Allocate( capacity ) )
+{
+}
+
+PacketBuffer::PacketBuffer( const PacketBuffer& other )
+:
+    m_block( other.m_block )
+{
+    if ( m_block != nullptr )
+    {
+        m_block->refCount.fetch_add( 1, std::memory_order_relaxed );
+    }
+}
+
+PacketBuffer::~PacketBuffer()
+{
+    if ( m_block != nullptr && m_block->refCount.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+    {
+        PacketBufferPool::Default().Free( m_block );
+    }
+}
@@ -0,0 +1,124 @@
+#ifndef PACKETBUFFER_H
+#define PACKETBUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+
+/**
+    A thread safe pool of aligned memory blocks used for packet payloads
+    (and the packets themselves) so that the steady state of the comms
+    system does not touch the system allocator.
+
+    Requests are rounded up to a power of two size class and each class
+    keeps a free list of blocks that are carved out of larger slabs.
+    Slab memory is retained by the pool for reuse (it is never returned
+    to the system) so the pool's footprint is the peak memory in use.
+    Requests larger than the largest class bypass the pool.
+
+    Block memory is not initialised and is always aligned to Alignment
+    bytes so payloads can be handed straight to SIMD code.
+*/
+class PacketBufferPool
+{
+public:
+    static constexpr std::size_t Alignment = 32;
+    static constexpr unsigned MinClassShift = 6;  // 64 bytes
+    static constexpr unsigned MaxClassShift = 20; // 1 MiB
+    static constexpr unsigned NumClasses = MaxClassShift - MinClassShift + 1;
+    static constexpr std::size_t SlabBytes = 256*1024;
+
+    /// Header preceding the memory of every block:
+    struct alignas(Alignment) Block
+    {
+        std::atomic<std::uint32_t> refCount;
+        std::uint32_t sizeClass;
+        std::size_t capacity;
+        Block* next;
+
+        char* Data() { return reinterpret_cast<char*>( this + 1 ); }
+    };
+
+    static PacketBufferPool& Default();
+
+    PacketBufferPool() {}
+    PacketBufferPool( const PacketBufferPool& ) = delete;
+    PacketBufferPool& operator=( const PacketBufferPool& ) = delete;
+    ~PacketBufferPool();
+
+    Block* Allocate( std::size_t size );
+    void Free( Block* block );
+
+private:
+    static constexpr std::uint32_t Unpooled = NumClasses;
+
+    struct SizeClass
+    {
+        std::mutex lock;
+        Block* free = nullptr;
+    };
+
+    SizeClass m_classes[NumClasses];
+    std::mutex m_slabLock;
+    Block* m_slabs = nullptr;
+
+    static unsigned SizeClassFor( std::size_t size );
+    Block* AllocateSlab( unsigned sizeClass );
+};
+
+static_assert( sizeof(PacketBufferPool::Block) == PacketBufferPool::Alignment, "Block header must preserve data alignment" );
+
+/**
+    Handle to a block of pooled memory with intrusive reference counting:
+    copies share the same memory and the block goes back to the pool when
+    the last handle is destroyed.
+*/
+class PacketBuffer
+{
+public:
+    PacketBuffer() : m_block( nullptr ) {}
+    explicit PacketBuffer( std::size_t capacity );
+    PacketBuffer( const PacketBuffer& other );
+    PacketBuffer( PacketBuffer&& other ) : m_block( other.m_block ) { other.m_block = nullptr; }
+    PacketBuffer& operator=( PacketBuffer other ) { std::swap( m_block, other.m_block ); return *this; }
+    ~PacketBuffer();
+
+    char* Data() const { return m_block ? m_block->Data() : nullptr; }
+    std::size_t Capacity() const { return m_block ? m_block->capacity : 0; }
+    std::uint32_t UseCount() const { return m_block ? m_block->refCount.load() : 0; }
+    explicit operator bool() const { return m_block != nullptr; }
+
+private:
+    PacketBufferPool::Block* m_block;
+};
+
+/**
+    Standard allocator that draws from the default PacketBufferPool, e.g.
+    for std::allocate_shared() so the control block of a shared packet
+    comes from the pool too.
+*/
+template <typename T>
+class PoolAllocator
+{
+public:
+    typedef T value_type;
+
+    PoolAllocator() {}
+    template <typename U> PoolAllocator( const PoolAllocator<U>& ) {}
+
+    T* allocate( std::size_t n )
+    {
+        return reinterpret_cast<T*>( PacketBufferPool::Default().Allocate( n*sizeof(T) )->Data() );
+    }
+
+    void deallocate( T* p, std::size_t )
+    {
+        PacketBufferPool::Default().Free( reinterpret_cast<PacketBufferPool::Block*>( p ) - 1 );
+    }
+
+    template <typename U> bool operator==( const PoolAllocator<U>& ) const { return true; }
+    template <typename U> bool operator!=( const PoolAllocator<U>& ) const { return false; }
+};
+
+#endif // PACKETBUFFER_H
@@ -10,5 +10,13 @@
 #include "PacketSubscriber.h"
 #include "PacketSubscription.h"
 #include "SimpleQueue.h"
+#include "LockFreeQueue.h"
+#include "PacketConnection.h"
+#include "UdpTransport.h"
+#include "SharedMemoryTransport.h"
+#include "SessionTransport.h"
+#include "PacketRecorder.h"
+#include "PacketReplayer.h"
+#include "PacketRelay.h"
 
 #endif // _PACKETCOMMS_H_
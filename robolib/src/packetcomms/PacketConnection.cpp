@@ -0,0 +1,195 @@
+#include "PacketConnection.h"
+
+#include <sys/epoll.h>
+#include <time.h>
+
+namespace
+{
+
+std::uint64_t ThreadCpuNanoseconds()
+{
+    timespec t;
+    clock_gettime( CLOCK_THREAD_CPUTIME_ID, &t );
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+
+/// Adds the CPU time used by the calling thread during its lifetime to total:
+class CpuTimer
+{
+public:
+    explicit CpuTimer( std::atomic<std::uint64_t>& total ) : m_total( total ), m_start( ThreadCpuNanoseconds() ) {}
+    ~CpuTimer() { m_total += ThreadCpuNanoseconds() - m_start; }
+
+private:
+    std::atomic<std::uint64_t>& m_total;
+    const std::uint64_t m_start;
+};
+
+constexpr std::uint32_t ReadEvents = EPOLLIN | EPOLLRDHUP;
+
+} // end anonymous namespace
+
+/**
+    Take ownership of a connected socket and start servicing it from the loop.
+
+    The muxer sends its Hello straight away. Heartbeats are sent when the
+    connection has been idle for a second, as they are with a send thread.
+*/
+PacketConnection::PacketConnection( std::unique_ptr<Socket> socket, EventLoop& loop,
+                                    const std::vector<std::string>& packetIds, const TxConfig& txConfig )
+:
+    m_socket        ( std::move(socket) ),
+    m_loop          ( loop ),
+    m_running       ( false ),
+    m_flushQueued   ( false ),
+    m_alive         ( std::make_shared<bool>( true ) ),
+    m_cpuNanoseconds( 0 ),
+    m_waitingToWrite( false ),
+    m_heartBeatTimer( 0 ),
+    m_demuxer       ( *m_socket, packetIds, false ),
+    m_muxer         ( *m_socket, packetIds, txConfig, [this]() { ScheduleFlush(); } )
+{
+    m_demuxer.SetCreditReceiver( &m_muxer );
+    m_loop.Invoke( [this]() { Start(); } );
+}
+
+/**
+    Stops servicing the socket. Once this returns the loop will not touch
+    the connection again. Must not be called from this connection's own
+    callbacks.
+*/
+PacketConnection::~PacketConnection()
+{
+    m_loop.Invoke( [this]() {
+        Close();
+        *m_alive = false;
+    });
+}
+
+/**
+    @return false once the connection has been closed (or either
+    direction has had an error).
+*/
+bool PacketConnection::Ok() const
+{
+    return m_running && m_muxer.Ok() && m_demuxer.Ok();
+}
+
+/**
+    @return The CPU time the event loop has spent servicing this connection
+    (including inline subscriber callbacks).
+*/
+double PacketConnection::GetCpuSeconds() const
+{
+    return m_cpuNanoseconds * 1e-9;
+}
+
+void PacketConnection::Start()
+{
+    const int fd = m_socket->GetFileDescriptor();
+    if ( m_loop.Add( fd, ReadEvents, [this]( std::uint32_t events ) { OnEvents( events ); } ) == false )
+    {
+        m_muxer.Shutdown();
+        m_demuxer.Shutdown();
+        return;
+    }
+
+    m_heartBeatTimer = m_loop.AddTimer( std::chrono::seconds(1), [this]() { m_muxer.SendHeartBeatIfIdle(); } );
+    {
+        std::lock_guard<std::mutex> guard( m_flushLock );
+        m_running = true;
+    }
+    Flush();
+}
+
+/**
+    Stop watching the socket (on a transport error or before destruction).
+    The muxer and demuxer are shut down so that no one waits on them.
+*/
+void PacketConnection::Close()
+{
+    bool wasRunning = false;
+    {
+        std::lock_guard<std::mutex> guard( m_flushLock );
+        wasRunning = m_running.exchange( false );
+    }
+
+    if ( wasRunning )
+    {
+        m_loop.Remove( m_socket->GetFileDescriptor() );
+        m_loop.RemoveTimer( m_heartBeatTimer );
+    }
+
+    m_muxer.Shutdown();
+    m_demuxer.Shutdown();
+}
+
+void PacketConnection::OnEvents( std::uint32_t events )
+{
+    CpuTimer timer( m_cpuNanoseconds );
+
+    if ( events & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
+    {
+        const bool hungUp = events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR );
+        if ( m_demuxer.ReceiveAvailable( hungUp ) == false )
+        {
+            Close();
+            return;
+        }
+    }
+
+    if ( events & EPOLLOUT )
+    {
+        Flush();
+    }
+}
+
+/**
+    Called whenever a packet is posted to the muxer (from any thread):
+    only one flush is queued on the loop at a time.
+
+    Nothing is posted once the connection is closed, and a flush that was
+    queued before the connection was destroyed does nothing when it runs.
+*/
+void PacketConnection::ScheduleFlush()
+{
+    std::lock_guard<std::mutex> guard( m_flushLock );
+    if ( m_running && m_flushQueued.exchange( true ) == false )
+    {
+        std::shared_ptr<bool> alive = m_alive;
+        m_loop.Post( [this, alive]() {
+            if ( *alive == false )
+            {
+                return;
+            }
+            m_flushQueued = false;
+            CpuTimer timer( m_cpuNanoseconds );
+            Flush();
+        });
+    }
+}
+
+/**
+    Write as much as the socket will take, then wait for it to be writable
+    only if there is more to send.
+*/
+void PacketConnection::Flush()
+{
+    if ( m_running == false )
+    {
+        return;
+    }
+
+    const bool wantWrite = m_muxer.Flush();
+    if ( m_muxer.Ok() == false )
+    {
+        Close();
+        return;
+    }
+
+    if ( wantWrite != m_waitingToWrite )
+    {
+        m_waitingToWrite = wantWrite;
+        m_loop.Modify( m_socket->GetFileDescriptor(), wantWrite ? ReadEvents | EPOLLOUT : ReadEvents );
+    }
+}
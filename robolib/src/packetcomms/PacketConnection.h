@@ -0,0 +1,70 @@
+#ifndef __PACKET_CONNECTION_H__
+#define __PACKET_CONNECTION_H__
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "PacketMuxer.h"
+#include "PacketDemuxer.h"
+#include "../network/Socket.h"
+#include "../network/EventLoop.h"
+
+/**
+    A muxer and demuxer pair for one connected socket, driven by an
+    EventLoop rather than by threads of their own. Many connections can
+    share the threads of an EventLoopPool, so the cost of an extra client
+    (e.g. a logger or dashboard) is a registration rather than two threads.
+
+    Packets are received, and inline subscriber callbacks run, on the loop's
+    thread so those callbacks must not block (use async subscriptions for
+    slow consumers). Posting to the muxer from the loop's thread must not
+    block either, so packet types posted from there should not use the
+    Block overflow policy.
+
+    The time the loop spends on the connection is accounted so that the
+    CPU cost of each client can be measured.
+*/
+class PacketConnection
+{
+public:
+    PacketConnection( std::unique_ptr<Socket> socket, EventLoop& loop,
+                      const std::vector<std::string>& packetIds, const TxConfig& txConfig = TxConfig() );
+    virtual ~PacketConnection();
+
+    bool Ok() const;
+
+    PacketMuxer& GetMuxer() { return m_muxer; }
+    PacketDemuxer& GetDemuxer() { return m_demuxer; }
+    Socket& GetSocket() { return *m_socket; }
+
+    double GetCpuSeconds() const;
+
+private:
+    void Start();
+    void Close();
+    void OnEvents( std::uint32_t events );
+    void ScheduleFlush();
+    void Flush();
+
+    std::unique_ptr<Socket> m_socket;
+    EventLoop& m_loop;
+    std::atomic<bool> m_running;
+    std::atomic<bool> m_flushQueued;
+
+    // Flushes are posted to the loop from any thread: the lock stops one being
+    // posted once the connection is closed and the flag (only touched on the
+    // loop thread) stops one already queued from running after destruction:
+    std::mutex m_flushLock;
+    std::shared_ptr<bool> m_alive;
+    std::atomic<std::uint64_t> m_cpuNanoseconds;
+    bool m_waitingToWrite;
+    EventLoop::TimerId m_heartBeatTimer;
+
+    PacketDemuxer m_demuxer;
+    PacketMuxer m_muxer;
+};
+
+#endif /* __PACKET_CONNECTION_H__ */
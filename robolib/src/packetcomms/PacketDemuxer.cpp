@@ -1,42 +1,81 @@
 #include "PacketDemuxer.h"
+#include "PacketMuxer.h"
 
 #include <iostream>
 #include <algorithm>
+#include <chrono>
 #include <functional>
 
+#include <cstring>
+
 #include <arpa/inet.h>
 #include <assert.h>
 
+constexpr unsigned PacketDemuxer::DefaultExecutorThreads;
+constexpr std::size_t PacketDemuxer::DefaultMaxPayloadBytes;
+constexpr std::size_t PacketDemuxer::HeaderBytes;
+constexpr std::size_t PacketDemuxer::TimestampedHeaderBytes;
+constexpr std::size_t PacketDemuxer::ReceiveBufferBytes;
+constexpr std::size_t PacketDemuxer::LargePayloadBytes;
+
 /**
     Create a new demuxer that will receive packets from the specified socket.
 
     This object is guaranteed to only ever read from the socket.
+
+    @param startReceiveThread If false there is no receive thread: the owner must
+    call ReceiveAvailable() whenever the transport is ready for reading.
 */
-PacketDemuxer::PacketDemuxer(AbstractReader& socket, const std::vector<std::string>& packetIds )
+PacketDemuxer::PacketDemuxer(AbstractReader& socket, const std::vector<std::string>& packetIds, bool startReceiveThread )
 :
     m_packetIds     ( packetIds ),
+    m_dispatchTable ( new DispatchTable( m_packetIds.Size() ) ),
+    m_dispatchSequence( 0 ),
+    m_dispatchThread( std::thread::id() ),
     m_transport     ( socket ),
     m_transportError( false ),
-    m_receiverThread( std::bind(&PacketDemuxer::ReceiveLoop, std::ref(*this)) )
+    m_rxBegin       ( 0 ),
+    m_rxEnd         ( 0 ),
+    m_largeReceived ( 0 ),
+    m_maxPayloadBytes( DefaultMaxPayloadBytes ),
+    m_helloReceived ( false ),
+    m_reassembly    ( m_packetIds.Size() ),
+    m_creditGranter ( std::make_shared<CreditGranter>( m_packetIds.Size() ) ),
+    m_creditReceiver( nullptr ),
+    m_headerBytes   ( HeaderBytes ),
+    m_packetPosted  ( 0 ),
+    m_packetSent    ( 0 ),
+    m_lastReadTime  ( 0 ),
+    m_latency       ( new LatencyHistogram[ static_cast<std::size_t>( LatencyStage::NumStages ) * m_packetIds.Size() ] )
 {
     m_transport.SetBlocking( false );
+    if ( startReceiveThread )
+    {
+        m_receiverThread = std::thread( std::bind(&PacketDemuxer::ReceiveLoop, std::ref(*this)) );
+    }
 }
 
 PacketDemuxer::~PacketDemuxer()
 {
     SignalTransportError(); /// Causes receive-thread to exit (@todo use better method)
+    m_creditGranter->Close();
 
     // Check if there any remaining subscribers:
     WarnAboutSubscribers();
 
     try
     {
-        m_receiverThread.join();
+        if ( m_receiverThread.joinable() )
+        {
+            m_receiverThread.join();
+        }
     }
     catch ( const std::system_error& e )
     {
         std::clog << "Error: " << e.what() << std::endl;
     }
+
+    delete m_dispatchTable.load();
 }
 
 /**
@@ -48,59 +87,296 @@ bool PacketDemuxer::Ok() const
 }
 
 /**
-    Returns a subscriber object.
+    Stop receiving: flags a transport error so that Ok() returns false
+    and the receive thread (if any) exits.
+*/
+void PacketDemuxer::Shutdown()
+{
+    SignalTransportError();
+}
+
+/**
+    Latencies are only measured if the muxer at the other end sends
+    timestamped headers (see PacketMuxer::EnableLatencyTimestamps()).
+    Stages that span both hosts are only meaningful if their clocks are
+    synchronised (e.g. with PTP).
+
+    @return The time packets of the specified type have spent in the specified stage.
+*/
+LatencySummary PacketDemuxer::GetLatency( const std::string& typeName, LatencyStage stage ) const
+{
+    const std::size_t index = static_cast<std::size_t>( stage ) * m_packetIds.Size() + m_packetIds.ToId(typeName);
+    return m_latency[ index ].Summarise();
+}
+
+/**
+    Bound the number of packets of a type (sent with TxQueueConfig::flowControl
+    set) that can be in flight or waiting for the subscribers to drain them:
+    the sender is granted credit for a window of packets and a packet's credit
+    is only granted back once every subscriber has released it (see CreditGranter).
+
+    @param window Maximum number of packets outstanding.
+    @param returnPath Muxer sending to the peer, used to send the credits.
+    It must outlive this demuxer.
+*/
+void PacketDemuxer::EnableFlowControl( const std::string& typeName, std::uint32_t window, PacketMuxer& returnPath )
+{
+    m_creditGranter->Enable( m_packetIds.ToId(typeName), window, returnPath );
+}
+
+/**
+    Credits granted by the peer (for types that this end sends with flow
+    control) are passed to the muxer sending to the peer, which must
+    outlive this demuxer (or be unset first by passing null).
+*/
+void PacketDemuxer::SetCreditReceiver( PacketMuxer* muxer )
+{
+    m_creditReceiver = muxer;
+}
+
+/**
+    Set the largest payload the peer may send. A header announcing a bigger
+    payload, or fragments adding up to one, is taken to be a broken or
+    malicious peer: nothing is allocated for it and a transport error is
+    signalled instead.
+*/
+void PacketDemuxer::SetMaxPayloadBytes( std::size_t bytes )
+{
+    m_maxPayloadBytes = bytes;
+}
+
+/**
+    Returns a subscriber object. The callback runs on the receive thread.
 */
 PacketSubscription PacketDemuxer::Subscribe( const std::string& typeName, PacketSubscriber::CallBack callback )
 {
-    const IdManager::PacketType type = m_packetIds.ToId(typeName);
+    return Subscribe( typeName, callback, SubscriptionOptions() );
+}
 
-    std::lock_guard<std::mutex> guard(m_subscriberLock);
-    SubscriptionEntry::second_type& queue = m_subscribers[type];
-    queue.emplace_back( new PacketSubscriber( type, *this , callback ) ); /// @note Can't use make_shared because of protected constructor.
+/**
+    Returns a subscriber object whose callback is run as specified by the options.
+*/
+PacketSubscription PacketDemuxer::Subscribe( const std::string& typeName, PacketSubscriber::CallBack callback, const SubscriptionOptions& options )
+{
+    return Subscribe( m_packetIds.ToId(typeName), callback, options );
+}
+
+/**
+    As above but for a type id that has already been looked up (e.g. by a Channel).
+*/
+PacketSubscription PacketDemuxer::Subscribe( IdManager::PacketType type, PacketSubscriber::CallBack callback, const SubscriptionOptions& options )
+{
+    assert( type > IdManager::ControlPacket && type < m_packetIds.Size() );
+    SubscriberPtr subscriber;
+
+    RetiredTables retired;
+    {
+        std::lock_guard<std::mutex> guard(m_subscriberLock);
+
+        if ( options.execution == SubscriptionOptions::Async || options.conflate )
+        {
+            SubscriptionOptions inboxOptions = options;
+            if ( options.conflate )
+            {
+                inboxOptions.inboxCapacity = 1;
+                inboxOptions.overflow = OverflowPolicy::DropOldest;
+            }
+
+            PacketExecutor* executor = options.executor;
+            if ( executor == nullptr )
+            {
+                if ( m_executor == nullptr )
+                {
+                    m_executor.reset( new PacketExecutor( DefaultExecutorThreads ) );
+                }
+                executor = m_executor.get();
+            }
 
-    std::clog << "New subscriber for '" << typeName << "'" << std::endl;
+            // The receive thread only posts to the inbox:
+            auto inbox = std::make_shared<SubscriberInbox>( *executor, callback, inboxOptions );
+            PacketSubscriber::CallBack post = Sample( [inbox]( const ComPacket::ConstSharedPacket& packet ) { inbox->Post( packet ); }, options );
+            subscriber.reset( new PacketSubscriber( type, *this, post ) ); /// @note Can't use make_shared because of protected constructor.
+            subscriber->m_inbox = inbox;
+        }
+        else
+        {
+            PacketSubscriber::CallBack sampled = Sample( callback, options );
+            subscriber.reset( new PacketSubscriber( type, *this, sampled ) );
+        }
 
-    return PacketSubscription( queue.back() );
+        DispatchTable* table = new DispatchTable( *m_dispatchTable.load() );
+        (*table)[type].push_back( subscriber );
+        retired = PublishDispatchTable( table );
+    }
+    FreeRetiredTables( retired );
+
+    std::clog << "New subscriber for '" << m_packetIds.ToString(type) << "'" << std::endl;
+
+    return PacketSubscription( subscriber );
 }
 
+/**
+    Wrap a subscriber's callback (or the post to its inbox) so that it only
+    sees the packets selected by the everyNth and maxRateHz options. The
+    wrapper keeps its own count and time of the last delivery: it is only
+    ever called by the thread that is dispatching packets.
+*/
+PacketSubscriber::CallBack PacketDemuxer::Sample( PacketSubscriber::CallBack deliver, const SubscriptionOptions& options )
+{
+    if ( options.everyNth <= 1 && options.maxRateHz <= 0.0 )
+    {
+        return deliver;
+    }
+
+    typedef std::chrono::steady_clock Clock;
+    const std::uint64_t everyNth = std::max( options.everyNth, 1u );
+    const Clock::duration minInterval = options.maxRateHz > 0.0
+            ? std::chrono::duration_cast<Clock::duration>( std::chrono::duration<double>( 1.0 / options.maxRateHz ) )
+            : Clock::duration::zero();
+    std::uint64_t count = 0;
+    bool delivered = false;
+    Clock::time_point lastDelivery;
+
+    return [=]( const ComPacket::ConstSharedPacket& packet ) mutable {
+        if ( count++ % everyNth != 0 )
+        {
+            return;
+        }
+
+        if ( minInterval > Clock::duration::zero() )
+        {
+            const Clock::time_point now = Clock::now();
+            if ( delivered && now - lastDelivery < minInterval )
+            {
+                return;
+            }
+            lastDelivery = now;
+            delivered = true;
+        }
+
+        deliver( packet );
+    };
+}
+
+/**
+    Once this returns the receive thread will not call the subscriber again,
+    except when this is called from a callback on the receive thread: the
+    packet being dispatched then still goes to every subscriber it was
+    going to (the subscriber itself is kept alive until then).
+*/
 void PacketDemuxer::Unsubscribe( const PacketSubscriber* pSubscriber )
 {
     const IdManager::PacketType type = pSubscriber->GetType();
     std::clog << "Removing subscriber for '" << m_packetIds.ToString(type) << "'" << std::endl;
 
+    // Closing an async subscriber's inbox first means the receive thread can not be
+    // left waiting to post to it (if it blocks) while we wait for the grace period:
+    if ( pSubscriber->m_inbox != nullptr )
+    {
+        pSubscriber->m_inbox->Close();
+    }
+
+    RetiredTables retired;
+    {
+        std::lock_guard<std::mutex> guard(m_subscriberLock);
+        DispatchTable* table = new DispatchTable( *m_dispatchTable.load() );
+        SubscriberList& list = (*table)[ type ];
+
+        // Search through all subscribers of this type for the specific subscriber:
+        auto itr = std::remove_if( list.begin(), list.end(), [pSubscriber]( const PacketDemuxer::SubscriberPtr& subscriber ) {
+            return subscriber.get() == pSubscriber;
+        });
+
+        assert( itr != list.end() );
+        list.erase( itr, list.end() );
+        retired = PublishDispatchTable( table );
+    }
+    FreeRetiredTables( retired );
+}
+
+/**
+    @return true if the specified subscriber is subscribed to this demuxer.
+*/
+bool PacketDemuxer::IsSubscribed( const PacketSubscriber* pSubscriber ) const
+{
     std::lock_guard<std::mutex> guard(m_subscriberLock);
-    SubscriptionEntry::second_type& queue = m_subscribers[ type ];
+    const SubscriberList& list = (*m_dispatchTable.load())[ pSubscriber->GetType() ];
 
     // Search through all subscribers of this type for the specific subscriber:
-    auto itr = std::remove_if( queue.begin(), queue.end(), [pSubscriber]( const PacketDemuxer::SubscriberPtr& subscriber ) {
+    auto itr = std::find_if( list.begin(), list.end(), [pSubscriber]( const PacketDemuxer::SubscriberPtr& subscriber ) {
         return subscriber.get() == pSubscriber;
     });
 
-    assert( itr != queue.end() );
-    queue.erase( itr );
+    return itr != list.end();
 }
 
 /**
-    @return true if the specified subscriber is subscribed to this demuxer.
+    Replace the dispatch table. The old table may still be in use by the
+    receive thread so it is not freed here: the tables returned must be
+    passed to FreeRetiredTables() after m_subscriberLock is released.
+    When called from the receive thread itself (i.e. from a subscriber's
+    callback) the old table is kept until a later change or destruction.
+
+    Must hold m_subscriberLock.
 */
-bool PacketDemuxer::IsSubscribed( const PacketSubscriber* pSubscriber ) const
+PacketDemuxer::RetiredTables PacketDemuxer::PublishDispatchTable( DispatchTable* table )
 {
-    const IdManager::PacketType type = pSubscriber->GetType();
-    auto queueItr = m_subscribers.find( type );
+    std::unique_ptr<DispatchTable> old( m_dispatchTable.exchange( table ) );
+    m_retiredTables.push_back( std::move(old) );
 
-    if ( queueItr == m_subscribers.end() )
+    RetiredTables retired;
+    const bool inDispatch = m_dispatchSequence.load() % 2 == 1 && m_dispatchThread.load() == std::this_thread::get_id();
+    if ( inDispatch == false )
     {
-        return false;
+        std::swap( retired, m_retiredTables );
     }
+    return retired;
+}
 
-    const SubscriptionEntry::second_type& queue = queueItr->second;
+/**
+    Free tables that were replaced once the receive thread has finished any
+    dispatch that could be using them (a grace period). This must not be
+    called with m_subscriberLock held as a callback in that dispatch may
+    itself be waiting for the lock.
+*/
+void PacketDemuxer::FreeRetiredTables( RetiredTables& retired )
+{
+    if ( retired.empty() )
+    {
+        return;
+    }
 
-    // Search through all subscribers of this type for the specific subscriber:
-    auto itr = std::find_if( queue.begin(), queue.end(), [pSubscriber]( const PacketDemuxer::SubscriberPtr& subscriber ) {
-        return subscriber.get() == pSubscriber;
-    });
+    const std::uint64_t sequence = m_dispatchSequence.load();
+    if ( sequence % 2 == 1 )
+    {
+        while ( m_dispatchSequence.load() == sequence )
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    retired.clear();
+}
+
+/**
+    Post a packet to all the subscribers for its type.
+*/
+void PacketDemuxer::Dispatch( const ComPacket::ConstSharedPacket& sptr )
+{
+    m_dispatchThread.store( std::this_thread::get_id(), std::memory_order_relaxed );
+    m_dispatchSequence.fetch_add( 1 );
+    const DispatchTable& table = *m_dispatchTable.load();
+    const IdManager::PacketType packetType = sptr->GetType();
+
+    if ( packetType < table.size() )
+    {
+        for ( const SubscriberPtr& subscriber : table[ packetType ] )
+        {
+            subscriber->m_callback( sptr );
+        }
+    }
 
-    return itr != queue.end();
+    m_dispatchSequence.fetch_add( 1, std::memory_order_release );
 }
 
 /**
@@ -115,35 +391,13 @@ void PacketDemuxer::ReceiveLoop()
 {
     std::clog << "PacketDemuxer::ReceiveLoop() entered." << std::endl;
     ComPacket packet;
-    constexpr int helloTimeoutInMilliseconds = 2000;
-    ReceiveHelloMessage( packet, helloTimeoutInMilliseconds );
 
     while ( m_transportError == false )
     {
         constexpr int timeoutInMilliseconds = 1000;
         if ( ReceivePacket( packet, timeoutInMilliseconds ) )
         {
-            const IdManager::PacketType packetType = packet.GetType(); // Need to cache this before we use std::move
-            //std::clog << m_packetIds.ToString( packetType ) << " bytes: " << packet.GetDataSize() << std::endl;
-            auto sptr = std::make_shared<ComPacket>( std::move(packet) );
-
-            if ( packetType == IdManager::ControlPacket )
-            {
-                // Control messages are used by the muxer to communicate
-                // with the demuxer (this is a one way protocol).
-                HandleControlMessage( sptr );
-            }
-            else
-            {
-                // Post the new packet to the message queues of all the subscribers for this packet type:
-                std::lock_guard<std::mutex> guard(m_subscriberLock);
-                SubscriptionEntry::second_type& queue = m_subscribers[ packetType ];
-                //std::clog << "Posting '" << m_packetIds.ToString(packetType) << "' to " << queue.size() << " subscribers" << std::endl;
-                for ( auto& subscriber : queue )
-                {
-                    subscriber->m_callback( sptr );
-                }
-            }
+            HandlePacket( packet );
         }
     }
 
@@ -151,82 +405,366 @@ void PacketDemuxer::ReceiveLoop()
 }
 
 /**
-    @param packet If return value is true then packet will contain the new data, if false packet remains unchanged.
-    @return false on comms error, true if successful.
+    Read whatever the transport has available (without waiting) and
+    dispatch every complete packet received. This is how the owner of
+    a demuxer without a receive thread drives it.
+
+    @param hungUp Set if the transport reported that the other end has
+    closed: the bytes still available are processed and then a transport
+    error is signalled.
+
+    @return false if there has been a transport error.
 */
-bool PacketDemuxer::ReceivePacket( ComPacket& packet, const int timeoutInMilliseconds )
+bool PacketDemuxer::ReceiveAvailable( bool hungUp )
 {
-    if ( m_transport.ReadyForReading( timeoutInMilliseconds ) == false )
+    int n = 0;
+    do
     {
-        return false;
+        n = m_transportError ? -1 : ReadAvailable();
+
+        ComPacket packet;
+        while ( m_transportError == false && ParseBufferedPacket( packet ) )
+        {
+            HandlePacket( packet );
+        }
+    } while ( hungUp && n > 0 );
+
+    if ( hungUp )
+    {
+        SignalTransportError();
+    }
+
+    return Ok();
+}
+
+/**
+    Pass a received packet on: the first packet must be the muxer's Hello,
+    after that control messages are handled here and everything else
+    goes to the subscribers (once all its fragments have arrived).
+*/
+void PacketDemuxer::HandlePacket( ComPacket& packet )
+{
+    if ( m_helloReceived && Reassemble( packet ) == false )
+    {
+        return;
     }
 
-    uint32_t type = 0;
-    uint32_t size = 0;
+    const IdManager::PacketType packetType = packet.GetType(); // Need to cache this before we use std::move
+    auto sptr = ComPacket::MakeShared( std::move(packet) );
+
+    if ( m_helloReceived == false )
+    {
+        CheckHelloMessage( sptr );
+    }
+    else if ( packetType == IdManager::ControlPacket )
+    {
+        // Control messages are used by the muxer to communicate
+        // with the demuxer (this is a one way protocol).
+        HandleControlMessage( sptr );
+    }
+    else
+    {
+        if ( m_headerBytes == TimestampedHeaderBytes )
+        {
+            RecordLatency( packetType );
+        }
 
-    // For the first read we generate a transport error on zero bytes
-    // (because ReadyForReading() said there were bytes available):
-    ///@note - the above is incorrect as ReadyForReading uses POLLIN which
-    /// also returns true if there is out of band data ready for reading.
-    size_t byteCount = sizeof(uint32_t);
-    bool ok = ReadBytes( reinterpret_cast<uint8_t*>(&type), byteCount, false );
-    if ( !ok ) { return false; }
+        // Post the new packet to the message queues of all the subscribers for this packet type:
+        if ( packetType < m_packetIds.Size() && m_creditGranter->IsEnabled( packetType ) )
+        {
+            Dispatch( m_creditGranter->Track( sptr ) );
+        }
+        else
+        {
+            Dispatch( sptr );
+        }
+    }
+}
 
-    byteCount = sizeof(uint32_t);
-    ok = ReadBytes( reinterpret_cast<uint8_t*>(&size), byteCount );
-    if ( !ok ) { return false; }
+/**
+    Append a fragment to the packet of its type being reassembled. Fragments
+    are copied, into a buffer that grows as they arrive: only payloads big
+    enough to be fragmented are ever reassembled so the copy is small
+    compared to the cost of receiving them.
+
+    @param packet A received packet. If it completes a fragmented packet it
+    is replaced by the whole packet.
+    @return true if packet is a whole packet (whether or not it was fragmented),
+    false if it was a fragment that has been held back (or was invalid). If
+    the fragments add up to more than the maximum payload (see SetMaxPayloadBytes())
+    they are discarded and a transport error is signalled.
+*/
+bool PacketDemuxer::Reassemble( ComPacket& packet )
+{
+    const IdManager::PacketType type = packet.GetType() & ~MoreFragmentsFlag;
+    const bool more = ( packet.GetType() & MoreFragmentsFlag ) != 0;
+    if ( type <= IdManager::ControlPacket || type >= m_reassembly.size() )
+    {
+        // Control packets are never fragmented and other types are ignored when they are dispatched:
+        return more == false;
+    }
 
-    type = ntohl( type );
-    size = ntohl( size );
+    Reassembly& partial = m_reassembly[type];
+    if ( more == false && partial.size == 0 )
+    {
+        return true;
+    }
 
-    ComPacket p( static_cast<IdManager::PacketType>(type), size );
-    byteCount = p.GetDataSize();
-    ok = ReadBytes( reinterpret_cast<uint8_t*>(p.GetDataPtr()), byteCount );
-    if ( !ok )
+    const std::size_t maxBytes = m_maxPayloadBytes.load( std::memory_order_relaxed );
+    const std::size_t size = partial.size + packet.GetDataSize();
+    if ( size > maxBytes )
     {
+        std::cerr << "Error in PacketDemuxer::Reassemble() - fragmented packet of type " << type
+                  << " exceeds " << maxBytes << " bytes." << std::endl;
+        partial = Reassembly();
+        SignalTransportError();
         return false;
     }
 
-    std::swap( p, packet );
-    assert( packet.GetType() != IdManager::InvalidPacket ); // Catch invalid packets at the lowest level.
+    if ( size > partial.buffer.Capacity() )
+    {
+        PacketBuffer bigger( std::min( std::max( size, 2 * partial.buffer.Capacity() ), maxBytes ) );
+        if ( partial.size > 0 )
+        {
+            std::memcpy( bigger.Data(), partial.buffer.Data(), partial.size );
+        }
+        std::swap( bigger, partial.buffer );
+    }
+    std::memcpy( partial.buffer.Data() + partial.size, packet.GetDataPtr(), packet.GetDataSize() );
+    partial.size = size;
+
+    if ( more )
+    {
+        return false;
+    }
 
+    packet = ComPacket( type, partial.buffer, 0, size );
+    partial = Reassembly();
     return true;
 }
 
 /**
-    Loop to guarantee the number of bytes requested are actually read.
+    Record the latency of each stage of the packet being dispatched. Stages
+    whose start time is not known (0) are not recorded.
+*/
+void PacketDemuxer::RecordLatency( IdManager::PacketType type )
+{
+    const std::uint64_t now = LatencyHistogram::Now();
+    auto record = [&]( LatencyStage stage, std::uint64_t from, std::uint64_t to ) {
+        if ( from != 0 && to != 0 )
+        {
+            m_latency[ static_cast<std::size_t>( stage ) * m_packetIds.Size() + type ].Record( to - from );
+        }
+    };
 
-    On error (return of false) size will contain the number of bytes that were remaining to be read.
+    record( LatencyStage::Queued, m_packetPosted, m_packetSent );
+    record( LatencyStage::Network, m_packetSent, m_lastReadTime );
+    record( LatencyStage::Receive, m_lastReadTime, now );
+    record( LatencyStage::Total, m_packetPosted, now );
+}
 
-    @param transportErrorOnZeroBytes If this is true then in the case that Read() returns zero bytes
-    a transport error will be signalled and ReadBytes() will return false.
+/**
+    Packets already held in the receive buffer are returned without
+    touching the transport - it is only polled and read from when the
+    buffer does not contain a complete packet.
 
-    @return true if all bytes were written, false if there was an error at any point. Also see impact
-    of the transportErrorOnZeroBytes parameter on the return value.
+    @param packet If return value is true then packet will contain the new data, if false packet remains unchanged.
+    @return false on comms error or timeout, true if successful.
 */
-bool PacketDemuxer::ReadBytes( uint8_t* buffer, size_t& size, bool transportErrorOnZeroBytes )
+bool PacketDemuxer::ReceivePacket( ComPacket& packet, const int timeoutInMilliseconds )
 {
-    while ( size > 0 && m_transportError == false )
+    while ( m_transportError == false )
     {
-        const int n = m_transport.Read( reinterpret_cast<char*>( buffer ), size );
+        if ( ParseBufferedPacket( packet ) )
+        {
+            assert( packet.GetType() != IdManager::InvalidPacket ); // Catch invalid packets at the lowest level.
+            return true;
+        }
+
+        if ( m_transport.ReadyForReading( timeoutInMilliseconds ) == false )
+        {
+            return false;
+        }
+
+        ///@note - a zero byte read here is not an error as ReadyForReading uses POLLIN
+        /// which also returns true if there is out of band data ready for reading.
+        if ( ReadAvailable() < 0 )
+        {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+/**
+    Extract the packet at the front of the receive buffer (if it is complete).
+    The new packet references the receive buffer's memory rather than copying it.
 
-        if ( n < 0 || (n == 0 && transportErrorOnZeroBytes) )
+    @return true if a packet was extracted, false if more data is needed (or
+    the header announced a payload over the maximum, which signals a transport error).
+*/
+bool PacketDemuxer::ParseBufferedPacket( ComPacket& packet )
+{
+    if ( m_largePacket.GetDataSize() > 0 )
+    {
+        if ( m_largeReceived < m_largePacket.GetDataSize() )
         {
-            std::clog << "Signalling transport error because bytes read := " << n << std::endl;
-            SignalTransportError();
             return false;
         }
 
-        size -= n;
-        buffer += n;
+        std::swap( m_largePacket, packet );
+        m_largePacket = ComPacket();
+        return true;
     }
 
-    if ( m_transportError )
+    const std::size_t buffered = m_rxEnd - m_rxBegin;
+    if ( buffered < m_headerBytes )
     {
         return false;
     }
 
-    return true;
+    uint32_t header[6];
+    std::memcpy( header, m_rxBuffer.Data() + m_rxBegin, m_headerBytes );
+    const uint32_t type = ntohl( header[0] );
+    const uint32_t size = ntohl( header[1] );
+    if ( m_headerBytes == TimestampedHeaderBytes )
+    {
+        m_packetPosted = ( std::uint64_t( ntohl( header[2] ) ) << 32 ) | ntohl( header[3] );
+        m_packetSent   = ( std::uint64_t( ntohl( header[4] ) ) << 32 ) | ntohl( header[5] );
+    }
+
+    if ( size > m_maxPayloadBytes.load( std::memory_order_relaxed ) )
+    {
+        std::cerr << "Error in PacketDemuxer::ParseBufferedPacket() - payload of " << size
+                  << " bytes (type " << type << ") exceeds the maximum of " << m_maxPayloadBytes << " bytes." << std::endl;
+        SignalTransportError();
+        return false;
+    }
+
+    if ( buffered - m_headerBytes >= size )
+    {
+        ComPacket p( static_cast<IdManager::PacketType>(type), m_rxBuffer, m_rxBegin + m_headerBytes, size );
+        m_rxBegin += m_headerBytes + size;
+        std::swap( p, packet );
+        return true;
+    }
+
+    if ( size > LargePayloadBytes )
+    {
+        BeginLargePacket( static_cast<IdManager::PacketType>(type), size );
+    }
+
+    return false;
+}
+
+/**
+    Start receiving a packet whose payload is too large to be worth staging in
+    the receive buffer: whatever has been buffered already is copied into a
+    dedicated buffer and the rest will be read from the transport directly into it.
+*/
+void PacketDemuxer::BeginLargePacket( IdManager::PacketType type, std::size_t size )
+{
+    ComPacket p( type, size );
+
+    const std::size_t buffered = m_rxEnd - m_rxBegin - m_headerBytes;
+    const char* payload = m_rxBuffer.Data() + m_rxBegin + m_headerBytes;
+    std::copy( payload, payload + buffered, p.GetDataPtr() );
+    m_rxBegin = m_rxEnd;
+
+    std::swap( p, m_largePacket );
+    m_largeReceived = buffered;
+}
+
+/**
+    Read as many bytes as are available, either into the large packet being
+    received or else into the receive buffer.
+
+    @return The number of bytes read or -1 on error (which also signals a transport error).
+*/
+int PacketDemuxer::ReadAvailable()
+{
+    if ( m_largePacket.GetDataSize() == 0 )
+    {
+        return FillReceiveBuffer();
+    }
+
+    const int n = ReadTransport( m_largePacket.GetDataPtr() + m_largeReceived, m_largePacket.GetDataSize() - m_largeReceived );
+    if ( n < 0 )
+    {
+        std::clog << "Signalling transport error because bytes read := " << n << std::endl;
+        SignalTransportError();
+        return -1;
+    }
+
+    m_largeReceived += n;
+    return n;
+}
+
+/**
+    Read as many bytes as are available (up to the free space) into the receive buffer.
+
+    The unparsed bytes are moved to the front of the buffer when the space after
+    them gets too small to complete a packet. If parsed packets still reference the
+    buffer a fresh buffer is allocated for this instead, so those packets are not
+    overwritten. The bytes moved are always less than one (not large) packet.
+
+    @return The number of bytes read or -1 on error (which also signals a transport error).
+*/
+int PacketDemuxer::FillReceiveBuffer()
+{
+    const std::size_t buffered = m_rxEnd - m_rxBegin;
+
+    if ( !m_rxBuffer || m_rxBuffer.Capacity() - m_rxEnd < LargePayloadBytes + TimestampedHeaderBytes )
+    {
+        if ( m_rxBuffer && m_rxBuffer.UseCount() == 1 )
+        {
+            std::memmove( m_rxBuffer.Data(), m_rxBuffer.Data() + m_rxBegin, buffered );
+        }
+        else
+        {
+            PacketBuffer fresh( ReceiveBufferBytes );
+            if ( buffered > 0 )
+            {
+                std::memcpy( fresh.Data(), m_rxBuffer.Data() + m_rxBegin, buffered );
+            }
+            std::swap( fresh, m_rxBuffer );
+        }
+        m_rxBegin = 0;
+        m_rxEnd = buffered;
+    }
+
+    const int n = ReadTransport( m_rxBuffer.Data() + m_rxEnd, m_rxBuffer.Capacity() - m_rxEnd );
+    if ( n < 0 )
+    {
+        std::clog << "Signalling transport error because bytes read := " << n << std::endl;
+        SignalTransportError();
+        return -1;
+    }
+
+    m_rxEnd += n;
+    return n;
+}
+
+/**
+    Read from the transport, noting when the data arrived if latencies are
+    being measured (the kernel's receive timestamp if the transport has one,
+    otherwise the time of the read).
+*/
+int PacketDemuxer::ReadTransport( char* data, std::size_t maxBytes )
+{
+    if ( m_headerBytes == HeaderBytes )
+    {
+        return m_transport.Read( data, maxBytes );
+    }
+
+    std::uint64_t received = 0;
+    const int n = m_transport.ReadTimestamped( data, maxBytes, received );
+    if ( n > 0 )
+    {
+        m_lastReadTime = received != 0 ? received : LatencyHistogram::Now();
+    }
+    return n;
 }
 
 void PacketDemuxer::SignalTransportError()
@@ -235,7 +773,7 @@ void PacketDemuxer::SignalTransportError()
 }
 
 /**
-    Receive the hello message. The first packet sent from a PacketMuxer to
+    Check the hello message. The first packet sent from a PacketMuxer to
     a demuxer will always be an Hello control message. If the first message
     is not such a message it is considered a transport error and the demuxer
     will terminate for safety.
@@ -246,33 +784,58 @@ void PacketDemuxer::SignalTransportError()
     its own secure handshaking procedure at a higher level (external to the
     Muxer/Demuxer system).
 */
-void PacketDemuxer::ReceiveHelloMessage( ComPacket& packet, const int timeoutInMillisecs )
+void PacketDemuxer::CheckHelloMessage( const ComPacket::ConstSharedPacket& sptr )
 {
-    if ( ReceivePacket( packet, timeoutInMillisecs ) )
+    // Very first packet should be a 'Hello' control packet:
+    if ( sptr->GetType() == IdManager::ControlPacket && GetControlMessage( sptr ) == ControlMessage::Hello )
     {
-        bool failHard = true;
-
-        // Very first packet should be a 'Hello' control packet:
-        if ( packet.GetType() == IdManager::ControlPacket )
-        {
-            auto sptr = std::make_shared<ComPacket>( std::move(packet) );
-            ControlMessage msg = GetControlMessage( sptr );
-            if ( msg == ControlMessage::Hello )
-            {
-                failHard = false;
-            }
-        }
+        m_helloReceived = true;
+        HandleHelloFeatures( sptr );
+    }
+    else
+    {
+        std::cerr << "Error in PacketDemuxer::Receive() - first message was not 'Hello'." << std::endl;
+        SignalTransportError();
+    }
+}
 
-        if ( failHard )
+void PacketDemuxer::HandleControlMessage( const ComPacket::ConstSharedPacket& sptr )
+{
+    const ControlMessage message = GetControlMessage( sptr );
+    if ( message == ControlMessage::Hello )
+    {
+        HandleHelloFeatures( sptr );
+    }
+    else if ( message == ControlMessage::Credit && sptr->GetDataSize() >= 1 + sizeof(CreditMessage) )
+    {
+        CreditMessage credit;
+        std::memcpy( &credit, sptr->GetDataPtr() + 1, sizeof(credit) );
+        PacketMuxer* muxer = m_creditReceiver;
+        if ( muxer != nullptr )
         {
-            std::cerr << "Error in PacketDemuxer::Receive() - first message was not 'Hello'." << std::endl;
-            SignalTransportError();
+            muxer->AddCredits( ntohl( credit.type ), ntohl( credit.credits ) );
         }
     }
 }
 
-void PacketDemuxer::HandleControlMessage( const ComPacket::ConstSharedPacket& sptr )
+/**
+    A Hello can announce features that change the format of every packet
+    after it (see HelloFeatures). Features the demuxer does not know about
+    are ignored.
+*/
+void PacketDemuxer::HandleHelloFeatures( const ComPacket::ConstSharedPacket& sptr )
 {
+    if ( sptr->GetDataSize() < 2 )
+    {
+        return;
+    }
+
+    const std::uint8_t features = sptr->GetDataPtr()[1];
+    if ( ( features & HelloFeatures::TimestampedHeaders ) && m_headerBytes != TimestampedHeaderBytes )
+    {
+        m_headerBytes = TimestampedHeaderBytes;
+        m_transport.EnableReceiveTimestamps();
+    }
 }
 
 ControlMessage PacketDemuxer::GetControlMessage( const ComPacket::ConstSharedPacket& sptr )
@@ -285,12 +848,13 @@ ControlMessage PacketDemuxer::GetControlMessage( const ComPacket::ConstSharedPac
 void PacketDemuxer::WarnAboutSubscribers()
 {
     std::lock_guard<std::mutex> guard(m_subscriberLock);
-    for ( const SubscriptionEntry& entry : m_subscribers )
+    const DispatchTable& table = *m_dispatchTable.load();
+    for ( IdManager::PacketType type = 0; type < table.size(); ++type )
     {
-        const size_t n = entry.second.size();
+        const size_t n = table[type].size();
         if( n > 0 )
         {
-            std::clog << "Warning: there are " << n << " live subscribers for '" << m_packetIds.ToString(entry.first) << "'" << std::endl;
+            std::clog << "Warning: there are " << n << " live subscribers for '" << m_packetIds.ToString(type) << "'" << std::endl;
         }
     }
 }
@@ -4,8 +4,9 @@
 #ifndef __PACKET_DEMUXER_H__
 #define __PACKET_DEMUXER_H__
 
-#include <unordered_map>
 #include <string>
+#include <vector>
+#include <atomic>
 #include <initializer_list>
 #include <mutex>
 #include <thread>
@@ -14,9 +15,15 @@
 #include "ComPacket.h"
 #include "PacketSubscription.h"
 #include "PacketSubscriber.h"
+#include "PacketExecutor.h"
+#include "SubscriptionOptions.h"
 #include "ControlMessage.h"
+#include "LatencyHistogram.h"
+#include "FlowControl.h"
 #include "../network/Socket.h"
 
+class PacketMuxer;
+
 /**
     Class which manages communications to and from the robot.
 
@@ -31,44 +38,142 @@
     The demuxing reads packets from the transport layer and then sends
     these packets onto any subscribers registered for the packet type.
 
-    The data itself is currently sent as byte stream over TCP.
+    The data itself is currently sent as byte stream over TCP. The
+    stream is read in large chunks into a pooled receive buffer and
+    all complete packets it holds are parsed before the transport is
+    polled again. Packets parsed from the buffer share its memory so
+    their payloads are never copied, while payloads too large to be
+    buffered are read directly into their own (aligned) buffer.
+
+    Subscribers are found through a table indexed by packet type that
+    the receive thread reads without taking a lock: Subscribe() and
+    Unsubscribe() publish a modified copy of the table and only free
+    the old one once the receive thread can no longer be using it.
+
+    Packets the muxer sent in fragments (see PacketMuxer::EnableFragmentation())
+    are reassembled before they are dispatched.
+
+    Callbacks run on the receive thread unless the subscription asks to
+    run them asynchronously (see SubscriptionOptions).
+
+    A demuxer can also be created without a receive thread, in which
+    case its owner calls ReceiveAvailable() whenever the transport is
+    readable (e.g. from an event loop, see PacketConnection) and the
+    callbacks run on that thread instead.
 */
 class PacketDemuxer
 {
 public:
     typedef std::shared_ptr<PacketSubscriber> SubscriberPtr;
 
-    PacketDemuxer( AbstractReader& socket, const std::vector<std::string>& packetIds );
+    PacketDemuxer( AbstractReader& socket, const std::vector<std::string>& packetIds, bool startReceiveThread = true );
     virtual ~PacketDemuxer();
 
     bool Ok() const;
+    void Shutdown();
+
+    /// Number of worker threads in the pool used for async subscribers without their own executor:
+    static constexpr unsigned DefaultExecutorThreads = 2;
+
+    /// Largest payload, whole or reassembled from fragments, accepted by default (see SetMaxPayloadBytes()):
+    static constexpr std::size_t DefaultMaxPayloadBytes = 8*1024*1024;
 
     PacketSubscription Subscribe( const std::string& type, PacketSubscriber::CallBack callback );
+    PacketSubscription Subscribe( const std::string& type, PacketSubscriber::CallBack callback, const SubscriptionOptions& options );
+    PacketSubscription Subscribe( IdManager::PacketType type, PacketSubscriber::CallBack callback, const SubscriptionOptions& options );
     void Unsubscribe( const PacketSubscriber *subscriber );
     bool IsSubscribed( const PacketSubscriber* subscriber ) const;
 
     void ReceiveLoop();
     bool ReceivePacket( ComPacket& packet, const int timeoutInMilliseconds );
+    bool ReceiveAvailable( bool hungUp = false );
+
+    LatencySummary GetLatency( const std::string& type, LatencyStage stage ) const;
+
+    void EnableFlowControl( const std::string& type, std::uint32_t window, PacketMuxer& returnPath );
+    void SetCreditReceiver( PacketMuxer* muxer );
+    void SetMaxPayloadBytes( std::size_t bytes );
 
     const IdManager& GetIdManager() const { return m_packetIds; }
 
 protected:
-    typedef std::pair< IdManager::PacketType, std::vector<SubscriberPtr> > SubscriptionEntry;
+    typedef std::vector<SubscriberPtr> SubscriberList;
+    typedef std::vector<SubscriberList> DispatchTable; // Indexed by packet type.
+    typedef std::vector< std::unique_ptr<DispatchTable> > RetiredTables;
+
+    static constexpr std::size_t HeaderBytes = 2*sizeof(uint32_t);
+    static constexpr std::size_t TimestampedHeaderBytes = HeaderBytes + 2*sizeof(uint64_t);
+    static constexpr std::size_t ReceiveBufferBytes = 64*1024;
+    static constexpr std::size_t LargePayloadBytes = ReceiveBufferBytes/4;
+
+    static PacketSubscriber::CallBack Sample( PacketSubscriber::CallBack deliver, const SubscriptionOptions& options );
+    void Dispatch( const ComPacket::ConstSharedPacket& sptr );
+    RetiredTables PublishDispatchTable( DispatchTable* table );
+    void FreeRetiredTables( RetiredTables& retired );
 
-    bool ReadBytes( uint8_t* buffer, size_t& size, bool transportErrorOnZeroBytes=false );
     void SignalTransportError();
 
+    bool ParseBufferedPacket( ComPacket& packet );
+    void BeginLargePacket( IdManager::PacketType type, std::size_t size );
+    int  ReadAvailable();
+    int  FillReceiveBuffer();
+    int  ReadTransport( char* data, std::size_t maxBytes );
+    void HandlePacket( ComPacket& packet );
+    bool Reassemble( ComPacket& packet );
+    void HandleHelloFeatures( const ComPacket::ConstSharedPacket& sptr );
+    void RecordLatency( IdManager::PacketType type );
+
 private:
     IdManager m_packetIds;
-    std::mutex m_subscriberLock;
-    std::unordered_map< SubscriptionEntry::first_type, SubscriptionEntry::second_type > m_subscribers;
+
+    // Serialises changes to the dispatch table (the receive thread never takes this lock):
+    mutable std::mutex m_subscriberLock;
+    std::atomic<DispatchTable*> m_dispatchTable;
+    std::atomic<std::uint64_t> m_dispatchSequence; // Odd while the receive thread is dispatching a packet.
+    std::atomic<std::thread::id> m_dispatchThread;
+    RetiredTables m_retiredTables;
+    std::unique_ptr<PacketExecutor> m_executor; // Created on the first async subscription.
     AbstractReader& m_transport;
-    bool m_transportError;
+    std::atomic<bool> m_transportError;
+
+    // Receive buffer: bytes [m_rxBegin, m_rxEnd) are buffered but not yet parsed.
+    PacketBuffer m_rxBuffer;
+    std::size_t m_rxBegin;
+    std::size_t m_rxEnd;
+
+    // A payload too large for the receive buffer is read directly into its own packet:
+    ComPacket m_largePacket;
+    std::size_t m_largeReceived;
+    std::atomic<std::size_t> m_maxPayloadBytes;
+
+    bool m_helloReceived;
+
+    // Packets being reassembled from fragments, indexed by packet type:
+    struct Reassembly
+    {
+        PacketBuffer buffer;
+        std::size_t size = 0;
+    };
+    std::vector<Reassembly> m_reassembly;
+
+    // Flow control: credits for the types this demuxer receives are granted through
+    // the granter, credits granted by the peer are passed to the credit receiver:
+    std::shared_ptr<CreditGranter> m_creditGranter;
+    std::atomic<PacketMuxer*> m_creditReceiver;
+
+    // Latency instrumentation (see PacketMuxer::EnableLatencyTimestamps()): the size of
+    // the headers the muxer sends, the times from the header of the packet being received
+    // and when the bytes last read from the transport arrived:
+    std::size_t m_headerBytes;
+    std::uint64_t m_packetPosted;
+    std::uint64_t m_packetSent;
+    std::uint64_t m_lastReadTime;
+    std::unique_ptr<LatencyHistogram[]> m_latency; // Indexed by stage then packet type.
 
     // This must be initialised last to ensure all other members are intialised before the thread starts:
     std::thread m_receiverThread;
 
-    void ReceiveHelloMessage( ComPacket& packet, int timeoutInMillisecs );
+    void CheckHelloMessage( const ComPacket::ConstSharedPacket& sptr );
     void HandleControlMessage( const ComPacket::ConstSharedPacket& sptr );
     ControlMessage GetControlMessage( const ComPacket::ConstSharedPacket& sptr );
     void WarnAboutSubscribers();
@@ -0,0 +1,209 @@
+#include "PacketExecutor.h"
+
+#include <iostream>
+
+constexpr int SubscriberInbox::MaxPacketsPerRun;
+
+SubscriberInbox::SubscriberInbox( PacketExecutor& executor, const PacketSubscriber::CallBack& callback, const SubscriptionOptions& options )
+:
+    m_executor  ( executor ),
+    m_callback  ( callback ),
+    m_capacity  ( options.inboxCapacity > 0 ? options.inboxCapacity : 1 ),
+    m_overflow  ( options.overflow ),
+    m_scheduled ( false ),
+    m_running   ( false ),
+    m_closed    ( false ),
+    m_dropped   ( 0 )
+{
+}
+
+/**
+    Queue a packet for the callback (applying the overflow policy if the
+    inbox is full) and schedule the inbox on the executor if it is idle.
+*/
+void SubscriberInbox::Post( const ComPacket::ConstSharedPacket& packet )
+{
+    std::unique_lock<std::mutex> guard( m_lock );
+
+    if ( m_overflow == OverflowPolicy::KeepLatest )
+    {
+        m_dropped += m_packets.size();
+        m_packets.clear();
+    }
+    else if ( m_packets.size() >= m_capacity )
+    {
+        switch ( m_overflow )
+        {
+        case OverflowPolicy::Block:
+            while ( m_closed == false && m_packets.size() >= m_capacity )
+            {
+                m_changed.wait( guard );
+            }
+            break;
+        case OverflowPolicy::DropOldest:
+            m_packets.pop_front();
+            m_dropped += 1;
+            break;
+        case OverflowPolicy::DropNewest:
+        default:
+            m_dropped += 1;
+            return;
+        }
+    }
+
+    if ( m_closed )
+    {
+        return;
+    }
+
+    m_packets.push_back( packet );
+
+    if ( m_scheduled == false )
+    {
+        m_scheduled = true;
+        guard.unlock();
+        m_executor.Schedule( shared_from_this() );
+    }
+}
+
+/**
+    Called by an executor's worker: runs the callback for up to
+    MaxPacketsPerRun queued packets then reschedules the inbox at the back
+    of the executor's queue if there are more (so busy subscribers can not
+    starve others sharing the executor).
+*/
+void SubscriberInbox::Run()
+{
+    std::unique_lock<std::mutex> guard( m_lock );
+
+    for ( int n = 0; n < MaxPacketsPerRun; ++n )
+    {
+        if ( m_closed || m_packets.empty() )
+        {
+            m_scheduled = false;
+            return;
+        }
+
+        ComPacket::ConstSharedPacket packet = std::move( m_packets.front() );
+        m_packets.pop_front();
+        m_running = true;
+        m_runningThread = std::this_thread::get_id();
+        m_changed.notify_all();
+        guard.unlock();
+
+        m_callback( packet );
+        packet.reset();
+
+        guard.lock();
+        m_running = false;
+        m_changed.notify_all();
+    }
+
+    if ( m_closed || m_packets.empty() )
+    {
+        m_scheduled = false;
+        return;
+    }
+
+    guard.unlock();
+    m_executor.Schedule( shared_from_this() );
+}
+
+/**
+    Discard any queued packets and stop running the callback. Once this returns
+    the callback will not be called again and is not running (unless this is
+    called from the callback itself).
+*/
+void SubscriberInbox::Close()
+{
+    std::unique_lock<std::mutex> guard( m_lock );
+    m_closed = true;
+    m_packets.clear();
+    m_changed.notify_all();
+
+    while ( m_running && m_runningThread != std::this_thread::get_id() )
+    {
+        m_changed.wait( guard );
+    }
+}
+
+/**
+    @return The number of packets discarded because the inbox was full.
+*/
+std::uint64_t SubscriberInbox::GetNumDropped() const
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    return m_dropped;
+}
+
+PacketExecutor::PacketExecutor( unsigned numThreads )
+:
+    m_stop( false )
+{
+    if ( numThreads == 0 )
+    {
+        numThreads = 1;
+    }
+
+    for ( unsigned t = 0; t < numThreads; ++t )
+    {
+        m_threads.emplace_back( &PacketExecutor::WorkLoop, this );
+    }
+}
+
+/**
+    Inboxes that are still scheduled are not run.
+*/
+PacketExecutor::~PacketExecutor()
+{
+    {
+        std::lock_guard<std::mutex> guard( m_lock );
+        m_stop = true;
+        m_ready.notify_all();
+    }
+
+    for ( std::thread& thread : m_threads )
+    {
+        try
+        {
+            thread.join();
+        }
+        catch ( const std::system_error& e )
+        {
+            std::clog << "Error: " << e.what() << std::endl;
+        }
+    }
+}
+
+void PacketExecutor::Schedule( std::shared_ptr<SubscriberInbox> inbox )
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    m_inboxes.push_back( std::move(inbox) );
+    m_ready.notify_one();
+}
+
+void PacketExecutor::WorkLoop()
+{
+    std::unique_lock<std::mutex> guard( m_lock );
+    while ( true )
+    {
+        while ( m_stop == false && m_inboxes.empty() )
+        {
+            m_ready.wait( guard );
+        }
+
+        if ( m_stop )
+        {
+            return;
+        }
+
+        std::shared_ptr<SubscriberInbox> inbox = std::move( m_inboxes.front() );
+        m_inboxes.pop_front();
+        guard.unlock();
+
+        inbox->Run();
+        inbox.reset();
+
+        guard.lock();
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef PACKETEXECUTOR_H
+#define PACKETEXECUTOR_H
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+#include "ComPacket.h"
+#include "PacketSubscriber.h"
+#include "SubscriptionOptions.h"
+
+class PacketExecutor;
+
+/**
+    Bounded queue of packets for one async subscriber. The demuxer's receive
+    thread posts packets to it and the inbox schedules itself on an executor
+    whenever it has packets to run. An inbox is only ever run by one worker
+    at a time so its callbacks are called in order and never concurrently.
+*/
+class SubscriberInbox : public std::enable_shared_from_this<SubscriberInbox>
+{
+public:
+    /// Maximum callbacks run for one inbox before the worker moves on to other inboxes.
+    static constexpr int MaxPacketsPerRun = 16;
+
+    SubscriberInbox( PacketExecutor& executor, const PacketSubscriber::CallBack& callback, const SubscriptionOptions& options );
+    SubscriberInbox( const SubscriberInbox& ) = delete;
+    virtual ~SubscriberInbox() {}
+
+    void Post( const ComPacket::ConstSharedPacket& packet );
+    void Run();
+    void Close();
+
+    std::uint64_t GetNumDropped() const;
+
+private:
+    PacketExecutor& m_executor;
+    PacketSubscriber::CallBack m_callback;
+    const std::size_t m_capacity;
+    const OverflowPolicy m_overflow;
+
+    mutable std::mutex m_lock;
+    std::condition_variable m_changed;
+    std::deque<ComPacket::ConstSharedPacket> m_packets;
+    bool m_scheduled;
+    bool m_running;
+    bool m_closed;
+    std::thread::id m_runningThread;
+    std::uint64_t m_dropped;
+};
+
+/**
+    Pool of worker threads that runs subscriber inboxes.
+*/
+class PacketExecutor
+{
+public:
+    explicit PacketExecutor( unsigned numThreads );
+    PacketExecutor( const PacketExecutor& ) = delete;
+    virtual ~PacketExecutor();
+
+    void Schedule( std::shared_ptr<SubscriberInbox> inbox );
+
+private:
+    std::mutex m_lock;
+    std::condition_variable m_ready;
+    std::deque< std::shared_ptr<SubscriberInbox> > m_inboxes;
+    bool m_stop;
+    std::vector<std::thread> m_threads;
+
+    void WorkLoop();
+};
+
+#endif // PACKETEXECUTOR_H
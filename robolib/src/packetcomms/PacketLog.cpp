@@ -0,0 +1,267 @@
+#include "PacketLog.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace PacketLogFormat;
+
+/**
+    Map a log into memory and load (or rebuild) its index.
+
+    @return nullptr if the file can not be opened or is not a packet log.
+*/
+std::unique_ptr<PacketLog> PacketLog::Open( const std::string& fileName )
+{
+    const int fd = open( fileName.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( fd == -1 )
+    {
+        std::clog << "PacketLog: could not open '" << fileName << "' - " << strerror(errno) << std::endl;
+        return nullptr;
+    }
+
+    struct stat info;
+    void* mapping = MAP_FAILED;
+    if ( fstat( fd, &info ) == 0 && info.st_size >= static_cast<off_t>( sizeof(FileHeader) ) )
+    {
+        mapping = mmap( nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    }
+    close( fd );
+
+    if ( mapping == MAP_FAILED )
+    {
+        std::clog << "PacketLog: could not map '" << fileName << "'" << std::endl;
+        return nullptr;
+    }
+
+    const char* data = static_cast<const char*>( mapping );
+    const std::size_t size = info.st_size;
+
+    FileHeader header;
+    std::memcpy( &header, data, sizeof(header) );
+    std::vector<std::string> names;
+    std::uint64_t offset = sizeof(header);
+    bool valid = std::memcmp( header.magic, FileMagic, sizeof(FileMagic) ) == 0 && header.version == Version;
+
+    for ( std::uint32_t t = 0; valid && t < header.numTypes; ++t )
+    {
+        std::uint32_t length = 0;
+        valid = offset + sizeof(length) <= size;
+        if ( valid )
+        {
+            std::memcpy( &length, data + offset, sizeof(length) );
+            offset += sizeof(length);
+            valid = length <= size - offset;
+        }
+
+        if ( valid )
+        {
+            names.emplace_back( data + offset, length );
+            offset += length;
+        }
+    }
+
+    if ( valid == false )
+    {
+        std::clog << "PacketLog: '" << fileName << "' is not a packet log" << std::endl;
+        munmap( mapping, size );
+        return nullptr;
+    }
+
+    std::unique_ptr<PacketLog> log( new PacketLog( data, size, names ) );
+    log->m_recordsBegin = std::min<std::uint64_t>( Align( offset ), size );
+    if ( log->LoadIndex() == false )
+    {
+        std::clog << "PacketLog: '" << fileName << "' was not closed - rebuilding its index" << std::endl;
+        log->ScanRecords();
+    }
+
+    // Records are mostly replayed in order:
+    madvise( mapping, size, MADV_SEQUENTIAL );
+    return log;
+}
+
+PacketLog::PacketLog( const char* data, std::size_t size, const std::vector<std::string>& names )
+:
+    m_data          ( data ),
+    m_size          ( size ),
+    m_packetIds     ( names ),
+    m_recordsBegin  ( 0 ),
+    m_recordsEnd    ( 0 ),
+    m_closed        ( false )
+{
+}
+
+PacketLog::~PacketLog()
+{
+    munmap( const_cast<char*>( m_data ), m_size );
+}
+
+std::vector<std::string> PacketLog::GetPacketIds() const
+{
+    std::vector<std::string> names;
+    for ( IdManager::PacketType type = IdManager::ControlPacket + 1; type < m_packetIds.Size(); ++type )
+    {
+        names.push_back( m_packetIds.ToString( type ) );
+    }
+    return names;
+}
+
+std::uint64_t PacketLog::GetNumRecords() const
+{
+    std::uint64_t total = 0;
+    for ( const TypeIndex& index : m_index )
+    {
+        total += index.count;
+    }
+    return total;
+}
+
+std::uint64_t PacketLog::GetNumRecords( const std::string& type ) const
+{
+    return m_index[ m_packetIds.ToId( type ) ].count;
+}
+
+/**
+    Read the record at offset and advance offset to the next one. Iterate
+    over every record in the order they were recorded with:
+
+        for ( auto offset = log.Begin(); log.ReadRecord( offset, record ); ) {}
+
+    @return false if there are no more records.
+*/
+bool PacketLog::ReadRecord( std::uint64_t& offset, PacketLogRecord& record ) const
+{
+    if ( offset >= m_recordsEnd || ParseRecord( offset, record ) == false )
+    {
+        return false;
+    }
+
+    offset = Align( offset + sizeof(RecordHeader) + record.size );
+    return true;
+}
+
+/**
+    @return The nth record of the specified type (found through the index).
+*/
+PacketLogRecord PacketLog::GetRecord( const std::string& type, std::uint64_t n ) const
+{
+    const TypeIndex& index = m_index[ m_packetIds.ToId( type ) ];
+    assert( n < index.count );
+
+    PacketLogRecord record;
+    ParseRecord( index.offsets[n], record );
+    return record;
+}
+
+/**
+    Use the index written when the log was closed (after checking it
+    is consistent with the file).
+
+    @return false if the log has no valid index.
+*/
+bool PacketLog::LoadIndex()
+{
+    if ( m_size < m_recordsBegin + sizeof(Trailer) )
+    {
+        return false;
+    }
+
+    Trailer trailer;
+    std::memcpy( &trailer, m_data + m_size - sizeof(Trailer), sizeof(trailer) );
+    const std::uint64_t indexEnd = m_size - sizeof(Trailer);
+    if ( std::memcmp( trailer.magic, IndexMagic, sizeof(IndexMagic) ) != 0 ||
+         trailer.indexOffset < m_recordsBegin || trailer.indexOffset > indexEnd || trailer.indexOffset % Alignment != 0 )
+    {
+        return false;
+    }
+
+    std::uint64_t offset = trailer.indexOffset;
+    std::vector<TypeIndex> index( m_packetIds.Size() );
+    for ( TypeIndex& entry : index )
+    {
+        if ( indexEnd - offset < sizeof(std::uint64_t) )
+        {
+            return false;
+        }
+
+        std::memcpy( &entry.count, m_data + offset, sizeof(std::uint64_t) );
+        offset += sizeof(std::uint64_t);
+        if ( entry.count > ( indexEnd - offset ) / sizeof(std::uint64_t) )
+        {
+            return false;
+        }
+
+        // The index is 8-byte aligned within the (page aligned) mapping:
+        entry.offsets = reinterpret_cast<const std::uint64_t*>( m_data + offset );
+        offset += entry.count * sizeof(std::uint64_t);
+        for ( std::uint64_t i = 0; i < entry.count; ++i )
+        {
+            if ( entry.offsets[i] < m_recordsBegin || entry.offsets[i] >= trailer.indexOffset )
+            {
+                return false;
+            }
+        }
+    }
+
+    m_index.swap( index );
+    m_recordsEnd = trailer.indexOffset;
+    m_closed = true;
+    return true;
+}
+
+/**
+    Rebuild the index of a log that was not closed by reading every record
+    up to the first one that is incomplete (or zeroed).
+*/
+void PacketLog::ScanRecords()
+{
+    m_scannedIndex.assign( m_packetIds.Size(), std::vector<std::uint64_t>() );
+    m_recordsEnd = m_size;
+
+    std::uint64_t offset = m_recordsBegin;
+    PacketLogRecord record;
+    while ( ParseRecord( offset, record ) && record.type != IdManager::InvalidPacket )
+    {
+        m_scannedIndex[ record.type ].push_back( offset );
+        offset = Align( offset + sizeof(RecordHeader) + record.size );
+    }
+    m_recordsEnd = std::min<std::uint64_t>( offset, m_size );
+
+    m_index.resize( m_packetIds.Size() );
+    for ( std::size_t t = 0; t < m_index.size(); ++t )
+    {
+        m_index[t].offsets = m_scannedIndex[t].data();
+        m_index[t].count = m_scannedIndex[t].size();
+    }
+}
+
+/**
+    @return false if there is not a complete record of a known type at offset.
+*/
+bool PacketLog::ParseRecord( std::uint64_t offset, PacketLogRecord& record ) const
+{
+    if ( offset > m_recordsEnd || m_recordsEnd - offset < sizeof(RecordHeader) )
+    {
+        return false;
+    }
+
+    RecordHeader header;
+    std::memcpy( &header, m_data + offset, sizeof(header) );
+    if ( header.type >= m_packetIds.Size() || header.size > m_recordsEnd - offset - sizeof(RecordHeader) )
+    {
+        return false;
+    }
+
+    record.timestamp = header.timestamp;
+    record.type = header.type;
+    record.data = m_data + offset + sizeof(RecordHeader);
+    record.size = header.size;
+    return true;
+}
@@ -0,0 +1,118 @@
+#ifndef PACKETLOG_H
+#define PACKETLOG_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "IdManager.h"
+
+/**
+    A packet log is an append-only file of packets (see PacketRecorder)
+    with an index of each type's packets at the end. All values are in
+    the byte order of the host that recorded the log.
+
+    The file starts with a FileHeader and the names of the packet types
+    (each a 32-bit length then the characters) in the order of the
+    recording demuxer's ids. Then come the records: a RecordHeader and
+    the payload, padded so that every record starts 8-byte aligned.
+
+    Closing the log appends the index: for every type in turn the number
+    of records of that type and then each of their file offsets. Last is
+    a Trailer holding the offset of the index. A log that was not closed
+    (e.g. the recorder crashed) has no trailer but is still readable:
+    the index is rebuilt by scanning the records.
+*/
+namespace PacketLogFormat
+{
+constexpr char FileMagic[8] = { 'R', 'L', 'P', 'K', 'T', 'L', 'O', 'G' };
+constexpr char IndexMagic[8] = { 'R', 'L', 'P', 'K', 'T', 'I', 'D', 'X' };
+constexpr std::uint32_t Version = 1;
+constexpr std::size_t Alignment = 8;
+
+struct FileHeader
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t numTypes;
+};
+
+struct RecordHeader
+{
+    std::uint64_t timestamp; ///< When the packet was received (nanoseconds, CLOCK_REALTIME).
+    std::uint32_t type;
+    std::uint32_t size;
+};
+
+struct Trailer
+{
+    std::uint64_t indexOffset;
+    char magic[8];
+};
+
+inline std::uint64_t Align( std::uint64_t offset )
+{
+    return ( offset + Alignment - 1 ) & ~std::uint64_t( Alignment - 1 );
+}
+}
+
+/**
+    One packet from a log. The data points into the log's memory map
+    so is only valid while the log is open.
+*/
+struct PacketLogRecord
+{
+    std::uint64_t timestamp;
+    IdManager::PacketType type; ///< The id in the log (see PacketLog::GetPacketIds()).
+    const char* data;
+    std::uint32_t size;
+};
+
+/**
+    Read-only access to a packet log. The file is memory-mapped so records
+    are never copied and opening even a very large log is cheap.
+*/
+class PacketLog
+{
+public:
+    static std::unique_ptr<PacketLog> Open( const std::string& fileName );
+    virtual ~PacketLog();
+
+    /// Names of the packet types in the log (excluding the invalid and control types).
+    std::vector<std::string> GetPacketIds() const;
+    const IdManager& GetIdManager() const { return m_packetIds; }
+
+    bool WasClosed() const { return m_closed; }
+    std::uint64_t GetNumRecords() const;
+    std::uint64_t GetNumRecords( const std::string& type ) const;
+
+    std::uint64_t Begin() const { return m_recordsBegin; }
+    bool ReadRecord( std::uint64_t& offset, PacketLogRecord& record ) const;
+    PacketLogRecord GetRecord( const std::string& type, std::uint64_t n ) const;
+
+protected:
+    struct TypeIndex
+    {
+        const std::uint64_t* offsets;
+        std::uint64_t count;
+    };
+
+    PacketLog( const char* data, std::size_t size, const std::vector<std::string>& names );
+
+    bool LoadIndex();
+    void ScanRecords();
+    bool ParseRecord( std::uint64_t offset, PacketLogRecord& record ) const;
+
+private:
+    const char* m_data;
+    std::size_t m_size;
+    IdManager m_packetIds;
+    std::uint64_t m_recordsBegin;
+    std::uint64_t m_recordsEnd;
+    bool m_closed;
+    std::vector<TypeIndex> m_index;
+    std::vector< std::vector<std::uint64_t> > m_scannedIndex; // Storage for the index of a log that was not closed.
+};
+
+#endif // PACKETLOG_H
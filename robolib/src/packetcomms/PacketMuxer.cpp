@@ -4,37 +4,96 @@
 
 #include <iostream>
 #include <algorithm>
+#include <cstring>
 #include <type_traits>
 
 /**
     Create a new muxer that will send packets over the specified
     socket.
 
+    @param txConfig Priority classes and weights for any packet types
+    that should not be scheduled with the defaults (see TxQueueConfig).
+
     This object is guaranteed to only ever write to the socket.
 */
-PacketMuxer::PacketMuxer(AbstractWriter &socket, const std::vector<std::string>& packetIds )
+constexpr std::size_t PacketMuxer::IngressCapacity;
+constexpr std::size_t PacketMuxer::MaxHeaderWords;
+constexpr std::size_t PacketMuxer::MaxBytesPerWrite;
+
+PacketMuxer::PacketMuxer(AbstractWriter &socket, const std::vector<std::string>& packetIds, const TxConfig& txConfig )
+:
+    m_packetIds     (packetIds),
+    m_numPosted     (0),
+    m_numSent       (0),
+    m_numBlocked    (0),
+    m_scheduler     (m_packetIds, txConfig),
+    m_ingress       (IngressCapacity),
+    m_pendingIov    (nullptr),
+    m_pendingCount  (0),
+    m_pendingZeroCopy(false),
+    m_sentSinceHeartBeat(false),
+    m_latencyTimestamps(false),
+    m_timestampedHeaders(false),
+    m_latency       (new LatencyHistogram[m_packetIds.Size()]),
+    m_zeroCopy      (false),
+    m_zeroCopyThreshold(0),
+    m_transport     (socket),
+    m_transportError(false)
+{
+    m_transport.SetBlocking( false );
+
+    // The Hello must be queued before anything else can be (e.g. control messages
+    // posted by another thread) so it is queued before the send thread starts:
+    SendControlMessage( ControlMessage::Hello );
+    m_sendThread = std::thread( std::bind(&PacketMuxer::SendLoop, std::ref(*this)) );
+}
+
+/**
+    Create a muxer that has no send thread of its own: it is driven by
+    its owner (typically from an event loop, see PacketConnection).
+
+    @param packetPosted Called (from whichever thread posted) whenever
+    there is something new to send. The owner must then call Flush(),
+    and also call it again when the transport becomes writable if the
+    previous Flush() returned true. SendHeartBeatIfIdle() should be
+    called about once a second.
+*/
+PacketMuxer::PacketMuxer( AbstractWriter& socket, const std::vector<std::string>& packetIds, const TxConfig& txConfig, std::function<void()> packetPosted )
 :
     m_packetIds     (packetIds),
     m_numPosted     (0),
     m_numSent       (0),
+    m_numBlocked    (0),
+    m_scheduler     (m_packetIds, txConfig),
+    m_ingress       (IngressCapacity),
+    m_pendingIov    (nullptr),
+    m_pendingCount  (0),
+    m_pendingZeroCopy(false),
+    m_sentSinceHeartBeat(false),
+    m_latencyTimestamps(false),
+    m_timestampedHeaders(false),
+    m_latency       (new LatencyHistogram[m_packetIds.Size()]),
+    m_zeroCopy      (false),
+    m_zeroCopyThreshold(0),
     m_transport     (socket),
     m_transportError(false),
-    m_sendThread    (std::bind(&PacketMuxer::SendLoop, std::ref(*this)))
+    m_packetPosted  (packetPosted)
 {
     m_transport.SetBlocking( false );
+    ReserveBatchBuffers();
+    SendControlMessage( ControlMessage::Hello );
 }
 
 PacketMuxer::~PacketMuxer()
 {
-    {
-        std::lock_guard<std::recursive_mutex> guard( m_txLock );
-        m_transportError = true; /// Causes threads to exit (@todo use better method)
-        m_txReady.notify_all();
-    }
+    Shutdown(); /// Causes threads to exit (@todo use better method)
 
     try
     {
-        m_sendThread.join();
+        if ( m_sendThread.joinable() )
+        {
+            m_sendThread.join();
+        }
     } catch ( const std::system_error& e )
     {
         std::clog << "Error: " << e.what() << std::endl;
@@ -49,6 +108,143 @@ bool PacketMuxer::Ok() const
     return m_transportError == false;
 }
 
+/**
+    Stop sending: flags a transport error so that Ok() returns false and
+    wakes the send thread and any posters waiting for queue space.
+*/
+void PacketMuxer::Shutdown()
+{
+    std::lock_guard<std::recursive_mutex> guard( m_txLock );
+    m_transportError = true;
+    m_txReady.Notify();
+    m_txSpace.notify_all();
+}
+
+/**
+    Ask the transport to send large payloads without copying them
+    into the kernel (e.g. MSG_ZEROCOPY on Linux sockets). Only batches
+    containing a payload of at least minPayloadBytes are sent this way:
+    for small writes the cost of the completion notifications outweighs
+    the saved copy.
+
+    Sent packets are kept alive until the transport reports the write
+    has completed, so their memory is held slightly longer than usual.
+
+    @return true if the transport supports zero-copy writes.
+*/
+bool PacketMuxer::EnableZeroCopy( std::size_t minPayloadBytes )
+{
+    std::lock_guard<std::recursive_mutex> guard( m_txLock );
+    m_zeroCopy = m_transport.EnableZeroCopy();
+    m_zeroCopyThreshold = minPayloadBytes;
+    return m_zeroCopy;
+}
+
+/**
+    Send payloads larger than fragmentBytes as a series of fragments, which
+    the demuxer reassembles before passing the packet on. Other packets
+    can be sent between the fragments so the time a higher priority packet
+    can be held up by a large one is bounded by the time to write one
+    fragment (each write is also limited to the fragment size) rather than
+    the whole payload. Packets of the same type are still sent in order.
+
+    Smaller fragments mean lower latency for everything else at the cost of
+    a header per fragment and more writes. The transport must pass the byte
+    stream through unchanged (UdpTransport does its own fragmentation).
+
+    @param fragmentBytes Largest fragment, or 0 to stop fragmenting.
+*/
+void PacketMuxer::EnableFragmentation( std::size_t fragmentBytes )
+{
+    std::lock_guard<std::recursive_mutex> guard( m_txLock );
+    m_scheduler.SetFragmentBytes( fragmentBytes );
+}
+
+/**
+    @return The number of packets of the named type that have been
+    discarded because their transmit queue overflowed.
+*/
+std::uint64_t PacketMuxer::GetNumDropped( const std::string& name )
+{
+    const IdManager::PacketType type = m_packetIds.ToId(name);
+    std::lock_guard<std::recursive_mutex> guard( m_txLock );
+    return m_scheduler.GetNumDropped( type );
+}
+
+/**
+    Measure how long each packet waits in the muxer and send each packet's
+    post and send times in its header so that the demuxer at the other end
+    can measure the rest of its journey (see PacketDemuxer::GetLatency()).
+
+    The demuxer is told through a Hello carrying the TimestampedHeaders
+    feature, which is sent ahead of any queued packets. The other end must
+    be a demuxer that understands the feature and the transport must pass
+    the byte stream through unchanged (i.e. not a UdpTransport).
+*/
+void PacketMuxer::EnableLatencyTimestamps()
+{
+    if ( m_latencyTimestamps.exchange( true ) == false )
+    {
+        SendControlMessage( ControlMessage::Hello, HelloFeatures::TimestampedHeaders );
+    }
+}
+
+/**
+    @return The time packets of the named type have spent between being posted
+    and being written to the transport (only once EnableLatencyTimestamps() is called).
+*/
+LatencySummary PacketMuxer::GetLatency( const std::string& name ) const
+{
+    return m_latency[ m_packetIds.ToId(name) ].Summarise();
+}
+
+/**
+    Grant the peer credit to send more packets of a flow controlled type
+    (see CreditGranter). Can be called from any thread.
+*/
+void PacketMuxer::SendCredits( IdManager::PacketType type, std::uint32_t credits )
+{
+    std::uint8_t bytes[1 + sizeof(CreditMessage)];
+    bytes[0] = static_cast<std::underlying_type<ControlMessage>::type>( ControlMessage::Credit );
+    const CreditMessage message{ htonl( type ), htonl( credits ) };
+    std::memcpy( bytes + 1, &message, sizeof(message) );
+
+    auto packet = ComPacket::MakeShared( IdManager::ControlPacket, reinterpret_cast<const VectorStream::CharType*>(bytes), sizeof(bytes) );
+    std::lock_guard<std::recursive_mutex> guard( m_txLock );
+    m_scheduler.Push( std::move(packet) );
+    SignalPacketPosted();
+}
+
+/**
+    Credit granted by the peer for a flow controlled type (see
+    TxQueueConfig::flowControl): that many more packets of the type may
+    be sent. Called by the demuxer receiving from the peer.
+*/
+void PacketMuxer::AddCredits( IdManager::PacketType type, std::uint32_t credits )
+{
+    if ( type >= m_packetIds.Size() )
+    {
+        return;
+    }
+
+    std::lock_guard<std::recursive_mutex> guard( m_txLock );
+    m_scheduler.AddCredits( type, credits );
+    m_txReady.Notify();
+    if ( m_packetPosted )
+    {
+        m_packetPosted();
+    }
+}
+
+/**
+    @return Number of packets of a flow controlled type that may still be sent.
+*/
+std::uint64_t PacketMuxer::GetCredits( const std::string& name )
+{
+    std::lock_guard<std::recursive_mutex> guard( m_txLock );
+    return m_scheduler.GetCredits( m_packetIds.ToId(name) );
+}
+
 /**
     This function loops sending all the queued packets over the
     transport layer. The loop exits if there is a transport error
@@ -61,20 +257,32 @@ void PacketMuxer::SendLoop()
 {
     std::clog << "PacketMuxer::SendLoop() entered." << std::endl;
 
-    SendControlMessage( ControlMessage::Hello );
+    // The batch buffers belong to this thread so are set up here rather than in the constructor:
+    ReserveBatchBuffers();
 
     // Grab the lock for the transmit/send queues:
     std::unique_lock<std::recursive_mutex> guard( m_txLock );
 
     while ( m_transportError == false )
     {
-        if ( m_numPosted == m_numSent )
+        DrainIngress();
+        if ( m_scheduler.Empty() )
         {
-            // Atomically relinquish lock for send queues and wait
-            // until new data is posted (don't care to which queue it
-            // is posted, hence one condition variable for all queues):
-            std::cv_status status = m_txReady.wait_for(guard, std::chrono::seconds(1));
-            if ( status == std::cv_status::timeout )
+            // Relinquish lock for send queues and wait until new data is
+            // posted (don't care to which queue it is posted, hence one event
+            // for all queues). The sequence is read before the final check
+            // for packets so a post in between makes the wait return at once:
+            const uint32_t sequence = m_txReady.Sequence();
+            DrainIngress();
+            if ( m_scheduler.Empty() == false || m_transportError )
+            {
+                continue;
+            }
+
+            guard.unlock();
+            const bool posted = m_txReady.Wait( sequence, std::chrono::seconds(1) );
+            guard.lock();
+            if ( posted == false )
             {
                 // If there are no packets to send after waiting for 1 second then
                 // send a 'HeartBeat' message - this serves two purposes:
@@ -86,102 +294,402 @@ void PacketMuxer::SendLoop()
             }
         }
 
-        // Send in priority order:
-        /// @todo if one queue is always full we could get starvation here...how to fix? Counter for each queue
-        /// indicating how many send loops it has been not empty?
-        /// (But in that case the system is overloaded anyway so what would we like to do when overloaded?)
-        for ( auto& pair : m_txQueues )
+        SendAll( guard );
+        ReleaseZeroCopyPackets();
+    }
+
+    std::clog << "PacketMuxer::SendLoop() exited." << std::endl;
+}
+
+void PacketMuxer::ReserveBatchBuffers()
+{
+    m_batch.reserve( MaxPacketsPerWrite );
+    m_headers.reserve( MaxHeaderWords*MaxPacketsPerWrite );
+    m_iov.resize( 2*MaxPacketsPerWrite );
+}
+
+/**
+    Send queued packets until everything has been sent or the transport
+    would block. Only for muxers driven by their owner rather than a send
+    thread, and must only be called from one thread at a time.
+
+    A batch that is only partially written is resumed by the next call.
+
+    @return true if the transport is full and Flush() must be called
+    again once it is writable, false if there is nothing left to send
+    (or there was a transport error).
+*/
+bool PacketMuxer::Flush()
+{
+    std::unique_lock<std::recursive_mutex> guard( m_txLock );
+    ReleaseZeroCopyPackets();
+
+    // Even if the transport is still full, newly posted packets are moved into their
+    // queues (where the overflow policies apply) so posters never wait for the ingress:
+    DrainIngress();
+
+    while ( m_transportError == false )
+    {
+        if ( m_pendingCount == 0 )
+        {
+            DrainIngress();
+            if ( m_scheduler.Empty() )
+            {
+                return false;
+            }
+            BeginBatch( GatherBatch() );
+        }
+
+        guard.unlock();
+        const WriteResult result = WritePending();
+        guard.lock();
+
+        if ( result == WriteResult::WouldBlock )
+        {
+            return true;
+        }
+
+        if ( result == WriteResult::Failed )
         {
-            SendAll( pair.second );
+            m_transportError = true;
         }
+        EndBatch();
     }
 
-    std::clog << "PacketMuxer::SendLoop() exited." << std::endl;
+    return false;
+}
+
+/**
+    Send a 'HeartBeat' control message if nothing has been sent since the
+    last call (see SendLoop() for why). Only for muxers driven by their owner.
+*/
+void PacketMuxer::SendHeartBeatIfIdle()
+{
+    std::lock_guard<std::recursive_mutex> guard( m_txLock );
+    if ( m_sentSinceHeartBeat == false && m_scheduler.Empty() )
+    {
+        SendControlMessage( ControlMessage::HeartBeat );
+    }
+    m_sentSinceHeartBeat = false;
+}
+
+/**
+    Move packets posted through the lock-free ingress queue into the scheduler.
+
+    Must hold the lock for the transmit queues.
+*/
+void PacketMuxer::DrainIngress()
+{
+    ComPacket::SharedPacket packet;
+    while ( m_ingress.TryPop( packet ) )
+    {
+        m_scheduler.Push( std::move(packet) );
+    }
 }
 
 /**
-    Send all the packets from the FIFO container. The container will
-    be empty after calling this function, regardless of whether there
-    were any errors from the transport layer.
+    Send all the queued packets in the order decided by the scheduler.
 
-    @note Assumes you have acquired the appropriate
-    lock to access the specified PacketContainer.
+    Packets are gathered into batches so that the headers and payloads of
+    up to MaxPacketsPerWrite packets go to the transport in a single write.
+    The tx lock is released while each batch is written so that other threads
+    can keep posting packets (and so that a high priority packet posted
+    meanwhile is at the front of the next batch).
 
-     @bug Bug on shutdown - the queues are always empty so we never attempt to send any packets
-     and therefore never get to state where m_transportError is true, hence the caller loops forever.
+    @param txGuard Must hold the lock for the transmit queues.
 */
-void PacketMuxer::SendAll( ComPacket::PacketContainer& packets )
+void PacketMuxer::SendAll( std::unique_lock<std::recursive_mutex>& txGuard )
 {
-    while ( m_transportError == false && packets.empty() == false )
+    while ( m_transportError == false && m_scheduler.Empty() == false )
     {
-        // Here we must send before popping to guarantee the shared_ptr is valid for the lifetime of SendPacket.
-        SendPacket( *(packets.front().get()) );
-        packets.pop();
-        m_numSent += 1;
+        DrainIngress();
+        const bool zeroCopy = GatherBatch();
+        txGuard.unlock();
+        SendBatch( zeroCopy );
+        txGuard.lock();
     }
 }
 
 /**
-    Used internally to send a packet over the transport layer.
+    Move the next packets chosen by the scheduler into m_batch.
+
+    Must hold the lock for the transmit queues.
+
+    @return true if the batch should be written with the transport's zero-copy write.
+*/
+bool PacketMuxer::GatherBatch()
+{
+    const std::size_t fragmentBytes = m_scheduler.GetFragmentBytes();
+    const std::size_t maxBytes = fragmentBytes != 0 ? std::min( fragmentBytes, MaxBytesPerWrite ) : MaxBytesPerWrite;
+
+    bool zeroCopy = false;
+    std::size_t batchBytes = 0;
+    std::size_t numPackets = 0;
+    while ( m_scheduler.Empty() == false && m_batch.size() < MaxPacketsPerWrite && batchBytes < maxBytes )
+    {
+        m_batch.push_back( m_scheduler.Pop() );
+        const std::size_t size = m_batch.back()->GetDataSize();
+        batchBytes += size;
+        zeroCopy |= m_zeroCopy && size >= m_zeroCopyThreshold;
+        numPackets += ( m_batch.back()->GetType() & MoreFragmentsFlag ) == 0;
+    }
+    m_numSent += numPackets;
+    m_sentSinceHeartBeat = true;
+
+    if ( m_numBlocked > 0 )
+    {
+        m_txSpace.notify_all();
+    }
+
+    return zeroCopy;
+}
 
-    Header is:
+/**
+    Used internally by the send thread to write the batch of packets in m_batch,
+    waiting for the transport whenever it is full.
+*/
+void PacketMuxer::SendBatch( bool zeroCopy )
+{
+    BeginBatch( zeroCopy );
+
+    WriteResult result = WritePending();
+    while ( result == WriteResult::WouldBlock )
+    {
+        // Transport buffers are full - wait rather than spin. Pending zero-copy
+        // completions must be reaped first as they also wake up the wait:
+        ReleaseZeroCopyPackets();
+        constexpr int writeTimeoutInMilliseconds = 100;
+        m_transport.ReadyForWriting( writeTimeoutInMilliseconds );
+        result = WritePending();
+    }
+
+    if ( result == WriteResult::Failed )
+    {
+        m_transportError = true;
+    }
+    EndBatch();
+}
+
+/**
+    Point the iovecs at the packets in m_batch ready for writing.
+
+    Each packet's header is:
     type (4-bytes)
     data-size (4-bytes)
 
-    followed by the data payload.
+    followed, once timestamped headers have been announced, by:
+    time posted (8-bytes, 0 if not known)
+    time sent (8-bytes)
+
+    and then the data payload.
+
+    @param zeroCopy If true the batch is written with the transport's zero-copy write.
 */
-void PacketMuxer::SendPacket( const ComPacket& packet )
+void PacketMuxer::BeginBatch( bool zeroCopy )
 {
-    assert( packet.GetType() != IdManager::InvalidPacket ); // Catch attempts to send invalid packets
+    const bool timestamps = m_timestampedHeaders || m_latencyTimestamps;
+    const std::uint64_t now = timestamps ? LatencyHistogram::Now() : 0;
 
-    // Write the type as an unsigned 32-bit integer in network byte order:
-    size_t writeCount = sizeof(uint32_t);
-    uint32_t type = htonl( static_cast<uint32_t>( packet.GetType() ) );
-    bool ok = WriteBytes( reinterpret_cast<const uint8_t*>(&type), writeCount );
+    // m_headers has capacity for every header so the iovecs can point into it as it is filled:
+    int count = 0;
+    for ( const ComPacket::SharedPacket& packet : m_batch )
+    {
+        assert( ( packet->GetType() & ~MoreFragmentsFlag ) != IdManager::InvalidPacket ); // Catch attempts to send invalid packets
+        const std::size_t headerStart = m_headers.size();
+        m_headers.push_back( htonl( static_cast<uint32_t>( packet->GetType() ) ) );
+        m_headers.push_back( htonl( packet->GetDataSize() ) );
 
-    // Write the data size:
-    uint32_t size = htonl( packet.GetDataSize() );
-    writeCount = sizeof(uint32_t);
-    ok &= WriteBytes( reinterpret_cast<const uint8_t*>(&size), writeCount );
+        if ( m_timestampedHeaders )
+        {
+            const std::uint64_t posted = packet->GetTimestamp();
+            m_headers.push_back( htonl( posted >> 32 ) );
+            m_headers.push_back( htonl( posted & 0xffffffff ) );
+            m_headers.push_back( htonl( now >> 32 ) );
+            m_headers.push_back( htonl( now & 0xffffffff ) );
+        }
+
+        if ( packet->GetTimestamp() != 0 )
+        {
+            m_latency[ packet->GetType() ].Record( now - packet->GetTimestamp() );
+        }
 
-    // Write the byte data:
-    writeCount = packet.GetDataSize();
-    ok &= WriteBytes( reinterpret_cast<const uint8_t*>( packet.GetDataPtr() ), writeCount );
+        m_iov[count].iov_base = &m_headers[headerStart];
+        m_iov[count].iov_len  = ( m_headers.size() - headerStart ) * sizeof(uint32_t);
+        count += 1;
+        m_iov[count].iov_base = const_cast<VectorStream::CharType*>( packet->GetDataPtr() );
+        m_iov[count].iov_len  = packet->GetDataSize();
+        count += 1;
 
-    m_transportError = !ok;
+        // Every packet after a Hello announcing timestamps must carry them (other
+        // control messages, e.g. Credit, have a payload where the features would be):
+        if ( packet->GetType() == IdManager::ControlPacket && packet->GetDataSize() > 1 &&
+             static_cast<ControlMessage>( packet->GetDataPtr()[0] ) == ControlMessage::Hello &&
+             ( packet->GetDataPtr()[1] & HelloFeatures::TimestampedHeaders ) )
+        {
+            m_timestampedHeaders = true;
+        }
+    }
+
+    m_pendingIov = m_iov.data();
+    m_pendingCount = count;
+    m_pendingZeroCopy = zeroCopy;
 }
 
 /**
-    Loop to guarantee the number of bytes requested are actually written.
+    Write the rest of the current batch until it is all written or the
+    transport would block. Partial writes are resumed from the point the
+    previous write stopped which means the iovecs are modified by this function.
+*/
+PacketMuxer::WriteResult PacketMuxer::WritePending()
+{
+    while ( m_pendingCount > 0 )
+    {
+        const int n = m_pendingZeroCopy ? m_transport.WriteVectorZeroCopy( m_pendingIov, m_pendingCount )
+                                        : m_transport.WriteVector( m_pendingIov, m_pendingCount );
+        if ( n < 0 || m_transportError )
+        {
+            return WriteResult::Failed;
+        }
+
+        if ( n == 0 )
+        {
+            return WriteResult::WouldBlock;
+        }
 
-    On error (return of false) size will contain the number of bytes that were remaining to be written.
+        // Skip the buffers that were completely written then adjust the partially written one:
+        std::size_t written = n;
+        while ( m_pendingCount > 0 && written >= m_pendingIov->iov_len )
+        {
+            written -= m_pendingIov->iov_len;
+            m_pendingIov += 1;
+            m_pendingCount -= 1;
+        }
 
-    @return true if all bytes were written, false if there was an error at any point.
+        if ( m_pendingCount > 0 )
+        {
+            m_pendingIov->iov_base = static_cast<uint8_t*>( m_pendingIov->iov_base ) + written;
+            m_pendingIov->iov_len -= written;
+        }
+    }
+
+    return WriteResult::Complete;
+}
+
+/**
+    Finish with the current batch (whether or not it was all written).
 */
-bool PacketMuxer::WriteBytes( const uint8_t* buffer, size_t& size )
+void PacketMuxer::EndBatch()
 {
-    while ( size > 0 )
+    m_pendingCount = 0;
+
+    if ( m_pendingZeroCopy )
     {
-        int n = m_transport.Write( reinterpret_cast<const VectorStream::CharType*>( buffer ), size );
-        if ( n < 0 || m_transportError )
+        // The transport may still be reading from the headers and packets so hang on to them:
+        m_zeroCopyPending.push_back( ZeroCopyBatch{ m_transport.ZeroCopyIssued(), std::move(m_batch), std::move(m_headers) } );
+        m_batch.reserve( MaxPacketsPerWrite );
+        m_headers.reserve( MaxHeaderWords*MaxPacketsPerWrite );
+    }
+
+    m_batch.clear();
+    m_headers.clear();
+}
+
+/**
+    Free the packets from all zero-copy batches that the transport has finished with.
+*/
+void PacketMuxer::ReleaseZeroCopyPackets()
+{
+    if ( m_zeroCopyPending.empty() )
+    {
+        return;
+    }
+
+    const uint32_t completed = m_transport.ReapZeroCopyCompletions();
+    while ( m_zeroCopyPending.empty() == false &&
+            static_cast<int32_t>( completed - m_zeroCopyPending.front().id ) >= 0 )
+    {
+        m_zeroCopyPending.pop_front();
+    }
+}
+
+/**
+    Queue a packet (waiting for space first if its queue is full and set to block).
+
+    Packets that can not block are pushed to the lock-free ingress queue (which
+    the send thread drains into the scheduler). If that is full the poster
+    takes the tx lock and drains it itself rather than wait: the only thread
+    that would drain it might be this one (e.g. an event loop posting from
+    inside a receive callback). Either way packets posted by one thread are
+    always sent in the order posted.
+*/
+void PacketMuxer::PostPacket( ComPacket::SharedPacket&& packet )
+{
+    const IdManager::PacketType type = packet->GetType();
+    const std::size_t size = packet->GetDataSize();
+    if ( m_latencyTimestamps )
+    {
+        packet->SetTimestamp( LatencyHistogram::Now() );
+    }
+
+    if ( m_scheduler.CanBlock( type ) == false )
+    {
+        if ( m_ingress.Emplace( std::move(packet) ) == false )
         {
-            return false;
+            std::lock_guard<std::recursive_mutex> guard( m_txLock );
+            DrainIngress();
+            m_scheduler.Push( std::move(packet) );
         }
+        SignalPacketPosted();
+        return;
+    }
 
-        size -= n;
-        buffer += n;
+    std::unique_lock<std::recursive_mutex> guard( m_txLock );
+    while ( m_transportError == false && m_scheduler.WouldBlock( type, size ) )
+    {
+        m_numBlocked += 1;
+        m_txSpace.wait( guard );
+        m_numBlocked -= 1;
     }
 
-    return true;
+    m_scheduler.Push( std::move(packet) );
+    SignalPacketPosted();
 }
 
 void PacketMuxer::SignalPacketPosted()
 {
     m_numPosted += 1;
-    m_txReady.notify_one();
+    m_txReady.Notify();
+    if ( m_packetPosted )
+    {
+        m_packetPosted();
+    }
 }
 
+/**
+    Control messages are only sent from the send thread (or whichever thread
+    drives the muxer), which must not post to the ingress queue as it is that
+    queue's consumer, so they go straight to the scheduler.
+*/
 void PacketMuxer::SendControlMessage( ControlMessage msg )
 {
-    EmplacePacket( IdManager::ControlString, reinterpret_cast<VectorStream::CharType*>(&msg), sizeof(std::underlying_type<ControlMessage>::type) );
+    const IdManager::PacketType type = m_packetIds.ToId( IdManager::ControlString );
+    auto packet = ComPacket::MakeShared( type, reinterpret_cast<VectorStream::CharType*>(&msg), sizeof(std::underlying_type<ControlMessage>::type) );
+
+    std::lock_guard<std::recursive_mutex> guard( m_txLock );
+    m_scheduler.Push( std::move(packet) );
+    SignalPacketPosted();
+}
+
+/**
+    Send a control message followed by a byte of feature flags (see HelloFeatures).
+*/
+void PacketMuxer::SendControlMessage( ControlMessage msg, std::uint8_t features )
+{
+    const IdManager::PacketType type = m_packetIds.ToId( IdManager::ControlString );
+    const std::uint8_t bytes[2] = { static_cast<std::underlying_type<ControlMessage>::type>( msg ), features };
+    auto packet = ComPacket::MakeShared( type, reinterpret_cast<const VectorStream::CharType*>(bytes), sizeof(bytes) );
+
+    std::lock_guard<std::recursive_mutex> guard( m_txLock );
+    m_scheduler.Push( std::move(packet) );
+    SignalPacketPosted();
 }
@@ -9,19 +9,25 @@
 #include <iostream>
 #include <cstdint>
 #include <queue>
-#include <unordered_map>
 #include <functional>
 #include <memory>
+#include <vector>
+#include <deque>
 
 #include "IdManager.h"
 #include "ComPacket.h"
+#include "PacketScheduler.h"
+#include "LockFreeQueue.h"
+#include "WaitEvent.h"
 #include "PacketSubscription.h"
 #include "ControlMessage.h"
+#include "LatencyHistogram.h"
 #include "../network/AbstractSocket.h"
 
 #include "../io/VectorStream.h"
 
 #include <mutex>
+#include <atomic>
 #include <chrono>
 #include <condition_variable>
 #include <thread>
@@ -39,38 +45,102 @@
 
     The muxer receives packets posted to it from any number of threads
     as messages and then sends the packets over the transport layer.
+    The order in which queued packets of different types are sent is
+    decided by a PacketScheduler configured by the TxConfig passed to
+    the constructor (e.g. so that tele-op packets never wait behind
+    a backlog of video data).
+
+    Packets of types that can never block the poster are handed to the
+    send thread through a lock-free queue, so posting them never contends
+    with other threads for the tx lock.
+
+    Normally the muxer writes from its own send thread. Alternatively
+    it can be driven by an event loop (see PacketConnection), in which
+    case Flush() writes as much as the transport accepts without blocking
+    and is called again once the transport is writable.
+
+    Large payloads can be split into fragments (see EnableFragmentation())
+    so that a big packet, e.g. a video keyframe, does not hold up higher
+    priority packets posted while it is being written.
 
     The data itself is currently sent as byte stream over TCP.
 */
 class PacketMuxer
 {
     friend void TestPacketMuxer();
+    friend void TestPacketMuxerPartialWrites();
+    friend void TestPacketFragmentation();
+    friend void TestPacketDemuxerStream();
 
 public:
     typedef std::shared_ptr<PacketSubscriber> Subscription;
 
-    PacketMuxer( AbstractWriter& socket, const std::vector<std::string>& packetIds );
+    PacketMuxer( AbstractWriter& socket, const std::vector<std::string>& packetIds, const TxConfig& txConfig = TxConfig() );
+    PacketMuxer( AbstractWriter& socket, const std::vector<std::string>& packetIds, const TxConfig& txConfig, std::function<void()> packetPosted );
     virtual ~PacketMuxer();
 
     bool Ok() const;
+    void Shutdown();
+
+    bool Flush();
+    void SendHeartBeatIfIdle();
+
+    bool EnableZeroCopy( std::size_t minPayloadBytes );
+    void EnableFragmentation( std::size_t fragmentBytes );
+
+    std::uint64_t GetNumDropped( const std::string& name );
+
+    void EnableLatencyTimestamps();
+    LatencySummary GetLatency( const std::string& name ) const;
+
+    void SendCredits( IdManager::PacketType type, std::uint32_t credits );
+    void AddCredits( IdManager::PacketType type, std::uint32_t credits );
+    std::uint64_t GetCredits( const std::string& name );
 
     template <typename ...Args>
     void EmplacePacket(const std::string& name, Args&&... args);
 
+    template <typename ...Args>
+    void EmplacePacket(IdManager::PacketType type, Args&&... args);
+
+    const IdManager& GetIdManager() const { return m_packetIds; }
+
 protected:
-    typedef std::pair< IdManager::PacketType, ComPacket::PacketContainer > MapEntry;
     typedef std::pair< IdManager::PacketType, std::vector<Subscription> > SubscriptionEntry;
 
+    /// Upper limit on the number of packets gathered into a single write (two buffers per packet):
+    static constexpr std::size_t MaxPacketsPerWrite = 32;
+
+    /// No more packets are added to a write once it holds this many bytes (so that
+    /// higher priority packets posted meanwhile are not held up by a huge write).
+    /// Writes are limited to the fragment size instead if that is smaller:
+    static constexpr std::size_t MaxBytesPerWrite = 64*1024;
+
+    /// Largest packet header in 32-bit words (type and size, plus the timestamps if they are sent):
+    static constexpr std::size_t MaxHeaderWords = 6;
+
+    /// Capacity of the lock-free queue of posted packets waiting to be scheduled:
+    static constexpr std::size_t IngressCapacity = 1024;
+
+    enum class WriteResult { Complete, WouldBlock, Failed };
+
     void SendLoop();
-    void SendAll( ComPacket::PacketContainer& packets );
-    void SendPacket( const ComPacket& packet );
+    void ReserveBatchBuffers();
+    void DrainIngress();
+    void SendAll( std::unique_lock<std::recursive_mutex>& txGuard );
+    bool GatherBatch();
+    void SendBatch( bool zeroCopy );
 
-    bool WriteBytes( const uint8_t* buffer, size_t& size );
+    void BeginBatch( bool zeroCopy );
+    WriteResult WritePending();
+    void EndBatch();
+    void ReleaseZeroCopyPackets();
 
     uint32_t GetNumPosted() const { return m_numPosted; };
     uint32_t GetNumSent() const { return m_numSent; };
 
 private:
+    void PostPacket( ComPacket::SharedPacket&& packet );
     void SignalPacketPosted();
 
     IdManager m_packetIds;
@@ -78,32 +148,81 @@ private:
     // Need a recursive mutex so that we can emplace control packets
     // to the queue internally while we already hold the tx lock:
     std::recursive_mutex m_txLock;
-    std::condition_variable_any m_txReady;
-    uint32_t m_numPosted;
-    uint32_t m_numSent;
-
-    std::unordered_map< MapEntry::first_type, MapEntry::second_type > m_txQueues;
+    WaitEvent m_txReady;
+    std::condition_variable_any m_txSpace;
+    std::atomic<uint32_t> m_numPosted;
+    std::atomic<uint32_t> m_numSent;
+    uint32_t m_numBlocked;
+
+    PacketScheduler m_scheduler;
+    MpscQueue<ComPacket::SharedPacket> m_ingress;
+
+    // Packets (and their headers) currently being gathered into a single write:
+    std::vector<ComPacket::SharedPacket> m_batch;
+    std::vector<uint32_t> m_headers;
+    std::vector<struct iovec> m_iov;
+
+    // The part of the batch not yet written (partial writes are resumed from here):
+    struct iovec* m_pendingIov;
+    int m_pendingCount;
+    bool m_pendingZeroCopy;
+    bool m_sentSinceHeartBeat;
+
+    // Latency instrumentation: posted packets are timestamped once enabled and the
+    // headers carry the timestamps once the Hello announcing them has been written:
+    std::atomic<bool> m_latencyTimestamps;
+    bool m_timestampedHeaders;
+    std::unique_ptr<LatencyHistogram[]> m_latency; // Indexed by packet type.
+
+    // Zero-copy writes reference the packet memory until the transport reports
+    // completion so the batches are kept alive here until then:
+    struct ZeroCopyBatch
+    {
+        uint32_t id;
+        std::vector<ComPacket::SharedPacket> packets;
+        std::vector<uint32_t> headers;
+    };
+    bool m_zeroCopy;
+    std::size_t m_zeroCopyThreshold;
+    std::deque<ZeroCopyBatch> m_zeroCopyPending;
 
     AbstractWriter& m_transport;
-    bool m_transportError;
+    std::atomic<bool> m_transportError;
 
-    // Async function should be initialised last - it requires everything else to
-    // be setup before it can run:
+    // Set when an event loop drives this muxer instead of the send thread:
+    std::function<void()> m_packetPosted;
+
+    // Send thread is started last (in the constructor body) - it requires everything
+    // else to be setup before it can run:
     std::thread m_sendThread;
 
     void SendControlMessage( ControlMessage msg );
+    void SendControlMessage( ControlMessage msg, std::uint8_t features );
 };
 
 /**
+    Construct a packet from args and queue it for sending.
+
+    If the queue for this packet type is bounded then this may block,
+    or cause packets to be dropped, depending on its OverflowPolicy.
+
     @note Uses perfect forwarding: g++-4.8 and later only.
 */
 template <typename ...Args>
 void PacketMuxer::EmplacePacket(const std::string& name, Args&&... args)
 {
-    const IdManager::PacketType type = m_packetIds.ToId(name);
-    std::lock_guard<std::recursive_mutex> guard( m_txLock );
-    m_txQueues[ type ].emplace( std::make_shared<ComPacket>(type, std::forward<Args>(args)...) );
-    SignalPacketPosted();
+    EmplacePacket( m_packetIds.ToId(name), std::forward<Args>(args)... );
+}
+
+/**
+    As above but for a type id that has already been looked up (e.g. by
+    a Channel) so that no string lookup is needed.
+*/
+template <typename ...Args>
+void PacketMuxer::EmplacePacket(IdManager::PacketType type, Args&&... args)
+{
+    assert( type > IdManager::ControlPacket && type < m_packetIds.Size() );
+    PostPacket( ComPacket::MakeShared(type, std::forward<Args>(args)...) );
 }
 
 #endif /* _PACKET_MUXER_H_ */
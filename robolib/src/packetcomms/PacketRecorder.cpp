@@ -0,0 +1,186 @@
+#include "PacketRecorder.h"
+#include "LatencyHistogram.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+using namespace PacketLogFormat;
+
+constexpr std::size_t PacketRecorder::DefaultQueueCapacity;
+
+/**
+    Create (or truncate) the log file and start recording.
+
+    @param queueCapacity Number of packets that can be waiting to be
+    written before packets start to be dropped.
+*/
+PacketRecorder::PacketRecorder( PacketDemuxer& demuxer, const std::string& fileName, std::size_t queueCapacity )
+:
+    m_file          ( std::fopen( fileName.c_str(), "wb" ) ),
+    m_queue         ( queueCapacity ),
+    m_offset        ( 0 ),
+    m_index         ( demuxer.GetIdManager().Size() ),
+    m_stop          ( false ),
+    m_writeError    ( m_file == nullptr ),
+    m_numRecorded   ( 0 ),
+    m_numDropped    ( 0 )
+{
+    if ( m_file == nullptr )
+    {
+        std::clog << "PacketRecorder: could not create '" << fileName << "' - " << strerror(errno) << std::endl;
+        return;
+    }
+
+    constexpr std::size_t fileBufferBytes = 1024*1024;
+    std::setvbuf( m_file, nullptr, _IOFBF, fileBufferBytes );
+    WriteHeader( demuxer.GetIdManager() );
+
+    m_writeThread = std::thread( &PacketRecorder::WriteLoop, this );
+
+    const IdManager& packetIds = demuxer.GetIdManager();
+    for ( IdManager::PacketType type = IdManager::ControlPacket + 1; type < packetIds.Size(); ++type )
+    {
+        m_subscriptions.push_back( demuxer.Subscribe( packetIds.ToString( type ), [this]( const ComPacket::ConstSharedPacket& packet ) {
+            if ( m_queue.Emplace( Entry{ LatencyHistogram::Now(), packet } ) == false )
+            {
+                m_numDropped += 1;
+            }
+        }));
+    }
+}
+
+PacketRecorder::~PacketRecorder()
+{
+    Close();
+}
+
+/**
+    @return false if the log could not be created or a write has failed.
+*/
+bool PacketRecorder::Ok() const
+{
+    return m_writeError == false;
+}
+
+/**
+    Stop recording: every packet received up to now is written, followed
+    by the index. Called automatically on destruction.
+*/
+void PacketRecorder::Close()
+{
+    m_subscriptions.clear();
+
+    m_stop = true;
+    if ( m_writeThread.joinable() )
+    {
+        m_writeThread.join();
+    }
+
+    if ( m_file != nullptr )
+    {
+        WriteIndex();
+        if ( std::fclose( m_file ) != 0 )
+        {
+            m_writeError = true;
+        }
+        m_file = nullptr;
+    }
+}
+
+void PacketRecorder::WriteLoop()
+{
+    while ( true )
+    {
+        // Check for stop before draining so nothing queued before Close() is missed:
+        const bool stop = m_stop;
+
+        Entry entry;
+        while ( m_queue.TryPop( entry ) )
+        {
+            WriteRecord( entry );
+            entry.packet.reset();
+        }
+
+        if ( stop )
+        {
+            break;
+        }
+        m_queue.WaitNotEmpty( std::chrono::milliseconds(100) );
+    }
+}
+
+/**
+    The file header is followed by the names of the packet types (excluding
+    the invalid and control types) so ids can be matched up on replay.
+*/
+void PacketRecorder::WriteHeader( const IdManager& packetIds )
+{
+    FileHeader header;
+    std::memcpy( header.magic, FileMagic, sizeof(FileMagic) );
+    header.version = Version;
+    header.numTypes = packetIds.Size() - ( IdManager::ControlPacket + 1 );
+    Write( &header, sizeof(header) );
+
+    for ( IdManager::PacketType type = IdManager::ControlPacket + 1; type < packetIds.Size(); ++type )
+    {
+        const std::string& name = packetIds.ToString( type );
+        const std::uint32_t length = name.size();
+        Write( &length, sizeof(length) );
+        Write( name.data(), length );
+    }
+    Pad();
+}
+
+void PacketRecorder::WriteRecord( const Entry& entry )
+{
+    const ComPacket& packet = *entry.packet;
+    m_index[ packet.GetType() ].push_back( m_offset );
+
+    RecordHeader header;
+    header.timestamp = entry.timestamp;
+    header.type = packet.GetType();
+    header.size = packet.GetDataSize();
+    Write( &header, sizeof(header) );
+    Write( packet.GetDataPtr(), packet.GetDataSize() );
+    Pad();
+    m_numRecorded += 1;
+}
+
+/**
+    Append the record offsets of each type in turn, then the trailer that
+    says where they start.
+*/
+void PacketRecorder::WriteIndex()
+{
+    Trailer trailer;
+    trailer.indexOffset = m_offset;
+    std::memcpy( trailer.magic, IndexMagic, sizeof(IndexMagic) );
+
+    for ( const std::vector<std::uint64_t>& offsets : m_index )
+    {
+        const std::uint64_t count = offsets.size();
+        Write( &count, sizeof(count) );
+        Write( offsets.data(), count * sizeof(std::uint64_t) );
+    }
+
+    Write( &trailer, sizeof(trailer) );
+}
+
+void PacketRecorder::Write( const void* data, std::size_t size )
+{
+    if ( std::fwrite( data, 1, size, m_file ) != size )
+    {
+        m_writeError = true;
+    }
+    m_offset += size;
+}
+
+/**
+    Pad the file so that the next write starts aligned.
+*/
+void PacketRecorder::Pad()
+{
+    static const char padding[Alignment] = {};
+    Write( padding, Align( m_offset ) - m_offset );
+}
@@ -0,0 +1,74 @@
+#ifndef PACKETRECORDER_H
+#define PACKETRECORDER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ComPacket.h"
+#include "LockFreeQueue.h"
+#include "PacketDemuxer.h"
+#include "PacketLog.h"
+
+/**
+    Records every packet a PacketDemuxer receives to a packet log (see
+    PacketLog for the format) so that the traffic can be replayed later
+    with a PacketReplayer.
+
+    The recorder subscribes to every packet type. Its callbacks only
+    timestamp the packet and queue it (sharing the packet, not copying
+    it) so the demuxer's receive thread never waits for the disk: the
+    file is written by the recorder's own thread. If the disk can not
+    keep up the queue fills and further packets are dropped (and counted)
+    rather than holding up the demuxer.
+
+    The index is written when the recorder is closed or destroyed.
+*/
+class PacketRecorder
+{
+public:
+    static constexpr std::size_t DefaultQueueCapacity = 4096;
+
+    PacketRecorder( PacketDemuxer& demuxer, const std::string& fileName, std::size_t queueCapacity = DefaultQueueCapacity );
+    virtual ~PacketRecorder();
+
+    bool Ok() const;
+    void Close();
+
+    std::uint64_t GetNumRecorded() const { return m_numRecorded; }
+    std::uint64_t GetNumDropped() const { return m_numDropped; }
+
+protected:
+    struct Entry
+    {
+        std::uint64_t timestamp;
+        ComPacket::ConstSharedPacket packet;
+    };
+
+    void WriteLoop();
+    void WriteHeader( const IdManager& packetIds );
+    void WriteRecord( const Entry& entry );
+    void WriteIndex();
+    void Write( const void* data, std::size_t size );
+    void Pad();
+
+private:
+    std::FILE* m_file;
+    MpscQueue<Entry> m_queue;
+    std::vector<PacketSubscription> m_subscriptions;
+
+    // Only used by the write thread once it has started:
+    std::uint64_t m_offset;
+    std::vector< std::vector<std::uint64_t> > m_index; // Record offsets by packet type.
+
+    std::atomic<bool> m_stop;
+    std::atomic<bool> m_writeError;
+    std::atomic<std::uint64_t> m_numRecorded;
+    std::atomic<std::uint64_t> m_numDropped;
+    std::thread m_writeThread;
+};
+
+#endif // PACKETRECORDER_H
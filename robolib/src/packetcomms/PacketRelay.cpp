@@ -0,0 +1,160 @@
+#include "PacketRelay.h"
+
+#include <iostream>
+#include <stdexcept>
+
+constexpr std::size_t PacketRelay::DefaultClientQueuePackets;
+
+/**
+    Start relaying: packets of the relayed types are forwarded to the
+    clients from the upstream demuxer's receive thread (or event loop).
+    The clients use the same packet ids as the upstream demuxer.
+
+    @param clientConfig Transmit settings for the clients' connections.
+    Relayed types it does not mention get a queue of DefaultClientQueuePackets
+    that drops the oldest packet when full.
+
+    @throw std::invalid_argument if a relayed type's client queue is bounded
+    with the Block overflow policy (a slow client would hold up the relay).
+*/
+PacketRelay::PacketRelay( PacketDemuxer& upstream, const std::vector<std::string>& relayedTypes, const TxConfig& clientConfig )
+:
+    m_packetIds     ( upstream.GetIdManager() ),
+    m_clientConfig  ( clientConfig ),
+    m_latched       ( m_packetIds.Size() ),
+    m_isLatched     ( m_packetIds.Size(), false ),
+    m_numRelayed    ( 0 )
+{
+    for ( IdManager::PacketType type = IdManager::ControlPacket + 1; type < m_packetIds.Size(); ++type )
+    {
+        m_packetNames.push_back( m_packetIds.ToString( type ) );
+    }
+
+    for ( const std::string& type : relayedTypes )
+    {
+        if ( m_clientConfig.find( type ) == m_clientConfig.end() )
+        {
+            m_clientConfig[type].maxPackets = DefaultClientQueuePackets;
+            m_clientConfig[type].overflow = OverflowPolicy::DropOldest;
+        }
+
+        const TxQueueConfig& config = m_clientConfig[type];
+        if ( config.overflow == OverflowPolicy::Block && ( config.maxPackets > 0 || config.maxBytes > 0 ) )
+        {
+            throw std::invalid_argument( "PacketRelay: client queue for '" + type + "' must not block" );
+        }
+    }
+
+    for ( const std::string& type : relayedTypes )
+    {
+        m_subscriptions.push_back( upstream.Subscribe( type, [this]( const ComPacket::ConstSharedPacket& packet ) {
+            Forward( packet );
+        }));
+    }
+}
+
+PacketRelay::~PacketRelay()
+{
+    m_subscriptions.clear();
+}
+
+/**
+    Keep the most recent packet of a (relayed) type for clients that join later.
+*/
+void PacketRelay::Latch( const std::string& type )
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    m_isLatched[ m_packetIds.ToId( type ) ] = true;
+}
+
+/**
+    Start relaying to a connected client, serviced by the specified loop.
+    The latched packets are queued for it first.
+*/
+void PacketRelay::AddClient( std::unique_ptr<Socket> socket, EventLoop& loop )
+{
+    std::unique_ptr<PacketConnection> client( new PacketConnection( std::move(socket), loop, m_packetNames, m_clientConfig ) );
+
+    std::lock_guard<std::mutex> guard( m_lock );
+    for ( const ComPacket::ConstSharedPacket& packet : m_latched )
+    {
+        if ( packet != nullptr )
+        {
+            Send( *client, *packet );
+        }
+    }
+    m_clients.push_back( std::move(client) );
+    std::clog << "PacketRelay: client " << m_clients.size() << " connected." << std::endl;
+}
+
+/**
+    @return The number of clients (including any that have disconnected
+    since the last packet was relayed).
+*/
+std::size_t PacketRelay::GetNumClients()
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    return m_clients.size();
+}
+
+/**
+    @return The number of packets of the named type the current clients have
+    dropped because they were not keeping up.
+*/
+std::uint64_t PacketRelay::GetNumDropped( const std::string& type )
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    std::uint64_t dropped = 0;
+    for ( const std::unique_ptr<PacketConnection>& client : m_clients )
+    {
+        dropped += client->GetMuxer().GetNumDropped( type );
+    }
+    return dropped;
+}
+
+/**
+    Queue a packet received from upstream for every client. Clients whose
+    connection has closed are removed (and destroyed once the lock is released).
+*/
+void PacketRelay::Forward( const ComPacket::ConstSharedPacket& packet )
+{
+    std::vector< std::unique_ptr<PacketConnection> > closed;
+    {
+        std::lock_guard<std::mutex> guard( m_lock );
+        if ( m_isLatched[ packet->GetType() ] )
+        {
+            // Copied so that a long lived packet does not pin the upstream demuxer's receive buffer:
+            m_latched[ packet->GetType() ] = ComPacket::MakeShared( packet->GetType(), packet->GetDataPtr(), packet->GetDataSize() );
+        }
+
+        auto itr = m_clients.begin();
+        while ( itr != m_clients.end() )
+        {
+            if ( (*itr)->Ok() )
+            {
+                Send( **itr, *packet );
+                ++itr;
+            }
+            else
+            {
+                closed.push_back( std::move(*itr) );
+                itr = m_clients.erase( itr );
+            }
+        }
+    }
+
+    m_numRelayed += 1;
+    if ( closed.empty() == false )
+    {
+        std::clog << "PacketRelay: " << closed.size() << " client(s) disconnected." << std::endl;
+    }
+}
+
+/**
+    Post a packet that shares the payload memory of the packet being relayed.
+*/
+void PacketRelay::Send( PacketConnection& client, const ComPacket& packet )
+{
+    const std::size_t offset = packet.GetDataPtr() - packet.GetBuffer().Data();
+    client.GetMuxer().EmplacePacket( packet.GetType(), packet.GetBuffer(), offset, packet.GetDataSize() );
+}
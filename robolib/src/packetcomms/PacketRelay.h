@@ -0,0 +1,72 @@
+#ifndef PACKETRELAY_H
+#define PACKETRELAY_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ComPacket.h"
+#include "PacketDemuxer.h"
+#include "PacketConnection.h"
+#include "../network/Socket.h"
+#include "../network/EventLoop.h"
+
+/**
+    Forwards selected packet types received from one upstream connection
+    (e.g. the robot) to any number of downstream clients, so that extra
+    viewers cost the relay's bandwidth rather than the robot's uplink.
+
+    Payloads are not copied: each client is sent a packet that shares the
+    memory of the packet received from upstream (only the small packet
+    object is per client) and the memory is freed once the last client
+    has sent it.
+
+    Every client has its own PacketConnection and so its own transmit
+    queues, configured by the client TxConfig. Queues for relayed types
+    must not block: a client that can not keep up has packets dropped from
+    its own queues according to their overflow policy while the upstream
+    demuxer, and every other client, carry on. Clients that disconnect are
+    removed when the next packet is relayed.
+
+    The most recent packet of a latched type (see Latch()) is kept and sent
+    to each new client before anything else, e.g. for a type that updates
+    rarely so a new client does not have to wait for the next update.
+*/
+class PacketRelay
+{
+public:
+    /// Queue length used for relayed types that the client TxConfig does not mention:
+    static constexpr std::size_t DefaultClientQueuePackets = 64;
+
+    PacketRelay( PacketDemuxer& upstream, const std::vector<std::string>& relayedTypes, const TxConfig& clientConfig = TxConfig() );
+    virtual ~PacketRelay();
+
+    void Latch( const std::string& type );
+    void AddClient( std::unique_ptr<Socket> socket, EventLoop& loop );
+
+    std::size_t GetNumClients();
+    std::uint64_t GetNumRelayed() const { return m_numRelayed; }
+    std::uint64_t GetNumDropped( const std::string& type );
+
+protected:
+    void Forward( const ComPacket::ConstSharedPacket& packet );
+    static void Send( PacketConnection& client, const ComPacket& packet );
+
+private:
+    const IdManager& m_packetIds;
+    std::vector<std::string> m_packetNames;
+    TxConfig m_clientConfig;
+
+    std::mutex m_lock;
+    std::vector< std::unique_ptr<PacketConnection> > m_clients;
+    std::vector<ComPacket::ConstSharedPacket> m_latched; // Indexed by packet type (null if not latched or none received yet).
+    std::vector<bool> m_isLatched;
+
+    std::atomic<std::uint64_t> m_numRelayed;
+    std::vector<PacketSubscription> m_subscriptions;
+};
+
+#endif // PACKETRELAY_H
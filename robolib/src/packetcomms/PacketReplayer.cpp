@@ -0,0 +1,202 @@
+#include "PacketReplayer.h"
+#include "PacketMuxer.h"
+#include "ControlMessage.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+#include <arpa/inet.h>
+
+constexpr double PacketReplayer::RealTime;
+constexpr double PacketReplayer::AsFastAsPossible;
+
+/**
+    @param packetIds The packet ids of the demuxer or muxer the log is replayed to.
+    @param speed How many times faster than real time to replay (AsFastAsPossible for no pacing).
+*/
+PacketReplayer::PacketReplayer( const PacketLog& log, const std::vector<std::string>& packetIds, double speed )
+:
+    m_log           ( log ),
+    m_speed         ( speed ),
+    m_typeMap       ( log.GetIdManager().Size(), IdManager::InvalidPacket ),
+    m_offset        ( log.Begin() ),
+    m_haveNext      ( false ),
+    m_started       ( false ),
+    m_firstTimestamp( 0 ),
+    m_numReplayed   ( 0 ),
+    m_payload       ( nullptr ),
+    m_payloadSize   ( 0 ),
+    m_readOffset    ( 0 )
+{
+    const IdManager replayIds( packetIds );
+    for ( IdManager::PacketType type = IdManager::ControlPacket + 1; type < m_typeMap.size(); ++type )
+    {
+        const std::string& name = log.GetIdManager().ToString( type );
+        if ( std::find( packetIds.begin(), packetIds.end(), name ) != packetIds.end() )
+        {
+            m_typeMap[type] = replayIds.ToId( name );
+        }
+    }
+
+    // A demuxer reading from the replayer expects the muxer's Hello first:
+    const uint32_t header[2] = { htonl( IdManager::ControlPacket ), htonl( 1 ) };
+    const char* headerBytes = reinterpret_cast<const char*>( header );
+    m_header.assign( headerBytes, headerBytes + sizeof(header) );
+    m_header.push_back( static_cast<char>( ControlMessage::Hello ) );
+}
+
+PacketReplayer::~PacketReplayer()
+{
+}
+
+/**
+    Wait until the next packet is due and return it.
+
+    @return false at the end of the log.
+*/
+bool PacketReplayer::NextPacket( PacketLogRecord& record )
+{
+    if ( FindNext() == false )
+    {
+        return false;
+    }
+
+    std::this_thread::sleep_until( DueTime( m_next ) );
+    record = m_next;
+    m_haveNext = false;
+    m_numReplayed += 1;
+    return true;
+}
+
+/**
+    Post every packet in the log to a muxer, paced as they were recorded.
+    Returns at the end of the log. The muxer must have been created with
+    the packet ids passed to the replayer.
+*/
+void PacketReplayer::ReplayTo( PacketMuxer& muxer )
+{
+    PacketLogRecord record;
+    while ( muxer.Ok() && NextPacket( record ) )
+    {
+        muxer.EmplacePacket( m_typeMap[record.type], record.data, record.size );
+    }
+}
+
+/**
+    @return true once the whole log has been replayed.
+*/
+bool PacketReplayer::Finished() const
+{
+    return m_readOffset == m_header.size() + m_payloadSize && FindNext() == false;
+}
+
+/**
+    Hand the packets to a demuxer in the muxer's wire format. Never blocks:
+    nothing is read until the next packet is due.
+
+    @return Number of bytes read, 0 if the next packet is not due yet or
+    -1 at the end of the log (which ends the demuxer's reading).
+*/
+int PacketReplayer::Read( char* data, std::size_t maxBytes )
+{
+    if ( m_readOffset == m_header.size() + m_payloadSize )
+    {
+        if ( FindNext() == false )
+        {
+            return -1;
+        }
+
+        if ( Clock::now() < DueTime( m_next ) )
+        {
+            return 0;
+        }
+
+        const uint32_t header[2] = { htonl( m_typeMap[m_next.type] ), htonl( m_next.size ) };
+        const char* headerBytes = reinterpret_cast<const char*>( header );
+        m_header.assign( headerBytes, headerBytes + sizeof(header) );
+        m_payload = m_next.data;
+        m_payloadSize = m_next.size;
+        m_readOffset = 0;
+        m_haveNext = false;
+        m_numReplayed += 1;
+    }
+
+    std::size_t n = 0;
+    if ( m_readOffset < m_header.size() )
+    {
+        n = std::min( maxBytes, m_header.size() - m_readOffset );
+        std::memcpy( data, m_header.data() + m_readOffset, n );
+    }
+
+    if ( m_readOffset + n >= m_header.size() && m_payloadSize > 0 )
+    {
+        const std::size_t payloadOffset = m_readOffset + n - m_header.size();
+        const std::size_t m = std::min( maxBytes - n, m_payloadSize - payloadOffset );
+        std::memcpy( data + n, m_payload + payloadOffset, m );
+        n += m;
+    }
+
+    m_readOffset += n;
+    return n;
+}
+
+/**
+    Sleep until the next packet is due (or the timeout expires).
+*/
+bool PacketReplayer::ReadyForReading( int milliseconds ) const
+{
+    if ( m_readOffset < m_header.size() + m_payloadSize || FindNext() == false )
+    {
+        return true;
+    }
+
+    const Clock::time_point due = DueTime( m_next );
+    if ( milliseconds >= 0 )
+    {
+        std::this_thread::sleep_until( std::min( due, Clock::now() + std::chrono::milliseconds( milliseconds ) ) );
+    }
+    else
+    {
+        std::this_thread::sleep_until( due );
+    }
+    return Clock::now() >= due;
+}
+
+/**
+    Find the next record of a type being replayed. Pacing starts from
+    the moment the first record is found.
+
+    @return false if there are no more records.
+*/
+bool PacketReplayer::FindNext() const
+{
+    while ( m_haveNext == false )
+    {
+        if ( m_log.ReadRecord( m_offset, m_next ) == false )
+        {
+            return false;
+        }
+        m_haveNext = m_typeMap[ m_next.type ] != IdManager::InvalidPacket;
+    }
+
+    if ( m_started == false )
+    {
+        m_started = true;
+        m_firstTimestamp = m_next.timestamp;
+        m_startTime = Clock::now();
+    }
+
+    return true;
+}
+
+PacketReplayer::Clock::time_point PacketReplayer::DueTime( const PacketLogRecord& record ) const
+{
+    if ( m_speed <= AsFastAsPossible || record.timestamp <= m_firstTimestamp )
+    {
+        return m_startTime;
+    }
+
+    const double elapsed = ( record.timestamp - m_firstTimestamp ) / m_speed;
+    return m_startTime + std::chrono::duration_cast<Clock::duration>( std::chrono::duration<double, std::nano>( elapsed ) );
+}
@@ -0,0 +1,80 @@
+#ifndef PACKETREPLAYER_H
+#define PACKETREPLAYER_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "PacketLog.h"
+#include "../network/AbstractSocket.h"
+
+class PacketMuxer;
+
+/**
+    Plays back a packet log, pacing the packets by the times they were
+    recorded: in real time, N times faster (or slower) than real time, or
+    as fast as possible.
+
+    The replayer is a transport that a PacketDemuxer can read from, so a
+    demuxer (and all its subscribers) can be fed the recorded traffic
+    exactly as if it were arriving from the network:
+
+        PacketReplayer replayer( *log, packetIds );
+        PacketDemuxer demuxer( replayer, packetIds );
+        ... subscribe ...
+        // demuxer.Ok() becomes false at the end of the log.
+
+    Alternatively ReplayTo() re-sends the packets through a PacketMuxer.
+
+    Packets are matched up by type name: recorded types that the
+    replay's packet ids do not include are skipped.
+*/
+class PacketReplayer : public AbstractReader
+{
+public:
+    static constexpr double RealTime = 1.0;
+    static constexpr double AsFastAsPossible = 0.0;
+
+    PacketReplayer( const PacketLog& log, const std::vector<std::string>& packetIds, double speed = RealTime );
+    virtual ~PacketReplayer();
+
+    bool NextPacket( PacketLogRecord& record );
+    void ReplayTo( PacketMuxer& muxer );
+
+    std::uint64_t GetNumReplayed() const { return m_numReplayed; }
+    bool Finished() const;
+
+    void SetBlocking( bool ) {}
+    int  Read( char* data, std::size_t maxBytes );
+    bool ReadyForReading( int milliseconds ) const;
+
+protected:
+    typedef std::chrono::steady_clock Clock;
+
+    bool FindNext() const;
+    Clock::time_point DueTime( const PacketLogRecord& record ) const;
+
+private:
+    const PacketLog& m_log;
+    const double m_speed;
+    std::vector<IdManager::PacketType> m_typeMap; // Replay id by the id in the log (InvalidPacket to skip).
+
+    // The next record to replay and the start of the pacing (found lazily, hence mutable):
+    mutable std::uint64_t m_offset;
+    mutable bool m_haveNext;
+    mutable PacketLogRecord m_next;
+    mutable bool m_started;
+    mutable std::uint64_t m_firstTimestamp;
+    mutable Clock::time_point m_startTime;
+
+    std::uint64_t m_numReplayed;
+
+    // Bytes of the packet being read by a demuxer (the Hello is sent first):
+    std::vector<char> m_header;
+    const char* m_payload;
+    std::size_t m_payloadSize;
+    std::size_t m_readOffset;
+};
+
+#endif // PACKETREPLAYER_H
@@ -0,0 +1,294 @@
+#include "PacketScheduler.h"
+#include "ControlMessage.h"
+
+#include <stdexcept>
+
+#include <assert.h>
+
+constexpr std::uint32_t PacketScheduler::QuantumBytes;
+
+/**
+    @param packetIds The packet types that will be scheduled.
+    @param config Settings for any packet types that should not use the
+    defaults (Normal priority, unit weight). Control packets are always
+    scheduled in the Realtime class.
+*/
+PacketScheduler::PacketScheduler( const IdManager& packetIds, const TxConfig& config )
+:
+    m_queues ( packetIds.Size() ),
+    m_queued ( 0 ),
+    m_fragmentBytes( 0 )
+{
+    for ( const TxConfig::value_type& entry : config )
+    {
+        TxQueue& queue = m_queues.at( packetIds.ToId( entry.first ) );
+        queue.config = entry.second;
+        if ( queue.config.weight == 0 || queue.config.priority >= TxQueueConfig::NumPriorities )
+        {
+            throw std::invalid_argument( "Invalid TxQueueConfig for packet type '" + entry.first + "'" );
+        }
+    }
+
+    m_queues[IdManager::ControlPacket].config.priority = TxQueueConfig::Realtime;
+}
+
+/**
+    @return true if the queue for this type is bounded and set to block, i.e.
+    if WouldBlock() can ever return true for it. This depends only on the
+    configuration so it is safe to call without synchronisation.
+*/
+bool PacketScheduler::CanBlock( IdManager::PacketType type ) const
+{
+    const TxQueueConfig& config = m_queues[type].config;
+    return config.overflow == OverflowPolicy::Block && ( config.maxPackets > 0 || config.maxBytes > 0 );
+}
+
+/**
+    @return true if the queue for this type is full, and set to block, so
+    that a new packet of the specified size must wait before it can be pushed.
+*/
+bool PacketScheduler::WouldBlock( IdManager::PacketType type, std::size_t size ) const
+{
+    const TxQueue& queue = m_queues[type];
+    return queue.config.overflow == OverflowPolicy::Block && WouldOverflow( queue, size );
+}
+
+/**
+    Queue a packet for sending. The packet's type must be one of the
+    types that the scheduler was constructed with.
+
+    If the queue is full then packets are dropped according to the
+    queue's overflow policy. Blocking queues accept the packet regardless
+    so the caller must wait until WouldBlock() returns false first.
+
+    @return The number of packets that were dropped (possibly including the new one).
+*/
+std::size_t PacketScheduler::Push( ComPacket::SharedPacket&& packet )
+{
+    TxQueue& queue = m_queues[packet->GetType()];
+    const bool wasEmpty = queue.packets.empty() && queue.partial == nullptr;
+    const std::size_t size = packet->GetDataSize();
+    std::size_t dropped = 0;
+
+    switch ( queue.config.overflow )
+    {
+    case OverflowPolicy::KeepLatest:
+        while ( queue.packets.empty() == false )
+        {
+            DropFront( queue );
+            dropped += 1;
+        }
+        break;
+    case OverflowPolicy::DropOldest:
+        while ( WouldOverflow( queue, size ) )
+        {
+            DropFront( queue );
+            dropped += 1;
+        }
+        break;
+    case OverflowPolicy::DropNewest:
+        if ( WouldOverflow( queue, size ) )
+        {
+            queue.dropped += 1;
+            return 1;
+        }
+        break;
+    case OverflowPolicy::Block:
+        break;
+    }
+
+    if ( wasEmpty )
+    {
+        if ( HasCredit( queue ) )
+        {
+            m_active[queue.config.priority].push_back( packet->GetType() );
+        }
+        else
+        {
+            queue.stalled = true;
+        }
+    }
+
+    queue.bytes += size;
+    queue.packets.push( std::move(packet) );
+    if ( queue.stalled == false )
+    {
+        m_queued += 1;
+    }
+    return dropped;
+}
+
+/**
+    Allow more packets of a flow controlled type to be sent. A queue that
+    was waiting for credit rejoins the back of its priority class.
+*/
+void PacketScheduler::AddCredits( IdManager::PacketType type, std::uint32_t credits )
+{
+    TxQueue& queue = m_queues[type];
+    queue.credits += credits;
+    if ( queue.stalled && HasCredit( queue ) )
+    {
+        queue.stalled = false;
+        m_active[queue.config.priority].push_back( type );
+        m_queued += queue.packets.size();
+    }
+}
+
+/**
+    @return The packet that should be sent next or null if no packets are queued.
+*/
+ComPacket::SharedPacket PacketScheduler::Pop()
+{
+    for ( std::deque<IdManager::PacketType>& active : m_active )
+    {
+        if ( active.empty() == false )
+        {
+            return PopRoundRobin( active );
+        }
+    }
+
+    return ComPacket::SharedPacket();
+}
+
+/**
+    Deficit round robin: each time a queue gets its turn it is granted
+    weight*QuantumBytes of credit and sends packets while it has enough
+    credit to cover them, then it moves to the back of the line. A packet
+    being sent in fragments costs one fragment at a time.
+
+    @param active The non-empty queues in one priority class (must not be empty).
+*/
+ComPacket::SharedPacket PacketScheduler::PopRoundRobin( std::deque<IdManager::PacketType>& active )
+{
+    assert( active.empty() == false );
+
+    while ( true )
+    {
+        const IdManager::PacketType type = active.front();
+        TxQueue& queue = m_queues[type];
+
+        if ( queue.hasTurn == false )
+        {
+            queue.deficit += queue.config.weight * QuantumBytes;
+            queue.hasTurn = true;
+        }
+
+        const ComPacket::SharedPacket& next = queue.partial ? queue.partial : queue.packets.front();
+        const std::size_t remaining = next->GetDataSize() - queue.partialSent;
+        const bool fragment = m_fragmentBytes != 0 && type != IdManager::ControlPacket && remaining > m_fragmentBytes;
+        const std::uint32_t cost = fragment ? m_fragmentBytes : remaining;
+        if ( cost <= queue.deficit )
+        {
+            queue.deficit -= cost;
+            if ( fragment )
+            {
+                // The queue keeps its turn (and its place) for the rest of the packet:
+                return PopFragment( queue, cost );
+            }
+
+            ComPacket::SharedPacket packet;
+            if ( queue.partial )
+            {
+                packet = PopFragment( queue, cost );
+            }
+            else
+            {
+                packet = std::move( queue.packets.front() );
+                queue.packets.pop();
+                queue.bytes -= cost;
+            }
+
+            m_queued -= 1;
+            if ( queue.config.flowControl )
+            {
+                queue.credits -= 1;
+            }
+
+            if ( queue.packets.empty() )
+            {
+                // Idle queues do not bank credit:
+                queue.deficit = 0;
+                queue.hasTurn = false;
+                active.pop_front();
+            }
+            else if ( HasCredit( queue ) == false )
+            {
+                // Out of flow control credit: park the queue (and its packets) until more is granted:
+                queue.deficit = 0;
+                queue.hasTurn = false;
+                queue.stalled = true;
+                m_queued -= queue.packets.size();
+                active.pop_front();
+            }
+            return packet;
+        }
+
+        // Not enough credit left for this packet so give the next queue a turn:
+        queue.hasTurn = false;
+        active.pop_front();
+        active.push_back( type );
+    }
+}
+
+/**
+    Take the next size bytes of the queue's front packet as a fragment that
+    shares the packet's memory. Starting a packet moves it out of the queue
+    (so it can no longer be dropped) and finishing it resets the queue's
+    partial packet.
+
+    Only the last fragment has the packet's type (and post time): the others
+    are marked with MoreFragmentsFlag.
+*/
+ComPacket::SharedPacket PacketScheduler::PopFragment( TxQueue& queue, std::size_t size )
+{
+    if ( queue.partial == nullptr )
+    {
+        queue.partial = std::move( queue.packets.front() );
+        queue.packets.pop();
+        queue.bytes -= queue.partial->GetDataSize();
+        queue.partialSent = 0;
+    }
+
+    const ComPacket& whole = *queue.partial;
+    const std::size_t offset = whole.GetDataPtr() - whole.GetBuffer().Data() + queue.partialSent;
+    const bool last = queue.partialSent + size == whole.GetDataSize();
+    const IdManager::PacketType type = last ? whole.GetType() : whole.GetType() | MoreFragmentsFlag;
+
+    ComPacket::SharedPacket packet = ComPacket::MakeShared( type, whole.GetBuffer(), offset, size );
+    queue.partialSent += size;
+    if ( last )
+    {
+        packet->SetTimestamp( whole.GetTimestamp() );
+        queue.partial.reset();
+        queue.partialSent = 0;
+    }
+    return packet;
+}
+
+bool PacketScheduler::WouldOverflow( const TxQueue& queue, std::size_t size ) const
+{
+    if ( queue.packets.empty() )
+    {
+        return false;
+    }
+
+    const TxQueueConfig& config = queue.config;
+    return ( config.maxPackets != 0 && queue.packets.size() >= config.maxPackets ) ||
+           ( config.maxBytes != 0 && queue.bytes + size > config.maxBytes );
+}
+
+/**
+    Discard the oldest packet in a queue (which must not be empty).
+    The queue is left in the active list: callers always push a new
+    packet immediately afterwards.
+*/
+void PacketScheduler::DropFront( TxQueue& queue )
+{
+    queue.bytes -= queue.packets.front()->GetDataSize();
+    queue.packets.pop();
+    queue.dropped += 1;
+    if ( queue.stalled == false )
+    {
+        m_queued -= 1;
+    }
+}
@@ -0,0 +1,121 @@
+#ifndef PACKETSCHEDULER_H
+#define PACKETSCHEDULER_H
+
+#include <cstdint>
+#include <string>
+#include <map>
+#include <vector>
+#include <deque>
+
+#include "IdManager.h"
+#include "ComPacket.h"
+#include "OverflowPolicy.h"
+
+/**
+    Transmit settings for one packet type.
+
+    Types in a higher priority class are always sent before any type
+    in a lower class. Types within the same class share the link in
+    proportion to their weights (deficit round robin over bytes sent).
+
+    Each queue can be bounded in packets and/or bytes (zero means no
+    limit) and the overflow policy decides what happens when it is full.
+    A queue will always accept a packet when it is empty, even if that
+    one packet is bigger than maxBytes.
+
+    A flow controlled type is only sent while the receiver has granted
+    credit for it (one packet per credit, see PacketDemuxer::EnableFlowControl()).
+    Without credit its packets wait in the queue, so the queue should be
+    bounded: its overflow policy then decides whether a slow receiver makes
+    the sender drop packets or block.
+
+    If the scheduler has a fragment size (see SetFragmentBytes()) larger
+    packets are sent as a series of fragments, each scheduled like a packet
+    of its own, so that other packets (in particular higher priority ones)
+    can be sent in between. Once its first fragment has gone a packet is
+    no longer subject to the overflow policy: it is always sent in full.
+*/
+struct TxQueueConfig
+{
+    enum Priority
+    {
+        Realtime = 0, ///< Reserved for control messages (but can be used for e.g. tele-op).
+        High,
+        Normal,
+        Bulk,
+        NumPriorities
+    };
+
+    Priority priority = Normal;
+    std::uint32_t weight = 1;
+
+    std::size_t maxPackets = 0;
+    std::size_t maxBytes = 0;
+    OverflowPolicy overflow = OverflowPolicy::Block;
+
+    /// Nothing is sent until the receiver grants credit (both ends must enable it).
+    bool flowControl = false;
+};
+
+typedef std::map<std::string, TxQueueConfig> TxConfig;
+
+/**
+    Holds the transmit queues for a PacketMuxer and decides which
+    packet should be sent next.
+
+    Not thread safe: the muxer serialises all access with its tx lock.
+*/
+class PacketScheduler
+{
+public:
+    /// Bytes each unit of weight entitles a queue to per round:
+    static constexpr std::uint32_t QuantumBytes = 1500;
+
+    PacketScheduler( const IdManager& packetIds, const TxConfig& config );
+    virtual ~PacketScheduler() {}
+
+    bool CanBlock( IdManager::PacketType type ) const;
+    bool WouldBlock( IdManager::PacketType type, std::size_t size ) const;
+    std::size_t Push( ComPacket::SharedPacket&& packet );
+    ComPacket::SharedPacket Pop();
+
+    void SetFragmentBytes( std::size_t bytes ) { m_fragmentBytes = bytes; }
+    std::size_t GetFragmentBytes() const { return m_fragmentBytes; }
+
+    std::uint64_t GetNumDropped( IdManager::PacketType type ) const { return m_queues[type].dropped; }
+
+    void AddCredits( IdManager::PacketType type, std::uint32_t credits );
+    std::uint64_t GetCredits( IdManager::PacketType type ) const { return m_queues[type].credits; }
+
+    /// Packets waiting for flow control credit are not counted: Empty() means there is nothing that can be sent.
+    bool Empty() const { return m_queued == 0; }
+    std::size_t Size() const { return m_queued; }
+
+private:
+    struct TxQueue
+    {
+        ComPacket::PacketContainer packets;
+        std::size_t bytes = 0;
+        std::uint64_t dropped = 0;
+        TxQueueConfig config;
+        std::uint32_t deficit = 0;
+        bool hasTurn = false;
+        std::uint64_t credits = 0;
+        bool stalled = false; // Holds packets but has no credit so is not in the active list.
+        ComPacket::SharedPacket partial; // Packet being sent in fragments (no longer in packets).
+        std::size_t partialSent = 0;
+    };
+
+    std::vector<TxQueue> m_queues; // Indexed by PacketType.
+    std::deque<IdManager::PacketType> m_active[TxQueueConfig::NumPriorities];
+    std::size_t m_queued;
+    std::size_t m_fragmentBytes;
+
+    bool WouldOverflow( const TxQueue& queue, std::size_t size ) const;
+    void DropFront( TxQueue& queue );
+    bool HasCredit( const TxQueue& queue ) const { return queue.config.flowControl == false || queue.credits > 0; }
+    ComPacket::SharedPacket PopRoundRobin( std::deque<IdManager::PacketType>& active );
+    ComPacket::SharedPacket PopFragment( TxQueue& queue, std::size_t size );
+};
+
+#endif // PACKETSCHEDULER_H
@@ -7,23 +7,28 @@
     Any type that has Cereal compatible serialisation functions
     can be serialised direct to a muxer, and directly from a
     shared ComPacket.
+
+    The data is serialised straight into pooled packet memory that
+    the posted packet then shares, and deserialised straight from the
+    received packet's data (see PacketArchive.h).
 */
 
 #include "../io/Serialisation.h"
+#include "PacketArchive.h"
 
 template <typename ...Args>
 void Serialise( PacketMuxer& muxer, const std::string& id, const Args& ...types )
 {
-    VectorOutputStream stream;
-    Serialise( stream, std::forward<const Args&>(types)... );
-    muxer.EmplacePacket( id, std::move(stream.Get()) );
+    PacketOutputArchive archive;
+    archive( std::forward<const Args&>(types)... );
+    muxer.EmplacePacket( id, archive.GetBuffer(), archive.GetHeaderSize(), archive.GetDataSize() );
 }
 
 template <typename ...Args>
 void Deserialise( const ComPacket::ConstSharedPacket& packet, Args& ...types )
 {
-    VectorInputStream stream(packet->GetData());
-    Deserialise(stream,std::forward<Args&>(types)...);
+    PacketInputArchive archive( packet->GetDataPtr(), packet->GetDataSize() );
+    archive( std::forward<Args&>(types)... );
 }
 
 #endif // PACKETSERIALISATION_H
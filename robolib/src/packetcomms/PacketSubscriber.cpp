@@ -1,5 +1,6 @@
 #include "PacketSubscriber.h"
 #include "PacketDemuxer.h"
+#include "PacketExecutor.h"
 
 /**
     This is the only constructor and is protected: the intent being
@@ -33,3 +34,12 @@ bool PacketSubscriber::IsSubscribed() const
 {
     return m_comms.IsSubscribed( this );
 }
+
+/**
+    @return The number of packets that an asynchronous subscriber has missed
+    because its inbox was full (always zero for inline subscribers).
+*/
+std::uint64_t PacketSubscriber::GetNumDropped() const
+{
+    return m_inbox ? m_inbox->GetNumDropped() : 0;
+}
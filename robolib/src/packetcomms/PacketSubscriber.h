@@ -5,8 +5,10 @@
 #include "ComPacket.h"
 
 #include <functional>
+#include <memory>
 
 class PacketDemuxer;
+class SubscriberInbox;
 
 /**
     A packet subscription is a component which can subscribe to
@@ -28,6 +30,8 @@ public:
 
     const PacketDemuxer& GetDemuxer() const { return m_comms; };
 
+    std::uint64_t GetNumDropped() const;
+
 protected:
     PacketSubscriber( const IdManager::PacketType, PacketDemuxer&, CallBack& );
     void Unsubscribe();
@@ -37,6 +41,7 @@ private:
     const IdManager::PacketType m_type;
     PacketDemuxer&  m_comms;
     CallBack        m_callback;
+    std::shared_ptr<SubscriberInbox> m_inbox; // Only set for asynchronous subscribers.
 };
 
 
@@ -45,3 +45,8 @@ const PacketDemuxer& PacketSubscription::GetDemuxer() const
 {
     return m_subscriber->GetDemuxer();
 }
+
+std::uint64_t PacketSubscription::GetNumDropped() const
+{
+    return m_subscriber->GetNumDropped();
+}
@@ -5,6 +5,7 @@
 #define _COMSUBSCRIBER_H_
 
 #include <memory>
+#include <cstdint>
 
 class PacketSubscriber;
 class PacketDemuxer;
@@ -31,6 +32,7 @@ public:
 
     bool IsSubscribed() const;
     const PacketDemuxer& GetDemuxer() const;
+    std::uint64_t GetNumDropped() const;
 
 protected:
 
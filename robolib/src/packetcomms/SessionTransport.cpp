@@ -0,0 +1,644 @@
+#include "SessionTransport.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+constexpr std::uint32_t SessionTransport::Magic;
+constexpr std::size_t SessionTransport::HandshakeBytes;
+constexpr std::size_t SessionTransport::DefaultReplayBytes;
+constexpr int SessionTransport::DefaultResumeTimeoutInMilliseconds;
+constexpr int SessionTransport::LinkTimeoutInMilliseconds;
+constexpr int SessionTransport::HandshakeTimeoutInMilliseconds;
+
+namespace
+{
+
+/// Time between attempts to reconnect a client:
+constexpr std::chrono::milliseconds RetryInterval( 100 );
+
+void Put32( char* bytes, std::uint32_t value )
+{
+    value = htonl( value );
+    std::memcpy( bytes, &value, sizeof(value) );
+}
+
+std::uint32_t Get32( const char* bytes )
+{
+    std::uint32_t value;
+    std::memcpy( &value, bytes, sizeof(value) );
+    return ntohl( value );
+}
+
+void Put64( char* bytes, std::uint64_t value )
+{
+    Put32( bytes, value >> 32 );
+    Put32( bytes + 4, value & 0xffffffff );
+}
+
+std::uint64_t Get64( const char* bytes )
+{
+    return ( std::uint64_t( Get32( bytes ) ) << 32 ) | Get32( bytes + 4 );
+}
+
+/// Formatted without touching std::clog's flags, which other sessions' threads share:
+std::string SessionName( std::uint64_t id )
+{
+    std::ostringstream name;
+    name << "Session " << std::hex << id;
+    return name.str();
+}
+
+std::uint64_t NewSessionId()
+{
+    std::random_device random;
+    std::uint64_t id = 0;
+    while ( id == 0 )
+    {
+        id = ( std::uint64_t( random() ) << 32 ) | random();
+    }
+    return id;
+}
+
+} // end anonymous namespace
+
+/**
+    Client end: connect and start a new session.
+
+    @param connect Makes a new connection to the server (or returns null
+    if it can not). Called again whenever the link is lost so it should
+    give up quickly (see Socket::Connect() with a timeout).
+    @param replayBytes How much of the stream is kept for resending.
+*/
+SessionTransport::SessionTransport( Connector connect, std::size_t replayBytes )
+:
+    m_connect       ( connect ),
+    m_sessionId     ( NewSessionId() ),
+    m_replay        ( replayBytes ),
+    m_generation    ( 0 ),
+    m_failed        ( false ),
+    m_reconnecting  ( false ),
+    m_numResumes    ( 0 ),
+    m_resumeTimeout ( DefaultResumeTimeoutInMilliseconds ),
+    m_txBytes       ( 0 ),
+    m_sentBytes     ( 0 ),
+    m_rxBytes       ( 0 )
+{
+    std::unique_ptr<Socket> socket = m_connect();
+    Handshake reply;
+    if ( socket == nullptr ||
+         WriteHandshake( *socket, Handshake{ NewSession, m_sessionId, 0 } ) == false ||
+         ReadHandshake( *socket, reply ) == false ||
+         reply.flags != NewSession || reply.sessionId != m_sessionId )
+    {
+        m_failed = true;
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard( m_lock );
+    Attach( std::move(socket), 0 );
+}
+
+/**
+    Server end: accept a new session from a client.
+
+    @param socket A connection whose handshake has been read with ReadHandshake().
+    @param hello The handshake (must be for a new session).
+*/
+SessionTransport::SessionTransport( std::unique_ptr<Socket> socket, const Handshake& hello, std::size_t replayBytes )
+:
+    m_sessionId     ( hello.sessionId ),
+    m_replay        ( replayBytes ),
+    m_generation    ( 0 ),
+    m_failed        ( false ),
+    m_reconnecting  ( false ),
+    m_numResumes    ( 0 ),
+    m_resumeTimeout ( DefaultResumeTimeoutInMilliseconds ),
+    m_txBytes       ( 0 ),
+    m_sentBytes     ( 0 ),
+    m_rxBytes       ( 0 )
+{
+    if ( hello.flags != NewSession || WriteHandshake( *socket, Handshake{ NewSession, m_sessionId, 0 } ) == false )
+    {
+        m_failed = true;
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard( m_lock );
+    Attach( std::move(socket), 0 );
+}
+
+/**
+    The muxer and demuxer using the session must be destroyed first.
+*/
+SessionTransport::~SessionTransport()
+{
+    Close();
+}
+
+/**
+    @return false once the session has failed or been closed.
+*/
+bool SessionTransport::Ok() const
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    return m_failed == false;
+}
+
+/**
+    @return true if the link is up right now.
+*/
+bool SessionTransport::Connected() const
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    return m_socket != nullptr;
+}
+
+unsigned SessionTransport::GetNumResumes() const
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    return m_numResumes;
+}
+
+/**
+    Set how long the link can be down before the session fails.
+*/
+void SessionTransport::SetResumeTimeout( std::chrono::milliseconds timeout )
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    m_resumeTimeout = timeout;
+}
+
+/**
+    Server end: carry on the session over a new connection from the client.
+    The old connection is dropped if it is still up (the client may have
+    noticed it was dead first).
+
+    @param socket A connection whose handshake has been read with ReadHandshake().
+    @param hello The handshake (must be asking to resume this session).
+    @return false if the session can not be resumed (the client is told so).
+*/
+bool SessionTransport::Resume( std::unique_ptr<Socket> socket, const Handshake& hello )
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    if ( m_failed || hello.flags != ResumeSession || hello.sessionId != m_sessionId )
+    {
+        WriteHandshake( *socket, Handshake{ RejectSession, hello.sessionId, 0 } );
+        return false;
+    }
+
+    Detach( m_generation );
+    if ( WriteHandshake( *socket, Handshake{ ResumeSession, m_sessionId, m_rxBytes } ) == false )
+    {
+        return false;
+    }
+
+    m_numResumes += 1;
+    return Attach( std::move(socket), hello.received );
+}
+
+/**
+    End the session: reads and writes fail from now on.
+*/
+void SessionTransport::Close()
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    m_failed = true;
+    Detach( m_generation );
+    m_linkChanged.notify_all();
+}
+
+/**
+    @return true if bytes at the start of a connection could be a session
+    handshake (so far). Lets a server tell session clients from plain ones.
+*/
+bool SessionTransport::IsHandshakeStart( const char* bytes, std::size_t size )
+{
+    char magic[4];
+    Put32( magic, Magic );
+    return std::memcmp( bytes, magic, std::min( size, sizeof(magic) ) ) == 0;
+}
+
+/**
+    Read the handshake at the start of a connection.
+
+    @return false if it is not a handshake or did not arrive in time.
+*/
+bool SessionTransport::ReadHandshake( Socket& socket, Handshake& hello, int timeoutInMilliseconds )
+{
+    char bytes[HandshakeBytes];
+    std::size_t received = 0;
+    const Clock::time_point deadline = Clock::now() + std::chrono::milliseconds( timeoutInMilliseconds );
+    while ( received < HandshakeBytes )
+    {
+        const int remaining = std::chrono::duration_cast<std::chrono::milliseconds>( deadline - Clock::now() ).count();
+        if ( remaining <= 0 || socket.ReadyForReading( remaining ) == false )
+        {
+            return false;
+        }
+
+        // Only read the handshake: the stream follows straight after it.
+        const int n = recv( socket.GetFileDescriptor(), bytes + received, HandshakeBytes - received, MSG_DONTWAIT );
+        if ( n == 0 || ( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK ) )
+        {
+            return false;
+        }
+        received += std::max( n, 0 );
+    }
+
+    if ( Get32( bytes ) != Magic )
+    {
+        return false;
+    }
+
+    hello.flags = Get32( bytes + 4 );
+    hello.sessionId = Get64( bytes + 8 );
+    hello.received = Get64( bytes + 16 );
+    return true;
+}
+
+/**
+    Send a handshake at the start of a connection (it always fits in the
+    socket's buffer so this does not wait).
+*/
+bool SessionTransport::WriteHandshake( Socket& socket, const Handshake& hello )
+{
+    char bytes[HandshakeBytes];
+    Put32( bytes, Magic );
+    Put32( bytes + 4, hello.flags );
+    Put64( bytes + 8, hello.sessionId );
+    Put64( bytes + 16, hello.received );
+    return socket.Write( bytes, sizeof(bytes) ) == int( sizeof(bytes) );
+}
+
+/**
+    Connections are always non-blocking: reads and writes are made holding
+    the session's lock so must never wait.
+*/
+void SessionTransport::SetBlocking( bool )
+{
+}
+
+int SessionTransport::Write( const char* data, std::size_t size )
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>( data );
+    iov.iov_len = size;
+    return WriteVector( &iov, 1 );
+}
+
+/**
+    Bytes that need resending on this connection are written first: new
+    bytes are only written once they have all gone.
+
+    @return Number of bytes written, 0 if the write would block (including
+    while the link is down) or -1 once the session has failed.
+*/
+int SessionTransport::WriteVector( const struct iovec* iov, int count )
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    if ( m_failed )
+    {
+        return -1;
+    }
+
+    if ( m_socket == nullptr || FlushReplay() == false )
+    {
+        return 0;
+    }
+
+    const int n = m_socket->WriteVector( iov, count );
+    if ( n < 0 )
+    {
+        Detach( m_generation );
+        return 0;
+    }
+
+    Record( iov, count, n );
+    return n;
+}
+
+/**
+    While the link is down this waits for it to come back (at the client
+    end by reconnecting).
+*/
+bool SessionTransport::ReadyForWriting( int milliseconds ) const
+{
+    std::shared_ptr<Socket> socket;
+    {
+        std::lock_guard<std::mutex> guard( m_lock );
+        if ( m_failed )
+        {
+            return true;
+        }
+        socket = m_socket;
+    }
+
+    if ( socket == nullptr )
+    {
+        // Waiting for the link can reconnect it:
+        return const_cast<SessionTransport*>( this )->WaitForLink( milliseconds );
+    }
+
+    return socket->ReadyForWriting( milliseconds );
+}
+
+/**
+    @return Number of bytes read, 0 if there was nothing to read (including
+    while the link is down) or -1 once the session has failed.
+*/
+int SessionTransport::Read( char* data, std::size_t maxBytes )
+{
+    std::lock_guard<std::mutex> guard( m_lock );
+    if ( m_failed )
+    {
+        return -1;
+    }
+
+    if ( m_socket == nullptr )
+    {
+        return 0;
+    }
+
+    // Socket::Read() does not tell a closed connection from an empty one:
+    const int n = recv( m_socket->GetFileDescriptor(), data, maxBytes, MSG_DONTWAIT );
+    if ( n > 0 )
+    {
+        m_rxBytes += n;
+        m_lastReceived = Clock::now();
+        return n;
+    }
+
+    if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+    {
+        return 0;
+    }
+
+    Detach( m_generation );
+    return 0;
+}
+
+/**
+    While the link is down this waits for it to come back (at the client
+    end by reconnecting). A link with nothing received for LinkTimeout is
+    dropped.
+*/
+bool SessionTransport::ReadyForReading( int milliseconds ) const
+{
+    std::shared_ptr<Socket> socket;
+    unsigned generation = 0;
+    int silentFor = 0;
+    {
+        std::lock_guard<std::mutex> guard( m_lock );
+        if ( m_failed )
+        {
+            return true;
+        }
+        socket = m_socket;
+        generation = m_generation;
+        silentFor = std::chrono::duration_cast<std::chrono::milliseconds>( Clock::now() - m_lastReceived ).count();
+    }
+
+    SessionTransport* self = const_cast<SessionTransport*>( this );
+    if ( socket == nullptr )
+    {
+        // Waiting for the link can reconnect it:
+        return self->WaitForLink( milliseconds );
+    }
+
+    const int linkTimeout = LinkTimeoutInMilliseconds - silentFor;
+    const bool ready = linkTimeout > 0 && socket->ReadyForReading( milliseconds < 0 ? linkTimeout : std::min( milliseconds, linkTimeout ) );
+    if ( ready == false )
+    {
+        std::lock_guard<std::mutex> guard( m_lock );
+        if ( Clock::now() - m_lastReceived >= std::chrono::milliseconds( LinkTimeoutInMilliseconds ) )
+        {
+            std::clog << SessionName( m_sessionId ) << " link timed out." << std::endl;
+            self->Detach( generation );
+        }
+    }
+    return ready;
+}
+
+/**
+    Make a new connection current, with the bytes the peer has not
+    received queued for resending. Must be called holding m_lock.
+
+    @param peerReceived How much of this end's stream the peer has received.
+    @return false if that is further back than the replay buffer goes (the
+    session fails).
+*/
+bool SessionTransport::Attach( std::unique_ptr<Socket> socket, std::uint64_t peerReceived )
+{
+    if ( peerReceived > m_txBytes || m_txBytes - peerReceived > m_replay.size() )
+    {
+        Fail( "peer is too far behind to resume" );
+        return false;
+    }
+
+    // What a connection can lose is this end's send buffer (including bytes sent but not
+    // acknowledged) and the peer's receive buffer (bytes acknowledged but not read). The
+    // kernel doubles the sizes asked for and a write can overshoot the send buffer by a
+    // segment, so a quarter each keeps everything it could lose in the replay buffer.
+    // Fixing the sizes also stops the kernel growing them as the stream speeds up:
+    const int bufferBytes = m_replay.size() / 8;
+    setsockopt( socket->GetFileDescriptor(), SOL_SOCKET, SO_SNDBUF, &bufferBytes, sizeof(bufferBytes) );
+    setsockopt( socket->GetFileDescriptor(), SOL_SOCKET, SO_RCVBUF, &bufferBytes, sizeof(bufferBytes) );
+    socket->SetBlocking( false );
+
+    m_socket = std::move( socket );
+    m_generation += 1;
+    m_sentBytes = peerReceived;
+    m_lastReceived = Clock::now();
+    m_reconnecting = false;
+    FlushReplay();
+    m_linkChanged.notify_all();
+    return true;
+}
+
+/**
+    Drop a connection (if it is still the current one). Must be called
+    holding m_lock.
+*/
+void SessionTransport::Detach( unsigned generation )
+{
+    if ( m_socket == nullptr || generation != m_generation )
+    {
+        return;
+    }
+
+    if ( m_failed == false )
+    {
+        std::clog << SessionName( m_sessionId ) << " link lost, waiting to resume." << std::endl;
+    }
+
+    // Shutting it down wakes anyone still waiting on it:
+    m_socket->Shutdown();
+    m_socket.reset();
+    m_detachedAt = Clock::now();
+    m_linkChanged.notify_all();
+}
+
+/**
+    Wait for the link to come back, reconnecting at the client end.
+
+    @return true if the link is up (or the session has failed so the
+    next read or write will report it).
+*/
+bool SessionTransport::WaitForLink( int milliseconds )
+{
+    std::unique_lock<std::mutex> lock( m_lock );
+    const Clock::time_point deadline = milliseconds < 0 ? Clock::time_point::max()
+                                                        : Clock::now() + std::chrono::milliseconds( milliseconds );
+    while ( m_socket == nullptr && m_failed == false )
+    {
+        const Clock::time_point giveUp = m_detachedAt + m_resumeTimeout;
+        if ( Clock::now() >= giveUp )
+        {
+            Fail( "link was not resumed in time" );
+            break;
+        }
+
+        if ( m_connect && m_reconnecting == false )
+        {
+            Reconnect( lock );
+            continue;
+        }
+
+        if ( m_linkChanged.wait_until( lock, std::min( deadline, giveUp ) ) == std::cv_status::timeout && Clock::now() >= deadline )
+        {
+            break;
+        }
+    }
+
+    return m_socket != nullptr || m_failed;
+}
+
+/**
+    Client end: one attempt to reconnect and resume. The lock is released
+    while connecting so the other direction can keep waiting.
+*/
+void SessionTransport::Reconnect( std::unique_lock<std::mutex>& lock )
+{
+    m_reconnecting = true;
+    const Handshake hello{ ResumeSession, m_sessionId, m_rxBytes };
+    lock.unlock();
+
+    std::unique_ptr<Socket> socket = m_connect();
+    Handshake reply;
+    const bool replied = socket != nullptr &&
+                         WriteHandshake( *socket, hello ) &&
+                         ReadHandshake( *socket, reply ) &&
+                         reply.sessionId == m_sessionId;
+
+    lock.lock();
+    m_reconnecting = false;
+    if ( m_failed )
+    {
+        return;
+    }
+
+    if ( replied && reply.flags == ResumeSession )
+    {
+        m_numResumes += 1;
+        Attach( std::move(socket), reply.received );
+    }
+    else if ( replied )
+    {
+        Fail( "server rejected the session" );
+    }
+    else
+    {
+        m_linkChanged.wait_for( lock, RetryInterval );
+    }
+}
+
+/**
+    Resend the bytes the current connection has not sent yet. Must be
+    called holding m_lock with a connection.
+
+    @return true once they have all been sent.
+*/
+bool SessionTransport::FlushReplay()
+{
+    while ( m_sentBytes < m_txBytes )
+    {
+        // The bytes can wrap around the end of the buffer:
+        const std::size_t start = m_sentBytes % m_replay.size();
+        const std::size_t length = m_txBytes - m_sentBytes;
+        const std::size_t first = std::min( length, m_replay.size() - start );
+        struct iovec iov[2];
+        iov[0].iov_base = &m_replay[start];
+        iov[0].iov_len = first;
+        iov[1].iov_base = &m_replay[0];
+        iov[1].iov_len = length - first;
+
+        const int n = m_socket->WriteVector( iov, iov[1].iov_len > 0 ? 2 : 1 );
+        if ( n < 0 )
+        {
+            Detach( m_generation );
+            return false;
+        }
+        if ( n == 0 )
+        {
+            return false;
+        }
+        m_sentBytes += n;
+    }
+
+    return true;
+}
+
+/**
+    Keep a copy of bytes just written in case they have to be resent.
+*/
+void SessionTransport::Record( const struct iovec* iov, int count, std::size_t bytes )
+{
+    for ( int i = 0; i < count && bytes > 0; ++i )
+    {
+        const char* data = static_cast<const char*>( iov[i].iov_base );
+        std::size_t length = std::min( bytes, iov[i].iov_len );
+        bytes -= length;
+
+        // Only the most recent bytes are kept (and only the size of the buffer can be needed):
+        if ( length > m_replay.size() )
+        {
+            data += length - m_replay.size();
+            m_txBytes += length - m_replay.size();
+            length = m_replay.size();
+        }
+
+        while ( length > 0 )
+        {
+            const std::size_t start = m_txBytes % m_replay.size();
+            const std::size_t n = std::min( length, m_replay.size() - start );
+            std::memcpy( &m_replay[start], data, n );
+            data += n;
+            length -= n;
+            m_txBytes += n;
+        }
+    }
+
+    m_sentBytes = m_txBytes;
+}
+
+/**
+    The session is over. Must be called holding m_lock.
+*/
+void SessionTransport::Fail( const char* reason )
+{
+    if ( m_failed == false )
+    {
+        std::clog << SessionName( m_sessionId ) << " failed: " << reason << std::endl;
+    }
+    m_failed = true;
+    Detach( m_generation );
+    m_linkChanged.notify_all();
+}
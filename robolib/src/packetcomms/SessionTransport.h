@@ -0,0 +1,132 @@
+#ifndef __SESSION_TRANSPORT_H__
+#define __SESSION_TRANSPORT_H__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "../network/Socket.h"
+
+/**
+    Lets a PacketMuxer and PacketDemuxer survive their stream socket
+    dropping out (e.g. WiFi going away for a moment): the session carries
+    on over a new connection and neither end sees anything but a pause.
+
+    Every connection starts with a session handshake (see Handshake) in
+    each direction. A client opening a new session picks a random session
+    id; a client that has lost its connection reconnects and asks to
+    resume that id, and each end tells the other how many bytes of its
+    stream it has received. Both ends keep the most recent bytes they have
+    sent so the bytes that were lost with the old connection are sent
+    again before anything new, and the muxer and demuxer just continue.
+    Resuming takes one round trip once the new connection is made.
+
+    A link that goes silent is treated as dropped: muxers send a heartbeat
+    at least every second so nothing being received for LinkTimeout means
+    the connection is dead even if the socket has not noticed yet.
+
+    While the link is down writes would block (so the muxer's queues and
+    overflow policies deal with the backlog) and reads return nothing. The
+    client end reconnects itself, using the connector it was given; the
+    server end waits for the server to pass it the new connection with
+    Resume(). If the session can not be resumed within the resume timeout
+    it fails and reads and writes return errors, exactly as a socket would.
+
+    The bytes lost with a connection are those in the sender's socket send
+    buffer and those the receiver has in its socket receive buffer but has
+    not read yet. Both buffers of every connection are limited so together
+    they stay well below the replay buffer, so whatever the kernel loses is
+    always still there to resend. The guarantee relies on both ends using
+    the same replay buffer size.
+*/
+class SessionTransport : public AbstractWriter, public AbstractReader
+{
+public:
+    using Connector = std::function< std::unique_ptr<Socket>() >;
+
+    enum HandshakeFlags : std::uint32_t
+    {
+        NewSession    = 0,
+        ResumeSession = 1,
+        RejectSession = 2
+    };
+
+    /**
+        The first bytes sent each way on every connection (in network
+        byte order, after a 4-byte magic number).
+    */
+    struct Handshake
+    {
+        std::uint32_t flags;
+        std::uint64_t sessionId;
+        std::uint64_t received; ///< Bytes of the session's stream received by the sender.
+    };
+
+    static constexpr std::uint32_t Magic = 0x524c5353; // "RLSS"
+    static constexpr std::size_t HandshakeBytes = 24;
+    static constexpr std::size_t DefaultReplayBytes = 1024*1024;
+    static constexpr int DefaultResumeTimeoutInMilliseconds = 3000;
+    static constexpr int LinkTimeoutInMilliseconds = 2500;
+    static constexpr int HandshakeTimeoutInMilliseconds = 1000;
+
+    explicit SessionTransport( Connector connect, std::size_t replayBytes = DefaultReplayBytes );
+    SessionTransport( std::unique_ptr<Socket> socket, const Handshake& hello, std::size_t replayBytes = DefaultReplayBytes );
+    virtual ~SessionTransport();
+
+    bool Ok() const;
+    bool Connected() const;
+    std::uint64_t GetSessionId() const { return m_sessionId; }
+    unsigned GetNumResumes() const;
+    void SetResumeTimeout( std::chrono::milliseconds timeout );
+
+    bool Resume( std::unique_ptr<Socket> socket, const Handshake& hello );
+    void Close();
+
+    static bool IsHandshakeStart( const char* bytes, std::size_t size );
+    static bool ReadHandshake( Socket& socket, Handshake& hello, int timeoutInMilliseconds = HandshakeTimeoutInMilliseconds );
+    static bool WriteHandshake( Socket& socket, const Handshake& hello );
+
+    void SetBlocking( bool block );
+    int  Write( const char* data, std::size_t size );
+    int  WriteVector( const struct iovec* iov, int count );
+    bool ReadyForWriting( int milliseconds ) const;
+    int  Read( char* data, std::size_t maxBytes );
+    bool ReadyForReading( int milliseconds ) const;
+
+protected:
+    using Clock = std::chrono::steady_clock;
+
+    bool Attach( std::unique_ptr<Socket> socket, std::uint64_t peerReceived );
+    void Detach( unsigned generation );
+    bool WaitForLink( int milliseconds );
+    void Reconnect( std::unique_lock<std::mutex>& lock );
+    bool FlushReplay();
+    void Record( const struct iovec* iov, int count, std::size_t bytes );
+    void Fail( const char* reason );
+
+private:
+    const Connector m_connect; // Empty at the server end.
+    std::uint64_t m_sessionId;
+    std::vector<char> m_replay; // The stream byte at offset i is kept at i % size().
+
+    mutable std::mutex m_lock;
+    std::condition_variable m_linkChanged;
+    std::shared_ptr<Socket> m_socket; // Null while the link is down.
+    unsigned m_generation; // Counts connections so an old one's errors are ignored.
+    bool m_failed;
+    bool m_reconnecting;
+    unsigned m_numResumes;
+    std::chrono::milliseconds m_resumeTimeout;
+    Clock::time_point m_detachedAt;
+    Clock::time_point m_lastReceived;
+
+    std::uint64_t m_txBytes;  // Bytes of the stream accepted from the muxer.
+    std::uint64_t m_sentBytes; // Bytes written to the current connection (less than m_txBytes while replaying).
+    std::uint64_t m_rxBytes;  // Bytes of the peer's stream passed to the demuxer.
+};
+
+#endif /* __SESSION_TRANSPORT_H__ */
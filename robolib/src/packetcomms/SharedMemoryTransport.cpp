@@ -0,0 +1,420 @@
+#include "SharedMemoryTransport.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+// The ring indices are shared between processes so their atomics must not use a (process local) lock:
+static_assert( ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2, "Shared memory transport needs lock-free atomics." );
+
+constexpr std::size_t SharedMemoryTransport::DefaultRingBytes;
+constexpr int SharedMemoryTransport::NumDescriptors;
+
+/**
+    Control block at the start of each ring's region of the shared memory.
+    The indices count bytes ever written and read so the ring is empty
+    when they are equal (the capacity is a power of two).
+*/
+struct SharedMemoryTransport::Ring
+{
+    alignas(64) std::atomic<std::uint64_t> head;  // Only written by the producer.
+    alignas(64) std::atomic<std::uint64_t> tail;  // Only written by the consumer.
+    alignas(64) std::atomic<std::uint32_t> readerWaiting;
+    std::atomic<std::uint32_t> writerWaiting;
+    std::atomic<std::uint32_t> producerClosed;
+    std::atomic<std::uint32_t> consumerClosed;
+};
+
+namespace
+{
+
+constexpr std::size_t RingHeaderBytes = 256;
+constexpr std::size_t MinRingBytes = 4096;
+
+template <std::size_t N>
+void CloseAll( const int (&fds)[N] )
+{
+    for ( int fd : fds )
+    {
+        if ( fd != -1 ) { close( fd ); }
+    }
+}
+
+} // end anonymous namespace
+
+/**
+    Create the shared memory and the first side of the transport.
+
+    @param ringBytes Capacity of each direction (rounded up to a power of two).
+    @return The transport or null if the shared memory could not be created.
+*/
+std::unique_ptr<SharedMemoryTransport> SharedMemoryTransport::Create( std::size_t ringBytes )
+{
+    static_assert( sizeof(Ring) <= RingHeaderBytes, "Ring control block does not fit." );
+
+    std::size_t capacity = MinRingBytes;
+    while ( capacity < ringBytes )
+    {
+        capacity *= 2;
+    }
+
+    int fds[NumDescriptors];
+    fds[0] = syscall( SYS_memfd_create, "robolib-packets", MFD_CLOEXEC );
+    for ( int i = 1; i < NumDescriptors; ++i )
+    {
+        fds[i] = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+    }
+
+    const bool ok = std::none_of( fds, fds + NumDescriptors, []( int fd ) { return fd == -1; } ) &&
+                    ftruncate( fds[0], 2*( RingHeaderBytes + capacity ) ) == 0;
+    if ( ok == false )
+    {
+        std::clog << "Error: could not create shared memory transport - " << strerror(errno) << std::endl;
+        CloseAll( fds );
+        return nullptr;
+    }
+
+    std::unique_ptr<SharedMemoryTransport> transport( new SharedMemoryTransport( fds, 0 ) );
+    if ( transport->IsValid() == false )
+    {
+        return nullptr;
+    }
+    return transport;
+}
+
+/**
+    Receive the descriptors sent by the other process's SendTo() (waiting
+    for them if necessary) and create this process's side of the transport.
+
+    @return The transport or null if the descriptors could not be received.
+*/
+std::unique_ptr<SharedMemoryTransport> SharedMemoryTransport::Receive( Socket& localSocket )
+{
+    localSocket.ReadyForReading( -1 );
+
+    char byte = 0;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+
+    union
+    {
+        char buffer[CMSG_SPACE( sizeof(int) * NumDescriptors )];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr msg;
+    std::memset( &msg, 0, sizeof(msg) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    const ssize_t n = recvmsg( localSocket.GetFileDescriptor(), &msg, MSG_CMSG_CLOEXEC );
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR( &msg );
+    if ( n != 1 || cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS ||
+         cmsg->cmsg_len != CMSG_LEN( sizeof(int) * NumDescriptors ) )
+    {
+        std::clog << "Error: did not receive shared memory transport descriptors." << std::endl;
+        return nullptr;
+    }
+
+    int fds[NumDescriptors];
+    std::memcpy( fds, CMSG_DATA( cmsg ), sizeof(fds) );
+    std::unique_ptr<SharedMemoryTransport> transport( new SharedMemoryTransport( fds, 1 ) );
+    if ( transport->IsValid() == false )
+    {
+        return nullptr;
+    }
+    return transport;
+}
+
+/**
+    Takes ownership of the descriptors and maps the shared memory.
+
+    @param side 0 for the side that created the memory, 1 for the other.
+*/
+SharedMemoryTransport::SharedMemoryTransport( const int (&fds)[NumDescriptors], int side )
+:
+    m_side( side ),
+    m_mapping( MAP_FAILED ),
+    m_mappingBytes( 0 ),
+    m_capacity( 0 ),
+    m_tx( nullptr ),
+    m_rx( nullptr ),
+    m_txData( nullptr ),
+    m_rxData( nullptr )
+{
+    std::copy( fds, fds + NumDescriptors, m_fds );
+
+    struct stat info;
+    if ( fstat( m_fds[0], &info ) == 0 )
+    {
+        m_mappingBytes = info.st_size;
+        m_mapping = mmap( nullptr, m_mappingBytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_fds[0], 0 );
+    }
+
+    if ( IsValid() == false )
+    {
+        std::clog << "Error: could not map shared memory transport - " << strerror(errno) << std::endl;
+        return;
+    }
+
+    // Layout is both ring headers followed by both rings' data:
+    char* base = static_cast<char*>( m_mapping );
+    m_capacity = m_mappingBytes/2 - RingHeaderBytes;
+    Ring* rings[2] = { reinterpret_cast<Ring*>( base ), reinterpret_cast<Ring*>( base + RingHeaderBytes ) };
+    char* data[2] = { base + 2*RingHeaderBytes, base + 2*RingHeaderBytes + m_capacity };
+
+    if ( side == 0 )
+    {
+        new (rings[0]) Ring();
+        new (rings[1]) Ring();
+    }
+
+    m_tx = rings[side];
+    m_rx = rings[1 - side];
+    m_txData = data[side];
+    m_rxData = data[1 - side];
+    m_txDataFd  = m_fds[1 + 2*side];
+    m_txSpaceFd = m_fds[2 + 2*side];
+    m_rxDataFd  = m_fds[1 + 2*(1 - side)];
+    m_rxSpaceFd = m_fds[2 + 2*(1 - side)];
+}
+
+/**
+    Tells the other side this one has gone (so its reads and writes
+    fail once the data already in the ring has been read).
+*/
+SharedMemoryTransport::~SharedMemoryTransport()
+{
+    if ( IsValid() )
+    {
+        const uint64_t one = 1;
+        m_tx->producerClosed = 1;
+        m_rx->consumerClosed = 1;
+        if ( write( m_txDataFd, &one, sizeof(one) ) < 0 || write( m_rxSpaceFd, &one, sizeof(one) ) < 0 )
+        {
+            std::clog << "Warning: could not signal shared memory transport peer." << std::endl;
+        }
+        munmap( m_mapping, m_mappingBytes );
+    }
+
+    CloseAll( m_fds );
+}
+
+bool SharedMemoryTransport::IsValid() const
+{
+    return m_mapping != MAP_FAILED;
+}
+
+/**
+    Pass the descriptors to another process over a connected Unix domain socket.
+*/
+bool SharedMemoryTransport::SendTo( Socket& localSocket ) const
+{
+    char byte = 0;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+
+    union
+    {
+        char buffer[CMSG_SPACE( sizeof(int) * NumDescriptors )];
+        struct cmsghdr align;
+    } control;
+    std::memset( &control, 0, sizeof(control) );
+
+    struct msghdr msg;
+    std::memset( &msg, 0, sizeof(msg) );
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR( &msg );
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN( sizeof(int) * NumDescriptors );
+    std::memcpy( CMSG_DATA( cmsg ), m_fds, sizeof(m_fds) );
+
+    return sendmsg( localSocket.GetFileDescriptor(), &msg, MSG_NOSIGNAL ) == 1;
+}
+
+/**
+    @return The other side of the transport for use within this process.
+*/
+std::unique_ptr<SharedMemoryTransport> SharedMemoryTransport::MakePeer() const
+{
+    int fds[NumDescriptors];
+    for ( int i = 0; i < NumDescriptors; ++i )
+    {
+        fds[i] = fcntl( m_fds[i], F_DUPFD_CLOEXEC, 0 );
+    }
+    return std::unique_ptr<SharedMemoryTransport>( new SharedMemoryTransport( fds, 1 - m_side ) );
+}
+
+int SharedMemoryTransport::Write( const char* data, std::size_t size )
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>( data );
+    iov.iov_len = size;
+    return WriteVector( &iov, 1 );
+}
+
+/**
+    Copy as much as fits into the ring.
+
+    @return Number of bytes written (0 if the ring is full) or -1 if the other side has gone.
+*/
+int SharedMemoryTransport::WriteVector( const struct iovec* iov, int count )
+{
+    if ( m_tx->consumerClosed )
+    {
+        return -1;
+    }
+
+    const std::size_t capacity = m_capacity;
+    const std::uint64_t head = m_tx->head.load( std::memory_order_relaxed );
+    const std::uint64_t tail = m_tx->tail.load( std::memory_order_acquire );
+    std::size_t space = capacity - ( head - tail );
+
+    std::uint64_t position = head;
+    for ( int i = 0; i < count && space > 0; ++i )
+    {
+        const char* bytes = static_cast<const char*>( iov[i].iov_base );
+        std::size_t length = std::min( iov[i].iov_len, space );
+        space -= length;
+
+        while ( length > 0 )
+        {
+            const std::size_t offset = position & ( capacity - 1 );
+            const std::size_t n = std::min( length, capacity - offset );
+            std::memcpy( m_txData + offset, bytes, n );
+            bytes += n;
+            length -= n;
+            position += n;
+        }
+    }
+
+    if ( position != head )
+    {
+        m_tx->head.store( position );
+        Signal( m_tx->readerWaiting, m_txDataFd );
+    }
+    return position - head;
+}
+
+bool SharedMemoryTransport::ReadyForWriting( int milliseconds ) const
+{
+    const Ring& ring = *m_tx;
+    const std::size_t capacity = m_capacity;
+    return Wait( m_tx->writerWaiting, m_txSpaceFd, milliseconds, [&ring, capacity]() {
+        return ring.head.load() - ring.tail.load() < capacity || ring.consumerClosed;
+    });
+}
+
+/**
+    Copy as many bytes as are available out of the ring.
+
+    @return Number of bytes read (0 if the ring is empty) or -1 if the other
+    side has gone and everything it wrote has been read.
+*/
+int SharedMemoryTransport::Read( char* data, std::size_t maxBytes )
+{
+    const std::size_t capacity = m_capacity;
+    const bool closed = m_rx->producerClosed;
+    const std::uint64_t head = m_rx->head.load( std::memory_order_acquire );
+    const std::uint64_t tail = m_rx->tail.load( std::memory_order_relaxed );
+    if ( head == tail )
+    {
+        return closed ? -1 : 0;
+    }
+
+    std::size_t length = std::min<std::size_t>( head - tail, maxBytes );
+    std::uint64_t position = tail;
+    while ( length > 0 )
+    {
+        const std::size_t offset = position & ( capacity - 1 );
+        const std::size_t n = std::min( length, capacity - offset );
+        std::memcpy( data, m_rxData + offset, n );
+        data += n;
+        length -= n;
+        position += n;
+    }
+
+    m_rx->tail.store( position );
+    Signal( m_rx->writerWaiting, m_rxSpaceFd );
+    return position - tail;
+}
+
+bool SharedMemoryTransport::ReadyForReading( int milliseconds ) const
+{
+    const Ring& ring = *m_rx;
+    return Wait( m_rx->readerWaiting, m_rxDataFd, milliseconds, [&ring]() {
+        return ring.head.load() != ring.tail.load() || ring.producerClosed;
+    });
+}
+
+/**
+    Sleep on the eventfd until ready() returns true or the timeout expires.
+    The waiting flag is raised before ready() is checked for the last time,
+    so the other side can not make us ready without seeing the flag and
+    signalling (the atomics are sequentially consistent).
+*/
+bool SharedMemoryTransport::Wait( std::atomic<std::uint32_t>& waiting, int eventFd, int milliseconds, const std::function<bool()>& ready )
+{
+    if ( ready() )
+    {
+        return true;
+    }
+
+    waiting.store( 1 );
+    if ( ready() == false )
+    {
+        struct pollfd pfd;
+        pfd.fd = eventFd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if ( poll( &pfd, 1, milliseconds ) > 0 )
+        {
+            uint64_t count;
+            if ( read( eventFd, &count, sizeof(count) ) < 0 && errno != EAGAIN )
+            {
+                std::clog << "Error: reading eventfd - " << strerror(errno) << std::endl;
+            }
+        }
+    }
+
+    return ready();
+}
+
+/**
+    Wake the other side if it is waiting.
+*/
+void SharedMemoryTransport::Signal( std::atomic<std::uint32_t>& waiting, int eventFd )
+{
+    if ( waiting.load() != 0 && waiting.exchange( 0 ) != 0 )
+    {
+        const uint64_t one = 1;
+        if ( write( eventFd, &one, sizeof(one) ) < 0 && errno != EAGAIN )
+        {
+            std::clog << "Error: writing eventfd - " << strerror(errno) << std::endl;
+        }
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef __SHARED_MEMORY_TRANSPORT_H__
+#define __SHARED_MEMORY_TRANSPORT_H__
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "../network/Socket.h"
+
+/**
+    A transport between processes on the same host (e.g. the comms server,
+    recorder and vision processes) that bypasses the network stack. A
+    PacketMuxer/PacketDemuxer pair uses it exactly as it would a socket.
+
+    Each direction is a single-producer/single-consumer byte ring in a
+    shared memory file (memfd). Bytes are copied straight from the muxer's
+    buffers into the ring and from the ring into the demuxer's buffers (or,
+    for large payloads, directly into the packet), so a packet costs one
+    copy on each side and no system calls. An eventfd is only signalled
+    when the other side is actually asleep waiting for data or space.
+
+    One side calls Create() and passes the descriptors to the other process
+    over a local (Unix domain) socket with SendTo(); the other process then
+    calls Receive(). MakePeer() creates the other side within the same
+    process instead (e.g. for threads or tests).
+
+    Either side being destroyed is seen by the other as a transport error.
+*/
+class SharedMemoryTransport : public AbstractWriter, public AbstractReader
+{
+public:
+    static constexpr std::size_t DefaultRingBytes = 1024*1024;
+
+    static std::unique_ptr<SharedMemoryTransport> Create( std::size_t ringBytes = DefaultRingBytes );
+    static std::unique_ptr<SharedMemoryTransport> Receive( Socket& localSocket );
+
+    virtual ~SharedMemoryTransport();
+
+    bool SendTo( Socket& localSocket ) const;
+    std::unique_ptr<SharedMemoryTransport> MakePeer() const;
+
+    void SetBlocking( bool ) {}
+    int  Write( const char* data, std::size_t size );
+    int  WriteVector( const struct iovec* iov, int count );
+    bool ReadyForWriting( int milliseconds ) const;
+    int  Read( char* data, std::size_t maxBytes );
+    bool ReadyForReading( int milliseconds ) const;
+
+protected:
+    struct Ring;
+
+    /// The memfd and the eventfds signalling data and space for each ring:
+    static constexpr int NumDescriptors = 5;
+
+    SharedMemoryTransport( const int (&fds)[NumDescriptors], int side );
+
+    bool IsValid() const;
+    static bool Wait( std::atomic<std::uint32_t>& waiting, int eventFd, int milliseconds, const std::function<bool()>& ready );
+    static void Signal( std::atomic<std::uint32_t>& waiting, int eventFd );
+
+private:
+    int m_fds[NumDescriptors];
+    int m_side;
+    void* m_mapping;
+    std::size_t m_mappingBytes;
+    std::size_t m_capacity;
+    Ring* m_tx;
+    Ring* m_rx;
+    char* m_txData;
+    char* m_rxData;
+    int m_txDataFd;
+    int m_txSpaceFd;
+    int m_rxDataFd;
+    int m_rxSpaceFd;
+};
+
+#endif /* __SHARED_MEMORY_TRANSPORT_H__ */
@@ -0,0 +1,74 @@
+#ifndef SUBSCRIPTIONOPTIONS_H
+#define SUBSCRIPTIONOPTIONS_H
+
+#include <cstddef>
+
+#include "OverflowPolicy.h"
+
+class PacketExecutor;
+
+/**
+    Options for PacketDemuxer::Subscribe().
+
+    By default a subscriber's callback runs inline on the demuxer's receive
+    thread, so it must be quick: a slow callback delays every packet type.
+    Async subscribers instead get their own bounded inbox that the receive
+    thread posts to, and the callbacks run on an executor's worker threads
+    (one at a time, in order, for each subscriber).
+
+    Consumers that do not need every packet (e.g. displays and loggers of
+    high rate telemetry) can have the demuxer thin the packets out before
+    they are queued or the callback fires: by only keeping the latest
+    packet, by sampling every Nth packet and/or by limiting the rate.
+*/
+struct SubscriptionOptions
+{
+    enum Execution
+    {
+        Inline,
+        Async
+    };
+
+    Execution execution = Inline;
+
+    /// Async only: maximum number of packets waiting in the inbox.
+    std::size_t inboxCapacity = 64;
+
+    /// Async only: what happens when the inbox is full. Note that Block
+    /// stalls the receive thread (and therefore every other subscriber).
+    OverflowPolicy overflow = OverflowPolicy::DropOldest;
+
+    /// Async only: executor to run the callbacks, or null for the demuxer's
+    /// shared pool. A custom executor must outlive the subscription.
+    PacketExecutor* executor = nullptr;
+
+    /// Only deliver the latest packet: an async subscriber with a single slot
+    /// inbox where a new packet replaces one still waiting (implies Async).
+    bool conflate = false;
+
+    /// Deliver only every Nth packet (the first, the N+1th and so on).
+    unsigned everyNth = 1;
+
+    /// Maximum deliveries per second (0 for no limit): packets that arrive
+    /// sooner than 1/maxRateHz after the last delivered one are skipped.
+    double maxRateHz = 0.0;
+
+    static SubscriptionOptions MakeAsync( std::size_t capacity, OverflowPolicy policy )
+    {
+        SubscriptionOptions options;
+        options.execution = Async;
+        options.inboxCapacity = capacity;
+        options.overflow = policy;
+        return options;
+    }
+
+    static SubscriptionOptions MakeConflated( double maxRateHz = 0.0 )
+    {
+        SubscriptionOptions options;
+        options.conflate = true;
+        options.maxRateHz = maxRateHz;
+        return options;
+    }
+};
+
+#endif // SUBSCRIPTIONOPTIONS_H
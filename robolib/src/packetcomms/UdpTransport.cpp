@@ -0,0 +1,361 @@
+#include "UdpTransport.h"
+#include "IdManager.h"
+#include "ControlMessage.h"
+
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+
+constexpr std::size_t UdpTransport::DefaultMaxDatagramBytes;
+constexpr std::size_t UdpTransport::DefaultMaxPacketBytes;
+constexpr std::size_t UdpTransport::HeaderBytes;
+constexpr std::uint32_t UdpTransport::Magic;
+constexpr std::size_t UdpTransport::MaxReassemblies;
+constexpr std::size_t UdpTransport::MaxReceiveBytes;
+
+/**
+    @param socket A datagram socket that is already connected to the peer.
+    @param maxDatagramBytes Packets that do not fit in a datagram of this size
+    (including the header) are fragmented. The default stays below a typical MTU.
+    @param maxPacketBytes Largest packet that will be received (reassembled).
+*/
+UdpTransport::UdpTransport( Socket& socket, std::size_t maxDatagramBytes, std::size_t maxPacketBytes )
+:
+    m_socket            ( socket ),
+    m_maxDatagramBytes  ( maxDatagramBytes ),
+    m_maxFragmentBytes  ( maxDatagramBytes - HeaderBytes ),
+    m_maxPacketBytes    ( maxPacketBytes ),
+    m_nextSequence      ( 0 ),
+    m_txHeaderBytes     ( 0 ),
+    m_txType            ( 0 ),
+    m_txSize            ( 0 ),
+    m_lossProbability   ( 0.0 ),
+    m_rxDatagram        ( MaxReceiveBytes ),
+    m_rxOffset          ( 0 ),
+    m_reassemblies      ( MaxReassemblies ),
+    m_numDropped        ( 0 ),
+    m_numStale          ( 0 ),
+    m_numIncomplete     ( 0 )
+{
+    assert( maxDatagramBytes > HeaderBytes );
+
+    for ( Reassembly& r : m_reassemblies )
+    {
+        r.inUse = false;
+    }
+
+    // The demuxer requires a Hello first but the muxer's could be lost:
+    const ControlMessage hello = ControlMessage::Hello;
+    Deliver( IdManager::ControlPacket, 0, reinterpret_cast<const char*>(&hello), sizeof(std::underlying_type<ControlMessage>::type) );
+    m_lastDelivered.clear();
+}
+
+UdpTransport::~UdpTransport()
+{
+}
+
+void UdpTransport::SetBlocking( bool block )
+{
+    m_socket.SetBlocking( block );
+}
+
+int UdpTransport::Write( const char* data, std::size_t size )
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>( data );
+    iov.iov_len = size;
+    return WriteVector( &iov, 1 );
+}
+
+/**
+    Split the muxer's byte stream back into packets and send each one.
+    Payloads that arrive in a single buffer (as they do from PacketMuxer)
+    are sent straight from that buffer, otherwise they are staged here
+    until complete.
+
+    @return The total size of the buffers: all bytes are always consumed.
+*/
+int UdpTransport::WriteVector( const struct iovec* iov, int count )
+{
+    int total = 0;
+    for ( int i = 0; i < count; ++i )
+    {
+        const char* bytes = static_cast<const char*>( iov[i].iov_base );
+        std::size_t length = iov[i].iov_len;
+        total += length;
+
+        while ( length > 0 )
+        {
+            if ( m_txHeaderBytes < sizeof(m_txHeader) )
+            {
+                const std::size_t n = std::min( sizeof(m_txHeader) - m_txHeaderBytes, length );
+                std::memcpy( m_txHeader + m_txHeaderBytes, bytes, n );
+                m_txHeaderBytes += n;
+                bytes += n;
+                length -= n;
+
+                if ( m_txHeaderBytes == sizeof(m_txHeader) )
+                {
+                    std::memcpy( &m_txType, m_txHeader, sizeof(uint32_t) );
+                    std::memcpy( &m_txSize, m_txHeader + sizeof(uint32_t), sizeof(uint32_t) );
+                    m_txType = ntohl( m_txType );
+                    m_txSize = ntohl( m_txSize );
+                    if ( m_txSize == 0 )
+                    {
+                        SendPacket( m_txType, nullptr, 0 );
+                        m_txHeaderBytes = 0;
+                    }
+                }
+                continue;
+            }
+
+            if ( m_txPayload.empty() && length >= m_txSize )
+            {
+                SendPacket( m_txType, bytes, m_txSize );
+                bytes += m_txSize;
+                length -= m_txSize;
+                m_txHeaderBytes = 0;
+                continue;
+            }
+
+            const std::size_t n = std::min<std::size_t>( m_txSize - m_txPayload.size(), length );
+            m_txPayload.insert( m_txPayload.end(), bytes, bytes + n );
+            bytes += n;
+            length -= n;
+
+            if ( m_txPayload.size() == m_txSize )
+            {
+                SendPacket( m_txType, m_txPayload.data(), m_txSize );
+                m_txPayload.clear();
+                m_txHeaderBytes = 0;
+            }
+        }
+    }
+
+    return total;
+}
+
+/**
+    Drop the specified fraction of outgoing datagrams at random
+    (for testing how the receiving side copes with loss).
+*/
+void UdpTransport::SetSimulatedLoss( double probability, unsigned seed )
+{
+    m_lossProbability = probability;
+    m_lossRandom.seed( seed );
+}
+
+/**
+    Send a packet as one or more datagrams. Each datagram's header is six
+    32-bit words in network order: magic, sequence number, fragment index
+    and count (16-bits each), byte offset of the fragment, packet type
+    and packet size. The payload fragment follows.
+*/
+void UdpTransport::SendPacket( std::uint32_t type, const char* payload, std::uint32_t size )
+{
+    const std::uint32_t sequence = m_nextSequence++;
+    const std::size_t fragmentCount = std::max<std::size_t>( 1, ( size + m_maxFragmentBytes - 1 ) / m_maxFragmentBytes );
+    if ( fragmentCount > UINT16_MAX )
+    {
+        m_numDropped += 1;
+        return;
+    }
+
+    std::uniform_real_distribution<double> uniform( 0.0, 1.0 );
+    for ( std::size_t f = 0; f < fragmentCount; ++f )
+    {
+        const std::size_t offset = f * m_maxFragmentBytes;
+        const std::size_t length = std::min<std::size_t>( m_maxFragmentBytes, size - offset );
+
+        if ( m_lossProbability > 0.0 && uniform( m_lossRandom ) < m_lossProbability )
+        {
+            m_numDropped += 1;
+            continue;
+        }
+
+        const uint32_t header[6] = {
+            htonl( Magic ), htonl( sequence ), htonl( ( f << 16 ) | fragmentCount ),
+            htonl( offset ), htonl( type ), htonl( size )
+        };
+
+        struct iovec iov[2];
+        iov[0].iov_base = const_cast<uint32_t*>( header );
+        iov[0].iov_len = HeaderBytes;
+        iov[1].iov_base = const_cast<char*>( payload + offset );
+        iov[1].iov_len = length;
+
+        const int n = m_socket.WriteVector( iov, length > 0 ? 2 : 1 );
+        if ( n != static_cast<int>( HeaderBytes + length ) )
+        {
+            m_numDropped += 1;
+        }
+    }
+}
+
+/**
+    Returns the bytes of complete packets that have been received, in the
+    same format the muxer wrote them.
+
+    @return Number of bytes read, 0 if nothing is available or -1 on error.
+*/
+int UdpTransport::Read( char* data, std::size_t maxBytes )
+{
+    while ( m_rxOffset == m_rxStream.size() )
+    {
+        m_rxStream.clear();
+        m_rxOffset = 0;
+
+        const int n = m_socket.Read( m_rxDatagram.data(), m_rxDatagram.size() );
+        if ( n < 0 && errno == ECONNREFUSED )
+        {
+            // A datagram we sent was refused because the peer is not running (yet): not fatal for UDP.
+            return 0;
+        }
+
+        if ( n <= 0 )
+        {
+            return n;
+        }
+
+        ReceiveDatagram( m_rxDatagram.data(), n );
+    }
+
+    const std::size_t n = std::min( maxBytes, m_rxStream.size() - m_rxOffset );
+    std::memcpy( data, m_rxStream.data() + m_rxOffset, n );
+    m_rxOffset += n;
+    return n;
+}
+
+bool UdpTransport::ReadyForReading( int milliseconds ) const
+{
+    return m_rxOffset < m_rxStream.size() || m_socket.ReadyForReading( milliseconds );
+}
+
+/**
+    Check a datagram and deliver its packet if it is now complete.
+    Datagrams that are malformed or not from a UdpTransport are ignored,
+    including any whose packet could not fit in its fragments or is larger
+    than the maximum packet size (it is checked before anything is allocated
+    for the reassembly).
+*/
+void UdpTransport::ReceiveDatagram( const char* datagram, std::size_t size )
+{
+    if ( size < HeaderBytes )
+    {
+        return;
+    }
+
+    uint32_t header[6];
+    std::memcpy( header, datagram, HeaderBytes );
+    for ( uint32_t& word : header )
+    {
+        word = ntohl( word );
+    }
+
+    const std::uint32_t sequence = header[1];
+    const std::uint16_t fragment = header[2] >> 16;
+    const std::uint16_t fragmentCount = header[2] & 0xffff;
+    const std::uint32_t offset = header[3];
+    const std::uint32_t type = header[4];
+    const std::uint32_t packetSize = header[5];
+    const char* payload = datagram + HeaderBytes;
+    const std::size_t length = size - HeaderBytes;
+
+    if ( header[0] != Magic || fragment >= fragmentCount || offset > packetSize || length > packetSize - offset ||
+         packetSize > m_maxPacketBytes || packetSize > fragmentCount * ( MaxReceiveBytes - HeaderBytes ) )
+    {
+        return;
+    }
+
+    if ( IsStale( type, sequence ) )
+    {
+        m_numStale += 1;
+        return;
+    }
+
+    if ( fragmentCount == 1 )
+    {
+        if ( length == packetSize )
+        {
+            Deliver( type, sequence, payload, packetSize );
+        }
+        return;
+    }
+
+    // Find the packet's reassembly, otherwise start a new one (abandoning the oldest if they are all in use):
+    auto itr = std::find_if( m_reassemblies.begin(), m_reassemblies.end(), [&]( const Reassembly& r ) {
+        return r.inUse && r.sequence == sequence && r.type == type;
+    });
+
+    if ( itr == m_reassemblies.end() )
+    {
+        itr = std::find_if( m_reassemblies.begin(), m_reassemblies.end(), []( const Reassembly& r ) { return r.inUse == false; } );
+        if ( itr == m_reassemblies.end() )
+        {
+            itr = std::min_element( m_reassemblies.begin(), m_reassemblies.end(), [&]( const Reassembly& a, const Reassembly& b ) {
+                return static_cast<int32_t>( a.sequence - b.sequence ) < 0;
+            });
+            m_numIncomplete += 1;
+        }
+
+        itr->inUse = true;
+        itr->sequence = sequence;
+        itr->type = type;
+        itr->size = packetSize;
+        itr->fragmentCount = fragmentCount;
+        itr->fragmentsReceived = 0;
+        itr->received.assign( fragmentCount, false );
+        itr->payload.resize( packetSize );
+    }
+
+    Reassembly& r = *itr;
+    if ( r.size != packetSize || r.fragmentCount != fragmentCount || r.received[fragment] )
+    {
+        return;
+    }
+
+    std::memcpy( r.payload.data() + offset, payload, length );
+    r.received[fragment] = true;
+    r.fragmentsReceived += 1;
+
+    if ( r.fragmentsReceived == r.fragmentCount )
+    {
+        Deliver( type, sequence, r.payload.data(), packetSize );
+        r.inUse = false;
+
+        // Older partial packets of this type can never be delivered now:
+        for ( Reassembly& other : m_reassemblies )
+        {
+            if ( other.inUse && IsStale( other.type, other.sequence ) )
+            {
+                other.inUse = false;
+                m_numIncomplete += 1;
+            }
+        }
+    }
+}
+
+/**
+    @return true if a packet of this type at least as new has already been delivered.
+*/
+bool UdpTransport::IsStale( std::uint32_t type, std::uint32_t sequence ) const
+{
+    auto itr = m_lastDelivered.find( type );
+    return itr != m_lastDelivered.end() && static_cast<int32_t>( sequence - itr->second ) <= 0;
+}
+
+/**
+    Append a packet (with the muxer's header) to the bytes waiting to be read.
+*/
+void UdpTransport::Deliver( std::uint32_t type, std::uint32_t sequence, const char* payload, std::uint32_t size )
+{
+    const uint32_t header[2] = { htonl( type ), htonl( size ) };
+    const char* headerBytes = reinterpret_cast<const char*>( header );
+    m_rxStream.insert( m_rxStream.end(), headerBytes, headerBytes + sizeof(header) );
+    m_rxStream.insert( m_rxStream.end(), payload, payload + size );
+    m_lastDelivered[type] = sequence;
+}
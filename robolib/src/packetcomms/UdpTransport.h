@@ -0,0 +1,111 @@
+#ifndef __UDP_TRANSPORT_H__
+#define __UDP_TRANSPORT_H__
+
+#include <atomic>
+#include <cstdint>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "../network/Socket.h"
+
+/**
+    Lets a PacketMuxer and PacketDemuxer run over a connected datagram
+    (UDP) socket, for traffic where the latest packet matters more than
+    getting every packet (e.g. joystick and telemetry). Unlike TCP a
+    lost datagram never holds up the packets behind it.
+
+    Each packet the muxer writes is sent as one datagram, or split into
+    fragments if it is larger than the maximum datagram size. Every
+    datagram carries a magic number, a sequence number, the fragment's
+    position and the packet's type and size. The receiving side reassembles
+    the fragments and only passes on a packet if it is newer than the last
+    packet of the same type that was passed on: stale and out of order
+    packets are dropped, as are packets with fragments missing. Datagrams
+    for a packet larger than the maximum packet size are ignored, so a
+    forged size can not make the receiver allocate an arbitrary amount.
+
+    Writes never block and never fail: datagrams that can not be sent are
+    simply counted as dropped. The demuxer's Hello check is replaced by the
+    magic number check on every datagram (the reader starts with a Hello
+    of its own so the demuxer still sees one first even if the muxer's
+    Hello was lost).
+
+    The writer is only used by the muxer's thread and the reader by the
+    demuxer's so the two halves need no locking.
+*/
+class UdpTransport : public AbstractWriter, public AbstractReader
+{
+public:
+    static constexpr std::size_t DefaultMaxDatagramBytes = 1400;
+    static constexpr std::size_t DefaultMaxPacketBytes = 8*1024*1024;
+    static constexpr std::size_t HeaderBytes = 24;
+
+    explicit UdpTransport( Socket& socket, std::size_t maxDatagramBytes = DefaultMaxDatagramBytes,
+                           std::size_t maxPacketBytes = DefaultMaxPacketBytes );
+    virtual ~UdpTransport();
+
+    void SetBlocking( bool block );
+    int  Write( const char* data, std::size_t size );
+    int  WriteVector( const struct iovec* iov, int count );
+    int  Read( char* data, std::size_t maxBytes );
+    bool ReadyForReading( int milliseconds ) const;
+
+    void SetSimulatedLoss( double probability, unsigned seed = 1 );
+
+    std::uint64_t GetNumDropped() const { return m_numDropped; }
+    std::uint64_t GetNumStale() const { return m_numStale; }
+    std::uint64_t GetNumIncomplete() const { return m_numIncomplete; }
+
+protected:
+    static constexpr std::uint32_t Magic = 0x524c5544; // "RLUD"
+    static constexpr std::size_t MaxReassemblies = 8;
+    static constexpr std::size_t MaxReceiveBytes = 64*1024;
+
+    void SendPacket( std::uint32_t type, const char* payload, std::uint32_t size );
+
+    void ReceiveDatagram( const char* datagram, std::size_t size );
+    bool IsStale( std::uint32_t type, std::uint32_t sequence ) const;
+    void Deliver( std::uint32_t type, std::uint32_t sequence, const char* payload, std::uint32_t size );
+
+private:
+    struct Reassembly
+    {
+        bool inUse;
+        std::uint32_t sequence;
+        std::uint32_t type;
+        std::uint32_t size;
+        std::uint16_t fragmentCount;
+        std::uint16_t fragmentsReceived;
+        std::vector<bool> received;
+        std::vector<char> payload;
+    };
+
+    Socket& m_socket;
+    const std::size_t m_maxDatagramBytes;
+    const std::size_t m_maxFragmentBytes;
+    const std::size_t m_maxPacketBytes;
+
+    // Send side: the muxer's byte stream is split back into packets here.
+    std::uint32_t m_nextSequence;
+    char m_txHeader[8];
+    std::size_t m_txHeaderBytes;
+    std::uint32_t m_txType;
+    std::uint32_t m_txSize;
+    std::vector<char> m_txPayload;
+    double m_lossProbability;
+    std::minstd_rand m_lossRandom;
+
+    // Receive side: complete packets wait in m_rxStream (from m_rxOffset) for the demuxer.
+    std::vector<char> m_rxDatagram;
+    std::vector<char> m_rxStream;
+    std::size_t m_rxOffset;
+    std::vector<Reassembly> m_reassemblies;
+    std::unordered_map<std::uint32_t, std::uint32_t> m_lastDelivered; // Sequence number by type.
+
+    std::atomic<std::uint64_t> m_numDropped;
+    std::atomic<std::uint64_t> m_numStale;
+    std::atomic<std::uint64_t> m_numIncomplete;
+};
+
+#endif /* __UDP_TRANSPORT_H__ */
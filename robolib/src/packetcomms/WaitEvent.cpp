@@ -0,0 +1,59 @@
+#include "WaitEvent.h"
+
+#include <climits>
+#include <cerrno>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+
+static_assert( sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t), "futex word must be a plain 32-bit integer" );
+
+/**
+    Wake up all threads waiting on the event.
+*/
+void WaitEvent::Notify()
+{
+    m_sequence.fetch_add( 1, std::memory_order_seq_cst );
+    if ( m_waiters.load( std::memory_order_seq_cst ) > 0 )
+    {
+        syscall( SYS_futex, reinterpret_cast<std::uint32_t*>( &m_sequence ), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0 );
+    }
+}
+
+/**
+    Sleep until the event is notified (returns immediately if it
+    was notified since sequence was read). May wake spuriously.
+*/
+void WaitEvent::Wait( std::uint32_t sequence )
+{
+    FutexWait( sequence, nullptr );
+}
+
+/**
+    As Wait() but gives up after the timeout.
+
+    @return false if the timeout expired, true otherwise.
+*/
+bool WaitEvent::Wait( std::uint32_t sequence, std::chrono::nanoseconds timeout )
+{
+    const auto seconds = std::chrono::duration_cast<std::chrono::seconds>( timeout );
+    struct timespec ts;
+    ts.tv_sec = seconds.count();
+    ts.tv_nsec = ( timeout - seconds ).count();
+    return FutexWait( sequence, &ts );
+}
+
+bool WaitEvent::FutexWait( std::uint32_t sequence, const struct timespec* timeout )
+{
+    m_waiters.fetch_add( 1, std::memory_order_seq_cst );
+    long result = 0;
+    if ( m_sequence.load( std::memory_order_seq_cst ) == sequence )
+    {
+        result = syscall( SYS_futex, reinterpret_cast<std::uint32_t*>( &m_sequence ), FUTEX_WAIT_PRIVATE, sequence, timeout, nullptr, 0 );
+    }
+    m_waiters.fetch_sub( 1, std::memory_order_seq_cst );
+
+    return !( result == -1 && errno == ETIMEDOUT );
+}
@@ -0,0 +1,77 @@
+#ifndef WAITEVENT_H
+#define WAITEVENT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/**
+    Lightweight event used by the lock-free queues to put an idle
+    consumer to sleep without a mutex (implemented with a futex).
+
+    The event is a sequence number that Notify() increments. A consumer
+    reads Sequence(), checks its condition and, only if the condition is
+    not yet true, calls Wait() with the sequence it read: the wait returns
+    immediately if anyone notified in between so no wake-up can be lost.
+
+    Notify() costs one atomic increment unless a thread is actually
+    asleep in Wait(), in which case it also makes the wake-up syscall.
+*/
+class WaitEvent
+{
+public:
+    WaitEvent() : m_sequence( 0 ), m_waiters( 0 ) {}
+    WaitEvent( const WaitEvent& ) = delete;
+    WaitEvent& operator=( const WaitEvent& ) = delete;
+
+    std::uint32_t Sequence() const { return m_sequence.load( std::memory_order_seq_cst ); }
+
+    void Notify();
+    void Wait( std::uint32_t sequence );
+    bool Wait( std::uint32_t sequence, std::chrono::nanoseconds timeout );
+
+    /**
+        Wait until ready() returns true. It is polled spinCount times before
+        the thread sleeps, which avoids the cost of a sleep and wake-up when
+        the producer is expected to follow up quickly.
+
+        @return The final value of ready() (false if the timeout expired first).
+    */
+    template <typename Predicate>
+    bool WaitFor( Predicate ready, std::chrono::nanoseconds timeout, unsigned spinCount = 0 )
+    {
+        for ( unsigned i = 0; i < spinCount; ++i )
+        {
+            if ( ready() )
+            {
+                return true;
+            }
+        }
+
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        while ( true )
+        {
+            const std::uint32_t sequence = Sequence();
+            if ( ready() )
+            {
+                return true;
+            }
+
+            const auto remaining = deadline - std::chrono::steady_clock::now();
+            if ( remaining <= std::chrono::nanoseconds::zero() )
+            {
+                return false;
+            }
+
+            Wait( sequence, std::chrono::duration_cast<std::chrono::nanoseconds>( remaining ) );
+        }
+    }
+
+private:
+    std::atomic<std::uint32_t> m_sequence;
+    std::atomic<std::uint32_t> m_waiters;
+
+    bool FutexWait( std::uint32_t sequence, const struct timespec* timeout );
+};
+
+#endif // WAITEVENT_H
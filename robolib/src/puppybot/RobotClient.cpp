@@ -2,6 +2,7 @@
 
 #include "../packetcomms/PacketDemuxer.h"
 #include "../packetcomms/PacketMuxer.h"
+#include "../packetcomms/SessionTransport.h"
 #include "../robotcomms/VideoClient.h"
 #include "../utility/AsyncLooper.h"
 
@@ -12,6 +13,8 @@ static void message( const char* msg )
     std::clog << msg << std::endl;
 }
 
+constexpr int RobotClient::ConnectTimeoutInMilliseconds;
+
 RobotClient::RobotClient()
 :
     m_joystick    ( "/dev/input/js0" ),
@@ -25,18 +28,34 @@ RobotClient::RobotClient()
 
 RobotClient::~RobotClient()
 {
-    m_client.Shutdown();
+    if ( m_session != nullptr )
+    {
+        m_session->Close();
+    }
     free( m_imageBuffer );
 }
 
 bool RobotClient::Connect( const char* host, int port, const std::vector<std::string>& packetTypes )
 {
-    //m_client.SetNagleBufferingOff();
-    bool connected = m_client.Connect( host, port );
+    // The session calls this again to reconnect if the link drops out:
+    const std::string hostName( host );
+    m_session.reset( new SessionTransport( [hostName, port]() {
+        std::unique_ptr<Socket> socket( new TcpSocket() );
+        if ( socket->Connect( hostName.c_str(), port, ConnectTimeoutInMilliseconds ) == false )
+        {
+            socket.reset();
+        }
+        return socket;
+    }));
+
+    bool connected = m_session->Ok();
     if ( connected )
     {
-        m_demuxer.reset( new PacketDemuxer( m_client, packetTypes ) );
-        m_muxer.reset( new PacketMuxer( m_client, packetTypes ) );
+        m_demuxer.reset( new PacketDemuxer( *m_session, packetTypes ) );
+        TxConfig txConfig;
+        txConfig["Joystick"].priority = TxQueueConfig::High;
+        txConfig["Joystick"].overflow = OverflowPolicy::KeepLatest;
+        m_muxer.reset( new PacketMuxer( *m_session, packetTypes, txConfig ) );
         SendJoystickData();
     }
     return connected;
@@ -123,6 +142,7 @@ void RobotClient::LoopToReceiveVideo()
     SetupImagePostData( w, h );
 
     int numFrames = 0;
+    double totalDecodeLatency_ms = 0.0;
 
     std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
     bool gotFrame = true;
@@ -143,14 +163,17 @@ void RobotClient::LoopToReceiveVideo()
             m_display.PostImage( m_postData );
 #endif
             numFrames += 1;
+            totalDecodeLatency_ms += m_videoClient->GetDecodeLatencyMilliseconds();
             if ( numFrames == 45 ) // Output some rolling averages after certain number of frames
             {
                 const auto t2 = std::chrono::steady_clock::now();
                 double secs = std::chrono::duration_cast<std::chrono::milliseconds>(t2-t1).count()/1000.0;
                 double bits_per_sec = m_videoClient->ComputeVideoBandwidthConsumed( secs );
 
-                std::clog << "Through-put: " << numFrames/secs << " fps @ " << bits_per_sec/(1024.0*1024.0) << " Mbps" << std::endl;
+                std::clog << "Through-put: " << numFrames/secs << " fps @ " << bits_per_sec/(1024.0*1024.0) << " Mbps"
+                          << " (decode latency " << totalDecodeLatency_ms/numFrames << " ms)" << std::endl;
                 numFrames = 0;
+                totalDecodeLatency_ms = 0.0;
                 t1 = std::chrono::steady_clock::now();
             }
         }
@@ -14,8 +14,14 @@
 
 class PacketDemuxer;
 class PacketMuxer;
+class SessionTransport;
 class VideoClient;
 
+/**
+    Controls the robot over a session (see SessionTransport) so that a
+    short dropout of the link only pauses the video and joystick rather
+    than ending the connection.
+*/
 class RobotClient
 {
 public:
@@ -35,7 +41,10 @@ protected:
     bool ReceiveVideoFrame();
     int FfmpegReadPacket( uint8_t* buffer, int size );
 private:
-    TcpSocket     m_client;
+    /// Reconnection attempts give up quickly so the session can try again:
+    static constexpr int ConnectTimeoutInMilliseconds = 500;
+
+    std::unique_ptr<SessionTransport> m_session;
     std::unique_ptr<PacketDemuxer> m_demuxer;
     std::unique_ptr<PacketMuxer>   m_muxer;
 
@@ -2,18 +2,26 @@
 #include "../network/Ipv4Address.h"
 #include "../network/TcpSocket.h"
 #include "../packetcomms/PacketSerialisation.h"
+#include "../packetcomms/Channel.h"
 
 #include <mutex>
 #include <chrono>
 #include <condition_variable>
 #include <sstream>
+#include <algorithm>
+#include <iterator>
 
+#include <errno.h>
 #include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
 
 #ifdef ARM_BUILD
 #include <FreeTypeCpp.h>
 #endif
 
+constexpr unsigned RobotServer::NumEventLoopThreads;
+
 /**
     Setup a robot server with specified TCP and serial ports.
     
@@ -22,7 +30,11 @@
 RobotServer::RobotServer( int tcpPort, const char* motorSerialPort )
 :
     m_serialPort( motorSerialPort ),
-    m_server( new TcpSocket() )
+    m_server( new TcpSocket() ),
+    m_eventLoops( NumEventLoopThreads ),
+    m_acceptLoop( nullptr ),
+    m_controlMuxer( nullptr ),
+    m_controlDemuxer( nullptr )
 {
     // Setup a server socket for receiving client commands:
     if ( m_server->Bind( tcpPort ) == false )
@@ -33,19 +45,82 @@ RobotServer::RobotServer( int tcpPort, const char* motorSerialPort )
 
 RobotServer::~RobotServer()
 {
+    // Stop accepting before the connection lists are destroyed:
+    if ( m_acceptLoop != nullptr )
+    {
+        m_acceptLoop->Invoke( [this]() {
+            m_acceptLoop->Remove( m_server->GetFileDescriptor() );
+            for ( const auto& con : m_unidentified )
+            {
+                m_acceptLoop->Remove( con.first );
+            }
+        });
+    }
+
+    // Connections are destroyed outside the lock as they have to wait for their loops:
+    std::vector< std::unique_ptr<PacketConnection> > observers;
+    {
+        std::lock_guard<std::mutex> guard( m_connectionLock );
+        std::swap( observers, m_observers );
+    }
+    observers.clear();
+    ReleaseController();
 }
 
 /**
-    Blocks until robot gets a connection.
+    Blocks until robot gets a controlling connection. Clients that connect
+    while there is a controlling connection become observers.
 **/
 bool RobotServer::Listen(const std::vector<std::string>& packetTypes)
 {
     if ( m_server )
     {
         fprintf( stderr, "Waiting for new connection...\n" );
-        m_server->Listen( 0 ); // Wait for connection - no queue
-        m_con.reset( m_server->Accept() ); // Create connection
-        m_con->SetBlocking( false );
+        {
+            std::lock_guard<std::mutex> guard( m_connectionLock );
+            m_packetTypes = packetTypes;
+        }
+        StartAccepting();
+
+        PendingClient client;
+        {
+            std::unique_lock<std::mutex> guard( m_connectionLock );
+            m_connectionReady.wait( guard, [this]() { return m_pending.empty() == false; } );
+            client = std::move( m_pending.front() );
+            m_pending.pop_front();
+        }
+
+        // Odometry must not queue up behind video (which gets whatever bandwidth is left).
+        // Only the latest odometry matters, and if the link can not keep up with the
+        // video the encoder is blocked so frames get skipped at capture instead:
+        TxConfig txConfig;
+        txConfig["Odometry"].priority = TxQueueConfig::High;
+        txConfig["Odometry"].overflow = OverflowPolicy::KeepLatest;
+        txConfig["AvData"].priority = TxQueueConfig::Bulk;
+        txConfig["AvData"].maxBytes = 256*1024;
+        txConfig["AvData"].overflow = OverflowPolicy::Block;
+
+        if ( client.session )
+        {
+            // A session runs its own muxer and demuxer threads as it has to wait for the link to come back:
+            std::unique_ptr<SessionTransport> session( new SessionTransport( std::move(client.socket), client.hello ) );
+            std::unique_ptr<PacketDemuxer> demuxer( new PacketDemuxer( *session, packetTypes ) );
+            std::unique_ptr<PacketMuxer> muxer( new PacketMuxer( *session, packetTypes, txConfig ) );
+            std::lock_guard<std::mutex> guard( m_connectionLock );
+            m_controlMuxer = muxer.get();
+            m_controlDemuxer = demuxer.get();
+            m_session = std::move( session );
+            m_sessionDemuxer = std::move( demuxer );
+            m_sessionMuxer = std::move( muxer );
+        }
+        else
+        {
+            std::unique_ptr<PacketConnection> controller( new PacketConnection( std::move(client.socket), m_eventLoops.Next(), packetTypes, txConfig ) );
+            std::lock_guard<std::mutex> guard( m_connectionLock );
+            m_controlMuxer = &controller->GetMuxer();
+            m_controlDemuxer = &controller->GetDemuxer();
+            m_controller = std::move( controller );
+        }
 
         PostConnectionSetup(packetTypes);
         return true;
@@ -57,6 +132,161 @@ bool RobotServer::Listen(const std::vector<std::string>& packetTypes)
     }
 }
 
+/**
+    Start accepting connections on one of the event loops (the first time this is called).
+**/
+void RobotServer::StartAccepting()
+{
+    if ( m_acceptLoop != nullptr )
+    {
+        return;
+    }
+
+    m_server->Listen( SOMAXCONN );
+    m_server->SetBlocking( false );
+    m_acceptLoop = &m_eventLoops.Next();
+    m_acceptLoop->Invoke( [this]() {
+        m_acceptLoop->Add( m_server->GetFileDescriptor(), EPOLLIN, [this]( std::uint32_t ) { AcceptConnections(); } );
+    });
+}
+
+/**
+    Runs on the accept loop: new connections are watched until their first
+    bytes arrive to tell session clients from plain ones.
+**/
+void RobotServer::AcceptConnections()
+{
+    while ( true )
+    {
+        std::unique_ptr<TcpSocket> con( m_server->Accept() );
+        if ( con == nullptr )
+        {
+            break;
+        }
+        con->SetBlocking( false );
+
+        const int fd = con->GetFileDescriptor();
+        m_unidentified[fd] = std::move( con );
+        m_acceptLoop->Add( fd, EPOLLIN | EPOLLRDHUP, [this, fd]( std::uint32_t events ) { IdentifyConnection( fd, events ); } );
+    }
+}
+
+/**
+    Runs on the accept loop: a connection that starts with a session
+    handshake is a session client, anything else is a plain client
+    (whose first bytes are its muxer's Hello).
+**/
+void RobotServer::IdentifyConnection( int fd, std::uint32_t events )
+{
+    char bytes[SessionTransport::HandshakeBytes];
+    const int n = recv( fd, bytes, sizeof(bytes), MSG_PEEK | MSG_DONTWAIT );
+    const bool session = n > 0 && SessionTransport::IsHandshakeStart( bytes, n );
+    const bool hungUp = events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR );
+    if ( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) && hungUp == false )
+    {
+        return;
+    }
+
+    // Wait for the whole handshake:
+    if ( session && n < int( sizeof(bytes) ) && hungUp == false )
+    {
+        return;
+    }
+
+    m_acceptLoop->Remove( fd );
+    auto itr = m_unidentified.find( fd );
+    std::unique_ptr<TcpSocket> con = std::move( itr->second );
+    m_unidentified.erase( itr );
+
+    if ( n <= 0 || ( session && n < int( sizeof(bytes) ) ) )
+    {
+        return; // Closed before it said anything useful.
+    }
+
+    if ( session )
+    {
+        AcceptSession( std::move(con) );
+    }
+    else
+    {
+        AcceptPlain( std::move(con) );
+    }
+}
+
+/**
+    A client asking to resume the controller's session takes it over. A new
+    session becomes the controller if there is none, otherwise the client
+    is told its session is new (so it can never be resumed) and becomes an
+    observer like any other.
+**/
+void RobotServer::AcceptSession( std::unique_ptr<TcpSocket> con )
+{
+    SessionTransport::Handshake hello;
+    if ( SessionTransport::ReadHandshake( *con, hello ) == false )
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard( m_connectionLock );
+        if ( hello.flags == SessionTransport::ResumeSession )
+        {
+            if ( m_session != nullptr && m_session->Resume( std::move(con), hello ) )
+            {
+                std::clog << "Controller resumed its session (" << m_session->GetNumResumes() << " resumes).\n";
+            }
+            else if ( con != nullptr )
+            {
+                SessionTransport::WriteHandshake( *con, SessionTransport::Handshake{ SessionTransport::RejectSession, hello.sessionId, 0 } );
+            }
+            return;
+        }
+
+        if ( m_controller == nullptr && m_session == nullptr && m_pending.empty() )
+        {
+            m_pending.push_back( PendingClient{ std::move(con), true, hello } );
+            m_connectionReady.notify_one();
+            return;
+        }
+    }
+
+    if ( SessionTransport::WriteHandshake( *con, SessionTransport::Handshake{ SessionTransport::NewSession, hello.sessionId, 0 } ) )
+    {
+        AcceptPlain( std::move(con) );
+    }
+}
+
+/**
+    Hands a plain connection to Listen() if there is no controlling client,
+    otherwise it becomes an observer.
+**/
+void RobotServer::AcceptPlain( std::unique_ptr<TcpSocket> con )
+{
+    std::vector<std::string> packetTypes;
+    {
+        std::lock_guard<std::mutex> guard( m_connectionLock );
+        if ( m_controller == nullptr && m_session == nullptr && m_pending.empty() )
+        {
+            m_pending.push_back( PendingClient{ std::move(con), false, SessionTransport::Handshake() } );
+            m_connectionReady.notify_one();
+            return;
+        }
+        packetTypes = m_packetTypes;
+    }
+
+    // Observers must never hold up the robot so their video is dropped if they can not keep up.
+    // The connection is created without holding the lock as it has to wait for its loop:
+    TxConfig txConfig;
+    txConfig["AvData"].priority = TxQueueConfig::Bulk;
+    txConfig["AvData"].maxBytes = 256*1024;
+    txConfig["AvData"].overflow = OverflowPolicy::DropOldest;
+    std::unique_ptr<PacketConnection> observer( new PacketConnection( std::move(con), m_eventLoops.Next(), packetTypes, txConfig ) );
+
+    std::lock_guard<std::mutex> guard( m_connectionLock );
+    m_observers.push_back( std::move(observer) );
+    std::clog << "Observer connected (" << m_observers.size() << " observers).\n";
+}
+
 /**
     Creates motor controller object and sets motor hardware settings.
 */
@@ -101,9 +331,7 @@ void RobotServer::PostConnectionSetup(const std::vector<std::string>& packetType
     SetupMotors();
     SetupCamera();
 
-    assert( m_con.get() != nullptr );
-    m_muxer.reset( new PacketMuxer( *m_con, packetTypes ) );
-    m_demuxer.reset( new PacketDemuxer( *m_con, packetTypes ) );
+    assert( m_controlMuxer != nullptr );
 }
 
 /**
@@ -122,19 +350,24 @@ void RobotServer::PostCommsCleanup()
 **/
 void RobotServer::RunCommsLoop()
 {
-    if ( m_muxer != nullptr && m_demuxer != nullptr )
+    if ( m_controlMuxer != nullptr )
     {
-        Ipv4Address clientAddress;
-        m_con->GetPeerAddress( clientAddress );
-
+        if ( m_controller != nullptr )
         {
+            Ipv4Address clientAddress;
+            m_controller->GetSocket().GetPeerAddress( clientAddress );
+
             std::string name;
             clientAddress.GetHostName( name );
             std::clog << "Client " << name << " connected to robot.\n";
         }
+        else
+        {
+            std::clog << "Client connected to robot (session " << std::hex << m_session->GetSessionId() << std::dec << ").\n";
+        }
 
         // Setup a TeleJoystick object:
-        auto muxerPair = std::make_pair( std::ref(*m_muxer), std::ref(*m_demuxer) );
+        auto muxerPair = std::make_pair( std::ref(*m_controlMuxer), std::ref(*m_controlDemuxer) );
         TeleJoystick teljoy( muxerPair, m_drive.get() ); // Will start receiving and processing remote joystick cammands immediately.
         std::this_thread::sleep_for(std::chrono::milliseconds(50));
 
@@ -154,25 +387,94 @@ void RobotServer::RunCommsLoop()
             }
         }
 
-        std::clog << "Control terminated.\n";
+        if ( m_controller != nullptr )
+        {
+            std::clog << "Control terminated (client used " << m_controller->GetCpuSeconds() << " CPU seconds).\n";
+        }
+        else
+        {
+            std::clog << "Control terminated (session resumed " << m_session->GetNumResumes() << " times).\n";
+        }
     } // end if
 
-    m_muxer.reset();
-    m_demuxer.reset();
-    m_con->Shutdown();
-
+    ReleaseController();
     PostCommsCleanup();
 }
 
+/**
+    Disconnect the controlling client (if any).
+**/
+void RobotServer::ReleaseController()
+{
+    std::unique_ptr<PacketConnection> controller;
+    std::unique_ptr<SessionTransport> session;
+    std::unique_ptr<PacketDemuxer> demuxer;
+    std::unique_ptr<PacketMuxer> muxer;
+    {
+        std::lock_guard<std::mutex> guard( m_connectionLock );
+        std::swap( controller, m_controller );
+        std::swap( session, m_session );
+        std::swap( demuxer, m_sessionDemuxer );
+        std::swap( muxer, m_sessionMuxer );
+        m_controlMuxer = nullptr;
+        m_controlDemuxer = nullptr;
+    }
+
+    if ( controller != nullptr )
+    {
+        controller->GetSocket().Shutdown();
+        controller.reset();
+    }
+
+    // Closing the session first stops its muxer and demuxer waiting for it to be resumed:
+    if ( session != nullptr )
+    {
+        session->Close();
+        muxer.reset();
+        demuxer.reset();
+        session.reset();
+    }
+}
+
+/**
+    Post to the controlling client and every observer. Observers that have
+    disconnected are removed.
+*/
+void RobotServer::ForEachClient( const std::function<void( PacketMuxer& )>& post )
+{
+    post( *m_controlMuxer );
+
+    std::vector< std::unique_ptr<PacketConnection> > closed;
+    {
+        std::lock_guard<std::mutex> guard( m_connectionLock );
+        auto itr = std::partition( m_observers.begin(), m_observers.end(), []( const std::unique_ptr<PacketConnection>& observer ) {
+            return observer->Ok();
+        });
+        std::move( itr, m_observers.end(), std::back_inserter( closed ) );
+        m_observers.erase( itr, m_observers.end() );
+
+        for ( auto& observer : m_observers )
+        {
+            post( observer->GetMuxer() );
+        }
+    }
+
+    // Connections are destroyed outside the lock as they have to wait for their loops:
+    for ( auto& observer : closed )
+    {
+        std::clog << "Observer disconnected (used " << observer->GetCpuSeconds() << " CPU seconds).\n";
+    }
+}
+
 /**
   @param joy This is only used to ensure that the streaming loop exits when joystick task exits.
 
     Assumptions:
-        m_con is not null.
+        There is a controlling client.
 */
 void RobotServer::StreamVideo( TeleJoystick& joy )
 {
-    assert( m_con != nullptr );
+    assert( m_controlMuxer != nullptr );
 
     // Setup an MPEG4 video stream for half-size video:
     const int w = m_camera->GetFrameWidth();
@@ -182,11 +484,14 @@ void RobotServer::StreamVideo( TeleJoystick& joy )
 
     // Lambda that enqueues video packets via the Muxing system:
     FFMpegStdFunctionIO videoIO( FFMpegCustomIO::WriteBuffer, [&]( uint8_t* buffer, int size ) {
-        m_muxer->EmplacePacket( "AvData", reinterpret_cast<VectorStream::CharType*>(buffer), size );
-        return m_muxer->Ok() ? size : -1;
+        ForEachClient( [&]( PacketMuxer& muxer ) {
+            muxer.EmplacePacket( "AvData", reinterpret_cast<VectorStream::CharType*>(buffer), size );
+        });
+        return m_controlMuxer->Ok() ? size : -1;
     });
 
     LibAvWriter streamer( videoIO );
+    streamer.EnableLiveStream();
     streamer.AddVideoStream( streamWidth, streamHeight, 30, video::FourCc( 'F','M','P','4' ) );
 
     // Allocate double buffers for video conversion:
@@ -245,6 +550,9 @@ void RobotServer::StreamVideo( TeleJoystick& joy )
     m_camera->StartCapture(); // This must not be called before SetCaptureCallback().
 
     {
+        // Every client's muxer has the same packet ids so one channel serves them all:
+        const Channel<timespec, int> avInfo( m_controlMuxer->GetIdManager(), "AvInfo" );
+
         bool sentOk = true;
         std::unique_lock<std::mutex> locker(bufferLock);
         while ( sentOk && joy.IsRunning() )
@@ -260,7 +568,9 @@ void RobotServer::StreamVideo( TeleJoystick& joy )
                 // Send the frame info:
                 const timespec stamp = m_timeBuffer[1];
                 std::clog << "Frame stamp := " << stamp.tv_sec << " " << stamp.tv_nsec << std::endl;
-                Serialise( *m_muxer, "AvInfo", stamp, framesCompressed );
+                ForEachClient( [&]( PacketMuxer& muxer ) {
+                    avInfo.Publish( muxer, stamp, framesCompressed );
+                });
 
                 // Wrap the conversion buffer in a video frame object (YUV420P is native for mpg4):
                 VideoFrame frame( m_buffer[1], AV_PIX_FMT_YUV420P, streamWidth, streamHeight, streamWidth );
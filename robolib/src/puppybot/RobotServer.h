@@ -3,12 +3,31 @@
 
 #include "../../include/RoboLib.h"
 
+#include "../network/EventLoop.h"
+
 #include <memory>
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
 
 class TcpSocket;
 
+/**
+    Connections are serviced by a small pool of event loop threads
+    so any number of clients can be connected at once. The first client
+    to connect controls the robot; clients that connect while it is in
+    control (e.g. loggers or dashboards) are observers that receive the
+    video stream but whose joystick commands are ignored.
+
+    A controlling client that opens a session (see SessionTransport) can
+    reconnect after its link drops out and carry on where it left off: the
+    camera, motors and video encoder keep running as long as the session
+    is resumed in time. Clients without a session work as before.
+*/
 class RobotServer
 {
 public:
@@ -22,19 +41,54 @@ public:
     void SetupMotors();
     void SetupCamera();
 private:
+    /// Number of threads servicing all the client connections:
+    static constexpr unsigned NumEventLoopThreads = 2;
+
+    void StartAccepting();
+    void AcceptConnections();
+    void IdentifyConnection( int fd, std::uint32_t events );
+    void AcceptSession( std::unique_ptr<TcpSocket> con );
+    void AcceptPlain( std::unique_ptr<TcpSocket> con );
+    void ReleaseController();
     void PostConnectionSetup(const std::vector<std::string>& packetTypes);
     void PostCommsCleanup();
     void StreamVideo( TeleJoystick& joy );
+    void ForEachClient( const std::function<void( PacketMuxer& )>& post );
 
     std::string m_serialPort;
 
     std::unique_ptr<MotionMind>     m_motors;
     std::unique_ptr<DiffDrive>      m_drive;
-    std::unique_ptr<PacketMuxer>    m_muxer;
-    std::unique_ptr<PacketDemuxer>  m_demuxer;
     std::unique_ptr<TcpSocket>      m_server;
-    std::unique_ptr<TcpSocket>      m_con;
     std::unique_ptr<UnicapCamera>   m_camera;
+
+    EventLoopPool                   m_eventLoops;
+    EventLoop*                      m_acceptLoop;
+    std::vector<std::string>        m_packetTypes;
+
+    /// An accepted connection waiting for Listen() to make it the controller:
+    struct PendingClient
+    {
+        std::unique_ptr<TcpSocket> socket;
+        bool session;
+        SessionTransport::Handshake hello;
+    };
+
+    // Connections waiting for their first bytes to show whether they open a session (accept loop only):
+    std::map< int, std::unique_ptr<TcpSocket> > m_unidentified;
+
+    // Connections waiting for Listen() and the connected clients. The controller has either
+    // a plain connection or a session (with its own muxer and demuxer):
+    std::mutex                      m_connectionLock;
+    std::condition_variable         m_connectionReady;
+    std::deque<PendingClient>       m_pending;
+    std::unique_ptr<PacketConnection> m_controller;
+    std::unique_ptr<SessionTransport> m_session;
+    std::unique_ptr<PacketDemuxer>  m_sessionDemuxer;
+    std::unique_ptr<PacketMuxer>    m_sessionMuxer;
+    PacketMuxer*                    m_controlMuxer;
+    PacketDemuxer*                  m_controlDemuxer;
+    std::vector< std::unique_ptr<PacketConnection> > m_observers;
 };
 
 #endif // ROBOT_SERVER_H
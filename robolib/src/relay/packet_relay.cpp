@@ -0,0 +1,98 @@
+/**
+    Relays the video and odometry from one robot to any number of viewers:
+    the relay connects to the robot (as an observer) and viewers connect to
+    the relay instead of the robot, so the robot's uplink only carries one
+    copy of the stream however many viewers there are.
+
+    Usage: packet-relay <robot host> <robot port> <listen port>
+*/
+#include "../packetcomms/PacketRelay.h"
+#include "../network/TcpSocket.h"
+#include "../network/EventLoop.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+namespace
+{
+
+const std::vector<std::string> g_packetTypes{"AvInfo", "AvData", "Odometry", "Joystick"};
+
+/// Number of threads servicing the robot and viewer connections:
+constexpr unsigned NumEventLoopThreads = 2;
+
+} // end anonymous namespace
+
+int main( int argc, char** argv )
+{
+    if ( argc != 4 )
+    {
+        std::cerr << "Usage: " << argv[0] << " <robot host> <robot port> <listen port>" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    EventLoopPool loops( NumEventLoopThreads );
+
+    std::unique_ptr<TcpSocket> robotSocket( new TcpSocket() );
+    if ( robotSocket->Connect( argv[1], std::atoi( argv[2] ) ) == false )
+    {
+        std::cerr << "Could not connect to robot." << std::endl;
+        return EXIT_FAILURE;
+    }
+    PacketConnection robot( std::move(robotSocket), loops.Next(), g_packetTypes );
+
+    // A viewer that can not keep up loses video rather than holding up the others:
+    TxConfig viewerConfig;
+    viewerConfig["Odometry"].priority = TxQueueConfig::High;
+    viewerConfig["Odometry"].overflow = OverflowPolicy::KeepLatest;
+    viewerConfig["AvData"].priority = TxQueueConfig::Bulk;
+    viewerConfig["AvData"].maxBytes = 256*1024;
+    viewerConfig["AvData"].overflow = OverflowPolicy::DropOldest;
+
+    PacketRelay relay( robot.GetDemuxer(), {"AvInfo", "AvData", "Odometry"}, viewerConfig );
+
+    // AvInfo is the timestamp and number of the latest frame, so a new viewer knows where the
+    // stream is straight away. It carries no codec header: viewers can only start decoding
+    // at the next I-frame (where the MPEG-4 encoder repeats its VOL header) so nothing from
+    // AvData can be latched, its packets are chunks of the stream not aligned to frames.
+    relay.Latch( "AvInfo" );
+
+    TcpSocket server;
+    if ( server.Bind( std::atoi( argv[3] ) ) == false || server.Listen( SOMAXCONN ) == false )
+    {
+        std::cerr << "Could not listen for viewers." << std::endl;
+        return EXIT_FAILURE;
+    }
+    server.SetBlocking( false );
+
+    EventLoop& acceptLoop = loops.Next();
+    acceptLoop.Invoke( [&]() {
+        acceptLoop.Add( server.GetFileDescriptor(), EPOLLIN, [&]( std::uint32_t ) {
+            while ( true )
+            {
+                std::unique_ptr<Socket> viewer( server.Accept() );
+                if ( viewer == nullptr )
+                {
+                    break;
+                }
+                viewer->SetBlocking( false );
+                relay.AddClient( std::move(viewer), loops.Next() );
+            }
+        });
+    });
+
+    while ( robot.Ok() )
+    {
+        std::this_thread::sleep_for( std::chrono::seconds(1) );
+    }
+
+    std::clog << "Robot disconnected after relaying " << relay.GetNumRelayed() << " packets." << std::endl;
+    acceptLoop.Invoke( [&]() { acceptLoop.Remove( server.GetFileDescriptor() ); } );
+    return EXIT_SUCCESS;
+}
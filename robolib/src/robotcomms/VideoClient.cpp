@@ -3,8 +3,15 @@
 
 #include <chrono>
 
+/// Capacity of the AV packet queue's ring (it spills beyond this rather
+/// than drop part of the bitstream) and the number of times the decode
+/// thread polls it before sleeping when it runs dry:
+constexpr std::size_t avDataQueueCapacity = 4096;
+constexpr unsigned avDataQueueSpinCount = 1000;
+
 VideoClient::VideoClient( PacketDemuxer &demuxer )
 :
+    m_avDataPackets (avDataQueueCapacity, avDataQueueSpinCount),
     m_packetOffset (0),
     m_avDataSubscription (
       demuxer.Subscribe( "AvData", [this]( const ComPacket::ConstSharedPacket& packet )
@@ -32,19 +39,17 @@ bool VideoClient::InitialiseVideoStream( const std::chrono::seconds& videoTimeou
     // Create a video reader object that uses function/callback IO:
     m_videoIO.reset( new FFMpegStdFunctionIO( FFMpegCustomIO::ReadBuffer,
                                               std::bind( &VideoClient::ReadPacket, std::ref(*this), std::placeholders::_1, std::placeholders::_2 ) ) );
-    m_streamer.reset( new LibAvCapture( *m_videoIO ) );
+    // The robot streams raw MPEG-4 (see RobotServer::StreamVideo()) so there
+    // is no need to probe the stream:
+    m_streamer.reset( new LibAvCapture( *m_videoIO, AV_CODEC_ID_MPEG4 ) );
     if ( m_streamer->IsOpen() == false )
     {
         return false;
     }
 
-    // Get some frames so we can extract correct image dimensions:
-    bool gotFrame = false;
-    for ( int i=0;i<2;++i )
-    {
-        gotFrame = m_streamer->GetFrame();
-        m_streamer->DoneFrame();
-    }
+    // Get a frame so we can extract correct image dimensions:
+    bool gotFrame = m_streamer->GetFrame();
+    m_streamer->DoneFrame();
 
     if ( gotFrame == false )
     {
@@ -97,14 +102,16 @@ bool VideoClient::StreamerIoError() const
 /**
     This is called back by the LibAvCapture object when it wants to decode
     the next AV packet (i.e. in consequence of calling m_streamer->GetFrame()).
+
+    Returns whatever is queued (up to size) so the decoder never waits for
+    data that has not arrived yet.
 */
 int VideoClient::ReadPacket( uint8_t* buffer, int size )
 {
     constexpr std::chrono::milliseconds packetTimeout(1000);
-    SimpleQueue::LockedQueue lockedQueue = m_avDataPackets.Lock();
     while ( m_avDataPackets.Empty() && m_avDataSubscription.GetDemuxer().Ok() )
     {
-        lockedQueue.WaitNotEmpty( packetTimeout );
+        m_avDataPackets.WaitNotEmpty( packetTimeout );
 
         if ( m_avDataPackets.Empty() )
         {
@@ -124,13 +131,14 @@ int VideoClient::ReadPacket( uint8_t* buffer, int size )
     while ( required > 0 && m_avDataPackets.Empty() == false )
     {
         const ComPacket::ConstSharedPacket packet = m_avDataPackets.Front();
-        const int availableSize = packet->GetData().size() - m_packetOffset;
+        const int availableSize = packet->GetDataSize() - m_packetOffset;
+        const VectorStream::CharType* data = packet->GetDataPtr() + m_packetOffset;
 
         if ( availableSize <= required )
         {
             // Current packet contains less than required so copy the whole packet
             // and continue:
-            std::copy( packet->GetData().begin() + m_packetOffset, packet->GetData().end(), buffer );
+            std::copy( data, data + availableSize, buffer );
             m_packetOffset = 0; // Reset the packet offset so the next packet will be read from beginning.
             m_avDataPackets.Pop();
             buffer += availableSize;
@@ -141,8 +149,7 @@ int VideoClient::ReadPacket( uint8_t* buffer, int size )
             assert( availableSize > required );
             // Current packet contains more than enough to fulfill the request
             // so copy what is required and save the rest for later:
-            auto startItr = packet->GetData().begin() + m_packetOffset;
-            std::copy( startItr, startItr+required, buffer );
+            std::copy( data, data + required, buffer );
             m_packetOffset += required; // Increment the packet offset by the amount read from this packet.
             required = 0;
         }
@@ -19,6 +19,8 @@ class PacketDemuxer;
     In the constructor a subscription is made to AvData packets which are
     simply enqued as they are received.
 
+    The stream is decoded as a live MPEG-4 stream (see LibAvCapture) so each
+    frame is available as soon as its last packet arrives.
 
 */
 class VideoClient
@@ -30,6 +32,7 @@ public:
     bool InitialiseVideoStream( const std::chrono::seconds& videoTimeout );
     int GetFrameWidth() const { return m_streamer->GetFrameWidth(); };
     int GetFrameHeight() const { return m_streamer->GetFrameHeight(); };
+    double GetDecodeLatencyMilliseconds() const { return m_streamer->GetDecodeLatencyMilliseconds(); };
 
     bool ReceiveVideoFrame( std::function< void(LibAvCapture&) > );
 
@@ -41,8 +44,7 @@ protected:
     int  ReadPacket( uint8_t* buffer, int size );
 
 private:
-    SimpleQueue m_avInfoPackets;
-    SimpleQueue m_avDataPackets;
+    SpillingSpscPacketQueue m_avDataPackets;
     int         m_packetOffset;
     uint64_t    m_lastTotalVideoBytes;
     uint64_t    m_totalVideoBytes;
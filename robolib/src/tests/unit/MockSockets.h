@@ -5,20 +5,27 @@
 #define __MOCK_SOCKETS_H__
 
 #include "../../network/AbstractSocket.h"
+#include "../../network/Socket.h"
 
 #include <arpa/inet.h>
+#include <unistd.h>
+#include <sys/socket.h>
 
-class MuxerTestSocket : public AbstractSocket
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+
+class MuxerTestSocket : public AbstractWriter, public AbstractReader
 {
 public:
     enum State
     {
-        Type = 0,
-        Size,
+        Header = 0,
         Payload
     };
 
-    MuxerTestSocket( int testPayloadSize ) : m_testPayloadSize(testPayloadSize), m_totalBytes(0), m_expected(Type) {}
+    MuxerTestSocket( int testPayloadSize ) : m_testPayloadSize(testPayloadSize), m_totalBytes(0), m_expected(Header) {}
 
     void SetBlocking( bool ) {}
 
@@ -39,6 +46,13 @@ public:
         }
     }
 
+    void CheckHeader( const char* data, std::size_t size )
+    {
+        EXPECT_EQ( 2*sizeof(uint32_t), size );
+        CheckType( data, sizeof(uint32_t) );
+        CheckSize( data + sizeof(uint32_t), sizeof(uint32_t) );
+    }
+
     /// @todo - this test is very tied to implementation (i.e. knows how the writes are broken down). Not good.
     void CheckPayload( const char* data, std::size_t size )
     {
@@ -52,17 +66,13 @@ public:
     {
         switch ( m_expected )
         {
-        case Type:
-            CheckType( data, size );
-            m_expected = Size;
-            break;
-        case Size:
-            CheckSize( data, size );
+        case Header:
+            CheckHeader( data, size );
             m_expected = Payload;
             break;
         case Payload:
             CheckPayload( data, size );
-            m_expected = Type;
+            m_expected = Header;
             break;
         default:
             ADD_FAILURE();
@@ -92,7 +102,7 @@ public:
     IdManager::PacketType m_type;
 };
 
-class DemuxerTestSocket : public AbstractSocket
+class DemuxerTestSocket : public AbstractWriter, public AbstractReader
 {
 public:
     DemuxerTestSocket() {};
@@ -108,7 +118,7 @@ public:
     This mock socket always reports being ready to read, and always
     reports an io error(returns -1) if Read() or Write() are called.
 */
-class AlwaysFailSocket : public AbstractSocket
+class AlwaysFailSocket : public AbstractWriter, public AbstractReader
 {
 public:
     AlwaysFailSocket() {};
@@ -120,5 +130,115 @@ public:
     virtual bool ReadyForReading( int milliseconds ) const { return true; };
 };
 
+/**
+    This mock socket records everything written to it but only ever
+    accepts a few bytes per call (and sometimes none at all) so that
+    the muxer has to correctly resume partial vectored writes.
+*/
+class ShortWriteSocket : public AbstractWriter, public AbstractReader
+{
+public:
+    ShortWriteSocket( std::size_t maxBytesPerWrite ) : m_maxBytesPerWrite(maxBytesPerWrite), m_writeCalls(0) {}
+    virtual ~ShortWriteSocket() {};
+
+    virtual void SetBlocking( bool ) {}
+    virtual int Write( const char* data, std::size_t size )
+    {
+        const iovec iov{ const_cast<char*>(data), size };
+        return WriteVector( &iov, 1 );
+    }
+
+    virtual int WriteVector( const iovec* iov, int count )
+    {
+        m_writeCalls += 1;
+        if ( m_writeCalls % 3 == 0 )
+        {
+            return 0; // Pretend the write would block.
+        }
+
+        std::size_t budget = m_maxBytesPerWrite;
+        int written = 0;
+        for ( int i = 0; i < count && budget > 0; ++i )
+        {
+            const std::size_t n = std::min( budget, iov[i].iov_len );
+            const char* data = static_cast<const char*>( iov[i].iov_base );
+            m_bytes.insert( m_bytes.end(), data, data + n );
+            budget -= n;
+            written += n;
+        }
+        return written;
+    }
+
+    virtual int Read( char*, std::size_t ) { return -1; }
+    virtual bool ReadyForReading( int milliseconds ) const { return false; };
+
+    std::size_t m_maxBytesPerWrite;
+    int m_writeCalls;
+    std::vector<char> m_bytes;
+};
+
+/**
+    Mock socket for testing the demuxer: reads return a recorded
+    byte stream at most maxBytesPerRead bytes at a time. Nothing
+    is readable until Start() is called (so tests can subscribe first).
+*/
+class StreamReadSocket : public AbstractWriter, public AbstractReader
+{
+public:
+    StreamReadSocket( const std::vector<char>& bytes, std::size_t maxBytesPerRead )
+    : m_bytes(bytes), m_maxBytesPerRead(maxBytesPerRead), m_offset(0), m_readCalls(0), m_started(false) {}
+    virtual ~StreamReadSocket() {};
+
+    virtual void SetBlocking( bool ) {}
+    virtual int Write( const char*, std::size_t ) { return -1; }
+
+    virtual int Read( char* data, std::size_t size )
+    {
+        m_readCalls += 1;
+        const std::size_t n = std::min( std::min( size, m_maxBytesPerRead ), m_bytes.size() - m_offset );
+        std::copy( m_bytes.begin() + m_offset, m_bytes.begin() + m_offset + n, data );
+        m_offset += n;
+        return n;
+    }
+
+    virtual bool ReadyForReading( int milliseconds ) const
+    {
+        if ( m_started == false || m_offset == m_bytes.size() )
+        {
+            usleep( 1000 );
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<char> m_bytes;
+    std::size_t m_maxBytesPerRead;
+    std::atomic<std::size_t> m_offset;
+    std::atomic<int> m_readCalls;
+    std::atomic<bool> m_started;
+
+    void Start() { m_started = true; }
+};
+
+/**
+    One end of a connected pair of local stream sockets, so that
+    real socket code can be tested without the network.
+*/
+class SocketPairEnd : public Socket
+{
+public:
+    explicit SocketPairEnd( int fd ) { m_socket = fd; }
+
+    static void Create( std::unique_ptr<Socket>& a, std::unique_ptr<Socket>& b, int type = SOCK_STREAM )
+    {
+        int fds[2];
+        if ( socketpair( AF_UNIX, type, 0, fds ) == 0 )
+        {
+            a.reset( new SocketPairEnd( fds[0] ) );
+            b.reset( new SocketPairEnd( fds[1] ) );
+        }
+    }
+};
+
 #endif /* __MOCK_SOCKETS_H__ */
 
@@ -2,9 +2,19 @@
 
 #include "../../packetcomms/PacketComms.h"
 #include "../../packetcomms/IdManager.h"
+#include "../../packetcomms/Channel.h"
+#include "../../packetcomms/PacketSerialisation.h"
 #include "MockSockets.h"
+#include "../../packetcomms/ControlMessage.h"
+#include "../../network/UdpSocket.h"
+#include "../../network/TcpSocket.h"
 
+#include <cstring>
+#include <limits>
 #include <memory>
+#include <thread>
+
+#include <sys/stat.h>
 
 TEST( packetcomms, IdManager )
 {
@@ -23,6 +33,462 @@ TEST( packetcomms, IdManager )
     EXPECT_EQ( "Type3", packetIds.ToString(ctrl+3) );
 }
 
+TEST( packetcomms, PacketScheduler )
+{
+    IdManager packetIds({ "Video", "Telemetry", "Joystick" });
+    TxConfig config;
+    config["Joystick"].priority = TxQueueConfig::High;
+    config["Telemetry"].weight = 3;
+    PacketScheduler scheduler( packetIds, config );
+
+    const IdManager::PacketType video = packetIds.ToId( "Video" );
+    const IdManager::PacketType telemetry = packetIds.ToId( "Telemetry" );
+    const IdManager::PacketType joystick = packetIds.ToId( "Joystick" );
+
+    constexpr int payloadSize = PacketScheduler::QuantumBytes;
+    for ( int i = 0; i < 40; ++i )
+    {
+        scheduler.Push( std::make_shared<ComPacket>( video, payloadSize ) );
+        scheduler.Push( std::make_shared<ComPacket>( telemetry, payloadSize ) );
+    }
+    scheduler.Push( std::make_shared<ComPacket>( joystick, payloadSize ) );
+    scheduler.Push( std::make_shared<ComPacket>( IdManager::ControlPacket, 1 ) );
+    EXPECT_EQ( 82u, scheduler.Size() );
+
+    // Strict priority between classes:
+    EXPECT_EQ( IdManager::ControlPacket, scheduler.Pop()->GetType() );
+    EXPECT_EQ( joystick, scheduler.Pop()->GetType() );
+
+    // Weighted sharing within a class:
+    int telemetryCount = 0;
+    for ( int i = 0; i < 40; ++i )
+    {
+        telemetryCount += scheduler.Pop()->GetType() == telemetry ? 1 : 0;
+    }
+    EXPECT_EQ( 30, telemetryCount );
+
+    while ( scheduler.Empty() == false )
+    {
+        scheduler.Pop();
+    }
+    EXPECT_EQ( nullptr, scheduler.Pop() );
+}
+
+TEST( packetcomms, PacketSchedulerOverflow )
+{
+    IdManager packetIds({ "Oldest", "Newest", "Latest", "Blocking" });
+    TxConfig config;
+    config["Oldest"].maxPackets = 2;
+    config["Oldest"].overflow = OverflowPolicy::DropOldest;
+    config["Newest"].maxBytes = 20;
+    config["Newest"].overflow = OverflowPolicy::DropNewest;
+    config["Latest"].overflow = OverflowPolicy::KeepLatest;
+    config["Blocking"].maxPackets = 1;
+    PacketScheduler scheduler( packetIds, config );
+
+    const IdManager::PacketType oldest = packetIds.ToId( "Oldest" );
+    const IdManager::PacketType newest = packetIds.ToId( "Newest" );
+    const IdManager::PacketType latest = packetIds.ToId( "Latest" );
+    const IdManager::PacketType blocking = packetIds.ToId( "Blocking" );
+
+    // Packets are tagged by their size so we can tell which ones survived:
+    for ( int size = 1; size <= 4; ++size )
+    {
+        scheduler.Push( std::make_shared<ComPacket>( oldest, size ) );
+        scheduler.Push( std::make_shared<ComPacket>( latest, size ) );
+    }
+    EXPECT_EQ( 0u, scheduler.Push( std::make_shared<ComPacket>( newest, 15 ) ) );
+    EXPECT_EQ( 1u, scheduler.Push( std::make_shared<ComPacket>( newest, 10 ) ) );
+    EXPECT_EQ( 0u, scheduler.Push( std::make_shared<ComPacket>( newest, 5 ) ) );
+
+    EXPECT_FALSE( scheduler.WouldBlock( blocking, 100 ) );
+    scheduler.Push( std::make_shared<ComPacket>( blocking, 100 ) );
+    EXPECT_TRUE( scheduler.WouldBlock( blocking, 1 ) );
+
+    EXPECT_EQ( 2u, scheduler.GetNumDropped( oldest ) );
+    EXPECT_EQ( 1u, scheduler.GetNumDropped( newest ) );
+    EXPECT_EQ( 3u, scheduler.GetNumDropped( latest ) );
+    EXPECT_EQ( 0u, scheduler.GetNumDropped( blocking ) );
+    EXPECT_EQ( 6u, scheduler.Size() );
+
+    std::vector<std::size_t> oldestSizes;
+    std::vector<std::size_t> latestSizes;
+    while ( scheduler.Empty() == false )
+    {
+        const ComPacket::SharedPacket packet = scheduler.Pop();
+        if ( packet->GetType() == oldest ) { oldestSizes.push_back( packet->GetDataSize() ); }
+        if ( packet->GetType() == latest ) { latestSizes.push_back( packet->GetDataSize() ); }
+    }
+    EXPECT_EQ( std::vector<std::size_t>({ 3, 4 }), oldestSizes );
+    EXPECT_EQ( std::vector<std::size_t>({ 4 }), latestSizes );
+    EXPECT_FALSE( scheduler.WouldBlock( blocking, 1 ) );
+}
+
+TEST( packetcomms, PacketSchedulerFragmentation )
+{
+    IdManager packetIds({ "Video", "Joystick" });
+    TxConfig config;
+    config["Video"].maxPackets = 1;
+    config["Video"].overflow = OverflowPolicy::DropOldest;
+    config["Joystick"].priority = TxQueueConfig::High;
+    PacketScheduler scheduler( packetIds, config );
+    scheduler.SetFragmentBytes( 1000 );
+
+    const IdManager::PacketType video = packetIds.ToId( "Video" );
+    const IdManager::PacketType joystick = packetIds.ToId( "Joystick" );
+
+    auto frame = std::make_shared<ComPacket>( video, 3500 );
+    for ( std::size_t i = 0; i < frame->GetDataSize(); ++i ) { frame->GetDataPtr()[i] = char( i ); }
+    frame->SetTimestamp( 1234 );
+    scheduler.Push( ComPacket::SharedPacket( frame ) );
+
+    std::vector<char> reassembled;
+    auto append = [&]( const ComPacket::SharedPacket& packet ) {
+        reassembled.insert( reassembled.end(), packet->GetDataPtr(), packet->GetDataPtr() + packet->GetDataSize() );
+    };
+
+    ComPacket::SharedPacket fragment = scheduler.Pop();
+    EXPECT_EQ( video | MoreFragmentsFlag, fragment->GetType() );
+    EXPECT_EQ( 1000u, fragment->GetDataSize() );
+    EXPECT_EQ( 0u, fragment->GetTimestamp() );
+    append( fragment );
+
+    // A higher priority packet goes between the fragments and the packet
+    // being fragmented can no longer be dropped to make room:
+    scheduler.Push( std::make_shared<ComPacket>( joystick, 10 ) );
+    scheduler.Push( std::make_shared<ComPacket>( video, 10 ) );
+    EXPECT_EQ( 0u, scheduler.GetNumDropped( video ) );
+    EXPECT_EQ( 3u, scheduler.Size() );
+    EXPECT_EQ( joystick, scheduler.Pop()->GetType() );
+
+    for ( std::size_t size : { 1000, 1000 } )
+    {
+        fragment = scheduler.Pop();
+        EXPECT_EQ( video | MoreFragmentsFlag, fragment->GetType() );
+        EXPECT_EQ( size, fragment->GetDataSize() );
+        append( fragment );
+    }
+
+    fragment = scheduler.Pop();
+    EXPECT_EQ( video, fragment->GetType() );
+    EXPECT_EQ( 500u, fragment->GetDataSize() );
+    EXPECT_EQ( 1234u, fragment->GetTimestamp() );
+    append( fragment );
+    EXPECT_EQ( 1u, scheduler.Size() );
+    EXPECT_EQ( 10u, scheduler.Pop()->GetDataSize() );
+    EXPECT_TRUE( scheduler.Empty() );
+
+    // Fragments share the packet's memory:
+    EXPECT_EQ( frame->GetDataPtr() + 3000, fragment->GetDataPtr() );
+    EXPECT_TRUE( std::equal( reassembled.begin(), reassembled.end(), frame->GetDataPtr() ) );
+    EXPECT_EQ( frame->GetDataSize(), reassembled.size() );
+}
+
+TEST( packetcomms, PacketBufferPool )
+{
+    PacketBufferPool pool;
+
+    // Blocks are aligned, rounded up to a size class and not shared:
+    PacketBufferPool::Block* a = pool.Allocate( 100 );
+    PacketBufferPool::Block* b = pool.Allocate( 100 );
+    EXPECT_NE( a, b );
+    EXPECT_EQ( 128u, a->capacity );
+    EXPECT_EQ( 0u, reinterpret_cast<std::uintptr_t>( a->Data() ) % PacketBufferPool::Alignment );
+    EXPECT_EQ( 0u, reinterpret_cast<std::uintptr_t>( b->Data() ) % PacketBufferPool::Alignment );
+
+    // Freed blocks are reused:
+    pool.Free( a );
+    EXPECT_EQ( a, pool.Allocate( 65 ) );
+    pool.Free( a );
+    pool.Free( b );
+
+    // Oversize requests bypass the size classes:
+    PacketBufferPool::Block* big = pool.Allocate( (1 << PacketBufferPool::MaxClassShift) + 1 );
+    EXPECT_EQ( (1u << PacketBufferPool::MaxClassShift) + 1, big->capacity );
+    pool.Free( big );
+
+    // Buffer handles share the block via the reference count:
+    PacketBuffer buffer( 1000 );
+    EXPECT_EQ( 1u, buffer.UseCount() );
+    {
+        ComPacket slice( IdManager::ControlPacket, buffer, 10, 20 );
+        EXPECT_EQ( 2u, buffer.UseCount() );
+        EXPECT_EQ( buffer.Data() + 10, slice.GetDataPtr() );
+        EXPECT_EQ( 20u, slice.GetDataSize() );
+    }
+    EXPECT_EQ( 1u, buffer.UseCount() );
+
+    auto sptr = ComPacket::MakeShared( IdManager::ControlPacket, 33 );
+    EXPECT_EQ( 33u, sptr->GetDataSize() );
+    EXPECT_EQ( 0u, reinterpret_cast<std::uintptr_t>( sptr->GetDataPtr() ) % PacketBufferPool::Alignment );
+}
+
+TEST( packetcomms, SpscQueue )
+{
+    SpscQueue<int> queue( 3 );
+    EXPECT_EQ( 4u, queue.Capacity() );
+    EXPECT_TRUE( queue.Empty() );
+    EXPECT_FALSE( queue.WaitNotEmpty( std::chrono::milliseconds(1) ) );
+
+    for ( int i = 0; i < 4; ++i )
+    {
+        EXPECT_TRUE( queue.Emplace( i ) );
+    }
+    EXPECT_FALSE( queue.Emplace( 4 ) );
+    EXPECT_EQ( 4u, queue.Size() );
+    EXPECT_EQ( 0, queue.Front() );
+    queue.Pop();
+    EXPECT_TRUE( queue.Emplace( 4 ) );
+
+    // Consumer sees items in order while a producer thread fills the queue:
+    constexpr int count = 100000;
+    std::thread producer( [&]() {
+        for ( int i = 5; i < count; ++i )
+        {
+            while ( queue.Emplace( i ) == false ) { std::this_thread::yield(); }
+        }
+    });
+
+    for ( int expected = 1; expected < count; ++expected )
+    {
+        ASSERT_TRUE( queue.WaitNotEmpty( std::chrono::seconds(5) ) );
+        int item = -1;
+        ASSERT_TRUE( queue.TryPop( item ) );
+        ASSERT_EQ( expected, item );
+    }
+    producer.join();
+    EXPECT_TRUE( queue.Empty() );
+}
+
+TEST( packetcomms, SpillingSpscQueue )
+{
+    SpillingSpscQueue<int> queue( 4 );
+    EXPECT_TRUE( queue.Empty() );
+    EXPECT_FALSE( queue.WaitNotEmpty( std::chrono::milliseconds(1) ) );
+
+    // Nothing is refused and the order is kept when the ring is full:
+    for ( int i = 0; i < 10; ++i )
+    {
+        queue.Emplace( i );
+    }
+    EXPECT_EQ( 10u, queue.Size() );
+    EXPECT_EQ( 6u, queue.GetNumSpilled() );
+    for ( int i = 0; i < 3; ++i )
+    {
+        EXPECT_EQ( i, queue.Front() );
+        queue.Pop();
+    }
+    queue.Emplace( 10 ); // Still spilling until the consumer catches up.
+
+    // Consumer sees items in order while a producer thread keeps filling it:
+    constexpr int count = 100000;
+    std::thread producer( [&]() {
+        for ( int i = 11; i < count; ++i )
+        {
+            queue.Emplace( i );
+        }
+    });
+
+    for ( int expected = 3; expected < count; ++expected )
+    {
+        ASSERT_TRUE( queue.WaitNotEmpty( std::chrono::seconds(5) ) );
+        ASSERT_EQ( expected, queue.Front() );
+        queue.Pop();
+    }
+    producer.join();
+    EXPECT_TRUE( queue.Empty() );
+}
+
+TEST( packetcomms, LatestPacketSlot )
+{
+    LatestPacketSlot slot;
+    EXPECT_TRUE( slot.Empty() );
+    EXPECT_FALSE( slot.WaitNotEmpty( std::chrono::milliseconds(1) ) );
+    EXPECT_EQ( nullptr, slot.Take() );
+
+    // Only the newest packet is kept:
+    auto older = ComPacket::MakeShared( 7, 1 );
+    auto newer = ComPacket::MakeShared( 7, 2 );
+    slot.Put( older );
+    slot.Put( newer );
+    EXPECT_TRUE( slot.WaitNotEmpty( std::chrono::milliseconds(1) ) );
+    EXPECT_EQ( newer, slot.Take() );
+    EXPECT_TRUE( slot.Empty() );
+
+    // A waiting consumer is woken by a Put() from another thread:
+    std::thread producer( [&]() {
+        std::this_thread::sleep_for( std::chrono::milliseconds(10) );
+        slot.Put( older );
+    });
+    EXPECT_TRUE( slot.WaitNotEmpty( std::chrono::seconds(5) ) );
+    EXPECT_EQ( older, slot.Take() );
+    producer.join();
+}
+
+TEST( packetcomms, MpscQueue )
+{
+    constexpr int numProducers = 4;
+    constexpr int countPerProducer = 50000;
+    MpscQueue<std::pair<int,int>> queue( 64, 100 );
+
+    std::vector<std::thread> producers;
+    for ( int p = 0; p < numProducers; ++p )
+    {
+        producers.emplace_back( [&queue, p]() {
+            for ( int i = 0; i < countPerProducer; ++i )
+            {
+                while ( queue.Emplace( std::make_pair( p, i ) ) == false ) { std::this_thread::yield(); }
+            }
+        });
+    }
+
+    // Items from each producer must arrive in the order they were posted:
+    std::vector<int> next( numProducers, 0 );
+    for ( int n = 0; n < numProducers*countPerProducer; ++n )
+    {
+        ASSERT_TRUE( queue.WaitNotEmpty( std::chrono::seconds(5) ) );
+        const std::pair<int,int> item = queue.Front();
+        queue.Pop();
+        ASSERT_EQ( next[item.first], item.second );
+        next[item.first] += 1;
+    }
+
+    for ( auto& producer : producers )
+    {
+        producer.join();
+    }
+    EXPECT_TRUE( queue.Empty() );
+
+    // Shared packets are released when popped:
+    MpscPacketQueue packets( 2 );
+    auto sptr = ComPacket::MakeShared( IdManager::ControlPacket, 4 );
+    EXPECT_TRUE( packets.Emplace( sptr ) );
+    EXPECT_EQ( 2, sptr.use_count() );
+    packets.Pop();
+    EXPECT_EQ( 1, sptr.use_count() );
+}
+
+/// Send a datagram in UdpTransport's format:
+TEST( packetcomms, LatencyHistogram )
+{
+    LatencyHistogram histogram;
+    LatencySummary empty = histogram.Summarise();
+    EXPECT_EQ( 0u, empty.count );
+    EXPECT_EQ( 0u, empty.max );
+
+    // 1 to 1000 microseconds:
+    for ( int i = 1000; i >= 1; --i )
+    {
+        histogram.Record( i * 1000 );
+    }
+    histogram.Record( -5 ); // Clock skew counts as zero.
+
+    LatencySummary summary = histogram.Summarise();
+    EXPECT_EQ( 1001u, summary.count );
+    EXPECT_EQ( 1000000u, summary.max );
+    EXPECT_NEAR( 500000.0, summary.p50, 500000 * 0.07 );
+    EXPECT_NEAR( 990000.0, summary.p99, 990000 * 0.07 );
+    EXPECT_LE( summary.p50, summary.p99 );
+    EXPECT_LE( summary.p99, summary.max );
+
+    // Anything too large for the buckets still gives an exact maximum:
+    histogram.Record( std::int64_t(1) << 40 );
+    EXPECT_EQ( std::uint64_t(1) << 40, histogram.Summarise().max );
+}
+
+static void SendUdpTransportDatagram( Socket& socket, uint32_t sequence, uint16_t fragment, uint16_t fragmentCount,
+                                      uint32_t offset, uint32_t type, const std::string& packet, std::size_t length )
+{
+    const uint32_t header[6] = { htonl( 0x524c5544 ), htonl( sequence ), htonl( ( uint32_t(fragment) << 16 ) | fragmentCount ),
+                                 htonl( offset ), htonl( type ), htonl( packet.size() ) };
+    std::vector<char> datagram( reinterpret_cast<const char*>(header), reinterpret_cast<const char*>(header) + sizeof(header) );
+    datagram.insert( datagram.end(), packet.begin() + offset, packet.begin() + offset + length );
+    socket.Write( datagram.data(), datagram.size() );
+}
+
+/// Read the next packet from the transport's byte stream as "type:payload":
+static std::string ReadUdpTransportPacket( UdpTransport& transport )
+{
+    uint32_t header[2];
+    if ( transport.Read( reinterpret_cast<char*>(header), sizeof(header) ) != sizeof(header) )
+    {
+        return "";
+    }
+
+    std::string payload( ntohl( header[1] ), '\0' );
+    if ( payload.size() > 0 )
+    {
+        transport.Read( &payload[0], payload.size() );
+    }
+    return std::to_string( ntohl( header[0] ) ) + ":" + payload;
+}
+
+TEST( packetcomms, UdpTransportOrdering )
+{
+    std::unique_ptr<Socket> sender;
+    std::unique_ptr<Socket> receiver;
+    SocketPairEnd::Create( sender, receiver, SOCK_DGRAM );
+    ASSERT_TRUE( receiver != nullptr );
+    receiver->SetBlocking( false );
+    UdpTransport transport( *receiver );
+
+    // The transport always starts with a Hello:
+    EXPECT_EQ( "1:\xfe", ReadUdpTransportPacket( transport ) );
+
+    SendUdpTransportDatagram( *sender, 5, 0, 1, 0, 2, "five", 4 );
+    SendUdpTransportDatagram( *sender, 3, 0, 1, 0, 2, "three", 5 );  // Stale.
+    SendUdpTransportDatagram( *sender, 4, 0, 1, 0, 3, "four", 4 );   // Different type so not stale.
+    SendUdpTransportDatagram( *sender, 5, 0, 1, 0, 2, "five", 4 );   // Duplicate.
+
+    // Fragments of packet 6 are never completed, packet 7 arrives in reverse order:
+    const std::string six = "sixsixsix";
+    const std::string seven = "sevenseven";
+    SendUdpTransportDatagram( *sender, 6, 0, 3, 0, 2, six, 3 );
+    SendUdpTransportDatagram( *sender, 7, 1, 2, 5, 2, seven, 5 );
+    SendUdpTransportDatagram( *sender, 7, 0, 2, 0, 2, seven, 5 );
+    SendUdpTransportDatagram( *sender, 6, 1, 3, 3, 2, six, 3 );  // Now stale.
+
+    // Junk is ignored:
+    sender->Write( "not a packet", 12 );
+    SendUdpTransportDatagram( *sender, 8, 0, 1, 0, 2, "eight", 5 );
+
+    EXPECT_EQ( "2:five", ReadUdpTransportPacket( transport ) );
+    EXPECT_EQ( "3:four", ReadUdpTransportPacket( transport ) );
+    EXPECT_EQ( "2:sevenseven", ReadUdpTransportPacket( transport ) );
+    EXPECT_EQ( "2:eight", ReadUdpTransportPacket( transport ) );
+    EXPECT_EQ( "", ReadUdpTransportPacket( transport ) );
+    EXPECT_EQ( 3u, transport.GetNumStale() );
+    EXPECT_EQ( 1u, transport.GetNumIncomplete() );
+}
+
+TEST( packetcomms, UdpTransportPacketSize )
+{
+    std::unique_ptr<Socket> sender;
+    std::unique_ptr<Socket> receiver;
+    SocketPairEnd::Create( sender, receiver, SOCK_DGRAM );
+    ASSERT_TRUE( receiver != nullptr );
+    receiver->SetBlocking( false );
+    UdpTransport transport( *receiver, UdpTransport::DefaultMaxDatagramBytes, 12 );
+    EXPECT_EQ( "1:\xfe", ReadUdpTransportPacket( transport ) );
+
+    // A fragment claiming a 4 GiB packet must not start a reassembly:
+    const uint32_t forged[6] = { htonl( 0x524c5544 ), htonl( 1 ), htonl( 2 ), htonl( 0 ), htonl( 2 ), htonl( 0xffffffff ) };
+    sender->Write( reinterpret_cast<const char*>(forged), sizeof(forged) );
+
+    // Packets over the maximum size are ignored whether or not they are fragmented:
+    const std::string thirteen = "thirteen13131";
+    SendUdpTransportDatagram( *sender, 2, 0, 1, 0, 2, thirteen, 13 );
+    SendUdpTransportDatagram( *sender, 3, 0, 2, 0, 2, thirteen, 7 );
+    SendUdpTransportDatagram( *sender, 3, 1, 2, 7, 2, thirteen, 6 );
+    const std::string twelve = "twelvetwelve";
+    SendUdpTransportDatagram( *sender, 4, 0, 2, 0, 2, twelve, 6 );
+    SendUdpTransportDatagram( *sender, 4, 1, 2, 6, 2, twelve, 6 );
+
+    EXPECT_EQ( "2:twelvetwelve", ReadUdpTransportPacket( transport ) );
+    EXPECT_EQ( "", ReadUdpTransportPacket( transport ) );
+    EXPECT_EQ( 0u, transport.GetNumIncomplete() );
+}
+
 void TestComPacket()
 {
     ComPacket pkt;
@@ -39,7 +505,7 @@ void TestComPacket()
     // Test packet contains the byte data:
     for( int i=0; i<size; ++i )
     {
-        EXPECT_EQ( bytes[i], pkt2.GetData()[i] );
+        EXPECT_EQ( bytes[i], pkt2.GetDataPtr()[i] );
     }
 
     // Create an Odometry packet with uninitialised data:
@@ -61,6 +527,10 @@ void TestComPacket()
     EXPECT_EQ( IdManager::ControlPacket, pkt4.GetType() );
     EXPECT_EQ( 0, pkt2.GetDataSize() );
     EXPECT_EQ( IdManager::InvalidPacket, pkt2.GetType() );
+
+    // Sizes the pool can not allocate must throw rather than give a null buffer:
+    EXPECT_THROW( ComPacket( IdManager::ControlPacket, std::numeric_limits<std::size_t>::max() ), std::bad_alloc );
+    EXPECT_THROW( ComPacket( IdManager::ControlPacket, std::numeric_limits<std::size_t>::max() - 16 ), std::bad_alloc );
 }
 
 void TestSimpleQueue()
@@ -145,6 +615,52 @@ void TestPacketMuxer()
     EXPECT_EQ( muxer.GetNumPosted(), muxer.GetNumSent() );
 }
 
+void TestPacketMuxerPartialWrites()
+{
+    constexpr std::size_t maxBytesPerWrite = 5;
+    ShortWriteSocket socket( maxBytesPerWrite );
+
+    constexpr int testPayloadSize = 11;
+    VectorStream::CharType payload[testPayloadSize] = "0123456789";
+    {
+        PacketMuxer muxer( socket, {"MockPacket"} );
+        muxer.EmplacePacket( "MockPacket", payload, testPayloadSize );
+        muxer.EmplacePacket( "MockPacket", payload, testPayloadSize );
+        while ( muxer.GetNumPosted() != muxer.GetNumSent() )
+        {
+            usleep( 1000 );
+        }
+        EXPECT_TRUE( muxer.Ok() );
+    }
+
+    // Walk the byte stream and check it parses into the expected packets:
+    const std::vector<char>& bytes = socket.m_bytes;
+    std::size_t offset = 0;
+    int mockPackets = 0;
+    while ( offset + 2*sizeof(uint32_t) <= bytes.size() )
+    {
+        const uint32_t type = ntohl( *reinterpret_cast<const uint32_t*>( &bytes[offset] ) );
+        const uint32_t size = ntohl( *reinterpret_cast<const uint32_t*>( &bytes[offset + sizeof(uint32_t)] ) );
+        offset += 2*sizeof(uint32_t);
+        ASSERT_LE( offset + size, bytes.size() );
+
+        if ( type == IdManager::ControlPacket + 1 )
+        {
+            mockPackets += 1;
+            ASSERT_EQ( testPayloadSize, size );
+            EXPECT_TRUE( std::equal( payload, payload + testPayloadSize, bytes.begin() + offset ) );
+        }
+        else
+        {
+            EXPECT_EQ( IdManager::ControlPacket, type );
+        }
+        offset += size;
+    }
+
+    EXPECT_EQ( bytes.size(), offset );
+    EXPECT_EQ( 2, mockPackets );
+}
+
 void TestDemuxerExitsCleanly()
 {
     AlwaysFailSocket socket;
@@ -160,3 +676,1449 @@ void TestPacketDemuxer()
     AlwaysFailSocket socket;
     PacketDemuxer demuxer( socket, {} );
 }
+
+/**
+    Record a muxed stream of small packets with one large packet in the middle
+    and check the demuxer splits it back into the same packets however the
+    stream is chunked by the transport.
+*/
+void TestPacketDemuxerStream()
+{
+    constexpr int numSmall = 2000;
+    constexpr std::size_t largeSize = 100000;
+    auto payloadSize = []( int i ) { return i == numSmall/2 ? largeSize : std::size_t( i % 61 ); };
+    auto payloadByte = []( int i, std::size_t j ) { return char( i + j ); };
+
+    ShortWriteSocket writer( 1 << 20 );
+    {
+        PacketMuxer muxer( writer, {"Data"} );
+        for ( int i = 0; i < numSmall; ++i )
+        {
+            std::vector<char> payload( payloadSize(i) );
+            for ( std::size_t j = 0; j < payload.size(); ++j ) { payload[j] = payloadByte( i, j ); }
+            muxer.EmplacePacket( "Data", std::move( payload ) );
+        }
+        while ( muxer.GetNumPosted() != muxer.GetNumSent() )
+        {
+            usleep( 1000 );
+        }
+    }
+
+    for ( const std::size_t maxBytesPerRead : { std::size_t(7), std::size_t(4096), std::size_t(1 << 20) } )
+    {
+        StreamReadSocket reader( writer.m_bytes, maxBytesPerRead );
+        std::vector<ComPacket::ConstSharedPacket> received;
+        std::mutex lock;
+        {
+            PacketDemuxer demuxer( reader, {"Data"} );
+            auto subscription = demuxer.Subscribe( "Data", [&]( const ComPacket::ConstSharedPacket& packet ) {
+                std::lock_guard<std::mutex> guard( lock );
+                received.push_back( packet );
+            });
+            reader.Start();
+
+            for ( int wait = 0; wait < 5000; ++wait )
+            {
+                {
+                    std::lock_guard<std::mutex> guard( lock );
+                    if ( received.size() == std::size_t(numSmall) ) { break; }
+                }
+                usleep( 1000 );
+            }
+        }
+
+        // Check the packets after they were all received to catch them being overwritten:
+        ASSERT_EQ( std::size_t(numSmall), received.size() );
+        for ( int i = 0; i < numSmall; ++i )
+        {
+            ASSERT_EQ( payloadSize(i), received[i]->GetDataSize() );
+            for ( std::size_t j = 0; j < received[i]->GetDataSize(); ++j )
+            {
+                ASSERT_EQ( payloadByte( i, j ), received[i]->GetDataPtr()[j] );
+            }
+        }
+
+        if ( maxBytesPerRead > largeSize )
+        {
+            EXPECT_LT( reader.m_readCalls, numSmall/10 );
+        }
+    }
+}
+
+/**
+    Check fragmented packets are reassembled intact, whatever is sent between
+    their fragments and however the stream is split up by the reads.
+*/
+void TestPacketFragmentation()
+{
+    constexpr int numPackets = 200;
+    auto payloadSize = []( int i ) { return i % 10 == 0 ? std::size_t( 20000 + i ) : std::size_t( i % 61 ); };
+    auto payloadByte = []( int i, std::size_t j ) { return char( i * 7 + j ); };
+    const std::vector<std::string> packetIds( {"Video", "Joystick"} );
+    auto typeOf = []( int i ) { return i % 3 == 0 ? "Joystick" : "Video"; };
+
+    TxConfig txConfig;
+    txConfig["Joystick"].priority = TxQueueConfig::High;
+
+    ShortWriteSocket writer( 1 << 20 );
+    {
+        PacketMuxer muxer( writer, packetIds, txConfig );
+        muxer.EnableFragmentation( 1024 );
+        for ( int i = 0; i < numPackets; ++i )
+        {
+            std::vector<char> payload( payloadSize(i) );
+            for ( std::size_t j = 0; j < payload.size(); ++j ) { payload[j] = payloadByte( i, j ); }
+            muxer.EmplacePacket( typeOf(i), std::move( payload ) );
+        }
+        while ( muxer.GetNumPosted() != muxer.GetNumSent() )
+        {
+            usleep( 1000 );
+        }
+    }
+
+    for ( const std::size_t maxBytesPerRead : { std::size_t(7), std::size_t(1 << 20) } )
+    {
+        StreamReadSocket reader( writer.m_bytes, maxBytesPerRead );
+        std::map<std::string, std::vector<ComPacket::ConstSharedPacket>> received;
+        std::atomic<int> count( 0 );
+        {
+            PacketDemuxer demuxer( reader, packetIds );
+            std::vector<PacketSubscription> subscriptions;
+            for ( const std::string& type : packetIds )
+            {
+                subscriptions.push_back( demuxer.Subscribe( type, [&, type]( const ComPacket::ConstSharedPacket& packet ) {
+                    received[type].push_back( packet );
+                    count += 1;
+                }));
+            }
+            reader.Start();
+
+            for ( int wait = 0; wait < 5000 && count < numPackets; ++wait )
+            {
+                usleep( 1000 );
+            }
+        }
+
+        // Each type arrives in order:
+        ASSERT_EQ( numPackets, count );
+        std::map<std::string, std::size_t> next;
+        for ( int i = 0; i < numPackets; ++i )
+        {
+            const ComPacket::ConstSharedPacket& packet = received[typeOf(i)][ next[typeOf(i)]++ ];
+            ASSERT_EQ( payloadSize(i), packet->GetDataSize() );
+            for ( std::size_t j = 0; j < packet->GetDataSize(); ++j )
+            {
+                ASSERT_EQ( payloadByte( i, j ), packet->GetDataPtr()[j] );
+            }
+        }
+    }
+}
+
+static void AppendPacket( std::vector<char>& bytes, uint32_t type, const void* data, uint32_t size )
+{
+    const uint32_t header[2] = { htonl( type ), htonl( size ) };
+    const char* headerBytes = reinterpret_cast<const char*>( header );
+    bytes.insert( bytes.end(), headerBytes, headerBytes + sizeof(header) );
+    bytes.insert( bytes.end(), static_cast<const char*>( data ), static_cast<const char*>( data ) + size );
+}
+
+/**
+    Check the demuxer refuses a header announcing a payload over its limit
+    (signalling a transport error) instead of trying to allocate it.
+*/
+void TestPacketPayloadLimit()
+{
+    const IdManager packetIds( {"Data"} );
+    const IdManager::PacketType data = packetIds.ToId( "Data" );
+    const auto hello = ControlMessage::Hello;
+    const std::vector<char> payload( 200, 'x' );
+
+    auto receive = [&]( const std::vector<char>& bytes, std::size_t maxPayloadBytes ) {
+        StreamReadSocket reader( bytes, 64 );
+        PacketDemuxer demuxer( reader, {"Data"} );
+        if ( maxPayloadBytes > 0 )
+        {
+            demuxer.SetMaxPayloadBytes( maxPayloadBytes );
+        }
+
+        std::atomic<int> received( 0 );
+        auto subscription = demuxer.Subscribe( "Data", [&]( const ComPacket::ConstSharedPacket& ) {
+            received += 1;
+        });
+        reader.Start();
+
+        for ( int wait = 0; wait < 5000 && demuxer.Ok(); ++wait )
+        {
+            usleep( 1000 );
+        }
+
+        EXPECT_FALSE( demuxer.Ok() );
+        return received.load();
+    };
+
+    // A header claiming 2 GiB (which does not fit in an int) with the default limit:
+    std::vector<char> bytes;
+    AppendPacket( bytes, IdManager::ControlPacket, &hello, sizeof(hello) );
+    AppendPacket( bytes, data, payload.data(), payload.size() );
+    const uint32_t header[2] = { htonl( data ), htonl( 0x80000000u ) };
+    bytes.insert( bytes.end(), reinterpret_cast<const char*>( header ), reinterpret_cast<const char*>( header ) + sizeof(header) );
+    AppendPacket( bytes, data, payload.data(), payload.size() );
+    EXPECT_EQ( 1, receive( bytes, 0 ) );
+
+    // A payload just over a configured limit:
+    bytes.clear();
+    AppendPacket( bytes, IdManager::ControlPacket, &hello, sizeof(hello) );
+    AppendPacket( bytes, data, payload.data(), payload.size() - 1 );
+    AppendPacket( bytes, data, payload.data(), payload.size() );
+    EXPECT_EQ( 1, receive( bytes, payload.size() - 1 ) );
+}
+
+/**
+    Check a fragmented packet is reassembled only up to the demuxer's limit:
+    a peer that keeps sending fragments past it causes a transport error
+    rather than an ever growing buffer.
+*/
+void TestPacketReassemblyLimit()
+{
+    constexpr std::size_t fragmentBytes = 1000;
+    const IdManager packetIds( {"Data"} );
+    const IdManager::PacketType data = packetIds.ToId( "Data" );
+    const std::vector<char> fragment( fragmentBytes, 'x' );
+
+    std::vector<char> bytes;
+    const auto hello = ControlMessage::Hello;
+    AppendPacket( bytes, IdManager::ControlPacket, &hello, sizeof(hello) );
+    AppendPacket( bytes, data | MoreFragmentsFlag, fragment.data(), fragmentBytes );
+    AppendPacket( bytes, data, fragment.data(), fragmentBytes );
+    for ( int i = 0; i < 3; ++i )
+    {
+        AppendPacket( bytes, data | MoreFragmentsFlag, fragment.data(), fragmentBytes );
+    }
+    AppendPacket( bytes, data, fragment.data(), fragmentBytes );
+
+    StreamReadSocket reader( bytes, 64 );
+    PacketDemuxer demuxer( reader, {"Data"} );
+    demuxer.SetMaxPayloadBytes( 2 * fragmentBytes );
+
+    std::atomic<int> received( 0 );
+    std::atomic<std::size_t> receivedBytes( 0 );
+    auto subscription = demuxer.Subscribe( "Data", [&]( const ComPacket::ConstSharedPacket& packet ) {
+        receivedBytes += packet->GetDataSize();
+        received += 1;
+    });
+    reader.Start();
+
+    for ( int wait = 0; wait < 5000 && demuxer.Ok(); ++wait )
+    {
+        usleep( 1000 );
+    }
+
+    EXPECT_FALSE( demuxer.Ok() );
+    EXPECT_EQ( 1, received );
+    EXPECT_EQ( 2 * fragmentBytes, receivedBytes );
+}
+
+/**
+    Check subscribers can come and go (including from inside their own
+    callback) while the demuxer is dispatching packets.
+*/
+void TestPacketDemuxerDispatch()
+{
+    constexpr int numPackets = 10000;
+    const IdManager packetIds( {"Data"} );
+    const IdManager::PacketType data = packetIds.ToId( "Data" );
+
+    std::vector<char> bytes;
+    const auto hello = ControlMessage::Hello;
+    AppendPacket( bytes, IdManager::ControlPacket, &hello, sizeof(hello) );
+    for ( int i = 0; i < numPackets; ++i )
+    {
+        AppendPacket( bytes, data, &i, sizeof(i) );
+    }
+
+    StreamReadSocket reader( bytes, 64 );
+    PacketDemuxer demuxer( reader, {"Data"} );
+
+    std::atomic<int> received( 0 );
+    auto subscription = demuxer.Subscribe( "Data", [&]( const ComPacket::ConstSharedPacket& ) {
+        received += 1;
+    });
+
+    std::atomic<int> selfCalls( 0 );
+    std::unique_ptr<PacketSubscription> self( new PacketSubscription( demuxer.Subscribe( "Data", [&]( const ComPacket::ConstSharedPacket& ) {
+        selfCalls += 1;
+        self.reset();
+    })));
+
+    reader.Start();
+
+    // No callback may run after its subscription has been destroyed:
+    std::atomic<int> violations( 0 );
+    int churned = 0;
+    while ( received < numPackets && churned < 1000 )
+    {
+        std::atomic<bool> unsubscribed( false );
+        {
+            auto temporary = demuxer.Subscribe( "Data", [&]( const ComPacket::ConstSharedPacket& ) {
+                if ( unsubscribed ) { violations += 1; }
+            });
+        }
+        unsubscribed = true;
+        churned += 1;
+    }
+
+    for ( int wait = 0; wait < 5000 && received < numPackets; ++wait )
+    {
+        usleep( 1000 );
+    }
+
+    EXPECT_EQ( numPackets, received );
+    EXPECT_EQ( 1, selfCalls );
+    EXPECT_EQ( 0, violations );
+}
+
+/**
+    Check async subscribers get their packets in order on another thread,
+    and that a slow one does not hold up inline subscribers.
+*/
+void TestPacketDemuxerAsync()
+{
+    constexpr int numPackets = 2000;
+    const IdManager packetIds( {"Data"} );
+
+    std::vector<char> bytes;
+    const auto hello = ControlMessage::Hello;
+    AppendPacket( bytes, IdManager::ControlPacket, &hello, sizeof(hello) );
+    for ( int i = 0; i < numPackets; ++i )
+    {
+        AppendPacket( bytes, packetIds.ToId( "Data" ), &i, sizeof(i) );
+    }
+
+    StreamReadSocket reader( bytes, 1024 );
+    PacketDemuxer demuxer( reader, {"Data"} );
+    const std::thread::id mainThread = std::this_thread::get_id();
+
+    std::atomic<int> inlineReceived( 0 );
+    auto inlineSubscription = demuxer.Subscribe( "Data", [&]( const ComPacket::ConstSharedPacket& ) {
+        inlineReceived += 1;
+    });
+
+    // Slow subscriber that drops packets:
+    std::atomic<int> slowReceived( 0 );
+    std::atomic<int> slowLast( -1 );
+    std::atomic<int> outOfOrder( 0 );
+    std::atomic<bool> slowUnsubscribed( false );
+    std::atomic<int> callsAfterUnsubscribe( 0 );
+    auto slowSubscription = demuxer.Subscribe( "Data", [&]( const ComPacket::ConstSharedPacket& packet ) {
+        const int index = *reinterpret_cast<const int*>( packet->GetDataPtr() );
+        if ( index <= slowLast ) { outOfOrder += 1; }
+        if ( slowUnsubscribed ) { callsAfterUnsubscribe += 1; }
+        slowLast = index;
+        slowReceived += 1;
+        usleep( 1000 );
+    }, SubscriptionOptions::MakeAsync( 8, OverflowPolicy::DropOldest ) );
+
+    // Subscriber that applies back-pressure so must see every packet:
+    std::atomic<int> blockingReceived( 0 );
+    std::atomic<int> blockingErrors( 0 );
+    auto blockingSubscription = demuxer.Subscribe( "Data", [&]( const ComPacket::ConstSharedPacket& packet ) {
+        const int index = *reinterpret_cast<const int*>( packet->GetDataPtr() );
+        if ( index != blockingReceived || std::this_thread::get_id() == mainThread ) { blockingErrors += 1; }
+        blockingReceived += 1;
+    }, SubscriptionOptions::MakeAsync( 4, OverflowPolicy::Block ) );
+
+    reader.Start();
+    for ( int wait = 0; wait < 5000 && ( inlineReceived < numPackets || blockingReceived < numPackets ); ++wait )
+    {
+        usleep( 1000 );
+    }
+
+    EXPECT_EQ( numPackets, inlineReceived );
+    EXPECT_EQ( numPackets, blockingReceived );
+    EXPECT_EQ( 0, blockingErrors );
+    EXPECT_EQ( 0u, blockingSubscription.GetNumDropped() );
+
+    slowSubscription = PacketSubscription();
+    slowUnsubscribed = true;
+    usleep( 10000 );
+    EXPECT_EQ( 0, callsAfterUnsubscribe );
+    EXPECT_EQ( 0, outOfOrder );
+    EXPECT_LT( slowReceived, numPackets );
+    EXPECT_GT( slowReceived, 0 );
+}
+
+/**
+    Check that subscriptions can sample every Nth packet, limit their rate and
+    be conflated so they only see the latest packet.
+*/
+void TestPacketDemuxerSampling()
+{
+    constexpr int numPackets = 1000;
+    const IdManager packetIds( {"Data"} );
+
+    std::vector<char> bytes;
+    const auto hello = ControlMessage::Hello;
+    AppendPacket( bytes, IdManager::ControlPacket, &hello, sizeof(hello) );
+    for ( int i = 0; i < numPackets; ++i )
+    {
+        AppendPacket( bytes, packetIds.ToId( "Data" ), &i, sizeof(i) );
+    }
+
+    StreamReadSocket reader( bytes, 1024 );
+    PacketDemuxer demuxer( reader, {"Data"} );
+
+    std::atomic<int> allReceived( 0 );
+    auto allSubscription = demuxer.Subscribe( "Data", [&]( const ComPacket::ConstSharedPacket& ) {
+        allReceived += 1;
+    });
+
+    SubscriptionOptions everyTenth;
+    everyTenth.everyNth = 10;
+    std::atomic<int> sampledReceived( 0 );
+    std::atomic<int> sampledErrors( 0 );
+    auto sampledSubscription = demuxer.Subscribe( "Data", [&]( const ComPacket::ConstSharedPacket& packet ) {
+        const int index = *reinterpret_cast<const int*>( packet->GetDataPtr() );
+        if ( index != sampledReceived * 10 ) { sampledErrors += 1; }
+        sampledReceived += 1;
+    }, everyTenth );
+
+    // The packets arrive far quicker than once a minute:
+    SubscriptionOptions limited;
+    limited.maxRateHz = 1.0/60.0;
+    std::atomic<int> limitedReceived( 0 );
+    auto limitedSubscription = demuxer.Subscribe( "Data", [&]( const ComPacket::ConstSharedPacket& ) {
+        limitedReceived += 1;
+    }, limited );
+
+    // A slow conflated subscriber only ever has the latest packet waiting:
+    std::atomic<int> conflatedReceived( 0 );
+    std::atomic<int> conflatedLast( -1 );
+    std::atomic<int> outOfOrder( 0 );
+    auto conflatedSubscription = demuxer.Subscribe( "Data", [&]( const ComPacket::ConstSharedPacket& packet ) {
+        const int index = *reinterpret_cast<const int*>( packet->GetDataPtr() );
+        if ( index <= conflatedLast ) { outOfOrder += 1; }
+        conflatedLast = index;
+        conflatedReceived += 1;
+        usleep( 5000 );
+    }, SubscriptionOptions::MakeConflated() );
+
+    reader.Start();
+    for ( int wait = 0; wait < 5000 && ( allReceived < numPackets || conflatedLast != numPackets - 1 ); ++wait )
+    {
+        usleep( 1000 );
+    }
+
+    EXPECT_EQ( numPackets, allReceived );
+    EXPECT_EQ( numPackets / 10, sampledReceived );
+    EXPECT_EQ( 0, sampledErrors );
+    EXPECT_EQ( 1, limitedReceived );
+    EXPECT_EQ( numPackets - 1, conflatedLast );
+    EXPECT_LT( conflatedReceived, numPackets / 2 );
+    EXPECT_EQ( 0, outOfOrder );
+}
+
+/**
+    Check that connections sharing a small pool of event loop threads each
+    exchange packets with a peer (which uses its own threads), and that a
+    peer hanging up is noticed.
+*/
+void TestPacketConnection()
+{
+    constexpr int numConnections = 8;
+    constexpr int numPackets = 500;
+    const std::vector<std::string> packetIds = {"Ping", "Pong"};
+
+    EventLoopPool loops( 2 );
+    std::vector< std::unique_ptr<PacketConnection> > connections;
+    std::vector< std::unique_ptr<Socket> > peerSockets;
+    std::vector< std::unique_ptr<PacketMuxer> > peerMuxers;
+    std::vector< std::unique_ptr<PacketDemuxer> > peerDemuxers;
+    std::vector<PacketSubscription> subscriptions;
+    std::vector< std::atomic<int> > pongs( numConnections );
+    std::atomic<int> errors( 0 );
+
+    for ( int c = 0; c < numConnections; ++c )
+    {
+        std::unique_ptr<Socket> serverEnd;
+        std::unique_ptr<Socket> peerEnd;
+        SocketPairEnd::Create( serverEnd, peerEnd );
+        ASSERT_TRUE( serverEnd != nullptr );
+
+        connections.emplace_back( new PacketConnection( std::move(serverEnd), loops.Next(), packetIds ) );
+        peerSockets.push_back( std::move(peerEnd) );
+        peerMuxers.emplace_back( new PacketMuxer( *peerSockets.back(), packetIds ) );
+        peerDemuxers.emplace_back( new PacketDemuxer( *peerSockets.back(), packetIds ) );
+        pongs[c] = 0;
+
+        // Echo pings from the loop thread:
+        PacketConnection& connection = *connections.back();
+        subscriptions.push_back( connection.GetDemuxer().Subscribe( "Ping", [&connection]( const ComPacket::ConstSharedPacket& packet ) {
+            connection.GetMuxer().EmplacePacket( "Pong", packet->GetDataPtr(), packet->GetDataSize() );
+        }));
+
+        subscriptions.push_back( peerDemuxers.back()->Subscribe( "Pong", [&, c]( const ComPacket::ConstSharedPacket& packet ) {
+            const int index = *reinterpret_cast<const int*>( packet->GetDataPtr() );
+            if ( index != pongs[c] ) { errors += 1; }
+            pongs[c] += 1;
+        }));
+    }
+
+    for ( int i = 0; i < numPackets; ++i )
+    {
+        for ( auto& muxer : peerMuxers )
+        {
+            muxer->EmplacePacket( "Ping", reinterpret_cast<VectorStream::CharType*>(&i), sizeof(i) );
+        }
+    }
+
+    auto allReceived = [&]() {
+        return std::all_of( pongs.begin(), pongs.end(), [&]( const std::atomic<int>& n ) { return n == numPackets; } );
+    };
+    for ( int wait = 0; wait < 5000 && allReceived() == false; ++wait )
+    {
+        usleep( 1000 );
+    }
+
+    EXPECT_TRUE( allReceived() );
+    EXPECT_EQ( 0, errors );
+    for ( auto& connection : connections )
+    {
+        EXPECT_TRUE( connection->Ok() );
+        EXPECT_GT( connection->GetCpuSeconds(), 0.0 );
+    }
+
+    // Peers hang up:
+    for ( auto& socket : peerSockets )
+    {
+        socket->Shutdown();
+    }
+    subscriptions.clear();
+    peerDemuxers.clear();
+    peerMuxers.clear();
+    peerSockets.clear();
+
+    auto allClosed = [&]() {
+        return std::none_of( connections.begin(), connections.end(), []( const std::unique_ptr<PacketConnection>& c ) { return c->Ok(); } );
+    };
+    for ( int wait = 0; wait < 5000 && allClosed() == false; ++wait )
+    {
+        usleep( 1000 );
+    }
+    EXPECT_TRUE( allClosed() );
+}
+
+/**
+    Check a muxer and demuxer can talk over UDP on the loopback interface,
+    and that with simulated loss the packets that do arrive are in order
+    and intact.
+*/
+void TestUdpTransport()
+{
+    constexpr int basePort = 3110;
+    constexpr int numPackets = 400;
+    constexpr std::size_t imageBytes = 5000; // Fragmented.
+    const std::vector<std::string> packetIds = {"Joystick", "Image"};
+
+    UdpSocket sendSocket;
+    UdpSocket receiveSocket;
+    ASSERT_TRUE( sendSocket.Bind( basePort ) );
+    ASSERT_TRUE( receiveSocket.Bind( basePort + 1 ) );
+    ASSERT_TRUE( sendSocket.Connect( "127.0.0.1", basePort + 1 ) );
+    ASSERT_TRUE( receiveSocket.Connect( "127.0.0.1", basePort ) );
+
+    UdpTransport sender( sendSocket );
+    UdpTransport receiver( receiveSocket );
+    sender.SetSimulatedLoss( 0.1 );
+
+    PacketDemuxer demuxer( receiver, packetIds );
+    std::atomic<int> joystickReceived( 0 );
+    std::atomic<int> imagesReceived( 0 );
+    std::atomic<int> errors( 0 );
+    int lastJoystick = -1;
+    int lastImage = -1;
+
+    auto joystickSubscription = demuxer.Subscribe( "Joystick", [&]( const ComPacket::ConstSharedPacket& packet ) {
+        const int index = *reinterpret_cast<const int*>( packet->GetDataPtr() );
+        if ( index <= lastJoystick ) { errors += 1; }
+        lastJoystick = index;
+        joystickReceived += 1;
+    });
+
+    auto imageSubscription = demuxer.Subscribe( "Image", [&]( const ComPacket::ConstSharedPacket& packet ) {
+        const char* data = packet->GetDataPtr();
+        const int index = data[0];
+        if ( packet->GetDataSize() != imageBytes || index <= lastImage ||
+             std::count( data, data + imageBytes, data[0] ) != imageBytes ) { errors += 1; }
+        lastImage = index;
+        imagesReceived += 1;
+    });
+
+    {
+        PacketMuxer muxer( sender, packetIds );
+        std::vector<char> image( imageBytes );
+        for ( int i = 0; i < numPackets; ++i )
+        {
+            muxer.EmplacePacket( "Joystick", reinterpret_cast<VectorStream::CharType*>(&i), sizeof(i) );
+            if ( i % 4 == 0 )
+            {
+                std::fill( image.begin(), image.end(), char( i / 4 ) );
+                muxer.EmplacePacket( "Image", image.data(), image.size() );
+            }
+            usleep( 100 );
+        }
+
+        // Wait until packets stop arriving:
+        int previous = -1;
+        while ( joystickReceived != previous )
+        {
+            previous = joystickReceived;
+            usleep( 20000 );
+        }
+    }
+
+    EXPECT_TRUE( demuxer.Ok() );
+    EXPECT_EQ( 0, errors );
+    EXPECT_GT( sender.GetNumDropped(), 0u );
+    EXPECT_GT( joystickReceived, numPackets / 2 );
+    EXPECT_LT( joystickReceived, numPackets );
+    EXPECT_GT( imagesReceived, 0 );
+    EXPECT_LT( imagesReceived, numPackets / 4 );
+    EXPECT_GT( receiver.GetNumIncomplete(), 0u );
+
+    receiveSocket.Shutdown(); // Wakes up the receive thread.
+}
+
+/**
+    Check a muxer and demuxer can talk through shared memory set up the
+    way two processes would (passing the descriptors over a local socket),
+    including payloads larger than the ring, and that the demuxer sees
+    the other side going away.
+*/
+void TestSharedMemoryTransport()
+{
+    constexpr int numPackets = 2000;
+    constexpr std::size_t largeBytes = 100*1024;
+    const std::vector<std::string> packetIds = {"Small", "Large"};
+
+    std::unique_ptr<SharedMemoryTransport> sender = SharedMemoryTransport::Create( 16*1024 );
+    ASSERT_TRUE( sender != nullptr );
+
+    std::unique_ptr<Socket> localA;
+    std::unique_ptr<Socket> localB;
+    SocketPairEnd::Create( localA, localB );
+    ASSERT_TRUE( sender->SendTo( *localA ) );
+    std::unique_ptr<SharedMemoryTransport> receiver = SharedMemoryTransport::Receive( *localB );
+    ASSERT_TRUE( receiver != nullptr );
+
+    PacketDemuxer demuxer( *receiver, packetIds );
+    std::atomic<int> smallReceived( 0 );
+    std::atomic<int> largeReceived( 0 );
+    std::atomic<int> errors( 0 );
+
+    auto smallSubscription = demuxer.Subscribe( "Small", [&]( const ComPacket::ConstSharedPacket& packet ) {
+        const int index = *reinterpret_cast<const int*>( packet->GetDataPtr() );
+        if ( index != smallReceived ) { errors += 1; }
+        smallReceived += 1;
+    });
+
+    auto largeSubscription = demuxer.Subscribe( "Large", [&]( const ComPacket::ConstSharedPacket& packet ) {
+        const char* data = packet->GetDataPtr();
+        if ( packet->GetDataSize() != largeBytes || data[0] != char( largeReceived ) ||
+             std::count( data, data + largeBytes, data[0] ) != largeBytes ) { errors += 1; }
+        largeReceived += 1;
+    });
+
+    {
+        PacketMuxer muxer( *sender, packetIds );
+        std::vector<char> large( largeBytes );
+        for ( int i = 0; i < numPackets; ++i )
+        {
+            muxer.EmplacePacket( "Small", reinterpret_cast<VectorStream::CharType*>(&i), sizeof(i) );
+            if ( i % 100 == 0 )
+            {
+                std::fill( large.begin(), large.end(), char( i / 100 ) );
+                muxer.EmplacePacket( "Large", large.data(), large.size() );
+            }
+        }
+
+        for ( int wait = 0; wait < 5000 && ( smallReceived < numPackets || largeReceived < numPackets / 100 ); ++wait )
+        {
+            usleep( 1000 );
+        }
+    }
+
+    EXPECT_EQ( numPackets, smallReceived );
+    EXPECT_EQ( numPackets / 100, largeReceived );
+    EXPECT_EQ( 0, errors );
+
+    sender.reset();
+    for ( int wait = 0; wait < 2000 && demuxer.Ok(); ++wait )
+    {
+        usleep( 1000 );
+    }
+    EXPECT_FALSE( demuxer.Ok() );
+}
+
+/**
+    Check a session carries on over a new connection when its connection
+    breaks, with the bytes lost with the old connection resent so no packet
+    is lost or duplicated in either direction, and that a session that can
+    not reconnect fails once its resume timeout has passed.
+*/
+void TestSessionTransport()
+{
+    constexpr int numPackets = 2000;
+    const std::vector<std::string> packetIds = {"Command", "Telemetry"};
+
+    // Each connection is a socket pair. The server end reads the handshake and then
+    // starts or resumes the server's session on its own thread (the client waits for the reply):
+    std::unique_ptr<SessionTransport> server;
+    std::mutex acceptLock;
+    std::vector<std::thread> accepts;
+    std::atomic<int> serverFd( -1 );
+    std::atomic<bool> allowConnect( true );
+    auto connect = [&]() -> std::unique_ptr<Socket> {
+        std::unique_ptr<Socket> clientEnd;
+        std::unique_ptr<Socket> serverEnd;
+        if ( allowConnect )
+        {
+            SocketPairEnd::Create( clientEnd, serverEnd );
+            serverFd = serverEnd->GetFileDescriptor();
+            std::lock_guard<std::mutex> guard( acceptLock );
+            accepts.emplace_back( [&server, socket = std::move(serverEnd)]() mutable {
+                SessionTransport::Handshake hello;
+                if ( SessionTransport::ReadHandshake( *socket, hello ) )
+                {
+                    if ( hello.flags == SessionTransport::NewSession ) { server.reset( new SessionTransport( std::move(socket), hello ) ); }
+                    else { server->Resume( std::move(socket), hello ); }
+                }
+            });
+        }
+        return clientEnd;
+    };
+
+    SessionTransport client( connect );
+    {
+        std::lock_guard<std::mutex> guard( acceptLock );
+        accepts.front().join();
+    }
+    ASSERT_TRUE( client.Ok() );
+    ASSERT_TRUE( server != nullptr );
+    EXPECT_TRUE( server->Ok() );
+    EXPECT_EQ( client.GetSessionId(), server->GetSessionId() );
+
+    // Only the client can resume its session:
+    {
+        std::unique_ptr<Socket> otherEnd;
+        std::unique_ptr<Socket> serverEnd;
+        SocketPairEnd::Create( otherEnd, serverEnd );
+        EXPECT_FALSE( server->Resume( std::move(serverEnd), SessionTransport::Handshake{ SessionTransport::ResumeSession, client.GetSessionId() + 1, 0 } ) );
+        SessionTransport::Handshake reply;
+        EXPECT_TRUE( SessionTransport::ReadHandshake( *otherEnd, reply ) );
+        EXPECT_EQ( SessionTransport::RejectSession, reply.flags );
+    }
+
+    std::atomic<int> commands( 0 );
+    std::atomic<int> telemetry( 0 );
+    std::atomic<int> errors( 0 );
+    PacketDemuxer serverDemuxer( *server, packetIds );
+    PacketDemuxer clientDemuxer( client, packetIds );
+    auto commandSubscription = serverDemuxer.Subscribe( "Command", [&]( const ComPacket::ConstSharedPacket& packet ) {
+        if ( *reinterpret_cast<const int*>( packet->GetDataPtr() ) != commands ) { errors += 1; }
+        commands += 1;
+    });
+    auto telemetrySubscription = clientDemuxer.Subscribe( "Telemetry", [&]( const ComPacket::ConstSharedPacket& packet ) {
+        if ( *reinterpret_cast<const int*>( packet->GetDataPtr() ) != telemetry ) { errors += 1; }
+        telemetry += 1;
+    });
+
+    PacketMuxer clientMuxer( client, packetIds );
+    PacketMuxer serverMuxer( *server, packetIds );
+    auto send = [&]( int begin, int end ) {
+        for ( int i = begin; i < end; ++i )
+        {
+            clientMuxer.EmplacePacket( "Command", reinterpret_cast<VectorStream::CharType*>(&i), sizeof(i) );
+            serverMuxer.EmplacePacket( "Telemetry", reinterpret_cast<VectorStream::CharType*>(&i), sizeof(i) );
+        }
+    };
+
+    // Break the connection while the second half of the packets are on their way:
+    send( 0, numPackets / 2 );
+    shutdown( serverFd, SHUT_RDWR );
+    send( numPackets / 2, numPackets );
+    for ( int wait = 0; wait < 5000 && ( commands < numPackets || telemetry < numPackets ); ++wait )
+    {
+        usleep( 1000 );
+    }
+
+    EXPECT_EQ( numPackets, commands );
+    EXPECT_EQ( numPackets, telemetry );
+    EXPECT_EQ( 0, errors );
+    EXPECT_EQ( 1u, client.GetNumResumes() );
+    EXPECT_EQ( 1u, server->GetNumResumes() );
+    EXPECT_TRUE( clientDemuxer.Ok() && serverDemuxer.Ok() && clientMuxer.Ok() && serverMuxer.Ok() );
+
+    // Now the client can not reconnect:
+    allowConnect = false;
+    client.SetResumeTimeout( std::chrono::milliseconds( 200 ) );
+    server->SetResumeTimeout( std::chrono::milliseconds( 200 ) );
+    shutdown( serverFd, SHUT_RDWR );
+    for ( int wait = 0; wait < 3000 && ( clientDemuxer.Ok() || serverDemuxer.Ok() ); ++wait )
+    {
+        usleep( 1000 );
+    }
+    EXPECT_FALSE( client.Ok() );
+    EXPECT_FALSE( server->Ok() );
+    EXPECT_FALSE( clientDemuxer.Ok() );
+    EXPECT_FALSE( serverDemuxer.Ok() );
+
+    std::lock_guard<std::mutex> guard( acceptLock );
+    for ( std::thread& accept : accepts )
+    {
+        if ( accept.joinable() ) { accept.join(); }
+    }
+}
+
+/**
+    Check a session resumes over TCP when the connection is lost with the
+    peer's receive buffer full of bytes it has not read yet: those bytes go
+    with the old connection so they must still be in the replay buffer.
+*/
+void TestSessionTransportUnread()
+{
+    constexpr int port = 3130;
+    constexpr std::size_t replayBytes = 256*1024;
+
+    TcpSocket listener;
+    ASSERT_TRUE( listener.Bind( port ) );
+    ASSERT_TRUE( listener.Listen( 4 ) );
+
+    std::unique_ptr<SessionTransport> server;
+    std::vector<std::thread> accepts;
+    std::atomic<int> clientFd( -1 );
+    auto connect = [&]() -> std::unique_ptr<Socket> {
+        std::unique_ptr<Socket> clientEnd( new TcpSocket() );
+        if ( clientEnd->Connect( "127.0.0.1", port ) == false )
+        {
+            return nullptr;
+        }
+        clientFd = clientEnd->GetFileDescriptor();
+        accepts.emplace_back( [&, socket = std::unique_ptr<Socket>( listener.Accept() )]() mutable {
+            SessionTransport::Handshake hello;
+            if ( socket != nullptr && SessionTransport::ReadHandshake( *socket, hello ) )
+            {
+                if ( hello.flags == SessionTransport::NewSession ) { server.reset( new SessionTransport( std::move(socket), hello, replayBytes ) ); }
+                else { server->Resume( std::move(socket), hello ); }
+            }
+        });
+        return clientEnd;
+    };
+
+    SessionTransport client( connect, replayBytes );
+    accepts.front().join();
+    ASSERT_TRUE( client.Ok() );
+    ASSERT_TRUE( server != nullptr );
+
+    // The server reads on its own thread, except while it is paused:
+    std::atomic<bool> paused( false );
+    std::atomic<bool> stop( false );
+    std::atomic<std::size_t> received( 0 );
+    std::atomic<int> errors( 0 );
+    std::thread reader( [&]() {
+        std::vector<char> bytes( 64*1024 );
+        while ( stop == false )
+        {
+            if ( paused || server->ReadyForReading( 10 ) == false )
+            {
+                usleep( 1000 );
+                continue;
+            }
+            const int n = server->Read( bytes.data(), bytes.size() );
+            for ( int i = 0; i < n; ++i )
+            {
+                if ( bytes[i] != char( received % 251 ) ) { errors += 1; }
+                received += 1;
+            }
+        }
+    });
+
+    std::size_t written = 0;
+    std::vector<char> chunk( 4096 );
+    auto write = [&]( std::size_t bytes, int timeoutInMilliseconds ) {
+        const std::size_t end = written + bytes;
+        while ( written < end && client.ReadyForWriting( timeoutInMilliseconds ) )
+        {
+            const std::size_t size = std::min( chunk.size(), end - written );
+            for ( std::size_t i = 0; i < size; ++i ) { chunk[i] = char( ( written + i ) % 251 ); }
+            const int n = client.Write( chunk.data(), size );
+            if ( n < 0 )
+            {
+                break;
+            }
+            written += n;
+        }
+    };
+
+    // Stream enough for the kernel to grow the server's receive buffer, then fill
+    // the connection with the server reading nothing:
+    write( 16*1024*1024, 2000 );
+    paused = true;
+    usleep( 50000 );
+    write( 16*1024*1024, 200 );
+
+    // Lose the connection (and with it everything the server has not read):
+    shutdown( clientFd, SHUT_RDWR );
+    EXPECT_EQ( 0, client.Write( chunk.data(), chunk.size() ) );
+    EXPECT_TRUE( client.ReadyForWriting( 2000 ) );
+    EXPECT_TRUE( client.Ok() );
+    EXPECT_EQ( 1u, client.GetNumResumes() );
+
+    // Everything written arrives, in order, over the new connection:
+    paused = false;
+    write( 64*1024, 2000 );
+    for ( int wait = 0; wait < 5000 && received < written; ++wait )
+    {
+        usleep( 1000 );
+    }
+    stop = true;
+    reader.join();
+
+    EXPECT_EQ( written, received );
+    EXPECT_EQ( 0, errors );
+    EXPECT_TRUE( server->Ok() );
+
+    client.Close();
+    server->Close();
+    for ( std::thread& accept : accepts )
+    {
+        if ( accept.joinable() ) { accept.join(); }
+    }
+}
+
+/**
+    Check timestamped headers can be switched on part way through a stream
+    (including for a payload too large for the demuxer's receive buffer) and
+    that both ends then measure the latency of every packet posted after that.
+*/
+void TestPacketLatency()
+{
+    constexpr int numPackets = 200;
+    const std::vector<std::string> packetIds = {"Data"};
+
+    std::unique_ptr<Socket> sendEnd;
+    std::unique_ptr<Socket> receiveEnd;
+    SocketPairEnd::Create( sendEnd, receiveEnd );
+    ASSERT_TRUE( sendEnd != nullptr );
+
+    PacketDemuxer demuxer( *receiveEnd, packetIds );
+    std::atomic<int> received( 0 );
+    std::atomic<int> errors( 0 );
+    auto subscription = demuxer.Subscribe( "Data", [&]( const ComPacket::ConstSharedPacket& packet ) {
+        const int index = *reinterpret_cast<const int*>( packet->GetDataPtr() );
+        if ( index != received ) { errors += 1; }
+        received += 1;
+    });
+
+    {
+        PacketMuxer muxer( *sendEnd, packetIds );
+        std::vector<char> payload( 40*1024 );
+        for ( int i = 0; i < numPackets; ++i )
+        {
+            if ( i == numPackets / 2 )
+            {
+                muxer.EnableLatencyTimestamps();
+            }
+
+            const std::size_t size = i == numPackets - 1 ? payload.size() : 64;
+            std::memcpy( payload.data(), &i, sizeof(i) );
+            muxer.EmplacePacket( "Data", payload.data(), size );
+        }
+
+        for ( int wait = 0; wait < 5000 && received < numPackets; ++wait )
+        {
+            usleep( 1000 );
+        }
+
+        const LatencySummary sent = muxer.GetLatency( "Data" );
+        EXPECT_EQ( numPackets / 2, sent.count );
+        EXPECT_LE( sent.p50, sent.p99 );
+        EXPECT_LE( sent.p99, sent.max );
+    }
+
+    EXPECT_EQ( numPackets, received );
+    EXPECT_EQ( 0, errors );
+
+    const LatencySummary queued = demuxer.GetLatency( "Data", LatencyStage::Queued );
+    const LatencySummary total = demuxer.GetLatency( "Data", LatencyStage::Total );
+    EXPECT_EQ( numPackets / 2, queued.count );
+    EXPECT_EQ( numPackets / 2, total.count );
+    EXPECT_LE( total.p50, total.p99 );
+    EXPECT_LE( total.p99, total.max );
+    EXPECT_LT( total.max, 5000000000u );
+    EXPECT_GE( total.max, queued.max );
+    // Packets posted before the switch but sent after it also have a receive time:
+    EXPECT_LE( demuxer.GetLatency( "Data", LatencyStage::Receive ).count, static_cast<std::uint64_t>( numPackets ) );
+
+    receiveEnd->Shutdown();
+}
+
+/**
+    Record a stream, read the log back (both through the index and in order,
+    and again after losing the index), then replay it into a demuxer whose
+    packet ids are in a different order and through a muxer with pacing.
+*/
+void TestPacketRecorder()
+{
+    constexpr int numPackets = 300;
+    constexpr int numPaced = 5;
+    const std::vector<std::string> packetIds = {"A", "B"};
+    const std::string fileName = "/tmp/robolib_packet_log_" + std::to_string( getpid() );
+
+    auto payloadSize = []( int i ) { return sizeof(int) + ( i * 37 ) % 3000; };
+    auto checkPayload = []( int i, const char* data, std::size_t size ) {
+        int index = -1;
+        std::memcpy( &index, data, sizeof(index) );
+        return index == i && std::all_of( data + sizeof(int), data + size, [i]( char c ) { return c == char(i); } );
+    };
+
+    {
+        std::unique_ptr<Socket> sendEnd;
+        std::unique_ptr<Socket> receiveEnd;
+        SocketPairEnd::Create( sendEnd, receiveEnd );
+        ASSERT_TRUE( sendEnd != nullptr );
+
+        PacketDemuxer demuxer( *receiveEnd, packetIds );
+        PacketRecorder recorder( demuxer, fileName );
+        ASSERT_TRUE( recorder.Ok() );
+
+        PacketMuxer muxer( *sendEnd, packetIds );
+        std::vector<char> payload( 4096 );
+        for ( int i = 0; i < numPackets + numPaced; ++i )
+        {
+            std::fill( payload.begin(), payload.end(), char(i) );
+            std::memcpy( payload.data(), &i, sizeof(i) );
+            muxer.EmplacePacket( i % 3 == 0 ? "B" : "A", payload.data(), payloadSize( i ) );
+            if ( i >= numPackets )
+            {
+                usleep( 20000 ); // Some gaps to check the pacing with.
+            }
+        }
+
+        for ( int wait = 0; wait < 5000 && recorder.GetNumRecorded() < numPackets + numPaced; ++wait )
+        {
+            usleep( 1000 );
+        }
+        recorder.Close();
+        EXPECT_TRUE( recorder.Ok() );
+        EXPECT_EQ( 0u, recorder.GetNumDropped() );
+        receiveEnd->Shutdown();
+    }
+
+    std::unique_ptr<PacketLog> log = PacketLog::Open( fileName );
+    ASSERT_TRUE( log != nullptr );
+    EXPECT_TRUE( log->WasClosed() );
+    EXPECT_EQ( packetIds, log->GetPacketIds() );
+    EXPECT_EQ( numPackets + numPaced, log->GetNumRecords() );
+    EXPECT_EQ( ( numPackets + numPaced + 2 ) / 3, log->GetNumRecords( "B" ) );
+
+    const PacketLogRecord fourthB = log->GetRecord( "B", 3 );
+    EXPECT_TRUE( checkPayload( 9, fourthB.data, fourthB.size ) );
+
+    // The muxer interleaves the types so the log is in the order they were received, not posted:
+    std::vector<int> logged;
+    PacketLogRecord record;
+    std::uint64_t previousTime = 0;
+    for ( auto offset = log->Begin(); log->ReadRecord( offset, record ); )
+    {
+        int index = -1;
+        std::memcpy( &index, record.data, sizeof(index) );
+        EXPECT_TRUE( checkPayload( index, record.data, record.size ) );
+        EXPECT_EQ( payloadSize( index ), record.size );
+        EXPECT_EQ( index % 3 == 0 ? "B" : "A", log->GetIdManager().ToString( record.type ) );
+        EXPECT_LE( previousTime, record.timestamp );
+        previousTime = record.timestamp;
+        logged.push_back( index );
+    }
+    ASSERT_EQ( numPackets + numPaced, logged.size() );
+
+    // Replay as fast as possible to a demuxer that has the types in a different order:
+    {
+        const std::vector<std::string> replayIds = {"C", "B", "A"};
+        PacketReplayer replayer( *log, replayIds, PacketReplayer::AsFastAsPossible );
+        PacketDemuxer demuxer( replayer, replayIds, false );
+        std::vector<int> received;
+        int errors = 0;
+        auto subscriber = [&]( const ComPacket::ConstSharedPacket& packet ) {
+            int index = -1;
+            std::memcpy( &index, packet->GetDataPtr(), sizeof(index) );
+            if ( checkPayload( index, packet->GetDataPtr(), packet->GetDataSize() ) == false ) { errors += 1; }
+            received.push_back( index );
+        };
+        auto a = demuxer.Subscribe( "A", subscriber );
+        auto b = demuxer.Subscribe( "B", subscriber );
+
+        while ( demuxer.ReceiveAvailable() ) {}
+
+        EXPECT_TRUE( replayer.Finished() );
+        EXPECT_EQ( logged, received );
+        EXPECT_EQ( 0, errors );
+    }
+
+    // Replay through a muxer at 4x real time:
+    {
+        std::unique_ptr<Socket> sendEnd;
+        std::unique_ptr<Socket> receiveEnd;
+        SocketPairEnd::Create( sendEnd, receiveEnd );
+        PacketDemuxer demuxer( *receiveEnd, packetIds );
+        std::atomic<int> received( 0 );
+        auto a = demuxer.Subscribe( "A", [&]( const ComPacket::ConstSharedPacket& ) { received += 1; } );
+
+        PacketMuxer muxer( *sendEnd, packetIds );
+        PacketReplayer replayer( *log, packetIds, 4.0 );
+        const auto start = std::chrono::steady_clock::now();
+        replayer.ReplayTo( muxer );
+        const double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+        const double recordedSpan = ( previousTime - log->GetRecord( "A", 0 ).timestamp ) * 1e-9;
+        EXPECT_GE( elapsed, 0.8 * recordedSpan / 4.0 );
+        EXPECT_EQ( numPackets + numPaced, replayer.GetNumReplayed() );
+
+        const int expected = log->GetNumRecords( "A" );
+        for ( int wait = 0; wait < 5000 && received < expected; ++wait )
+        {
+            usleep( 1000 );
+        }
+        EXPECT_EQ( expected, received );
+        receiveEnd->Shutdown();
+    }
+
+    // A log that lost its index (e.g. the recorder crashed) is still readable:
+    log.reset();
+    struct stat info;
+    ASSERT_EQ( 0, stat( fileName.c_str(), &info ) );
+    ASSERT_EQ( 0, truncate( fileName.c_str(), info.st_size - 4 ) );
+    log = PacketLog::Open( fileName );
+    ASSERT_TRUE( log != nullptr );
+    EXPECT_FALSE( log->WasClosed() );
+    EXPECT_EQ( numPackets + numPaced, log->GetNumRecords() );
+    EXPECT_TRUE( checkPayload( 9, log->GetRecord( "B", 3 ).data, log->GetRecord( "B", 3 ).size ) );
+
+    log.reset();
+    unlink( fileName.c_str() );
+}
+
+void TestChannel()
+{
+    static constexpr const char* packetSet[] = { "Pose", "Status" };
+    constexpr Channel<int32_t, double> pose( StaticPacketId( packetSet, "Pose" ) );
+    static_assert( pose.GetType() == IdManager::ControlPacket + 1, "Static ids must match IdManager" );
+
+    const std::vector<std::string> packetIds = PacketIdList( packetSet );
+    std::unique_ptr<Socket> sendEnd;
+    std::unique_ptr<Socket> receiveEnd;
+    SocketPairEnd::Create( sendEnd, receiveEnd );
+    ASSERT_TRUE( sendEnd != nullptr );
+
+    PacketDemuxer demuxer( *receiveEnd, packetIds );
+    const Channel<uint8_t> status( demuxer.GetIdManager(), "Status" );
+    EXPECT_EQ( demuxer.GetIdManager().ToId( "Status" ), status.GetType() );
+    EXPECT_THROW( Channel<uint8_t>( demuxer.GetIdManager(), "Unknown" ), std::out_of_range );
+
+    constexpr int numPackets = 100;
+    std::atomic<int> received( 0 );
+    std::atomic<int> errors( 0 );
+    auto poseSubscription = pose.Subscribe( demuxer, [&]( const int32_t& index, const double& value ) {
+        if ( index != received || value != index * 0.5 ) { errors += 1; }
+        received += 1;
+    });
+
+    std::atomic<int> statusReceived( 0 );
+    auto statusSubscription = status.Subscribe( demuxer, [&]( const uint8_t& value ) {
+        if ( value != 42 ) { errors += 1; }
+        statusReceived += 1;
+    }, SubscriptionOptions::MakeAsync( 4, OverflowPolicy::Block ) );
+
+    {
+        PacketMuxer muxer( *sendEnd, packetIds );
+        for ( int32_t i = 0; i < numPackets; ++i )
+        {
+            pose.Publish( muxer, i, i * 0.5 );
+        }
+        status.Publish( muxer, 42 );
+
+        // Packets sent through a channel can be read with the untyped API too:
+        Serialise( muxer, "Pose", int32_t( numPackets ), numPackets * 0.5 );
+
+        for ( int wait = 0; wait < 5000 && ( received <= numPackets || statusReceived < 1 ); ++wait )
+        {
+            usleep( 1000 );
+        }
+    }
+
+    EXPECT_EQ( numPackets + 1, received );
+    EXPECT_EQ( 1, statusReceived );
+    EXPECT_EQ( 0, errors );
+
+    receiveEnd->Shutdown();
+}
+
+/**
+    A receiver that stops draining packets must stop the sender after a
+    window of packets, with the sender's overflow policy deciding what
+    happens to the rest, and sending must resume once it drains them.
+*/
+void TestFlowControl()
+{
+    constexpr int numPackets = 100;
+    constexpr std::uint32_t window = 8;
+    constexpr std::size_t queueCapacity = 4;
+    const std::vector<std::string> packetIds = {"Video", "Telemetry"};
+
+    // Robot sends video to the client, the client sends credits back to the robot:
+    std::unique_ptr<Socket> robotSend, clientReceive, clientSend, robotReceive;
+    SocketPairEnd::Create( robotSend, clientReceive );
+    SocketPairEnd::Create( clientSend, robotReceive );
+    ASSERT_TRUE( robotSend != nullptr && clientSend != nullptr );
+
+    TxConfig txConfig;
+    txConfig["Video"].flowControl = true;
+    txConfig["Video"].maxPackets = queueCapacity;
+    txConfig["Video"].overflow = OverflowPolicy::DropOldest;
+
+    PacketDemuxer robotDemuxer( *robotReceive, packetIds );
+    PacketMuxer robotMuxer( *robotSend, packetIds, txConfig );
+    robotDemuxer.SetCreditReceiver( &robotMuxer );
+
+    PacketDemuxer clientDemuxer( *clientReceive, packetIds );
+    PacketMuxer clientMuxer( *clientSend, packetIds );
+
+    // A consumer that has stopped draining (e.g. a stalled decoder) holds on to its packets:
+    std::mutex heldLock;
+    std::vector<ComPacket::ConstSharedPacket> held;
+    std::atomic<int> received( 0 );
+    std::atomic<int> lastIndex( -1 );
+    auto subscription = clientDemuxer.Subscribe( "Video", [&]( const ComPacket::ConstSharedPacket& packet ) {
+        lastIndex = *reinterpret_cast<const int*>( packet->GetDataPtr() );
+        received += 1;
+        std::lock_guard<std::mutex> guard( heldLock );
+        held.push_back( packet );
+    });
+
+    clientDemuxer.EnableFlowControl( "Video", window, clientMuxer );
+    for ( int wait = 0; wait < 5000 && robotMuxer.GetCredits( "Video" ) < window; ++wait )
+    {
+        usleep( 1000 );
+    }
+    ASSERT_EQ( window, robotMuxer.GetCredits( "Video" ) );
+
+    // Send a window's worth one at a time, then the rest all at once:
+    for ( int i = 0; i < numPackets; ++i )
+    {
+        robotMuxer.EmplacePacket( "Video", reinterpret_cast<VectorStream::CharType*>( &i ), sizeof(i) );
+        for ( int wait = 0; wait < 5000 && i < static_cast<int>( window ) && received <= i; ++wait )
+        {
+            usleep( 100 );
+        }
+    }
+
+    // Other types are unaffected:
+    std::atomic<int> telemetry( 0 );
+    auto telemetrySubscription = clientDemuxer.Subscribe( "Telemetry", [&]( const ComPacket::ConstSharedPacket& ) { telemetry += 1; } );
+    robotMuxer.EmplacePacket( "Telemetry", "ok", 2 );
+    for ( int wait = 0; wait < 5000 && telemetry < 1; ++wait )
+    {
+        usleep( 1000 );
+    }
+    usleep( 50000 );
+
+    EXPECT_EQ( 1, telemetry );
+    EXPECT_EQ( window, static_cast<std::uint32_t>( received ) );
+    EXPECT_EQ( 0u, robotMuxer.GetCredits( "Video" ) );
+
+    // The rest wait in (or were dropped from) the bounded queue at the sender:
+    const std::uint64_t dropped = robotMuxer.GetNumDropped( "Video" );
+    EXPECT_EQ( numPackets - window - queueCapacity, dropped );
+
+    // Draining the held packets grants credit again so the queued (newest) packets are sent:
+    {
+        std::lock_guard<std::mutex> guard( heldLock );
+        held.clear();
+    }
+    for ( int wait = 0; wait < 5000 && lastIndex != numPackets - 1; ++wait )
+    {
+        usleep( 1000 );
+    }
+    EXPECT_EQ( numPackets - 1, lastIndex );
+    EXPECT_EQ( numPackets - dropped, static_cast<std::uint64_t>( received ) );
+
+    subscription = PacketSubscription();
+    {
+        std::lock_guard<std::mutex> guard( heldLock );
+        held.clear();
+    }
+    robotDemuxer.SetCreditReceiver( nullptr );
+    robotReceive->Shutdown();
+    clientReceive->Shutdown();
+}
+
+/**
+    Check the relay sends every client the latched packets and then the
+    relayed stream intact, and that a client that stops reading only loses
+    its own packets.
+*/
+void TestPacketRelay()
+{
+    constexpr int numFast = 2;
+    constexpr int numPackets = 400;
+    constexpr std::size_t payloadSize = 8*1024;
+    const std::vector<std::string> packetIds = {"Info", "Data", "Private"};
+
+    EventLoopPool loops( 2 ); // Must outlive the relay's client connections.
+    std::unique_ptr<Socket> robotEnd, relayEnd;
+    SocketPairEnd::Create( robotEnd, relayEnd );
+    ASSERT_TRUE( robotEnd != nullptr );
+    PacketMuxer robot( *robotEnd, packetIds );
+    PacketDemuxer upstream( *relayEnd, packetIds );
+
+    TxConfig clientConfig;
+    clientConfig["Data"].maxPackets = 16;
+    clientConfig["Data"].overflow = OverflowPolicy::DropOldest;
+    PacketRelay relay( upstream, {"Info", "Data"}, clientConfig );
+    relay.Latch( "Info" );
+
+    const int info = 42;
+    robot.EmplacePacket( "Info", reinterpret_cast<const VectorStream::CharType*>( &info ), sizeof(info) );
+    for ( int wait = 0; wait < 5000 && relay.GetNumRelayed() < 1; ++wait )
+    {
+        usleep( 1000 );
+    }
+
+    // Clients that join after the Info was relayed:
+    std::vector< std::unique_ptr<Socket> > viewerSockets;
+    std::vector< std::unique_ptr<PacketDemuxer> > viewers;
+    std::vector<PacketSubscription> subscriptions;
+    std::vector< std::atomic<int> > infos( numFast );
+    std::vector< std::atomic<int> > received( numFast );
+    std::atomic<int> errors( 0 );
+    for ( int c = 0; c < numFast + 1; ++c )
+    {
+        std::unique_ptr<Socket> relaySide, viewerSide;
+        SocketPairEnd::Create( relaySide, viewerSide );
+        viewerSockets.push_back( std::move(viewerSide) );
+        if ( c == numFast )
+        {
+            relay.AddClient( std::move(relaySide), loops.Next() ); // The last client never reads.
+            break;
+        }
+
+        infos[c] = 0;
+        received[c] = 0;
+        viewers.emplace_back( new PacketDemuxer( *viewerSockets.back(), packetIds ) );
+        subscriptions.push_back( viewers.back()->Subscribe( "Info", [&, c]( const ComPacket::ConstSharedPacket& packet ) {
+            if ( *reinterpret_cast<const int*>( packet->GetDataPtr() ) == info ) { infos[c] += 1; }
+        }));
+        subscriptions.push_back( viewers.back()->Subscribe( "Data", [&, c]( const ComPacket::ConstSharedPacket& packet ) {
+            const int index = received[c];
+            if ( packet->GetDataSize() != payloadSize || packet->GetDataPtr()[index % payloadSize] != char( index ) ) { errors += 1; }
+            received[c] += 1;
+        }));
+        relay.AddClient( std::move(relaySide), loops.Next() );
+    }
+    EXPECT_EQ( std::size_t( numFast + 1 ), relay.GetNumClients() );
+
+    // Paced so that the clients that are reading never fall far behind:
+    auto minReceived = [&]() {
+        return std::min_element( received.begin(), received.end() )->load();
+    };
+    for ( int i = 0; i < numPackets; ++i )
+    {
+        std::vector<char> payload( payloadSize, 0 );
+        payload[ i % payloadSize ] = char( i );
+        robot.EmplacePacket( "Data", std::move( payload ) );
+        robot.EmplacePacket( "Private", "not relayed", 11 );
+        for ( int wait = 0; wait < 5000 && i - minReceived() > 4; ++wait )
+        {
+            usleep( 100 );
+        }
+    }
+    for ( int wait = 0; wait < 5000 && minReceived() < numPackets; ++wait )
+    {
+        usleep( 1000 );
+    }
+
+    EXPECT_EQ( std::uint64_t( numPackets + 1 ), relay.GetNumRelayed() );
+    EXPECT_EQ( numPackets, minReceived() );
+    EXPECT_EQ( 0, errors );
+    for ( int c = 0; c < numFast; ++c )
+    {
+        EXPECT_EQ( 1, infos[c] );
+    }
+
+    // Only the client that stopped reading lost packets (once its socket filled up):
+    EXPECT_GT( relay.GetNumDropped( "Data" ), 0u );
+
+    // A client that hangs up is removed when the next packet is relayed:
+    viewerSockets.back()->Shutdown();
+    for ( int wait = 0; wait < 5000 && relay.GetNumClients() > std::size_t( numFast ); ++wait )
+    {
+        robot.EmplacePacket( "Info", reinterpret_cast<const VectorStream::CharType*>( &info ), sizeof(info) );
+        usleep( 1000 );
+    }
+    EXPECT_EQ( std::size_t( numFast ), relay.GetNumClients() );
+
+    subscriptions.clear();
+}
+
+/**
+    Check a relay whose upstream is driven by an event loop can forward a
+    burst of more packets than a muxer's ingress queue holds to a client
+    on the same loop: the loop thread is the only one that could drain the
+    client's ingress queue so posting must not wait for it.
+*/
+void TestPacketRelayOnUpstreamLoop()
+{
+    constexpr int numPackets = 3000;
+    const std::vector<std::string> packetIds = {"Odometry"};
+
+    EventLoop loop; // Must outlive the connections.
+    std::unique_ptr<Socket> robotEnd, relayEnd;
+    SocketPairEnd::Create( robotEnd, relayEnd );
+    ASSERT_TRUE( robotEnd != nullptr );
+    PacketMuxer robot( *robotEnd, packetIds );
+    PacketConnection upstream( std::move(relayEnd), loop, packetIds );
+
+    TxConfig clientConfig;
+    clientConfig["Odometry"].maxPackets = 2*numPackets;
+    clientConfig["Odometry"].overflow = OverflowPolicy::DropOldest;
+    PacketRelay relay( upstream.GetDemuxer(), {"Odometry"}, clientConfig );
+
+    std::unique_ptr<Socket> relaySide, viewerSide;
+    SocketPairEnd::Create( relaySide, viewerSide );
+    PacketDemuxer viewer( *viewerSide, packetIds );
+    std::atomic<int> received( 0 );
+    std::atomic<int> errors( 0 );
+    PacketSubscription subscription = viewer.Subscribe( "Odometry", [&]( const ComPacket::ConstSharedPacket& packet ) {
+        if ( *reinterpret_cast<const int*>( packet->GetDataPtr() ) != received ) { errors += 1; }
+        received += 1;
+    });
+    relay.AddClient( std::move(relaySide), loop );
+
+    // Hold up the loop while the robot sends so that the whole burst is
+    // received (and relayed) by one call on the loop thread:
+    loop.Post( []() { usleep( 200000 ); } );
+    for ( int i = 0; i < numPackets; ++i )
+    {
+        robot.EmplacePacket( "Odometry", reinterpret_cast<const VectorStream::CharType*>( &i ), sizeof(i) );
+    }
+
+    for ( int wait = 0; wait < 5000 && received < numPackets; ++wait )
+    {
+        usleep( 1000 );
+    }
+    EXPECT_EQ( numPackets, received );
+    EXPECT_EQ( 0, errors );
+    EXPECT_EQ( std::uint64_t( numPackets ), relay.GetNumRelayed() );
+
+    subscription = PacketSubscription();
+    viewer.Shutdown();
+}
@@ -5,7 +5,26 @@ void TestComPacket();
 void TestSimpleQueue();
 void TestPacketMuxer();
 void TestPacketMuxerExitsCleanly();
+void TestPacketMuxerPartialWrites();
+void TestPacketFragmentation();
 void TestPacketDemuxer();
 void TestDemuxerExitsCleanly();
+void TestPacketDemuxerStream();
+void TestPacketPayloadLimit();
+void TestPacketReassemblyLimit();
+void TestPacketDemuxerDispatch();
+void TestPacketDemuxerAsync();
+void TestPacketDemuxerSampling();
+void TestPacketConnection();
+void TestUdpTransport();
+void TestSharedMemoryTransport();
+void TestSessionTransport();
+void TestSessionTransportUnread();
+void TestPacketLatency();
+void TestPacketRecorder();
+void TestChannel();
+void TestFlowControl();
+void TestPacketRelay();
+void TestPacketRelayOnUpstreamLoop();
 
 #endif // PACKETCOMMSTESTS_H
@@ -1,9 +1,13 @@
 #include <gtest/gtest.h>
 #include <cereal/cereal.hpp>
 #include <cereal/archives/portable_binary.hpp>
+#include <cereal/archives/binary.hpp>
+#include <cereal/types/string.hpp>
+#include <cereal/types/vector.hpp>
 
 #include "../../io/VectorStream.h"
 #include "../../packetcomms/ComPacket.h"
+#include "../../packetcomms/PacketArchive.h"
 
 struct Type1
 {
@@ -59,14 +63,13 @@ TEST( IO, VectorStream )
     Type1 out1;
     Type1 out2;
     {
-        const VectorStream::Buffer& buffer = pkt.GetData();
-        const size_t sizeBefore = buffer.size();
-        VectorInputStream vsIn(buffer);
+        const size_t sizeBefore = pkt.GetDataSize();
+        VectorInputStream vsIn(pkt.GetDataPtr(), pkt.GetDataSize());
         std::istream achiveInputStream(&vsIn);
         cereal::PortableBinaryInputArchive archive(achiveInputStream);
         int intOut = 0;
         archive( out1, intOut, out2, out3 );
-        const size_t sizeAfter = buffer.size();
+        const size_t sizeAfter = pkt.GetDataSize();
         EXPECT_EQ( intOut, intIn );
         // Need to check because VectorInputStream uses const cast inside
         EXPECT_EQ( sizeBefore, sizeAfter );
@@ -85,3 +88,53 @@ TEST( IO, VectorStream )
     EXPECT_EQ( out3.t.axis2, in3.t.axis2);
     EXPECT_EQ( out3.t.max,   out3.t.max);
 }
+
+TEST( IO, PacketArchive )
+{
+    const Type1 in1{1,2,3};
+    const Type2 in2{true,0.1f,{10,11,12}};
+    const std::string inString = "Hello packet";
+    const std::vector<int16_t> inVector( 1000, 7 );
+
+    // Start small with header space so the archive has to grow and keep the header in front:
+    constexpr std::size_t headerBytes = 8;
+    PacketOutputArchive archive( 16, headerBytes );
+    std::memset( archive.GetHeaderPtr(), 0xAB, headerBytes );
+    archive( in1, in2, inString, inVector );
+    EXPECT_EQ( archive.GetHeaderSize(), headerBytes );
+    EXPECT_EQ( static_cast<unsigned char>( archive.GetHeaderPtr()[headerBytes-1] ), 0xAB );
+
+    // Must be byte for byte the same as Cereal's binary archive:
+    VectorOutputStream vs;
+    {
+        std::ostream archiveStream(&vs);
+        cereal::BinaryOutputArchive binaryArchive(archiveStream);
+        binaryArchive( in1, in2, inString, inVector );
+    }
+    ASSERT_EQ( archive.GetDataSize(), vs.Get().size() );
+    EXPECT_EQ( std::memcmp( archive.GetDataPtr(), vs.Get().data(), vs.Get().size() ), 0 );
+
+    // A packet shares the archive's buffer rather than copying it:
+    const ComPacket pkt( IdManager::InvalidPacket, archive.GetBuffer(), archive.GetHeaderSize(), archive.GetDataSize() );
+    EXPECT_EQ( pkt.GetDataPtr(), archive.GetDataPtr() );
+
+    Type1 out1;
+    Type2 out2;
+    std::string outString;
+    std::vector<int16_t> outVector;
+    PacketInputArchive inArchive( pkt.GetDataPtr(), pkt.GetDataSize() );
+    inArchive( out1, out2, outString, outVector );
+    EXPECT_EQ( inArchive.GetRemaining(), 0u );
+
+    EXPECT_EQ( out1.axis1, in1.axis1 );
+    EXPECT_EQ( out1.max, in1.max );
+    EXPECT_EQ( out2.b, in2.b );
+    EXPECT_EQ( out2.f, in2.f );
+    EXPECT_EQ( out2.t.axis2, in2.t.axis2 );
+    EXPECT_EQ( outString, inString );
+    EXPECT_EQ( outVector, inVector );
+
+    // Reading past the end throws like Cereal's own archives:
+    PacketInputArchive truncated( pkt.GetDataPtr(), sizeof(Type1) - 1 );
+    EXPECT_THROW( truncated( out1 ), cereal::Exception );
+}
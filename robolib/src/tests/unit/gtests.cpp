@@ -34,12 +34,71 @@ TEST( robolib, PacketMuxer )
 {
     TestPacketMuxerExitsCleanly();
     TestPacketMuxer();
+    TestPacketMuxerPartialWrites();
+    TestPacketFragmentation();
 }
 
 TEST( robolib, PacketDemuxer )
 {
     TestDemuxerExitsCleanly();
     TestPacketDemuxer();
+    TestPacketDemuxerStream();
+    TestPacketPayloadLimit();
+    TestPacketReassemblyLimit();
+    TestPacketDemuxerDispatch();
+    TestPacketDemuxerAsync();
+    TestPacketDemuxerSampling();
+}
+
+TEST( robolib, PacketConnection )
+{
+    TestPacketConnection();
+}
+
+TEST( robolib, UdpTransport )
+{
+    TestUdpTransport();
+}
+
+TEST( robolib, SharedMemoryTransport )
+{
+    TestSharedMemoryTransport();
+}
+
+TEST( robolib, SessionTransport )
+{
+    TestSessionTransport();
+    TestSessionTransportUnread();
+}
+
+TEST( robolib, PacketLatency )
+{
+    TestPacketLatency();
+}
+
+TEST( robolib, PacketRecorder )
+{
+    TestPacketRecorder();
+}
+
+TEST( robolib, Channel )
+{
+    TestChannel();
+}
+
+TEST( robolib, FlowControl )
+{
+    TestFlowControl();
+}
+
+TEST( robolib, PacketRelay )
+{
+    TestPacketRelay();
+}
+
+TEST( robolib, PacketRelayOnUpstreamLoop )
+{
+    TestPacketRelayOnUpstreamLoop();
 }
 
 /**
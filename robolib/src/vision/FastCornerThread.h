@@ -37,7 +37,7 @@ public:
         uint16_t h;
         uint16_t stride;
         uint16_t threshold;
-        uint8_t* buffer;
+        const uint8_t* buffer;
     };
 
     FastCornerThread();
@@ -7,7 +7,7 @@
 namespace robo
 {
 
-LoadBalancingCornerDetector::LoadBalancingCornerDetector( uint32_t width, uint32_t height, uint32_t stride, uint8_t* buffer )
+LoadBalancingCornerDetector::LoadBalancingCornerDetector( uint32_t width, uint32_t height, uint32_t stride, const uint8_t* buffer )
 :
     m_height            ( height ),
     m_splitHeight       ( height / 2 ),
@@ -19,11 +19,11 @@ LoadBalancingCornerDetector::LoadBalancingCornerDetector( uint32_t width, uint32
     assert( height > 32 );
 
     m_cornerJob1.w = width;
-    m_cornerJob1.stride = width;
+    m_cornerJob1.stride = stride;
     m_cornerJob1.buffer = buffer;
 
     m_cornerJob2.w = width;
-    m_cornerJob2.stride = width;
+    m_cornerJob2.stride = stride;
 
     ReBalance();
 }
@@ -32,6 +32,22 @@ LoadBalancingCornerDetector::~LoadBalancingCornerDetector()
 {
 }
 
+/**
+    Change the image that corners are detected in (e.g. to detect directly in
+    each decoded video frame rather than copying frames into one buffer).
+    The image must be the size given to the constructor.
+
+    @param buffer pointer to the grey-level image data.
+    @param stride number of bytes between rows in buffer.
+*/
+void LoadBalancingCornerDetector::SetImage( const uint8_t* buffer, uint32_t stride )
+{
+    m_cornerJob1.stride = stride;
+    m_cornerJob1.buffer = buffer;
+    m_cornerJob2.stride = stride;
+    m_cornerJob2.buffer = buffer + ( stride * m_yOffsetJob2 );
+}
+
 /**
     Turn off the load balancing algorithm. It is enabled by default.
 
@@ -32,9 +32,11 @@ namespace robo
 class LoadBalancingCornerDetector
 {
 public:
-    LoadBalancingCornerDetector( uint32_t width, uint32_t height, uint32_t stride, uint8_t* buffer );
+    LoadBalancingCornerDetector( uint32_t width, uint32_t height, uint32_t stride, const uint8_t* buffer );
     virtual ~LoadBalancingCornerDetector();
 
+    void SetImage( const uint8_t* buffer, uint32_t stride );
+
     void DisableBalancing();
     void EnableBalancing();
 
@@ -22,8 +22,8 @@ int main( int argc, char** argv )
 
     if ( argc > 1 )
     {
-        // Try to capture from video file:
-        capture.reset( new LibAvCapture( argv[1] ) );
+        // Try to capture from video file (decoding ahead in the background):
+        capture.reset( new LibAvCapture( argv[1], 8 ) );
         if ( false == capture->IsOpen() )
         {
             std::cerr << "Coult not open video-file: " << argv[1] << std::endl;
@@ -71,8 +71,11 @@ int main( int argc, char** argv )
 
     while ( display.IsRunning() && capture->GetFrame() )
     {
+        // Detect straight from the decoded frame when possible (lum is only
+        // filled if the frame has to be converted):
         timer.Reset();
-        capture->ExtractLuminanceImage( lum, capture->GetFrameWidth() );
+        const ImagePlane lumImage = capture->GetLuminanceImage( lum, capture->GetFrameWidth() );
+        m_detector.SetImage( lumImage[0], lumImage.StrideInBytes() );
         totalImageConversionTime_us += timer.GetMicroSeconds();
 
         timer.Reset();
@@ -95,6 +98,11 @@ int main( int argc, char** argv )
             display.Add( robo::AnnotatedImage::Point( detectedCorners[i].x, detectedCorners[i].y ) );
         }
 
+        // The display needs the rows packed together:
+        if ( lumImage[0] != lum )
+        {
+            lumImage.CopyTo( lum, capture->GetFrameWidth() );
+        }
         display.PostImage( GLK::ImageWindow::FixedAspectRatio, capture->GetFrameWidth(), capture->GetFrameHeight(), lum );
 
         capture->DoneFrame();
@@ -6,6 +6,7 @@
 #include "../src/video/FourCc.h"
 #include "../src/video/video_conversion.h"
 #include "../src/video/VideoFrame.h"
+#include "../src/video/ImagePlane.h"
 #include "../src/video/LibAvCapture.h"
 #include "../src/video/LibAvWriter.h"
 #include "../src/video/FFmpegCustomIO.h"
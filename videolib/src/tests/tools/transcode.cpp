@@ -25,7 +25,8 @@ int main( int argc, char** argv )
         return EXIT_FAILURE;
     }
 
-    LibAvCapture video( argv[1] );
+    // Transcoding is decode bound so decode ahead on all cores:
+    LibAvCapture video( argv[1], 8 );
     if ( video.IsOpen() == false )
     {
         std::cerr << "Could not open video from file: " <<  argv[1] << std::endl;
@@ -43,8 +44,8 @@ int main( int argc, char** argv )
 
     while ( video.GetFrame() )
     {
-        video.DoneFrame();
         video.ExtractRgbImage( buffer, video.GetFrameWidth()*3 );
+        video.DoneFrame();
         out.PutVideoFrame( frame );
     }
 
@@ -20,11 +20,15 @@ const int STREAM_HEIGHT = 240;
     Creates a LibAvWriter which writes a test video using the
     specified IO object.
 */
-void RunWriter( FFMpegCustomIO& videoIO )
+void RunWriter( FFMpegCustomIO& videoIO, bool liveStream = false )
 {
     // Write video into memory buffers:
     LibAvWriter writer( videoIO );
     ASSERT_TRUE( writer.IsOpen() );
+    if ( liveStream )
+    {
+        writer.EnableLiveStream();
+    }
 
     bool streamCreated = writer.AddVideoStream( STREAM_WIDTH, STREAM_HEIGHT, 30, video::FourCc( 'F','M','P','4' ) );
     ASSERT_TRUE( streamCreated );
@@ -45,14 +49,15 @@ void RunWriter( FFMpegCustomIO& videoIO )
     free( buffer );
 }
 
-void RunReader( FFMpegCustomIO& videoIn )
+/**
+    Reads back the video written by RunWriter() and checks every frame.
+*/
+void ReadFrames( LibAvCapture& reader )
 {
     uint8_t* buffer;
     int err = posix_memalign( (void**)&buffer, 16, FRAME_WIDTH*FRAME_HEIGHT );
     ASSERT_EQ( 0, err );
 
-    // Now try to read back the same video
-    LibAvCapture reader( videoIn );
     ASSERT_TRUE( reader.IsOpen() );
 
     int decodedCount = 0;
@@ -61,6 +66,16 @@ void RunReader( FFMpegCustomIO& videoIn )
         reader.ExtractLuminanceImage( buffer, 640 );
         EXPECT_EQ( buffer[0], decodedCount );
 
+        // The luminance is the same whether it is used in place (full range)
+        // or converted (MPEG-4 normally decodes to limited range YUV420P),
+        // in which case it goes in the half of the buffer not used above:
+        uint8_t* converted = buffer + FRAME_WIDTH*STREAM_HEIGHT;
+        const ImagePlane plane = reader.GetLuminanceImage( converted, 640 );
+        EXPECT_EQ( 320u, plane.Width() );
+        EXPECT_EQ( 240u, plane.Height() );
+        EXPECT_EQ( buffer[0], plane[0][0] );
+        EXPECT_EQ( buffer[640*100 + 100], plane[100][100] );
+
         /// timespec stamp = reader.GetFrameTimestamp();
         /// @todo Implement user settable timestamp and test it here.
 
@@ -73,6 +88,13 @@ void RunReader( FFMpegCustomIO& videoIn )
     free( buffer );
 }
 
+void RunReader( FFMpegCustomIO& videoIn, unsigned decodeAheadFrames = 0 )
+{
+    // Now try to read back the same video
+    LibAvCapture reader( videoIn, decodeAheadFrames );
+    ReadFrames( reader );
+}
+
 /**
     Test video read/write using FFMpegFileIO.
 */
@@ -101,6 +123,45 @@ void TestVideo()
     EXPECT_EQ( -1, fileCreated ); // should return -1 for non existent file
 }
 
+/**
+    Test reading back in decode-ahead mode gives the same frames in order.
+*/
+void TestDecodeAhead()
+{
+    FFMpegFileIO videoOut( "decode_ahead.avi", false );
+    RunWriter( videoOut );
+
+    FFMpegFileIO videoIn( "decode_ahead.avi", true );
+    RunReader( videoIn, 4 );
+
+    // Check it can be destroyed while the decode thread is still busy (and
+    // that the frame size and IO state are available while the thread decodes):
+    LibAvCapture reader( "decode_ahead.avi", 2 );
+    ASSERT_TRUE( reader.IsOpen() );
+    EXPECT_EQ( STREAM_WIDTH, reader.GetFrameWidth() );
+    EXPECT_EQ( STREAM_HEIGHT, reader.GetFrameHeight() );
+    EXPECT_FALSE( reader.IoError() );
+    EXPECT_TRUE( reader.GetFrame() );
+    EXPECT_EQ( STREAM_WIDTH, reader.GetFrameWidth() );
+    EXPECT_EQ( STREAM_HEIGHT, reader.GetFrameHeight() );
+    reader.DoneFrame();
+}
+
+/**
+    Test the live stream decoder reads back all frames without probing.
+*/
+void TestLiveStream()
+{
+    FFMpegFileIO videoOut( "live.m4v", false );
+    RunWriter( videoOut, true );
+
+    FFMpegFileIO videoIn( "live.m4v", true );
+    LibAvCapture reader( videoIn, AV_CODEC_ID_MPEG4 );
+    ReadFrames( reader );
+    EXPECT_FALSE( reader.IoError() );
+    EXPECT_GE( reader.GetDecodeLatencyMilliseconds(), 0.0 );
+}
+
 void TestStdFunctionIO()
 {
     using namespace std;
@@ -135,6 +196,16 @@ TEST( video, file )
     TestVideo();
 }
 
+TEST( video, decodeahead )
+{
+    TestDecodeAhead();
+}
+
+TEST( video, live )
+{
+    TestLiveStream();
+}
+
 TEST( video, stdfunction )
 {
     TestStdFunctionIO();
@@ -6,6 +6,8 @@
 
 #include <time.h>
 
+#include "ImagePlane.h"
+
 /**
     Abstract base for all types of capture (live or from files).
 */
@@ -26,6 +28,35 @@ public:
     virtual void ExtractLuminanceImage( uint8_t*, int stride ) = 0;
     virtual void ExtractRgbImage( uint8_t*, int stride ) = 0;
     virtual void ExtractBgrImage( uint8_t*, int stride ) = 0;
+
+    /**
+        Get a view of the current frame's luminance without copying it, if
+        the frame's format has a plane that is exactly the grey image. The
+        view is only valid until DoneFrame() (or the next GetFrame()).
+
+        @return false if the luminance would have to be converted.
+    */
+    virtual bool GetLuminancePlane( ImagePlane& ) { return false; };
+
+    /**
+        Get the current frame's luminance, converting it into the buffer only
+        if GetLuminancePlane() can not provide it directly.
+
+        @param data buffer that is used if the frame has to be converted.
+        @param stride number of bytes between rows in data.
+        @return A view of the luminance (which may or may not refer to data)
+        that is only valid until DoneFrame() (or the next GetFrame()).
+    */
+    ImagePlane GetLuminanceImage( uint8_t* data, int stride )
+    {
+        ImagePlane plane;
+        if ( GetLuminancePlane( plane ) == false )
+        {
+            ExtractLuminanceImage( data, stride );
+            plane = ImagePlane( data, GetFrameWidth(), GetFrameHeight(), stride );
+        }
+        return plane;
+    };
 };
 
 #endif /* __CAPTURE_H__ */
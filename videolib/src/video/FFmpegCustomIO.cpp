@@ -27,6 +27,21 @@ int fd_read_packet( void* opaque, uint8_t* buffer, int size )
     return numBytes;
 }
 
+/**
+    Read straight from the IO callback, bypassing the AVIOContext's buffer.
+
+    A single call of the callback is made so this returns whatever data was
+    available rather than waiting to fill the buffer (which is what live
+    streams need). Must not be mixed with reads through the AVIOContext.
+
+    @return number of bytes read, 0 at the end of the stream, or negative on error.
+*/
+int FFMpegCustomIO::ReadDirect( uint8_t* buffer, int size )
+{
+    AVIOContext* io = GetAVIOContext();
+    return io->read_packet( io->opaque, buffer, size );
+}
+
 /**
     Construct an object for non-seekable file-IO.
 
@@ -37,6 +37,8 @@ public:
     virtual AVIOContext* GetAVIOContext() = 0;
     virtual const char* GetStreamName() const = 0;
     virtual bool IoError() const = 0; // should return true if there was an IO error
+
+    int ReadDirect( uint8_t* buffer, int size );
 };
 
 /**
@@ -0,0 +1,57 @@
+/*
+    Copyright (C) Mark Pupilli 2012, All rights reserved
+*/
+#ifndef __IMAGE_PLANE_H__
+#define __IMAGE_PLANE_H__
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+    Non-owning, read-only view of a single plane of 8-bit pixels (e.g. the
+    luminance plane of a decoded frame). Rows are StrideInBytes() apart so
+    the view can refer directly to a decoder's own buffers.
+
+    The view does not keep the data alive: it is only valid for as long as
+    whatever provided it says (see Capture::GetLuminancePlane()).
+*/
+class ImagePlane
+{
+public:
+    ImagePlane() : m_data( 0 ), m_width( 0 ), m_height( 0 ), m_stride( 0 ) {};
+    ImagePlane( const uint8_t* data, uint32_t width, uint32_t height, uint32_t stride )
+    :
+        m_data   ( data ),
+        m_width  ( width ),
+        m_height ( height ),
+        m_stride ( stride )
+    {};
+
+    uint32_t Width() const  { return m_width; };
+    uint32_t Height() const { return m_height; };
+    uint32_t StrideInBytes() const { return m_stride; };
+    bool IsValid() const { return m_data != 0; };
+
+    // Access row pointers:
+    const uint8_t* operator [] ( uint32_t i ) const { return m_data + i*m_stride; };
+
+    /**
+        Copy the pixels into a buffer (for consumers that need the rows to
+        be a particular distance apart).
+    */
+    void CopyTo( uint8_t* data, uint32_t stride ) const
+    {
+        for ( uint32_t j = 0; j < m_height; ++j )
+        {
+            memcpy( data + j*stride, (*this)[j], m_width );
+        }
+    };
+
+private:
+    const uint8_t* m_data;
+    uint32_t m_width;
+    uint32_t m_height;
+    uint32_t m_stride;
+};
+
+#endif /* __IMAGE_PLANE_H__ */
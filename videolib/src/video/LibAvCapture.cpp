@@ -3,6 +3,7 @@
 #include "FFmpegCustomIO.h"
 
 #include <assert.h>
+#include <time.h>
 
 #include <iostream>
 #include <stdint.h>
@@ -11,6 +12,16 @@ extern "C" {
 #include <libavutil/mathematics.h>
 }
 
+static double milliseconds( const timespec& t )
+{
+    return t.tv_sec*1000.0 + (0.000001*t.tv_nsec );
+}
+
+static int64_t microseconds( const timespec& t )
+{
+    return t.tv_sec*1000000LL + t.tv_nsec/1000;
+}
+
 /**
     Static member to register all codecs with libav.
     This is not thread safe.
@@ -90,6 +101,16 @@ void LibAvCapture::Init( const char* streamName )
         return;
     }
 
+    if ( m_decodeAheadFrames > 0 )
+    {
+        // Let libavcodec decode several frames (or slices of a frame) at once
+        // on as many threads as there are cores. Frames must be reference
+        // counted so they stay valid while they wait in the queue:
+        m_codecContext->thread_count = 0;
+        m_codecContext->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        m_codecContext->refcounted_frames = 1;
+    }
+
     // Open codec
     if( avcodec_open2( m_codecContext, m_codec, 0 ) < 0 )
     {
@@ -105,22 +126,80 @@ void LibAvCapture::Init( const char* streamName )
 
     // Allocate video frame
     m_avFrame = av_frame_alloc();
+
+    if ( m_decodeAheadFrames > 0 )
+    {
+        m_frameWidth = m_codecContext->width;
+        m_frameHeight = m_codecContext->height;
+        m_decodeThread = std::thread( &LibAvCapture::DecodeAhead, this );
+    }
+}
+
+/**
+    Initialisation for live streams: the decoder and parser are set up
+    directly for the given codec instead of probing the stream.
+
+    Should only be called from within a constructor.
+*/
+void LibAvCapture::InitLive( AVCodecID codecId )
+{
+    InitLibAvCodec();
+
+    m_codec = avcodec_find_decoder( codecId );
+    m_parser = av_parser_init( codecId );
+    if ( m_codec == 0 || m_parser == 0 )
+    {
+        return;
+    }
+
+    m_codecContext = avcodec_alloc_context3( m_codec );
+    if ( m_codecContext == 0 )
+    {
+        return;
+    }
+
+    // Frame threading delays output by a frame per thread so only allow
+    // slice threading, and ask the decoder not to hold frames back:
+    m_codecContext->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    m_codecContext->thread_type = FF_THREAD_SLICE;
+
+    if ( avcodec_open2( m_codecContext, m_codec, 0 ) < 0 )
+    {
+        return;
+    }
+
+    // The parser reads past the end of its input so the buffer is padded:
+    m_liveBuffer.assign( LiveReadSize + AV_INPUT_BUFFER_PADDING_SIZE, 0 );
+    m_avFrame = av_frame_alloc();
+    m_open = m_avFrame != 0;
 }
 
 /**
     Construct a LibAvCapture object that is ready to read from the specified file.
 
     @param videoFile video file in a valid format (please see libavcodec docs on your platform for supported formats).
+    @param decodeAheadFrames if non-zero the video is decoded on background threads
+    keeping up to this many decoded frames ready for GetFrame().
 
     @note This calls the static member InitLibAvCodec() so is not thread safe. If you are using this
     class in a multi-threaded system then call InitLibAvCodec() manually in your start up code before launching the multi-threaded components.
 */
-LibAvCapture::LibAvCapture( const char* videoFile )
+LibAvCapture::LibAvCapture( const char* videoFile, unsigned decodeAheadFrames )
 :
     m_formatContext ( 0 ),
     m_customIO      ( 0 ),
     m_codecContext  ( 0 ),
-    m_open ( false )
+    m_avFrame       ( 0 ),
+    m_open ( false ),
+    m_decodeAheadFrames ( decodeAheadFrames ),
+    m_decodingFinished  ( false ),
+    m_stopDecoding      ( false ),
+    m_decodeIoError     ( false ),
+    m_frameWidth        ( 0 ),
+    m_frameHeight       ( 0 ),
+    m_live   ( false ),
+    m_parser ( 0 ),
+    m_decodeLatency_ms ( 0.0 )
 {
     Init( videoFile );
 }
@@ -130,22 +209,78 @@ LibAvCapture::LibAvCapture( const char* videoFile )
 
     @param customIO the custom io object that must provide an AVIOContext
     that is valid for output.
+    @param decodeAheadFrames if non-zero the video is decoded on background threads
+    keeping up to this many decoded frames ready for GetFrame().
 */
-LibAvCapture::LibAvCapture( FFMpegCustomIO& customIO )
+LibAvCapture::LibAvCapture( FFMpegCustomIO& customIO, unsigned decodeAheadFrames )
 :
     m_formatContext ( 0 ),
     m_customIO      ( &customIO ),
     m_codecContext  ( 0 ),
-    m_open ( false )
+    m_avFrame       ( 0 ),
+    m_open ( false ),
+    m_decodeAheadFrames ( decodeAheadFrames ),
+    m_decodingFinished  ( false ),
+    m_stopDecoding      ( false ),
+    m_decodeIoError     ( false ),
+    m_frameWidth        ( 0 ),
+    m_frameHeight       ( 0 ),
+    m_live   ( false ),
+    m_parser ( 0 ),
+    m_decodeLatency_ms ( 0.0 )
 {
     Init( m_customIO->GetStreamName() );
 }
 
+/**
+    Construct a reader for a live stream of known format.
+
+    @param customIO the custom io object that must provide an AVIOContext
+    that is valid for input. Its read callback should return whatever data
+    is available (blocking only if there is none).
+    @param liveCodec the codec the stream was encoded with. The stream must
+    be the codec's raw bitstream (no container).
+*/
+LibAvCapture::LibAvCapture( FFMpegCustomIO& customIO, AVCodecID liveCodec )
+:
+    m_formatContext ( 0 ),
+    m_customIO      ( &customIO ),
+    m_codecContext  ( 0 ),
+    m_avFrame       ( 0 ),
+    m_open ( false ),
+    m_decodeAheadFrames ( 0 ),
+    m_decodingFinished  ( false ),
+    m_stopDecoding      ( false ),
+    m_decodeIoError     ( false ),
+    m_frameWidth        ( 0 ),
+    m_frameHeight       ( 0 ),
+    m_live   ( true ),
+    m_parser ( 0 ),
+    m_liveOffset  ( 0 ),
+    m_liveBytes   ( 0 ),
+    m_liveEnded   ( false ),
+    m_liveIoError ( false ),
+    m_inputTime   {0,0},
+    m_decodeLatency_ms ( 0.0 )
+{
+    InitLive( liveCodec );
+}
+
 LibAvCapture::~LibAvCapture()
 {
-    if ( m_open )
+    if ( m_live )
+    {
+        av_frame_free( &m_avFrame );
+        avcodec_free_context( &m_codecContext );
+        if ( m_parser != 0 )
+        {
+            av_parser_close( m_parser );
+        }
+    }
+    else if ( m_open )
     {
-        av_free( m_avFrame );
+        StopDecodeAhead();
+        av_frame_free( &m_avFrame );
         avcodec_close( m_codecContext );
 
         if ( m_customIO == 0 )
@@ -175,6 +310,18 @@ bool LibAvCapture::IsOpen() const
 */
 bool LibAvCapture::IoError() const
 {
+    if ( m_live )
+    {
+        return m_liveIoError;
+    }
+
+    if ( m_decodeAheadFrames > 0 )
+    {
+        // The decode thread owns the IO context (an error ends decoding):
+        std::lock_guard<std::mutex> lock( m_queueLock );
+        return m_decodeIoError;
+    }
+
     assert( m_formatContext != 0 );
 
     assert( m_formatContext->pb != 0 );
@@ -189,6 +336,9 @@ bool LibAvCapture::IoError() const
 /**
     Read frame and buffer it internally.
 
+    In decode-ahead mode this takes the next frame from the decode queue,
+    only waiting if the background decoding has fallen behind.
+
     @return false if there are no more frames to read, true otherwise.
 */
 bool LibAvCapture::GetFrame()
@@ -198,6 +348,26 @@ bool LibAvCapture::GetFrame()
         return false;
     }
 
+    if ( m_live )
+    {
+        return GetLiveFrame();
+    }
+
+    if ( m_decodeAheadFrames > 0 )
+    {
+        return NextDecodedFrame();
+    }
+
+    return DecodeFrame( m_avFrame );
+}
+
+/**
+    Read packets until the next video frame is decoded into frame.
+
+    @return false if there are no more frames to read, true otherwise.
+*/
+bool LibAvCapture::DecodeFrame( AVFrame* frame )
+{
     bool success = false;
     int frameFinished;
     AVPacket packet;
@@ -208,7 +378,7 @@ bool LibAvCapture::GetFrame()
         if( packet.stream_index == m_videoStream )
         {
             // Decode video frame
-            int bytes = avcodec_decode_video2( m_codecContext, m_avFrame, &frameFinished, &packet );
+            int bytes = avcodec_decode_video2( m_codecContext, frame, &frameFinished, &packet );
 
             // Did we get a video frame?
             if( bytes >=0 && frameFinished )
@@ -230,7 +400,7 @@ bool LibAvCapture::GetFrame()
             // but there might be more buffered frames:
             packet.data = 0;
             packet.size = 0;
-            int bytes = avcodec_decode_video2( m_codecContext, m_avFrame, &frameFinished, &packet );
+            int bytes = avcodec_decode_video2( m_codecContext, frame, &frameFinished, &packet );
             if( bytes >=0 && frameFinished )
             {
                 success = true;
@@ -242,6 +412,210 @@ bool LibAvCapture::GetFrame()
     return success;
 }
 
+/**
+    Make the oldest frame in the decode queue the current frame, waiting for
+    the decode thread if the queue is empty.
+
+    The previous current frame is recycled for the decode thread to reuse.
+
+    @return false if decoding has finished and the queue is empty.
+*/
+bool LibAvCapture::NextDecodedFrame()
+{
+    std::unique_lock<std::mutex> lock( m_queueLock );
+    m_queueChanged.wait( lock, [this]() { return m_decoded.empty() == false || m_decodingFinished; } );
+
+    if ( m_decoded.empty() )
+    {
+        return false;
+    }
+
+    AVFrame* previous = m_avFrame;
+    m_avFrame = m_decoded.front();
+    m_decoded.pop_front();
+
+    av_frame_unref( previous );
+    m_spareFrames.push_back( previous );
+    m_queueChanged.notify_all();
+
+    m_frameWidth = m_avFrame->width;
+    m_frameHeight = m_avFrame->height;
+    return true;
+}
+
+/**
+    Body of the decode-ahead thread: decodes frames until the end of the
+    video, blocking whenever the queue already holds m_decodeAheadFrames.
+*/
+void LibAvCapture::DecodeAhead()
+{
+    AVFrame* frame = av_frame_alloc();
+
+    while ( frame != 0 && DecodeFrame( frame ) )
+    {
+        // The decoder can update the codec context's time base as it decodes
+        // so the timestamp is converted here (see GetFrameTimestamp()):
+        if ( frame->pts != AV_NOPTS_VALUE )
+        {
+            frame->pts = av_rescale_q( frame->pts, m_codecContext->time_base, AVRational{1,1000000} );
+        }
+
+        std::unique_lock<std::mutex> lock( m_queueLock );
+        m_queueChanged.wait( lock, [this]() { return m_stopDecoding || m_decoded.size() < m_decodeAheadFrames; } );
+
+        if ( m_stopDecoding )
+        {
+            break;
+        }
+
+        m_decoded.push_back( frame );
+        m_queueChanged.notify_all();
+
+        if ( m_spareFrames.empty() )
+        {
+            frame = av_frame_alloc();
+        }
+        else
+        {
+            frame = m_spareFrames.back();
+            m_spareFrames.pop_back();
+        }
+    }
+
+    av_frame_free( &frame );
+    const bool ioError = m_formatContext->pb == 0 || m_formatContext->pb->error < 0;
+
+    std::lock_guard<std::mutex> lock( m_queueLock );
+    m_decodeIoError = ioError;
+    m_decodingFinished = true;
+    m_queueChanged.notify_all();
+}
+
+/**
+    Stops the decode-ahead thread (if running) and frees all queued frames.
+*/
+void LibAvCapture::StopDecodeAhead()
+{
+    if ( m_decodeThread.joinable() )
+    {
+        {
+            std::lock_guard<std::mutex> lock( m_queueLock );
+            m_stopDecoding = true;
+            m_queueChanged.notify_all();
+        }
+        m_decodeThread.join();
+    }
+
+    for ( AVFrame* frame : m_decoded )
+    {
+        av_frame_free( &frame );
+    }
+    m_decoded.clear();
+
+    for ( AVFrame* frame : m_spareFrames )
+    {
+        av_frame_free( &frame );
+    }
+    m_spareFrames.clear();
+}
+
+/**
+    Get the next frame of a live stream: frames the decoder already has are
+    returned first, only reading more of the stream when it needs input.
+
+    @return false at the end of the stream.
+*/
+bool LibAvCapture::GetLiveFrame()
+{
+    while ( true )
+    {
+        const int err = avcodec_receive_frame( m_codecContext, m_avFrame );
+        if ( err == 0 )
+        {
+            if ( m_avFrame->pts != AV_NOPTS_VALUE )
+            {
+                timespec now;
+                clock_gettime( CLOCK_MONOTONIC, &now );
+                m_decodeLatency_ms = milliseconds( now ) - 0.001*m_avFrame->pts;
+            }
+            return true;
+        }
+
+        if ( err == AVERROR_EOF )
+        {
+            return false;
+        }
+
+        // Anything else means the decoder needs more data (a decoding error
+        // just loses that frame, as it would for a file):
+        if ( SendLivePacket() == false )
+        {
+            return false;
+        }
+    }
+}
+
+/**
+    Parse the stream until a whole frame's packet is found and send it to
+    the decoder, reading more of the stream if needed. At the end of the
+    stream the decoder is told to drain instead.
+
+    Each packet's pts is set to the time (in microseconds) of the read that
+    completed it, so the time travels with the frame through the decoder.
+
+    @return false if nothing more can be sent to the decoder.
+*/
+bool LibAvCapture::SendLivePacket()
+{
+    while ( true )
+    {
+        if ( m_liveBytes == 0 && m_liveEnded == false )
+        {
+            const int bytes = m_customIO->ReadDirect( m_liveBuffer.data(), LiveReadSize );
+            m_liveOffset = 0;
+            if ( bytes > 0 )
+            {
+                m_liveBytes = bytes;
+                clock_gettime( CLOCK_MONOTONIC, &m_inputTime );
+            }
+            else
+            {
+                m_liveEnded = true;
+                m_liveIoError = bytes < 0;
+            }
+        }
+
+        // With no bytes left this flushes whatever the parser is holding:
+        uint8_t* data = 0;
+        int size = 0;
+        const int used = av_parser_parse2( m_parser, m_codecContext, &data, &size,
+                                           m_liveBuffer.data() + m_liveOffset, m_liveBytes,
+                                           AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0 );
+        m_liveOffset += used;
+        m_liveBytes -= used;
+
+        if ( size > 0 )
+        {
+            AVPacket packet;
+            av_init_packet( &packet );
+            packet.data = data;
+            packet.size = size;
+            packet.pts = microseconds( m_inputTime );
+            if ( avcodec_send_packet( m_codecContext, &packet ) == 0 )
+            {
+                return true;
+            }
+            // The decoder rejected the packet so skip it. Either it was corrupt
+            // or it is the end-of-frame start code LibAvWriter appends, which
+            // the parser only leaves on its own after the stream's last frame.
+        }
+        else if ( m_liveEnded )
+        {
+            return avcodec_send_packet( m_codecContext, 0 ) == 0;
+        }
+    }
+}
+
 /**
     Frees any resources allocated during GetFrame(), hence not calling this will cause a memory or resource leak.
 */
@@ -249,18 +623,43 @@ void LibAvCapture::DoneFrame()
 {
 }
 
+/**
+    In decode-ahead mode this is the size of the current frame (or of the
+    stream before the first frame has been read).
+*/
 int32_t LibAvCapture::GetFrameWidth() const
 {
+    if ( m_decodeAheadFrames > 0 )
+    {
+        return m_frameWidth;
+    }
     return m_codecContext->width;
 }
 
 int32_t LibAvCapture::GetFrameHeight() const
 {
+    if ( m_decodeAheadFrames > 0 )
+    {
+        return m_frameHeight;
+    }
     return m_codecContext->height;
 }
 
+/**
+    @return For live streams the time in milliseconds from the current frame's
+    last bytes being read from the stream to the decoder returning the frame
+    (so it includes any time the frame waited behind earlier frames). Zero
+    for other streams.
+*/
+double LibAvCapture::GetDecodeLatencyMilliseconds() const
+{
+    return m_decodeLatency_ms;
+}
+
 /**
     @return the frame's timestamp in micro seconds. For video formats where no time stamp is available return -1.
+    For live streams this is the time (CLOCK_MONOTONIC) the frame's last bytes were read.
+    In decode-ahead mode the decode thread has already converted it.
 */
 timespec LibAvCapture::GetFrameTimestamp() const
 {
@@ -269,17 +668,30 @@ timespec LibAvCapture::GetFrameTimestamp() const
         return {0,0}; // no presentation timestamp provided by decoder
     }
 
-    // Convert from the codec's timebase to microseconds:
-    const int64_t pts = av_rescale_q( m_avFrame->pts, m_codecContext->time_base, AVRational{1,1000000} );
+    // Convert from the codec's timebase to microseconds (unless that was done when it was decoded):
+    const bool inMicroseconds = m_live || m_decodeAheadFrames > 0;
+    const int64_t pts = inMicroseconds ? m_avFrame->pts : av_rescale_q( m_avFrame->pts, m_codecContext->time_base, AVRational{1,1000000} );
     const time_t secs = pts/1000000;
     const long nsecs = (pts%1000000L)*1000L;
     const timespec t{secs,nsecs};
     return t;
 }
 
+/**
+    Full range luminance is copied as it is, anything else is converted
+    (which expands limited range to 0-255).
+*/
 void LibAvCapture::ExtractLuminanceImage( uint8_t* data, int stride )
 {
-    FrameConversion( AV_PIX_FMT_GRAY8, data, stride );
+    ImagePlane plane;
+    if ( GetLuminancePlane( plane ) )
+    {
+        plane.CopyTo( data, stride );
+    }
+    else
+    {
+        FrameConversion( AV_PIX_FMT_GRAY8, data, stride );
+    }
 }
 
 void LibAvCapture::ExtractRgbImage( uint8_t* data, int stride )
@@ -297,6 +709,54 @@ void LibAvCapture::ExtractRgb565Image( uint8_t* data, int stride )
     FrameConversion( AV_PIX_FMT_RGB565, data, stride );
 }
 
+/**
+    The luminance plane is returned directly only when it already is the
+    grey image, i.e. when it is full range (see FullRangeLuminance()).
+    Limited range luminance (16-235, what video codecs usually produce)
+    has to be expanded so it is converted instead.
+*/
+bool LibAvCapture::GetLuminancePlane( ImagePlane& plane )
+{
+    if ( FullRangeLuminance() == false )
+    {
+        return false;
+    }
+
+    plane = ImagePlane( m_avFrame->data[0], m_avFrame->width, m_avFrame->height, m_avFrame->linesize[0] );
+    return true;
+}
+
+/**
+    @return true if the current frame's first plane is luminance spanning
+    the full 0-255 range. This is decided by the frame's colour range: the
+    JPEG formats are always full range and grey images are taken as they are.
+    An unspecified range (what the MPEG-4 decoder reports) is taken to be
+    limited, the default for video.
+*/
+bool LibAvCapture::FullRangeLuminance() const
+{
+    switch ( m_avFrame->format )
+    {
+    case AV_PIX_FMT_YUVJ420P:
+    case AV_PIX_FMT_YUVJ422P:
+    case AV_PIX_FMT_YUVJ444P:
+    case AV_PIX_FMT_GRAY8:
+        return true;
+
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUV410P:
+    case AV_PIX_FMT_YUV411P:
+    case AV_PIX_FMT_NV12:
+    case AV_PIX_FMT_NV21:
+        return m_avFrame->color_range == AVCOL_RANGE_JPEG;
+
+    default:
+        return false;
+    }
+}
+
 /**
     Uses swscale library to convert the most recently read frame to
     the specified format.
@@ -310,11 +770,13 @@ void LibAvCapture::ExtractRgb565Image( uint8_t* data, int stride )
 */
 void LibAvCapture::FrameConversion( AVPixelFormat format, uint8_t* data, int stride )
 {
-    const int w = m_codecContext->width;
-    const int h = m_codecContext->height;
+    const int w = m_avFrame->width;
+    const int h = m_avFrame->height;
     uint8_t* dstPlanes[4] = { data, 0, 0, 0 };
     int dstStrides[4] = { stride, 0, 0, 0 };
 
-    m_converter.Configure( w, h, m_codecContext->pix_fmt, w, h, format );
+    // Use the frame's own format - with frame threading the codec context
+    // belongs to the decoder threads:
+    m_converter.Configure( w, h, static_cast<AVPixelFormat>( m_avFrame->format ), w, h, format );
     m_converter.Convert( m_avFrame->data, m_avFrame->linesize, 0, h, dstPlanes, dstStrides );
 }
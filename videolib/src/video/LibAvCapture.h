@@ -6,6 +6,12 @@
 
 #include <stdint.h>
 
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
@@ -19,15 +25,32 @@ class FFMpegCustomIO;
 
 /**
     Class which uses libavcodec to read video streams from a video file.
+
+    By default frames are decoded on the caller's thread inside GetFrame().
+    For offline processing a number of decode-ahead frames can be given to
+    the constructor: the codec then uses libavcodec's frame and slice
+    threading and a background thread keeps up to that many decoded frames
+    queued, so GetFrame() usually returns immediately and decoding overlaps
+    with whatever the caller does with each frame. Decode-ahead adds
+    latency so it is not meant for live streams.
+
+    Live streams whose codec is known should instead be opened by passing
+    the codec id: this skips libavformat's probing and demuxing altogether.
+    Bytes are read from the custom IO as soon as they arrive, split into
+    frames with the codec's parser, and decoded with the send/receive API
+    in low-delay mode, so each frame is returned as soon as it can be
+    decoded.
 */
 class LibAvCapture : public Capture
 {
 private:
     void Init( const char* streamName );
+    void InitLive( AVCodecID codecId );
 
 public:
-    LibAvCapture( const char* videoFile );
-    LibAvCapture( FFMpegCustomIO& customIO );
+    LibAvCapture( const char* videoFile, unsigned decodeAheadFrames = 0 );
+    LibAvCapture( FFMpegCustomIO& customIO, unsigned decodeAheadFrames = 0 );
+    LibAvCapture( FFMpegCustomIO& customIO, AVCodecID liveCodec );
     virtual ~LibAvCapture();
 
     bool IsOpen() const;
@@ -38,16 +61,26 @@ public:
     int32_t GetFrameWidth() const;
     int32_t GetFrameHeight() const;
     timespec GetFrameTimestamp() const;
+    double GetDecodeLatencyMilliseconds() const;
 
     void ExtractLuminanceImage( uint8_t* data, int stride );
     void ExtractRgbImage( uint8_t* data, int stride );
     void ExtractBgrImage( uint8_t* data, int stride );
     void ExtractRgb565Image( uint8_t* data, int stride );
 
+    bool GetLuminancePlane( ImagePlane& plane );
+
     static void InitLibAvCodec();
 
 protected:
     void FrameConversion( AVPixelFormat format, uint8_t* data, int stride );
+    bool FullRangeLuminance() const;
+    bool DecodeFrame( AVFrame* frame );
+    bool NextDecodedFrame();
+    void DecodeAhead();
+    void StopDecodeAhead();
+    bool GetLiveFrame();
+    bool SendLivePacket();
 
 private:
     AVFormatContext* m_formatContext;
@@ -58,6 +91,31 @@ private:
     int              m_videoStream;
     FrameConverter   m_converter;
     bool m_open;
+
+    // Decode-ahead state (only used when m_decodeAheadFrames > 0):
+    const unsigned m_decodeAheadFrames;
+    std::thread m_decodeThread;
+    mutable std::mutex m_queueLock;
+    std::condition_variable m_queueChanged;
+    std::deque<AVFrame*> m_decoded;
+    std::vector<AVFrame*> m_spareFrames;
+    bool m_decodingFinished;
+    bool m_stopDecoding;
+    bool m_decodeIoError; // Copied from the IO context when decoding finishes.
+    int32_t m_frameWidth;  // The decode thread owns the codec context so the size is
+    int32_t m_frameHeight; // taken from the stream when opened and then from each frame.
+
+    // Live stream state (only used when m_live is true):
+    static const int LiveReadSize = 64*1024;
+    const bool m_live;
+    AVCodecParserContext* m_parser;
+    std::vector<uint8_t> m_liveBuffer;
+    int  m_liveOffset;
+    int  m_liveBytes;
+    bool m_liveEnded;
+    bool m_liveIoError;
+    timespec m_inputTime; // Time of the last read that returned any data.
+    double m_decodeLatency_ms;
 };
 
 #endif /* __LIB_AV_CAPTURE_H__ */
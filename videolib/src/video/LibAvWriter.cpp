@@ -51,7 +51,8 @@ LibAvWriter::LibAvWriter( const char* videoFile )
     m_formatContext  (0),
     m_customIO       (0),
     m_stream         (0),
-    m_open ( false )
+    m_open ( false ),
+    m_liveStream ( false )
 {
     Init();
     if ( m_open )
@@ -80,7 +81,8 @@ LibAvWriter::LibAvWriter( FFMpegCustomIO& customIO )
     m_formatContext  (0),
     m_customIO       (&customIO), // m_customIO ptr should not need to be deleted locally!
     m_stream         (0),
-    m_open ( false )
+    m_open ( false ),
+    m_liveStream ( false )
 {
     Init();
     if ( m_open )
@@ -135,6 +137,20 @@ bool LibAvWriter::IoError() const
     return m_formatContext->pb->error < 0;
 }
 
+/**
+    Write each frame out as soon as it is encoded (rather than when the IO
+    buffer fills up) so that a receiver can show it straight away.
+
+    MPEG-4 frames are also followed by an empty user-data start code: a
+    receiver's parser only knows a frame has ended when it sees the next
+    start code so this saves it waiting for the next frame (see the live
+    stream constructor of LibAvCapture). The result is still a valid stream.
+*/
+void LibAvWriter::EnableLiveStream()
+{
+    m_liveStream = true;
+}
+
 /**
     @param width width of images to be encoded in this stream
     @param height height of images to be encoded in this stream
@@ -272,6 +288,15 @@ bool LibAvWriter::WriteCodecFrame( AVFrame* frame )
 
         clock_gettime( CLOCK_MONOTONIC, &t1 );
         err = av_write_frame( m_formatContext, &pkt );
+        if ( err == 0 && m_liveStream )
+        {
+            if ( codecContext->codec_id == AV_CODEC_ID_MPEG4 )
+            {
+                static const unsigned char endOfFrame[4] = { 0x00, 0x00, 0x01, 0xB2 };
+                avio_write( m_formatContext->pb, endOfFrame, sizeof(endOfFrame) );
+            }
+            avio_flush( m_formatContext->pb );
+        }
         clock_gettime( CLOCK_MONOTONIC, &t2 );
         lastPacketWriteTime_ms = milliseconds(t2) - milliseconds(t1);
 
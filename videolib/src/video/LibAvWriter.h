@@ -33,6 +33,7 @@ public:
     bool IsOpen() const;
     bool IoError() const;
 
+    void EnableLiveStream();
     bool AddVideoStream( uint32_t width, uint32_t height, uint32_t fps, int32_t fourcc );
     bool PutVideoFrame( VideoFrame& frame );
 
@@ -51,6 +52,7 @@ private:
     FrameConverter    m_converter;
 
     bool    m_open;
+    bool    m_liveStream;
 
 public:
     // For benchmarking only: